@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include "sr_router.h"
+#include "sr_utils.h"
+#include "sr_afpacket.h"
+#include "sr_perf.h"
+
+#ifdef _LINUX_
+
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+/* Frame data starts here in both rings */
+#define SR_AFP_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+static struct sr_afpacket_port *sr_afpacket_find(struct sr_afpacket *afp, const char *name) {
+    struct sr_afpacket_port *port;
+    for (port = afp->ports; port; port = port->next) {
+        if (strncmp(port->name, name, sr_IFACE_NAMELEN) == 0) {
+            return port;
+        }
+    }
+    return NULL;
+}
+
+/* Ask the kernel to transmit everything queued on the tx ring. Call with
+   tx_lock held. */
+static void sr_afpacket_kick(struct sr_afpacket_port *port) {
+    if (send(port->fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS && errno != EINTR) {
+        perror("send(..):sr_afpacket_kick");
+    }
+    port->tx_pending = 0;
+}
+
+/* Set up the socket and rings for one interface, and register the
+   interface with the router. */
+static struct sr_afpacket_port *sr_afpacket_open_port(struct sr_instance *sr, const char *name) {
+    struct sr_afpacket_port *port;
+    struct tpacket_req3 rx_req, tx_req;
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+    int version = TPACKET_V3;
+    int on = 1;
+    uint32_t ip;
+
+    if (strlen(name) >= IFNAMSIZ) {
+        fprintf(stderr, "Interface name %s is too long\n", name);
+        return NULL;
+    }
+
+    port = calloc(1, sizeof(struct sr_afpacket_port));
+    strncpy(port->name, name, sr_IFACE_NAMELEN - 1);
+    pthread_mutex_init(&(port->tx_lock), NULL);
+
+    if ((port->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+        perror("socket(..):sr_afpacket_open_port");
+        free(port);
+        return NULL;
+    }
+
+    /* -- interface index, MAC and address from the kernel -- */
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(port->fd, SIOCGIFINDEX, &ifr) != 0) {
+        fprintf(stderr, "No interface %s\n", name);
+        goto fail;
+    }
+    port->ifindex = ifr.ifr_ifindex;
+    if (ioctl(port->fd, SIOCGIFHWADDR, &ifr) != 0) {
+        perror("ioctl(SIOCGIFHWADDR):sr_afpacket_open_port");
+        goto fail;
+    }
+    sr_add_interface(sr, name);
+    sr_set_ether_addr(sr, (unsigned char *) ifr.ifr_hwaddr.sa_data);
+    if (ioctl(port->fd, SIOCGIFADDR, &ifr) != 0) {
+        fprintf(stderr, "Interface %s has no IPv4 address\n", name);
+        goto fail;
+    }
+    memcpy(&ip, &((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr, sizeof(ip));
+    sr_set_ether_ip(sr, ip);
+
+    /* -- rings -- */
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        perror("setsockopt(PACKET_VERSION):sr_afpacket_open_port");
+        goto fail;
+    }
+
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size = SR_AFP_BLOCK_SIZE;
+    rx_req.tp_block_nr = SR_AFP_RX_BLOCKS;
+    rx_req.tp_frame_size = SR_AFP_FRAME_SIZE;
+    rx_req.tp_frame_nr = SR_AFP_BLOCK_SIZE / SR_AFP_FRAME_SIZE * SR_AFP_RX_BLOCKS;
+    rx_req.tp_retire_blk_tov = SR_AFP_BLOCK_TMO_MS;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) != 0) {
+        perror("setsockopt(PACKET_RX_RING):sr_afpacket_open_port");
+        goto fail;
+    }
+
+    /* The tx ring is a plain array of frames; block timeouts do not apply */
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = SR_AFP_BLOCK_SIZE;
+    tx_req.tp_block_nr = SR_AFP_TX_FRAMES * SR_AFP_FRAME_SIZE / SR_AFP_BLOCK_SIZE;
+    tx_req.tp_frame_size = SR_AFP_FRAME_SIZE;
+    tx_req.tp_frame_nr = SR_AFP_TX_FRAMES;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) != 0) {
+        perror("setsockopt(PACKET_TX_RING):sr_afpacket_open_port");
+        goto fail;
+    }
+
+    port->map_len = (size_t) SR_AFP_BLOCK_SIZE * (rx_req.tp_block_nr + tx_req.tp_block_nr);
+    port->map = mmap(NULL, port->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, port->fd, 0);
+    if (port->map == MAP_FAILED) {
+        perror("mmap(..):sr_afpacket_open_port");
+        port->map = NULL;
+        goto fail;
+    }
+    port->rx_ring = port->map;
+    port->tx_ring = port->map + (size_t) SR_AFP_BLOCK_SIZE * rx_req.tp_block_nr;
+
+    /* Best effort: skip the qdisc on transmit and our own frames on receive */
+#ifdef PACKET_QDISC_BYPASS
+    setsockopt(port->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &on, sizeof(on));
+#endif
+#ifdef PACKET_IGNORE_OUTGOING
+    setsockopt(port->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+#endif
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = port->ifindex;
+    if (bind(port->fd, (struct sockaddr *) &sll, sizeof(sll)) != 0) {
+        perror("bind(..):sr_afpacket_open_port");
+        goto fail;
+    }
+
+    return port;
+
+fail:
+    if (port->map) {
+        munmap(port->map, port->map_len);
+    }
+    close(port->fd);
+    free(port);
+    return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_afpacket_open(..)
+ *
+ * Attach the router to the comma separated Linux interfaces in ifnames.
+ * Returns 0 on success.
+ *---------------------------------------------------------------------*/
+int sr_afpacket_open(struct sr_instance *sr, const char *ifnames) {
+    struct sr_afpacket *afp = calloc(1, sizeof(struct sr_afpacket));
+    struct sr_afpacket_port *port, **tail = &(afp->ports);
+    char *names = strdup(ifnames);
+    char *name, *save;
+
+    afp->loop_thread = pthread_self();
+    sr->afpacket = afp;
+    sr->transport = SR_TRANSPORT_AFPACKET;
+
+    for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if ((port = sr_afpacket_open_port(sr, name)) == NULL) {
+            free(names);
+            return -1;
+        }
+        *tail = port;
+        tail = &(port->next);
+        afp->n_ports++;
+    }
+    free(names);
+
+    if (afp->n_ports == 0) {
+        fprintf(stderr, "No interfaces given\n");
+        return -1;
+    }
+
+    printf("Router interfaces:\n");
+    sr_print_if_list(sr);
+    if (sr_verify_routing_table(sr) != 0) {
+        fprintf(stderr, "Routing table not consistent with hardware\n");
+        return -1;
+    }
+    printf(" <-- Ready to process packets --> \n");
+    return 0;
+}
+
+/* Frames the local stack sent over a veth or tap may still carry only the
+   pseudo-header sum in their TCP or UDP checksum (TP_STATUS_CSUMNOTREADY);
+   finish it, as the NIC would have, before routing the frame elsewhere. */
+static void sr_afpacket_finish_csum(uint8_t *frame, unsigned int len) {
+    sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+    unsigned int hl, l4_len, sum_off;
+    uint16_t sum;
+
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) || ethertype(frame) != ethertype_ip ||
+        (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK))) {
+        return;
+    }
+    hl = ip_hdr->ip_hl * 4;
+    if (ip_hdr->ip_p == ip_protocol_tcp) {
+        sum_off = 16;
+    } else if (ip_hdr->ip_p == ip_protocol_udp) {
+        sum_off = 6;
+    } else {
+        return;
+    }
+    if (ntohs(ip_hdr->ip_len) < hl + sum_off + sizeof(sum) ||
+        sizeof(sr_ethernet_hdr_t) + ntohs(ip_hdr->ip_len) > len) {
+        return;
+    }
+    l4_len = ntohs(ip_hdr->ip_len) - hl;
+    sum = cksum((uint8_t *) ip_hdr + hl, l4_len);
+    memcpy((uint8_t *) ip_hdr + hl + sum_off, &sum, sizeof(sum));
+}
+
+/* Hand every completed rx block of port to the router */
+static void sr_afpacket_drain(struct sr_instance *sr, struct sr_afpacket_port *port) {
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *sll;
+    unsigned int i;
+
+    for (;;) {
+        bd = (struct tpacket_block_desc *) (port->rx_ring + (size_t) port->rx_block * SR_AFP_BLOCK_SIZE);
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+
+        hdr = (struct tpacket3_hdr *) ((uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+            sll = (struct sockaddr_ll *) ((uint8_t *) hdr + SR_AFP_DATA_OFF);
+            /* Routed in place; the block is ours until we give it back */
+            if (sll->sll_pkttype != PACKET_OUTGOING && hdr->tp_snaplen == hdr->tp_len &&
+                hdr->tp_snaplen >= sizeof(sr_ethernet_hdr_t)) {
+                port->rx_frames++;
+                if (hdr->tp_status & TP_STATUS_CSUMNOTREADY) {
+                    sr_afpacket_finish_csum((uint8_t *) hdr + hdr->tp_mac, hdr->tp_snaplen);
+                }
+                sr_dispatch_packet(sr, (uint8_t *) hdr + hdr->tp_mac, hdr->tp_snaplen, port->name);
+            }
+            hdr = (struct tpacket3_hdr *) ((uint8_t *) hdr + hdr->tp_next_offset);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        port->rx_block = (port->rx_block + 1) % SR_AFP_RX_BLOCKS;
+    }
+}
+
+/* Event loop callbacks: route a port's received blocks when its socket
+   is readable, and kick its queued transmits before the loop sleeps */
+static int sr_afpacket_dispatch(struct sr_instance *sr, void *arg) {
+    SR_PERF_BEGIN(t0);
+    sr_afpacket_drain(sr, (struct sr_afpacket_port *) arg);
+    SR_PERF_END(SR_PERF_RX, t0);
+    return 1;
+}
+
+static int sr_afpacket_prepare(struct sr_instance *sr, void *arg) {
+    struct sr_afpacket_port *port = arg;
+
+    pthread_mutex_lock(&(port->tx_lock));
+    if (port->tx_pending) {
+        sr_afpacket_kick(port);
+    }
+    pthread_mutex_unlock(&(port->tx_lock));
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_afpacket_add_sources(..)
+ *
+ * Put every port on the event loop. Frames a receive burst produces are
+ * sent as one batch when the loop is about to wait again.
+ *---------------------------------------------------------------------*/
+int sr_afpacket_add_sources(struct sr_instance *sr, struct sr_event_loop *loop) {
+    struct sr_afpacket_port *port;
+    for (port = sr->afpacket->ports; port; port = port->next) {
+        if (sr_event_add(loop, port->fd, sr_afpacket_dispatch, sr_afpacket_prepare, port) == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Copy one frame into the next tx slot. Call with tx_lock held. */
+static int sr_afpacket_queue(struct sr_afpacket_port *port, const uint8_t *buf, unsigned int len) {
+    struct tpacket3_hdr *hdr;
+
+    if (len > SR_AFP_FRAME_SIZE - SR_AFP_DATA_OFF) {
+        return -1;
+    }
+    hdr = (struct tpacket3_hdr *) (port->tx_ring + (size_t) port->tx_frame * SR_AFP_FRAME_SIZE);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+        /* Ring full: push out what is queued, then drop if still no room */
+        sr_afpacket_kick(port);
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+            port->tx_drops++;
+            return -1;
+        }
+    }
+
+    memcpy((uint8_t *) hdr + SR_AFP_DATA_OFF, buf, len);
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    port->tx_frame = (port->tx_frame + 1) % SR_AFP_TX_FRAMES;
+    port->tx_frames++;
+    port->tx_pending++;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_afpacket_send(..)
+ *
+ * Queue a frame on iface's tx ring. The kernel is kicked when a batch
+ * is complete or before the event loop sleeps; frames sent from
+ * other threads (ARP, NAT) are kicked straight away.
+ *---------------------------------------------------------------------*/
+int sr_afpacket_send(struct sr_instance *sr, uint8_t *buf, unsigned int len, const char *iface) {
+    struct sr_afpacket_port *port = sr_afpacket_find(sr->afpacket, iface);
+    int ret;
+
+    if (port == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&(port->tx_lock));
+    ret = sr_afpacket_queue(port, buf, len);
+    if (port->tx_pending >= SR_AFP_TX_BATCH ||
+        !pthread_equal(pthread_self(), sr->afpacket->loop_thread)) {
+        sr_afpacket_kick(port);
+    }
+    pthread_mutex_unlock(&(port->tx_lock));
+    return ret;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_afpacket_send_batch(..)
+ *
+ * Queue n frames for the same interface under one lock and kick the
+ * kernel once for all of them. Returns the number queued and sets
+ * taken[i] to whether frame i was: one that is too big or meets a full
+ * ring is dropped and the ones after it are still tried.
+ *---------------------------------------------------------------------*/
+int sr_afpacket_send_batch(struct sr_instance *sr, uint8_t **bufs, unsigned int *lens,
+                           unsigned int n, const char *iface, uint8_t *taken) {
+    struct sr_afpacket_port *port = sr_afpacket_find(sr->afpacket, iface);
+    unsigned int i;
+    int sent = 0;
+
+    memset(taken, 0, n);
+    if (port == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(port->tx_lock));
+    for (i = 0; i < n; i++) {
+        if (sr_afpacket_queue(port, bufs[i], lens[i]) == 0) {
+            taken[i] = 1;
+            sent++;
+        }
+    }
+    if (port->tx_pending) {
+        sr_afpacket_kick(port);
+    }
+    pthread_mutex_unlock(&(port->tx_lock));
+    return sent;
+}
+
+void sr_afpacket_close(struct sr_afpacket *afp) {
+    struct sr_afpacket_port *port, *next;
+
+    if (afp == NULL) {
+        return;
+    }
+    for (port = afp->ports; port; port = next) {
+        next = port->next;
+        printf("%s: %lu frames in, %lu out, %lu dropped on a full ring\n",
+               port->name, port->rx_frames, port->tx_frames, port->tx_drops);
+        munmap(port->map, port->map_len);
+        close(port->fd);
+        pthread_mutex_destroy(&(port->tx_lock));
+        free(port);
+    }
+    free(afp);
+}
+
+#else /* _LINUX_ */
+
+/* AF_PACKET rings are Linux only */
+
+int sr_afpacket_open(struct sr_instance *sr, const char *ifnames) {
+    fprintf(stderr, "The raw-socket dataplane needs Linux\n");
+    return -1;
+}
+
+int sr_afpacket_add_sources(struct sr_instance *sr, struct sr_event_loop *loop) {
+    return -1;
+}
+
+int sr_afpacket_send(struct sr_instance *sr, uint8_t *buf, unsigned int len, const char *iface) {
+    return -1;
+}
+
+int sr_afpacket_send_batch(struct sr_instance *sr, uint8_t **bufs, unsigned int *lens,
+                           unsigned int n, const char *iface) {
+    return 0;
+}
+
+void sr_afpacket_close(struct sr_afpacket *afp) {
+}
+
+#endif /* _LINUX_ */
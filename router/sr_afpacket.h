@@ -0,0 +1,71 @@
+/* Raw-socket dataplane: runs the router directly on Linux interfaces
+   (physical ports or veth pairs) instead of through VNS.
+
+   Every interface gets an AF_PACKET socket with TPACKET_V3 memory-mapped
+   rings. The receive ring is block based: the kernel fills a block with
+   many frames and hands the whole block over, so one wakeup yields a
+   batch of frames that go straight to sr_handlepacket. Transmits are copied
+   into the transmit ring and only kicked with send() once per batch -
+   before the event loop sleeps again, or when SR_AFP_TX_BATCH frames are
+   pending - rather than once per frame.
+
+   The interface's MAC and IPv4 address are taken from the kernel, so the
+   routing table must name the Linux interfaces. The kernel keeps running
+   its own stack on them; give the interfaces no addresses of their own in
+   the kernel (or run in a network namespace) if that gets in the way.
+
+   --
+
+   sr_afpacket_open(sr, "eth1,eth2")        adds the interfaces to sr->if_list
+   sr_afpacket_add_sources(sr, &sr->loop)   puts the sockets on the event loop
+ */
+
+#ifndef SR_AFPACKET_H
+#define SR_AFPACKET_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "sr_protocol.h"
+
+#define SR_AFP_BLOCK_SIZE   (1 << 18)  /* rx block, many frames each */
+#define SR_AFP_RX_BLOCKS    16
+#define SR_AFP_FRAME_SIZE   2048       /* tx slot, one frame each */
+#define SR_AFP_TX_FRAMES    512
+#define SR_AFP_BLOCK_TMO_MS 1          /* hand over a partly filled block after this */
+#define SR_AFP_TX_BATCH     32         /* kick the kernel at least this often */
+
+struct sr_instance;
+struct sr_event_loop;
+
+struct sr_afpacket_port {
+    char name[sr_IFACE_NAMELEN];
+    int fd;
+    int ifindex;
+    uint8_t* map;               /* rx ring followed by tx ring */
+    size_t map_len;
+    uint8_t* rx_ring;
+    uint8_t* tx_ring;
+    unsigned int rx_block;      /* next block to look at */
+    unsigned int tx_frame;      /* next free tx slot */
+    unsigned int tx_pending;    /* queued since the last kick */
+    pthread_mutex_t tx_lock;
+    unsigned long rx_frames;
+    unsigned long tx_frames;
+    unsigned long tx_drops;     /* tx ring full */
+    struct sr_afpacket_port* next;
+};
+
+struct sr_afpacket {
+    struct sr_afpacket_port* ports;
+    int n_ports;
+    pthread_t loop_thread;      /* sends from other threads are kicked at once */
+};
+
+int sr_afpacket_open(struct sr_instance* sr, const char* ifnames);
+int sr_afpacket_add_sources(struct sr_instance* sr, struct sr_event_loop* loop);
+int sr_afpacket_send(struct sr_instance* sr, uint8_t* buf, unsigned int len, const char* iface);
+int sr_afpacket_send_batch(struct sr_instance* sr, uint8_t** bufs, unsigned int* lens,
+                           unsigned int n, const char* iface, uint8_t* taken);
+void sr_afpacket_close(struct sr_afpacket* afp);
+
+#endif
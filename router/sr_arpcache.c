@@ -9,20 +9,169 @@
 #include "sr_arpcache.h"
 #include "sr_router.h"
 #include "sr_if.h"
+#include "sr_rt.h"
 #include "sr_protocol.h"
 #include "sr_utils.h"
+#include "sr_event.h"
+#include "sr_log.h"
+#include "sr_perf.h"
+#include "sr_drop.h"
 
-/* Send ARP request if the request in our cache is not sent more than 5 times */
+/* Request timer heap, ordered by deadline. Callers hold cache->lock. */
+
+static void sr_arpreq_heap_set(struct sr_arpcache *cache, unsigned int i, struct sr_arpreq *req) {
+    cache->timers[i] = req;
+    req->timer_index = i;
+}
+
+static void sr_arpreq_heap_up(struct sr_arpcache *cache, unsigned int i) {
+    struct sr_arpreq *req = cache->timers[i];
+    while (i > 0 && cache->timers[(i - 1) / 2]->deadline > req->deadline) {
+        sr_arpreq_heap_set(cache, i, cache->timers[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    sr_arpreq_heap_set(cache, i, req);
+}
+
+static void sr_arpreq_heap_down(struct sr_arpcache *cache, unsigned int i) {
+    struct sr_arpreq *req = cache->timers[i];
+    unsigned int child;
+    while ((child = 2 * i + 1) < cache->n_timers) {
+        if (child + 1 < cache->n_timers &&
+            cache->timers[child + 1]->deadline < cache->timers[child]->deadline) {
+            child++;
+        }
+        if (cache->timers[child]->deadline >= req->deadline) {
+            break;
+        }
+        sr_arpreq_heap_set(cache, i, cache->timers[child]);
+        i = child;
+    }
+    sr_arpreq_heap_set(cache, i, req);
+}
+
+static void sr_arpreq_heap_push(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    if (cache->n_timers == cache->timers_cap) {
+        cache->timers_cap = cache->timers_cap ? 2 * cache->timers_cap : 16;
+        cache->timers = realloc(cache->timers, cache->timers_cap * sizeof(struct sr_arpreq *));
+    }
+    sr_arpreq_heap_set(cache, cache->n_timers++, req);
+    sr_arpreq_heap_up(cache, req->timer_index);
+}
+
+static void sr_arpreq_heap_remove(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    unsigned int i = req->timer_index;
+    struct sr_arpreq *last;
+
+    req->timer_index = -1;
+    last = cache->timers[--cache->n_timers];
+    if (last != req) {
+        sr_arpreq_heap_set(cache, i, last);
+        sr_arpreq_heap_up(cache, i);
+        sr_arpreq_heap_down(cache, last->timer_index);
+    }
+}
+
+/* Point req_timer at the earliest deadline, if that changed */
+static void sr_arpreq_rearm(struct sr_arpcache *cache) {
+    uint64_t deadline, now;
+
+    if (!cache->req_timer) {
+        return;
+    }
+    if (cache->n_timers == 0) {
+        if (cache->armed_deadline) {
+            sr_event_timer_disarm(cache->req_timer);
+            cache->armed_deadline = 0;
+        }
+        return;
+    }
+    deadline = cache->timers[0]->deadline;
+    if (deadline == 0) {
+        deadline = 1;
+    }
+    if (deadline != cache->armed_deadline) {
+        now = monotonic_ms();
+        sr_event_timer_arm(cache->req_timer, deadline > now ? (unsigned int) (deadline - now) : 0);
+        cache->armed_deadline = deadline;
+    }
+}
+
+void sr_arpreq_schedule(struct sr_arpcache *cache, struct sr_arpreq *req, uint64_t deadline) {
+    pthread_mutex_lock(&(cache->lock));
+
+    uint64_t old = req->deadline;
+    req->deadline = deadline;
+    if (req->timer_index < 0) {
+        sr_arpreq_heap_push(cache, req);
+    } else if (deadline < old) {
+        sr_arpreq_heap_up(cache, req->timer_index);
+    } else {
+        sr_arpreq_heap_down(cache, req->timer_index);
+    }
+    sr_arpreq_rearm(cache);
+
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Delay before the next try, after times_sent tries */
+static uint64_t sr_arpreq_delay(struct sr_arpcache *cache, uint32_t times_sent) {
+    uint64_t delay = cache->req_interval_ms;
+    uint32_t i;
+    for (i = 1; i < times_sent && delay < SR_ARPREQ_MAX_DELAY_MS; i++) {
+        delay *= cache->req_backoff;
+    }
+    if (delay > SR_ARPREQ_MAX_DELAY_MS) {
+        delay = SR_ARPREQ_MAX_DELAY_MS;
+    }
+    return delay ? delay : 1;
+}
+
+/* Send an ARP request for tip out of iface: broadcast, or unicast to dmac
+   when refreshing an entry we already have */
+static void sr_arpcache_send_request(struct sr_instance *sr, struct sr_if *target_iface,
+                                     uint32_t tip, const unsigned char *dmac) {
+    int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
+    uint8_t *new_packet = malloc(packet_len);
+
+    /* Createn ethernet header */
+    sr_ethernet_hdr_t *new_eth_hdr = (sr_ethernet_hdr_t *) new_packet;
+    if (dmac) {
+        memcpy(new_eth_hdr->ether_dhost, dmac, sizeof(uint8_t)*ETHER_ADDR_LEN);
+    } else {
+        memset(new_eth_hdr->ether_dhost, 255, sizeof(uint8_t)*ETHER_ADDR_LEN);
+    }
+    memcpy(new_eth_hdr->ether_shost, target_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
+    new_eth_hdr->ether_type = htons(ethertype_arp);
+
+    /* Create ARP header */
+    sr_arp_hdr_t *new_arp_hdr = (sr_arp_hdr_t *)(new_packet + sizeof(sr_ethernet_hdr_t));
+    new_arp_hdr->ar_hrd = htons(arp_hrd_ethernet);
+    new_arp_hdr->ar_pro = htons(ethertype_ip);
+    new_arp_hdr->ar_hln = ETHER_ADDR_LEN;
+    new_arp_hdr->ar_pln = sizeof(uint32_t);
+    new_arp_hdr->ar_op = htons(arp_op_request);
+    memcpy(new_arp_hdr->ar_sha, target_iface->addr, sizeof(unsigned char)*ETHER_ADDR_LEN);
+    new_arp_hdr->ar_sip = target_iface->ip;
+    memcpy(new_arp_hdr->ar_tha, new_eth_hdr->ether_dhost, sizeof(unsigned char)*ETHER_ADDR_LEN);
+    new_arp_hdr->ar_tip = tip;
+
+    sr_send_packet(sr, new_packet, packet_len, target_iface->name);            
+    free(new_packet);
+}
+
+/* Send ARP request if the request is due and has tries left; give up on
+   it with ICMP host unreachable otherwise */
 void handle_arpreq (struct sr_arpreq * req, struct sr_instance *sr) {
     struct sr_arpcache *sr_cache = &sr->cache;
-    time_t curr_time;
-    time(&curr_time);
-    double one_sec = 1.0;
-    if (difftime(curr_time, req->sent) >  one_sec){
+    uint64_t curr_time = monotonic_ms();
+
+    pthread_mutex_lock(&(sr_cache->lock));
+    if (curr_time >= req->deadline) {
         struct sr_packet *packet = req->packets; 
-        /* If packet is sent more than equal or more than 5 times, send ICMP host unreachable message */
-        if ((req->times_sent) >= 5) {
-            printf("Packet sent more than 5 times\n");
+        /* If the request has run out of tries, send ICMP host unreachable message */
+        if ((req->times_sent) >= sr_cache->req_max_tries) {
+            sr_log(SR_LOG_ARP, SR_LOG_INFO, "Packet sent more than %u times\n", sr_cache->req_max_tries);
             while (packet) {
                 uint8_t *buf = packet->buf;
                 char *interface = packet->iface;
@@ -51,52 +200,39 @@ void handle_arpreq (struct sr_arpreq * req, struct sr_instance *sr) {
                 send_icmp_type3_msg (new_packet, src_lpm, sr_cache, sr, interface, packet_len); 
                 
                 free(new_packet);
+                SR_DROP(SR_DROP_ARP_TIMEOUT);
 
                 packet = packet->next;
             }
             sr_arpreq_destroy(sr_cache, req); 
         } else {
             /* Send out arp request */
-            struct sr_if *target_iface = sr_get_interface(sr, packet->iface);
-            int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
-            uint8_t *new_packet = malloc(packet_len);
-
-            /* Createn ethernet header */
-            sr_ethernet_hdr_t *new_eth_hdr = (sr_ethernet_hdr_t *) new_packet;
-            memset(new_eth_hdr->ether_dhost, 255, sizeof(uint8_t)*ETHER_ADDR_LEN);
-            memcpy(new_eth_hdr->ether_shost, target_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
-            new_eth_hdr->ether_type = htons(ethertype_arp);
-
-            /* Create ARP header */
-            sr_arp_hdr_t *new_arp_hdr = (sr_arp_hdr_t *)(new_packet + sizeof(sr_ethernet_hdr_t));
-            new_arp_hdr->ar_hrd = htons(arp_hrd_ethernet);
-            new_arp_hdr->ar_pro = htons(ethertype_ip);
-            new_arp_hdr->ar_hln = ETHER_ADDR_LEN;
-            new_arp_hdr->ar_pln = sizeof(uint32_t);
-            new_arp_hdr->ar_op = htons(arp_op_request);
-            memcpy(new_arp_hdr->ar_sha, target_iface->addr, sizeof(unsigned char)*ETHER_ADDR_LEN);
-            new_arp_hdr->ar_sip = target_iface->ip;
-            memset(new_arp_hdr->ar_tha, 255, sizeof(unsigned char)*ETHER_ADDR_LEN);
-            new_arp_hdr->ar_tip = req->ip;
-
-            sr_send_packet(sr, new_packet, packet_len, target_iface->name);            
-            free(new_packet);
-        }
+            sr_arpcache_send_request(sr, sr_get_interface(sr, packet->iface), req->ip, NULL);
+
             req->sent = curr_time;
             req->times_sent = req->times_sent + 1;
+            sr_arpreq_schedule(sr_cache, req, curr_time + sr_arpreq_delay(sr_cache, req->times_sent));
+        }
     }   
+    pthread_mutex_unlock(&(sr_cache->lock));
 }
 
 
 
+/* Handle the requests whose deadline has passed. Each one is either
+   rescheduled into the future or destroyed, so the loop ends. */
 void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
     struct sr_arpcache *sr_cache = &sr->cache;
-    struct sr_arpreq *sr_req= sr_cache->requests;
-    while (sr_req) {
-        struct sr_arpreq *next_req =  sr_req->next;
-        handle_arpreq (sr_req, sr);
-        sr_req  = next_req;
+    uint64_t now = monotonic_ms();
+
+    pthread_mutex_lock(&(sr_cache->lock));
+    /* the one-shot timer has fired, so it is no longer armed */
+    sr_cache->armed_deadline = 0;
+    while (sr_cache->n_timers && sr_cache->timers[0]->deadline <= now) {
+        handle_arpreq (sr_cache->timers[0], sr);
     }
+    sr_arpreq_rearm(sr_cache);
+    pthread_mutex_unlock(&(sr_cache->lock));
 }
 
 /* You should not need to touch the rest of this code. */
@@ -104,6 +240,7 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
+    SR_PERF_BEGIN(t0);
     pthread_mutex_lock(&(cache->lock));
     
     struct sr_arpentry *entry = NULL, *copy = NULL;
@@ -118,11 +255,13 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
     if (entry) {
+        entry->used = monotonic_ms();
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
         memcpy(copy, entry, sizeof(struct sr_arpentry));
     }
         
     pthread_mutex_unlock(&(cache->lock));
+    SR_PERF_END(SR_PERF_ARP, t0);
     
     return copy;
 }
@@ -152,8 +291,11 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     if (!req) {
         req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
         req->ip = ip;
+        req->timer_index = -1;
         req->next = cache->requests;
         cache->requests = req;
+        /* due at once */
+        sr_arpreq_schedule(cache, req, 0);
     }
     
     /* Add the packet to the list of packets for this request */
@@ -200,18 +342,96 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         }
         prev = req;
     }
+    if (req && req->timer_index >= 0) {
+        sr_arpreq_heap_remove(cache, req);
+        sr_arpreq_rearm(cache);
+    }
     
-    int i;
+    /* Refresh the entry for this IP if there is one, else take a free slot,
+       else evict the entry that went unused longest */
+    int i, slot = SR_ARPCACHE_SZ, lru = 0;
     for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
+        if (cache->entries[i].valid && cache->entries[i].ip == ip) {
+            slot = i;
             break;
+        }
+        if (!(cache->entries[i].valid) && slot == SR_ARPCACHE_SZ)
+            slot = i;
+        if (cache->entries[i].used < cache->entries[lru].used ||
+            (cache->entries[i].used == cache->entries[lru].used &&
+             cache->entries[i].added < cache->entries[lru].added))
+            lru = i;
     }
+    if (slot == SR_ARPCACHE_SZ)
+        slot = lru;
+    
+    struct sr_arpentry *entry = &(cache->entries[slot]);
+    if (!entry->valid || entry->ip != ip)
+        entry->used = 0;
+    memcpy(entry->mac, mac, 6);
+    entry->ip = ip;
+    entry->added = time(NULL);
+    entry->valid = 1;
     
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
+    pthread_mutex_unlock(&(cache->lock));
+    
+    return req;
+}
+
+/* Take one token from the learning bucket. Callers hold cache->lock. */
+static int sr_arpcache_learn_token(struct sr_arpcache *cache) {
+    uint64_t now = monotonic_ms();
+
+    cache->learn_tokens += (now - cache->learn_stamp) * SR_ARP_LEARN_RATE;
+    if (cache->learn_tokens > SR_ARP_LEARN_BURST * 1000) {
+        cache->learn_tokens = SR_ARP_LEARN_BURST * 1000;
+    }
+    cache->learn_stamp = now;
+    if (cache->learn_tokens < 1000) {
+        cache->learn_limited++;
+        return 0;
+    }
+    cache->learn_tokens -= 1000;
+    return 1;
+}
+
+struct sr_arpreq *sr_arpcache_learn(struct sr_arpcache *cache,
+                                    unsigned char *mac,
+                                    uint32_t ip,
+                                    int create)
+{
+    struct sr_arpreq *req = NULL;
+
+    if (ip == 0) {
+        /* ARP probe, the sender has no address yet */
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+    
+    int known = 0, free_slots = 0;
+    int i;
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        if (!cache->entries[i].valid)
+            free_slots++;
+        else if (cache->entries[i].ip == ip)
+            known = 1;
+    }
+    for (req = cache->requests; req != NULL && !known; req = req->next) {
+        if (req->ip == ip)
+            known = 1;
+    }
+    if (!known && create) {
+        /* New entries leave the last free slots to resolved next hops */
+        if (free_slots > SR_ARP_LEARN_RESERVE)
+            known = 1;
+        else
+            cache->learn_full++;
+    }
+
+    req = NULL;
+    if (known && sr_arpcache_learn_token(cache)) {
+        req = sr_arpcache_insert(cache, mac, ip);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -241,24 +461,34 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
             }
             prev = req;
         }
-        
-        struct sr_packet *pkt, *nxt;
-        
-        for (pkt = entry->packets; pkt; pkt = nxt) {
-            nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+        if (entry->timer_index >= 0) {
+            sr_arpreq_heap_remove(cache, entry);
+            sr_arpreq_rearm(cache);
         }
         
-        free(entry);
+        sr_arpreq_free(entry);
     }
     
     pthread_mutex_unlock(&(cache->lock));
 }
 
+/* Frees a request that is no longer on the queue, such as the one
+   sr_arpcache_insert hands back. Needs no lock. */
+void sr_arpreq_free(struct sr_arpreq *entry) {
+    struct sr_packet *pkt, *nxt;
+    
+    for (pkt = entry->packets; pkt; pkt = nxt) {
+        nxt = pkt->next;
+        if (pkt->buf)
+            free(pkt->buf);
+        if (pkt->iface)
+            free(pkt->iface);
+        free(pkt);
+    }
+    
+    free(entry);
+}
+
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
@@ -282,6 +512,17 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     /* Invalidate all entries */
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
+    cache->timers = NULL;
+    cache->n_timers = cache->timers_cap = 0;
+    cache->req_timer = NULL;
+    cache->armed_deadline = 0;
+    cache->req_interval_ms = SR_ARPREQ_INTERVAL_MS;
+    cache->req_backoff = SR_ARPREQ_BACKOFF;
+    cache->req_max_tries = SR_ARPREQ_MAX_TRIES;
+    cache->learn_tokens = SR_ARP_LEARN_BURST * 1000;
+    cache->learn_stamp = monotonic_ms();
+    cache->learn_limited = 0;
+    cache->learn_full = 0;
     
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -293,34 +534,45 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    free(cache->timers);
+    cache->timers = NULL;
+    cache->n_timers = cache->timers_cap = 0;
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
-void *sr_arpcache_timeout(void *sr_ptr) {
-    struct sr_instance *sr = sr_ptr;
+/* Sweeps through the cache and invalidates entries that were added more than
+   SR_ARPCACHE_TO seconds ago. Pending requests have their own timer; only
+   without one are they retransmitted from here. */
+void sr_arpcache_tick(struct sr_instance *sr) {
     struct sr_arpcache *cache = &(sr->cache);
     
-    while (1) {
-        sleep(1.0);
-        
-        pthread_mutex_lock(&(cache->lock));
+    pthread_mutex_lock(&(cache->lock));
+
+    time_t curtime = time(NULL);
+    uint64_t now = monotonic_ms();
     
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
+    int i;    
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        struct sr_arpentry *entry = &(cache->entries[i]);
+        if (!entry->valid)
+            continue;
+        double age = difftime(curtime, entry->added);
+        if (age > SR_ARPCACHE_TO) {
+            entry->valid = 0;
+        } else if (age >= SR_ARPCACHE_TO - SR_ARPCACHE_REFRESH && entry->used &&
+                   now - entry->used <= SR_ARPCACHE_REFRESH_IDLE * 1000) {
+            /* Still in use: ask the neighbour directly before it expires */
+            struct sr_rt *rt = sr_routing_lpm(sr, entry->ip);
+            if (rt) {
+                sr_arpcache_send_request(sr, sr_get_interface(sr, rt->interface), entry->ip, entry->mac);
             }
         }
-        
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
     }
     
-    return NULL;
+    if (!cache->req_timer) {
+        sr_arpcache_sweepreqs(sr);
+    }
+
+    pthread_mutex_unlock(&(cache->lock));
 }
 
@@ -61,6 +61,36 @@
    Since handle_arpreq as defined in the comments above could destroy your
    current request, make sure to save the next pointer before calling
    handle_arpreq when traversing through the ARP requests linked list.
+
+   --
+
+   Rather than sweeping every request once a second, each request carries
+   its own deadline on the monotonic clock and sits in a min-heap ordered by
+   it. A one-shot event-loop timer (req_timer) is armed for the earliest
+   deadline, and sr_arpcache_sweepreqs only handles the requests that are
+   due. Retransmits are req_interval_ms apart, multiplied by req_backoff
+   after every try, and a request gives up after req_max_tries.
+
+   --
+
+   An entry that is still being looked up (used within the last
+   SR_ARPCACHE_REFRESH_IDLE seconds) is refreshed during the last
+   SR_ARPCACHE_REFRESH seconds of its life: the tick sends a unicast ARP
+   request to the cached MAC once a second, and the reply re-inserts the
+   entry in place. Packets keep using the old MAC meanwhile, so a busy
+   neighbour never drops out of the cache.
+
+   --
+
+   Besides replies to our own requests, the cache learns from ARP traffic it
+   sees anyway (sr_arpcache_learn): the sender of a request aimed at us is
+   about to receive our answer, and a gratuitous ARP updates an entry or
+   completes a request we already have. Learning is rate limited by a token
+   bucket (SR_ARP_LEARN_RATE per second, bursts of SR_ARP_LEARN_BURST) so a
+   flood of ARP cannot churn the cache, and a snooped sender only gets a new
+   entry while more than SR_ARP_LEARN_RESERVE slots are free, so it cannot
+   fill the cache either. When the cache is full anyway, an answer to one
+   of our own requests evicts the least recently used entry.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -73,6 +103,18 @@
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_TICK_MS 1000 /* how often sr_arpcache_tick runs */
+#define SR_ARPCACHE_REFRESH 3.0      /* refresh window before SR_ARPCACHE_TO */
+#define SR_ARPCACHE_REFRESH_IDLE 5.0 /* entries unused for longer just expire */
+#define SR_ARPREQ_INTERVAL_MS 1000
+#define SR_ARPREQ_BACKOFF     1
+#define SR_ARPREQ_MAX_TRIES   5
+#define SR_ARPREQ_MAX_DELAY_MS 60000 /* backoff stops growing here */
+#define SR_ARP_LEARN_RATE  100
+#define SR_ARP_LEARN_BURST 200
+#define SR_ARP_LEARN_RESERVE 25 /* free slots kept for resolved next hops */
+
+struct sr_event_source;
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
@@ -86,22 +128,36 @@ struct sr_arpentry {
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
     int valid;
+    uint64_t used;              /* last lookup, monotonic ms */
 };
 
 struct sr_arpreq {
     uint32_t ip;
-    time_t sent;                /* Last time this ARP request was sent. You 
-                                   should update this. If the ARP request was 
-                                   never sent, will be 0. */
+    uint64_t sent;              /* Last time this ARP request was sent, in
+                                   monotonic ms. 0 if it was never sent. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
     struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    uint64_t deadline;          /* next retransmit, monotonic ms */
+    int timer_index;            /* slot in cache->timers, -1 if none */
     struct sr_arpreq *next;
 };
 
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    struct sr_arpreq **timers;  /* min-heap of requests by deadline */
+    unsigned int n_timers;
+    unsigned int timers_cap;
+    struct sr_event_source *req_timer; /* armed for timers[0], may be NULL */
+    uint64_t armed_deadline;    /* what req_timer is armed for, 0 if idle */
+    unsigned int req_interval_ms;
+    unsigned int req_backoff;
+    unsigned int req_max_tries;
+    uint64_t learn_tokens;      /* in 1/1000 of a token */
+    uint64_t learn_stamp;       /* last refill, monotonic ms */
+    unsigned long learn_limited; /* snooped mappings dropped by the limit */
+    unsigned long learn_full;   /* snooped senders not cached, too few free slots */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -126,26 +182,50 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping in the cache, and marks it valid. An
+      existing entry for this IP is updated in place; if the cache is full,
+      the least recently used entry makes room. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
                                      uint32_t ip);
 
+/* Inserts a mapping snooped from ARP traffic, like sr_arpcache_insert, if
+   the rate limit allows it. Unless create is set, only an IP that already
+   has an entry or a pending request is learned; with create, a new entry
+   is only made while more than SR_ARP_LEARN_RESERVE slots are free. Returns the pending
+   request, if any, for the caller to send and destroy. */
+struct sr_arpreq *sr_arpcache_learn(struct sr_arpcache *cache,
+                                    unsigned char *mac,
+                                    uint32_t ip,
+                                    int create);
+
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 
+/* Frees a request that sr_arpcache_insert or sr_arpcache_learn already took
+   off the queue, without walking the queue again. */
+void sr_arpreq_free(struct sr_arpreq *entry);
+
+/* Sets the time handle_arpreq should next look at this request, in
+   monotonic ms. */
+void sr_arpreq_schedule(struct sr_arpcache *cache, struct sr_arpreq *req,
+                        uint64_t deadline);
+
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and the tick, run by the router's event loop every
+   SR_ARPCACHE_TICK_MS, refreshes busy entries and times out cache entries
+   after 15 seconds. ARP
+   requests are retransmitted by sr_arpcache_sweepreqs when req_timer
+   fires; without a req_timer the tick sweeps them instead. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
-void *sr_arpcache_timeout(void *cache_ptr);
+void  sr_arpcache_tick(struct sr_instance *sr);
 
 void sr_arpcache_sweepreqs(struct sr_instance *sr);
 void handle_arpreq (struct sr_arpreq * req, struct sr_instance *sr);
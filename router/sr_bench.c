@@ -0,0 +1,711 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_bench.c
+ *
+ * Description:
+ *
+ * Microbenchmarks for the router core. Traffic is generated from a seeded
+ * generator so runs are repeatable: a number of flows from internal
+ * clients to destinations spread over a synthetic routing table, with a
+ * mix of frame sizes and, for the NAT, a share of packets that open new
+ * flows. Each stage is timed on its own:
+ *
+ *   cksum       cksum over the IP payload of each frame size
+ *   lpm         sr_routing_lpm over the synthetic table
+ *   arp_lookup  sr_arpcache_lookup of known next hops
+ *   forward     sr_handlepacket without NAT (route_packet)
+ *   nat_out     sr_handlepacket, internal to external through the NAT
+ *   nat_in      sr_handlepacket, external to internal through the NAT
+ *   fib_compile sr_fib_compile, and a check that the compiled trie
+ *               forwards every address as the full one does, before and
+ *               after rounds of route changes
+ *
+ * Results are printed one JSON object per line, preceded by a line with
+ * the parameters, so runs can be stored and compared with a baseline.
+ * Cheap stages are timed in batches, and percentiles are then over batch
+ * averages; the batch size is part of each result.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_utils.h"
+#include "sr_tool.h"
+
+extern char* optarg;
+
+#define DEFAULT_FLOWS 1000
+#define DEFAULT_ROUTES 1000
+#define DEFAULT_NEW_PCT 10
+#define DEFAULT_ITERATIONS 100000
+#define DEFAULT_SIZES "64:7,576:4,1500:1" /* simple IMIX */
+#define DEFAULT_SEED 1
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_FRAME 1514
+#define BENCH_MIN_FRAME (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t))
+#define BENCH_NEXT_HOPS 64
+#define BENCH_BATCH 64
+#define BENCH_CHURN_ROUNDS 5
+
+
+/* Addressing of the synthetic topology */
+#define BENCH_INT_IP   "10.0.1.1"
+#define BENCH_EXT_IP   "172.64.3.1"
+#define BENCH_CLIENTS  0x0a010000 /* 10.1.0.0, first client */
+#define BENCH_CLIENT_GW "10.0.1.100"
+#define BENCH_HOPS     0xac400302 /* 172.64.3.2, first external next hop */
+
+struct bench_flow {
+    uint32_t client;     /* nbo */
+    uint32_t server;     /* nbo */
+    uint16_t sport;
+    uint16_t dport;
+    unsigned int size;
+};
+
+struct bench_params {
+    unsigned int flows;
+    unsigned int routes;
+    unsigned int new_pct;
+    unsigned int iterations;
+    unsigned int seed;
+    unsigned int n_sizes;
+    unsigned int sizes[BENCH_MAX_SIZES];
+    unsigned int weights[BENCH_MAX_SIZES];
+    unsigned int weight_sum;
+    char* size_spec;
+};
+
+static const unsigned char int_mac[ETHER_ADDR_LEN] = { 0, 0, 0, 0, 1, 1 };
+static const unsigned char ext_mac[ETHER_ADDR_LEN] = { 0, 0, 0, 0, 2, 1 };
+static const unsigned char client_mac[ETHER_ADDR_LEN] = { 0, 0, 0, 0, 1, 100 };
+static const unsigned char server_mac[ETHER_ADDR_LEN] = { 0, 0, 0, 0, 2, 2 };
+
+static unsigned long tx_packets = 0;
+static uint32_t rng_state;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ * Scope: Global
+ *
+ * Stand-in for the VNS version: frames are only counted.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const char* iface /* borrowed */)
+{
+    __sync_fetch_and_add(&tx_packets, 1);
+    return 0;
+} /* -- sr_send_packet -- */
+
+int sr_send_packets(struct sr_instance* sr, uint8_t** bufs, unsigned int* lens,
+                    unsigned int n, const char* iface)
+{
+    __sync_fetch_and_add(&tx_packets, n);
+    return n;
+} /* -- sr_send_packets -- */
+
+static void usage(char* argv0)
+{
+    printf("Simple Router Benchmarks\n");
+    printf("Format: %s [-f flows] [-r routes] [-m size:weight[,size:weight...]]\n", argv0);
+    printf("           [-N new_flow_pct] [-n iterations] [-s seed] [-b bench[,bench...]] [-v]\n");
+} /* -- usage -- */
+
+static uint32_t rng(void)
+{
+    /* xorshift32 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int parse_sizes(struct bench_params* p, char* spec)
+{
+    char* copy = strdup(spec);
+    char* item;
+
+    p->n_sizes = 0;
+    p->weight_sum = 0;
+    for (item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        unsigned int size, weight = 1;
+        if (p->n_sizes == BENCH_MAX_SIZES || sscanf(item, "%u:%u", &size, &weight) < 1 ||
+                size < BENCH_MIN_FRAME || size > BENCH_MAX_FRAME || weight == 0) {
+            free(copy);
+            return -1;
+        }
+        p->sizes[p->n_sizes] = size;
+        p->weights[p->n_sizes] = weight;
+        p->weight_sum += weight;
+        p->n_sizes++;
+    }
+    free(copy);
+    return p->n_sizes ? 0 : -1;
+}
+
+static unsigned int pick_size(struct bench_params* p)
+{
+    unsigned int w = rng() % p->weight_sum;
+    unsigned int i;
+
+    for (i = 0; w >= p->weights[i]; i++) {
+        w -= p->weights[i];
+    }
+    return p->sizes[i];
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: bench_setup(..)
+ * Scope: Local
+ *
+ * Two interfaces, eth1 towards the clients and eth2 towards the servers,
+ * 'routes' random prefixes out of eth2 over BENCH_NEXT_HOPS next hops plus
+ * a default route, and every next hop in the ARP cache.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void bench_setup(struct sr_instance* sr, struct bench_params* p, int nat_mode)
+{
+    struct in_addr dest, gw, mask;
+    unsigned char mac[ETHER_ADDR_LEN];
+    unsigned int i;
+
+    memset(sr, 0, sizeof(*sr));
+    sr->sockfd = -1;
+
+    sr_add_interface(sr, "eth1");
+    sr_set_ether_addr(sr, int_mac);
+    sr_set_ether_ip(sr, inet_addr(BENCH_INT_IP));
+    sr_add_interface(sr, "eth2");
+    sr_set_ether_addr(sr, ext_mac);
+    sr_set_ether_ip(sr, inet_addr(BENCH_EXT_IP));
+
+    /* Same seed, same table for every instance */
+    rng_state = p->seed;
+    for (i = 0; i < p->routes; i++) {
+        unsigned int len = 16 + rng() % 13;
+        mask.s_addr = htonl(0xffffffffU << (32 - len));
+        /* 20.0.0.0 - 199.255.255.255, clear of the clients and the NAT */
+        dest.s_addr = htonl((20 + rng() % 180) << 24 | (rng() & 0xffffff)) & mask.s_addr;
+        gw.s_addr = htonl(BENCH_HOPS + i % BENCH_NEXT_HOPS);
+        sr_add_rt_entry(sr, dest, gw, mask, "eth2");
+    }
+    dest.s_addr = 0;
+    mask.s_addr = 0;
+    gw.s_addr = htonl(BENCH_HOPS);
+    sr_add_rt_entry(sr, dest, gw, mask, "eth2");
+    dest.s_addr = inet_addr("10.0.0.0");
+    mask.s_addr = inet_addr("255.0.0.0");
+    gw.s_addr = inet_addr(BENCH_CLIENT_GW);
+    sr_add_rt_entry(sr, dest, gw, mask, "eth1");
+    /* As a loaded table would be */
+    sr_fib_compile(sr->fib.current);
+
+    if (nat_mode) {
+        sr_tool_nat_defaults(&(sr->nat));
+    }
+    sr->nat_mode = nat_mode;
+    sr_init(sr);
+
+    for (i = 0; i < BENCH_NEXT_HOPS; i++) {
+        memcpy(mac, server_mac, ETHER_ADDR_LEN);
+        mac[4] = 3;
+        mac[5] = i;
+        sr_arpcache_insert(&(sr->cache), mac, htonl(BENCH_HOPS + i));
+    }
+    memcpy(mac, client_mac, ETHER_ADDR_LEN);
+    sr_arpcache_insert(&(sr->cache), mac, inet_addr(BENCH_CLIENT_GW));
+}
+
+/* Flows go from distinct clients to hosts inside the synthetic prefixes */
+static struct bench_flow* make_flows(struct sr_instance* sr, struct bench_params* p)
+{
+    struct bench_flow* flows = malloc(p->flows * sizeof(*flows));
+    struct sr_rt* rt;
+    unsigned int n_rt = 0, i;
+
+    for (rt = sr->routing_table; rt; rt = rt->next) {
+        n_rt++;
+    }
+    rng_state = p->seed ^ 0x9e3779b9;
+    for (i = 0; i < p->flows; i++) {
+        unsigned int k = rng() % n_rt;
+        for (rt = sr->routing_table; k--; rt = rt->next);
+        if (rt->mask.s_addr == 0 || strcmp(rt->interface, "eth2") != 0) {
+            rt = sr->routing_table;
+        }
+        flows[i].client = htonl(BENCH_CLIENTS + i);
+        flows[i].server = rt->dest.s_addr | (rng() & ~rt->mask.s_addr);
+        flows[i].sport = 1024 + rng() % 60000;
+        flows[i].dport = 80;
+        flows[i].size = pick_size(p);
+    }
+    return flows;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: report(..)
+ * Scope: Local
+ *
+ * Print one result line. 'samples' holds 'n' batch durations of 'batch'
+ * operations each; it is sorted in place.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void report(FILE* out, const char* name, uint32_t* samples, unsigned long n,
+        unsigned int batch, uint64_t total_ns, unsigned long sent)
+{
+    unsigned long ops = n * batch;
+    double per_op = (double) total_ns / ops;
+
+    qsort(samples, n, sizeof(uint32_t), sr_tool_cmp_u32);
+    fprintf(out, "{\"bench\":\"%s\",\"ops\":%lu,\"batch\":%u,\"total_s\":%.6f,"
+            "\"ns_per_op\":%.1f,\"mops\":%.3f,\"p50_ns\":%.1f,\"p90_ns\":%.1f,"
+            "\"p99_ns\":%.1f,\"p999_ns\":%.1f,\"max_ns\":%.1f,\"sent\":%lu}\n",
+            name, ops, batch, total_ns / 1e9, per_op, 1e3 / per_op,
+            (double) samples[n * 50 / 100] / batch, (double) samples[n * 90 / 100] / batch,
+            (double) samples[n * 99 / 100] / batch, (double) samples[n * 999 / 1000] / batch,
+            (double) samples[n - 1] / batch, sent);
+    fflush(out);
+}
+
+static uint32_t clamp_ns(uint64_t ns)
+{
+    return ns > 0xffffffffULL ? 0xffffffffU : (uint32_t) ns;
+}
+
+static void bench_cksum(FILE* out, struct bench_params* p, uint32_t* samples)
+{
+    unsigned long n = p->iterations / BENCH_BATCH, i;
+    uint8_t* bufs[BENCH_MAX_SIZES];
+    unsigned int j, k;
+    volatile uint16_t sink = 0;
+
+    rng_state = p->seed;
+    for (j = 0; j < p->n_sizes; j++) {
+        bufs[j] = malloc(p->sizes[j]);
+        for (k = 0; k < p->sizes[j]; k++) {
+            bufs[j][k] = rng();
+        }
+    }
+
+    uint64_t start = sr_tool_now_ns();
+    for (i = 0; i < n; i++) {
+        unsigned int s = i % p->n_sizes;
+        unsigned int len = p->sizes[s] - sizeof(sr_ethernet_hdr_t);
+        uint64_t t0 = sr_tool_now_ns();
+        for (k = 0; k < BENCH_BATCH; k++) {
+            sink += cksum(bufs[s] + sizeof(sr_ethernet_hdr_t), len);
+        }
+        samples[i] = clamp_ns(sr_tool_now_ns() - t0);
+    }
+    report(out, "cksum", samples, n, BENCH_BATCH, sr_tool_now_ns() - start, 0);
+
+    for (j = 0; j < p->n_sizes; j++) {
+        free(bufs[j]);
+    }
+}
+
+static void bench_lpm(FILE* out, struct sr_instance* sr, struct bench_params* p,
+        struct bench_flow* flows, uint32_t* samples)
+{
+    unsigned long n = p->iterations / BENCH_BATCH, i;
+    unsigned int k;
+    volatile unsigned long hits = 0;
+
+    uint64_t start = sr_tool_now_ns();
+    for (i = 0; i < n; i++) {
+        uint64_t t0 = sr_tool_now_ns();
+        for (k = 0; k < BENCH_BATCH; k++) {
+            hits += sr_routing_lpm(sr, flows[(i * BENCH_BATCH + k) % p->flows].server) != NULL;
+        }
+        samples[i] = clamp_ns(sr_tool_now_ns() - t0);
+    }
+    report(out, "lpm", samples, n, BENCH_BATCH, sr_tool_now_ns() - start, 0);
+}
+
+static void bench_arp_lookup(FILE* out, struct sr_instance* sr, struct bench_params* p,
+        uint32_t* samples)
+{
+    unsigned long n = p->iterations / BENCH_BATCH, i;
+    unsigned int k;
+
+    uint64_t start = sr_tool_now_ns();
+    for (i = 0; i < n; i++) {
+        uint64_t t0 = sr_tool_now_ns();
+        for (k = 0; k < BENCH_BATCH; k++) {
+            struct sr_arpentry* entry = sr_arpcache_lookup(&(sr->cache),
+                    htonl(BENCH_HOPS + (i * BENCH_BATCH + k) % BENCH_NEXT_HOPS));
+            free(entry);
+        }
+        samples[i] = clamp_ns(sr_tool_now_ns() - t0);
+    }
+    report(out, "arp_lookup", samples, n, BENCH_BATCH, sr_tool_now_ns() - start, 0);
+}
+
+static void bench_forward(FILE* out, struct sr_instance* sr, struct bench_params* p,
+        struct bench_flow* flows, uint32_t* samples)
+{
+    uint8_t* frame = malloc(BENCH_MAX_FRAME);
+    unsigned long i;
+    unsigned long sent = tx_packets;
+
+    uint64_t start = sr_tool_now_ns();
+    for (i = 0; i < p->iterations; i++) {
+        struct bench_flow* f = &flows[i % p->flows];
+        unsigned int len = build_tcp_frame(frame, f->size, client_mac, int_mac,
+                f->client, f->server, f->sport, f->dport, 0);
+        uint64_t t0 = sr_tool_now_ns();
+        sr_handlepacket(sr, frame, len, "eth1");
+        samples[i] = clamp_ns(sr_tool_now_ns() - t0);
+    }
+    report(out, "forward", samples, p->iterations, 1, sr_tool_now_ns() - start, tx_packets - sent);
+    free(frame);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: bench_nat(..)
+ * Scope: Local
+ *
+ * Open every flow with a SYN, then time 'iterations' outbound segments of
+ * which new_pct percent open a new flow, then time the same number of
+ * inbound segments to the established mappings.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void bench_nat(FILE* out, struct sr_instance* sr, struct bench_params* p,
+        struct bench_flow* flows, uint32_t* samples, int do_out, int do_in)
+{
+    uint8_t* frame = malloc(BENCH_MAX_FRAME);
+    unsigned long i, sent;
+    unsigned int len;
+    uint16_t next_port = 1024;
+
+    for (i = 0; i < p->flows; i++) {
+        struct bench_flow* f = &flows[i];
+        len = build_tcp_frame(frame, f->size, client_mac, int_mac, f->client, f->server, f->sport, f->dport, 1);
+        sr_handlepacket(sr, frame, len, "eth1");
+    }
+
+    if (do_out) {
+        sent = tx_packets;
+        rng_state = p->seed;
+        uint64_t start = sr_tool_now_ns();
+        for (i = 0; i < p->iterations; i++) {
+            struct bench_flow* f = &flows[i % p->flows];
+            if (rng() % 100 < p->new_pct) {
+                /* New flow from the same client on a port nobody else uses */
+                len = build_tcp_frame(frame, f->size, client_mac, int_mac, f->client, f->server,
+                        next_port++, f->dport, 1);
+                if (next_port == 0) {
+                    next_port = 1024;
+                }
+            } else {
+                len = build_tcp_frame(frame, f->size, client_mac, int_mac, f->client, f->server,
+                        f->sport, f->dport, 0);
+            }
+            uint64_t t0 = sr_tool_now_ns();
+            sr_handlepacket(sr, frame, len, "eth1");
+            samples[i] = clamp_ns(sr_tool_now_ns() - t0);
+        }
+        report(out, "nat_out", samples, p->iterations, 1, sr_tool_now_ns() - start, tx_packets - sent);
+    }
+
+    if (do_in) {
+        uint32_t* ext_port = malloc(p->flows * sizeof(uint32_t));
+        for (i = 0; i < p->flows; i++) {
+            struct sr_nat_mapping* m = sr_nat_lookup_internal(&(sr->nat), flows[i].client,
+                    flows[i].sport, nat_mapping_tcp);
+            ext_port[i] = m ? m->aux_ext : 0;
+        }
+
+        sent = tx_packets;
+        uint64_t start = sr_tool_now_ns();
+        for (i = 0; i < p->iterations; i++) {
+            struct bench_flow* f = &flows[i % p->flows];
+            len = build_tcp_frame(frame, f->size, server_mac, ext_mac, f->server, inet_addr(BENCH_EXT_IP),
+                    f->dport, ext_port[i % p->flows], 0);
+            uint64_t t0 = sr_tool_now_ns();
+            sr_handlepacket(sr, frame, len, "eth2");
+            samples[i] = clamp_ns(sr_tool_now_ns() - t0);
+        }
+        report(out, "nat_in", samples, p->iterations, 1, sr_tool_now_ns() - start, tx_packets - sent);
+        free(ext_port);
+    }
+    free(frame);
+}
+
+/* Same next hops, in the same order */
+static int same_group(const struct sr_rt* a, const struct sr_rt* b)
+{
+    for ( ; a && b; a = a->ecmp_next, b = b->ecmp_next) {
+        if (a->gw.s_addr != b->gw.s_addr || strcmp(a->interface, b->interface) != 0) {
+            return 0;
+        }
+    }
+    return a == b;
+}
+
+/* 1 if the compiled trie forwards ip (hbo) differently from the full one */
+static unsigned long fib_differs(const struct sr_fib* fib, uint32_t ip)
+{
+    return !same_group(sr_fib_lookup(fib, htonl(ip)), sr_fib_lookup_full(fib, htonl(ip)));
+}
+
+/* Compare the tries on both sides of every prefix's edges and on random addresses */
+static unsigned long fib_check(struct sr_instance* sr, struct bench_params* p, unsigned long* addresses)
+{
+    const struct sr_fib* fib = sr_fib_current(&(sr->fib));
+    unsigned long bad = 0;
+    struct sr_rt* rt;
+    uint32_t first, last;
+    unsigned int i;
+
+    for (rt = sr->routing_table; rt; rt = rt->next) {
+        first = ntohl(rt->dest.s_addr);
+        last = first | ~ntohl(rt->mask.s_addr);
+        bad += fib_differs(fib, first) + fib_differs(fib, first - 1) +
+            fib_differs(fib, last) + fib_differs(fib, last + 1) +
+            fib_differs(fib, first + (last - first) / 2) + fib_differs(fib, first + (last - first) / 2 + 1);
+        *addresses += 6;
+    }
+    for (i = 0; i < p->iterations; i++) {
+        bad += fib_differs(fib, rng());
+    }
+    *addresses += p->iterations;
+    return bad;
+}
+
+/* Random route changes in place: new prefixes, some on prefixes that
+   have routes already (more next hops), removed prefixes and next hops */
+static void fib_churn(struct sr_instance* sr, struct bench_params* p)
+{
+    unsigned int n_rt = 0, n = p->routes / 10 + 100, i;
+    struct in_addr dest, gw, mask;
+    struct sr_rt** rts;
+    struct sr_rt* rt;
+
+    for (rt = sr->routing_table; rt; rt = rt->next) {
+        n_rt++;
+    }
+    rts = malloc(n_rt * sizeof(*rts));
+    for (rt = sr->routing_table, i = 0; rt; rt = rt->next) {
+        rts[i++] = rt;
+    }
+    for (i = 0; i < n; i++) {
+        /* Removed routes are retired, not freed, so rts stays readable */
+        rt = rts[rng() % n_rt];
+        gw.s_addr = htonl(BENCH_HOPS + rng() % 4);
+        switch (rng() % 4) {
+            case 0:
+                mask.s_addr = htonl(0xffffffffU << (32 - (8 + rng() % 21)));
+                dest.s_addr = htonl((20 + rng() % 180) << 24 | (rng() & 0xffffff)) & mask.s_addr;
+                sr_add_rt_entry(sr, dest, gw, mask, "eth2");
+                break;
+            case 1:
+                sr_add_rt_entry(sr, rt->dest, gw, rt->mask, rt->interface);
+                break;
+            case 2:
+                sr_del_rt_entry(sr, rt->dest, rt->mask);
+                break;
+            default:
+                sr_del_rt_nexthop(sr, rt->dest, rt->gw, rt->mask, rt->interface);
+                break;
+        }
+    }
+    free(rts);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: bench_fib_compile(..)
+ * Scope: Local
+ *
+ * Time sr_fib_compile and check its result against the full trie, on the
+ * table as set up and after each of BENCH_CHURN_ROUNDS rounds of changes.
+ * Any mismatch is a bug; the stage exits nonzero then.
+ *
+ *---------------------------------------------------------------------------*/
+
+static unsigned long bench_fib_compile(FILE* out, struct sr_instance* sr, struct bench_params* p)
+{
+    const struct sr_fib_compiled* c;
+    unsigned long addresses = 0, bad;
+    uint64_t ns = 0, t0;
+    unsigned int round;
+    struct in_addr zero;
+
+    rng_state = p->seed ^ 0x85ebca6b;
+    bad = fib_check(sr, p, &addresses);
+    for (round = 0; round < BENCH_CHURN_ROUNDS; round++) {
+        fib_churn(sr, p);
+        if (round == BENCH_CHURN_ROUNDS / 2) {
+            /* From here on an address can match a prefix that forwards
+               nowhere under a shorter one that forwards somewhere */
+            zero.s_addr = 0;
+            sr_del_rt_entry(sr, zero, zero);
+        }
+        t0 = sr_tool_now_ns();
+        if (sr_fib_compile(sr->fib.current) != 0) {
+            fprintf(stderr, "sr_fib_compile: out of memory\n");
+            return 1;
+        }
+        ns += sr_tool_now_ns() - t0;
+        bad += fib_check(sr, p, &addresses);
+    }
+    c = sr->fib.current->compiled;
+    fprintf(out, "{\"bench\":\"fib_compile\",\"rounds\":%d,\"compile_ms\":%.3f,\"routes\":%u,"
+            "\"prefixes\":%u,\"nodes\":%u,\"addresses\":%lu,\"mismatches\":%lu}\n",
+            BENCH_CHURN_ROUNDS, ns / 1e6 / BENCH_CHURN_ROUNDS, sr->fib.current->n_routes,
+            c->n_prefixes, c->n_nodes, addresses, bad);
+    fflush(out);
+    return bad;
+}
+
+static int wanted(const char* list, const char* name)
+{
+    const char* s = list;
+    size_t n = strlen(name);
+
+    if (list == NULL) {
+        return 1;
+    }
+    while ((s = strstr(s, name)) != NULL) {
+        if ((s == list || s[-1] == ',') && (s[n] == ',' || s[n] == '\0')) {
+            return 1;
+        }
+        s += n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    int verbose = 0;
+    char* benches = NULL;
+    struct bench_params p;
+    struct sr_instance sr, sr_nat, sr_fib;
+    int ret = 0;
+
+    p.flows = DEFAULT_FLOWS;
+    p.routes = DEFAULT_ROUTES;
+    p.new_pct = DEFAULT_NEW_PCT;
+    p.iterations = DEFAULT_ITERATIONS;
+    p.seed = DEFAULT_SEED;
+    p.size_spec = DEFAULT_SIZES;
+
+    while ((c = getopt(argc, argv, "hf:r:m:N:n:s:b:v")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'f':
+                p.flows = atoi((char *) optarg);
+                break;
+            case 'r':
+                p.routes = atoi((char *) optarg);
+                break;
+            case 'm':
+                p.size_spec = optarg;
+                break;
+            case 'N':
+                p.new_pct = atoi((char *) optarg);
+                break;
+            case 'n':
+                p.iterations = atoi((char *) optarg);
+                break;
+            case 's':
+                p.seed = atoi((char *) optarg);
+                break;
+            case 'b':
+                benches = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        } /* switch */
+    } /* -- while -- */
+
+    if (parse_sizes(&p, p.size_spec) != 0) {
+        fprintf(stderr, "Invalid size mix %s (sizes %u to %u bytes)\n", p.size_spec,
+                (unsigned int) BENCH_MIN_FRAME, BENCH_MAX_FRAME);
+        exit(1);
+    }
+    if (p.flows == 0 || p.flows > 0xffff || p.routes == 0 || p.iterations < BENCH_BATCH || p.new_pct > 100 || p.seed == 0) {
+        fprintf(stderr, "Need 1-65535 flows, at least one route, %d iterations, new_pct <= 100 and a non-zero seed\n",
+                BENCH_BATCH);
+        exit(1);
+    }
+
+    /* The router prints for every packet, to both streams; keep that out of the results */
+    FILE* out = fdopen(dup(fileno(stdout)), "w");
+    if (out == NULL) {
+        perror("fdopen");
+        exit(1);
+    }
+    if (!verbose && (freopen("/dev/null", "w", stdout) == NULL ||
+                freopen("/dev/null", "w", stderr) == NULL)) {
+        perror("freopen");
+        exit(1);
+    }
+
+    fprintf(out, "{\"params\":{\"flows\":%u,\"routes\":%u,\"sizes\":\"%s\",\"new_pct\":%u,"
+            "\"iterations\":%u,\"seed\":%u}}\n",
+            p.flows, p.routes, p.size_spec, p.new_pct, p.iterations, p.seed);
+
+    uint32_t* samples = malloc(p.iterations * sizeof(uint32_t));
+
+    bench_setup(&sr, &p, 0);
+    struct bench_flow* flows = make_flows(&sr, &p);
+
+    if (wanted(benches, "cksum")) {
+        bench_cksum(out, &p, samples);
+    }
+    if (wanted(benches, "lpm")) {
+        bench_lpm(out, &sr, &p, flows, samples);
+    }
+    if (wanted(benches, "arp_lookup")) {
+        bench_arp_lookup(out, &sr, &p, samples);
+    }
+    if (wanted(benches, "forward")) {
+        bench_forward(out, &sr, &p, flows, samples);
+    }
+    if (wanted(benches, "nat_out") || wanted(benches, "nat_in")) {
+        bench_setup(&sr_nat, &p, 1);
+        bench_nat(out, &sr_nat, &p, flows, samples, wanted(benches, "nat_out"), wanted(benches, "nat_in"));
+    }
+    if (wanted(benches, "fib_compile")) {
+        /* Its own table: the changes would skew the other stages */
+        bench_setup(&sr_fib, &p, 0);
+        ret = bench_fib_compile(out, &sr_fib, &p) != 0;
+    }
+
+    free(flows);
+    free(samples);
+    fclose(out);
+    return ret;
+} /* -- main -- */
@@ -0,0 +1,760 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_utils.h"
+#include "sr_event.h"
+#include "sr_drop.h"
+#include "sr_stats.h"
+#include "sr_perf.h"
+#include "sr_ctl.h"
+
+/* Indexed by sr_tcp_state */
+static const char *sr_ctl_tcp_states[] = {
+    "close_wait", "closed", "closing", "established", "fin_wait_1", "fin_wait_2",
+    "last_ack", "listen", "syn_rcvd", "syn_sent", "time_wait"
+};
+
+/* One command: its words, what the control thread parsed out of them for
+   the loop thread, and what the loop thread hands back */
+struct sr_ctl_cmd {
+    int argc;
+    char *argv[SR_CTL_ARGS];
+    const char *error;          /* set when a command fails */
+
+    struct in_addr dest, gw, mask;
+    char iface[sr_IFACE_NAMELEN];
+    sr_nat_mapping_type type;
+    uint32_t ip_int, ip_ext;
+    uint16_t aux_int, aux_ext;
+
+    struct sr_rt_load load;     /* "route reload": built here, installed by the loop */
+
+    /* "routes": one chunk of the table and where the next one starts */
+    uint32_t cursor;
+    int cursor_len;
+    struct sr_rt *routes;
+    unsigned int n_routes, max_routes, n_prefixes;
+};
+
+struct sr_ctl_command {
+    const char *name;
+    const char *usage;
+    int (*run)(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out);
+};
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_call(..)
+ *
+ * Run fn(sr, arg) on the event loop thread, between packets, and wait
+ * for it. Returns what fn returns, or -1 if the router is stopping.
+ *---------------------------------------------------------------------*/
+static int sr_ctl_call(struct sr_ctl *ctl, sr_event_fn fn, void *arg) {
+    uint64_t one = 1;
+    int ret;
+
+    pthread_mutex_lock(&(ctl->lock));
+    if (ctl->stopping) {
+        pthread_mutex_unlock(&(ctl->lock));
+        return -1;
+    }
+    ctl->call_fn = fn;
+    ctl->call_arg = arg;
+    if (write(ctl->call_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write(..):sr_ctl_call");
+    }
+    while (ctl->call_fn != NULL) {
+        pthread_cond_wait(&(ctl->done), &(ctl->lock));
+    }
+    ret = ctl->call_ret;
+    pthread_mutex_unlock(&(ctl->lock));
+    return ret;
+}
+
+/* Loop side of sr_ctl_call */
+static int sr_ctl_dispatch(struct sr_instance *sr, void *arg) {
+    struct sr_ctl *ctl = arg;
+    uint64_t n;
+
+    if (read(ctl->call_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("read(..):sr_ctl_dispatch");
+    }
+    pthread_mutex_lock(&(ctl->lock));
+    if (ctl->call_fn != NULL) {
+        ctl->call_ret = ctl->call_fn(sr, ctl->call_arg);
+        ctl->call_fn = NULL;
+        pthread_cond_signal(&(ctl->done));
+    }
+    pthread_mutex_unlock(&(ctl->lock));
+    return 1;
+}
+
+static int sr_ctl_parse_ip(const char *s, uint32_t *ip) {
+    struct in_addr addr;
+
+    if (inet_pton(AF_INET, s, &addr) != 1) {
+        return -1;
+    }
+    *ip = addr.s_addr;
+    return 0;
+}
+
+static int sr_ctl_parse_aux(const char *s, uint16_t *aux) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+
+    if (*s == '\0' || *end != '\0' || v > MAX_16B_NUM) {
+        return -1;
+    }
+    *aux = v;
+    return 0;
+}
+
+static int sr_ctl_parse_type(const char *s, sr_nat_mapping_type *type) {
+    if (strcmp(s, "tcp") == 0) {
+        *type = nat_mapping_tcp;
+    } else if (strcmp(s, "icmp") == 0) {
+        *type = nat_mapping_icmp;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static const char *sr_ctl_ip(uint32_t ip, char *buf) {
+    return inet_ntop(AF_INET, &ip, buf, INET_ADDRSTRLEN);
+}
+
+/* ICMP identifiers are kept as they appear in the packet */
+static unsigned int sr_ctl_aux(sr_nat_mapping_type type, uint16_t aux) {
+    return type == nat_mapping_icmp ? ntohs(aux) : aux;
+}
+
+/*---------------------------------------------------------------------
+ * Commands served on the control thread
+ *---------------------------------------------------------------------*/
+
+static int sr_ctl_help(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out);
+
+static int sr_ctl_stats(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    sr_drop_dump_json(out);
+    sr_stats_dump_json(ctl->sr, out);
+    sr_perf_dump_json(out);
+    return 0;
+}
+
+static int sr_ctl_perf(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    if (cmd->argc == 1) {
+        fprintf(out, "{\"perf\":%s}\n", sr_perf_enabled ? "true" : "false");
+        sr_perf_dump_json(out);
+    } else if (cmd->argc == 2 && strcmp(cmd->argv[1], "on") == 0) {
+        sr_perf_enabled = 1;
+    } else if (cmd->argc == 2 && strcmp(cmd->argv[1], "off") == 0) {
+        sr_perf_enabled = 0;
+    } else if (cmd->argc == 2 && strcmp(cmd->argv[1], "reset") == 0) {
+        sr_perf_reset();
+    } else {
+        cmd->error = "usage";
+        return -1;
+    }
+    return 0;
+}
+
+/* What "arp" keeps of a pending request */
+struct sr_ctl_arpreq {
+    uint32_t ip;
+    uint32_t times_sent;
+    unsigned int queued;
+};
+
+static int sr_ctl_arp(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    struct sr_arpcache *cache = &(ctl->sr->cache);
+    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    struct sr_ctl_arpreq *reqs = NULL;
+    struct sr_arpreq *req;
+    struct sr_packet *pkt;
+    unsigned int i, n_reqs = 0;
+    unsigned long learn_limited, learn_full;
+    uint64_t now_ms = monotonic_ms();
+    time_t now = time(NULL);
+    char ip[INET_ADDRSTRLEN];
+
+    /* Copy under the lock, print without it */
+    pthread_mutex_lock(&(cache->lock));
+    memcpy(entries, cache->entries, sizeof(entries));
+    learn_limited = cache->learn_limited;
+    learn_full = cache->learn_full;
+    for (req = cache->requests; req; req = req->next) {
+        n_reqs++;
+    }
+    if (n_reqs && (reqs = calloc(n_reqs, sizeof(struct sr_ctl_arpreq))) != NULL) {
+        for (i = 0, req = cache->requests; req; req = req->next, i++) {
+            reqs[i].ip = req->ip;
+            reqs[i].times_sent = req->times_sent;
+            for (pkt = req->packets; pkt; pkt = pkt->next) {
+                reqs[i].queued++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&(cache->lock));
+
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        if (!entries[i].valid) {
+            continue;
+        }
+        fprintf(out, "{\"ip\":\"%s\",\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"age_s\":%ld",
+                sr_ctl_ip(entries[i].ip, ip), entries[i].mac[0], entries[i].mac[1],
+                entries[i].mac[2], entries[i].mac[3], entries[i].mac[4], entries[i].mac[5],
+                (long) (now - entries[i].added));
+        if (entries[i].used) {
+            fprintf(out, ",\"idle_ms\":%" PRIu64, now_ms - entries[i].used);
+        }
+        fprintf(out, "}\n");
+    }
+    for (i = 0; reqs && i < n_reqs; i++) {
+        fprintf(out, "{\"pending\":\"%s\",\"tries\":%u,\"queued\":%u}\n",
+                sr_ctl_ip(reqs[i].ip, ip), reqs[i].times_sent, reqs[i].queued);
+    }
+    fprintf(out, "{\"learn_limited\":%lu,\"learn_full\":%lu}\n", learn_limited, learn_full);
+    free(reqs);
+    return 0;
+}
+
+static int sr_ctl_nat_dump(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    struct sr_nat *nat = &(ctl->sr->nat);
+    struct sr_nat_mapping *m;
+    struct sr_nat_connection *conn;
+    time_t now = time(NULL);
+    char ip_int[INET_ADDRSTRLEN], ip_ext[INET_ADDRSTRLEN];
+
+    for (m = sr_nat_dump_begin(nat); m; m = m->next) {
+        fprintf(out, "{\"type\":\"%s\",\"int\":\"%s:%u\",\"ext\":\"%s:%u\",\"idle_s\":%ld,\"static\":%s",
+                m->type == nat_mapping_tcp ? "tcp" : "icmp",
+                sr_ctl_ip(m->ip_int, ip_int), sr_ctl_aux(m->type, m->aux_int),
+                sr_ctl_ip(m->ip_ext, ip_ext), sr_ctl_aux(m->type, m->aux_ext),
+                (long) (now - m->last_updated), m->is_static ? "true" : "false");
+        if (m->type == nat_mapping_tcp) {
+            fprintf(out, ",\"conns\":[");
+            for (conn = __atomic_load_n(&m->conns, __ATOMIC_ACQUIRE); conn; conn = conn->next) {
+                fprintf(out, "{\"peer\":\"%s\",\"state\":\"%s\",\"idle_s\":%ld}%s",
+                        sr_ctl_ip(conn->ip, ip_int), sr_ctl_tcp_states[conn->tcp_state],
+                        (long) (now - conn->last_updated), conn->next ? "," : "");
+            }
+            fprintf(out, "]");
+        }
+        fprintf(out, "}\n");
+        /* A slow reader only holds up this thread and deferred frees */
+    }
+    sr_nat_dump_end(nat);
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Commands run on the loop thread through sr_ctl_call
+ *---------------------------------------------------------------------*/
+
+/* sr_fib_walk callback: copy a prefix's routes, up to a chunk of them */
+static int sr_ctl_copy_prefix(struct sr_rt *rt, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+    struct sr_rt *more;
+    unsigned int start = cmd->n_routes;
+
+    if (cmd->n_prefixes == SR_CTL_ROUTE_CHUNK) {
+        return 1;
+    }
+    for (; rt; rt = rt->ecmp_next) {
+        if (cmd->n_routes == cmd->max_routes) {
+            if ((more = realloc(cmd->routes, 2 * cmd->max_routes * sizeof(struct sr_rt))) == NULL) {
+                cmd->n_routes = start;
+                cmd->error = "out of memory";
+                return -1;
+            }
+            cmd->routes = more;
+            cmd->max_routes *= 2;
+        }
+        cmd->routes[cmd->n_routes++] = *rt;
+    }
+    cmd->n_prefixes++;
+    return 0;
+}
+
+/* The next chunk of "routes", so a large table never holds up the loop
+   for long. Returns 1 while there is more to come. */
+static int sr_ctl_copy_routes(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+
+    int more;
+
+    cmd->n_routes = cmd->n_prefixes = 0;
+    more = sr_fib_walk(sr_fib_current(&(sr->fib)), &(cmd->cursor), &(cmd->cursor_len),
+                       sr_ctl_copy_prefix, cmd);
+    return cmd->error ? -1 : more;
+}
+
+static int sr_ctl_add_route(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+
+    switch (sr_add_rt_entry(sr, cmd->dest, cmd->gw, cmd->mask, cmd->iface)) {
+        case 0:
+            return 0;
+        case 1:
+            cmd->error = "route already exists";
+            return -1;
+        default:
+            cmd->error = "mask is not contiguous";
+            return -1;
+    }
+}
+
+static int sr_ctl_replace_route(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+
+    if (sr_replace_rt_entry(sr, cmd->dest, cmd->gw, cmd->mask, cmd->iface) != 0) {
+        cmd->error = "mask is not contiguous";
+        return -1;
+    }
+    return 0;
+}
+
+static int sr_ctl_del_route(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+
+    if (cmd->iface[0]) {
+        return sr_del_rt_nexthop(sr, cmd->dest, cmd->gw, cmd->mask, cmd->iface);
+    }
+    return sr_del_rt_entry(sr, cmd->dest, cmd->mask);
+}
+
+static int sr_ctl_install(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+
+    sr_install_rt(sr, &(cmd->load));
+    return 0;
+}
+
+static int sr_ctl_add_static(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+    struct sr_if *iface;
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (iface->ip == cmd->ip_ext && !sr_nat_is_interface_internal(iface->name)) {
+            break;
+        }
+    }
+    return sr_nat_add_static(&(sr->nat), cmd->type, cmd->ip_int, cmd->aux_int,
+                             cmd->ip_ext, cmd->aux_ext, iface != NULL);
+}
+
+static int sr_ctl_del_mapping(struct sr_instance *sr, void *arg) {
+    struct sr_ctl_cmd *cmd = arg;
+
+    return sr_nat_del_mapping(&(sr->nat), cmd->type, cmd->ip_ext, cmd->aux_ext);
+}
+
+/* In prefix order, a chunk per loop call; a route changed while the
+   dump runs shows up or not, but no prefix twice */
+static int sr_ctl_routes(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    char dest[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN];
+    unsigned int i;
+    int more;
+
+    cmd->max_routes = SR_CTL_ROUTE_CHUNK;
+    if ((cmd->routes = malloc(cmd->max_routes * sizeof(struct sr_rt))) == NULL) {
+        cmd->error = "out of memory";
+        return -1;
+    }
+    cmd->cursor = 0;
+    cmd->cursor_len = -1;
+    do {
+        more = sr_ctl_call(ctl, sr_ctl_copy_routes, cmd);
+        for (i = 0; i < cmd->n_routes; i++) {
+            fprintf(out, "{\"dest\":\"%s\",\"gw\":\"%s\",\"mask\":\"%s\",\"iface\":\"%s\"}\n",
+                    sr_ctl_ip(cmd->routes[i].dest.s_addr, dest), sr_ctl_ip(cmd->routes[i].gw.s_addr, gw),
+                    sr_ctl_ip(cmd->routes[i].mask.s_addr, mask), cmd->routes[i].interface);
+        }
+    } while (more == 1);
+    free(cmd->routes);
+    if (more < 0) {
+        if (cmd->error == NULL) {
+            cmd->error = "router stopping";
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int sr_ctl_route(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    if (cmd->argc == 6 && (strcmp(cmd->argv[1], "add") == 0 || strcmp(cmd->argv[1], "replace") == 0)) {
+        if (sr_ctl_parse_ip(cmd->argv[2], &(cmd->dest.s_addr)) || sr_ctl_parse_ip(cmd->argv[3], &(cmd->gw.s_addr)) ||
+            sr_ctl_parse_ip(cmd->argv[4], &(cmd->mask.s_addr))) {
+            cmd->error = "bad address";
+            return -1;
+        }
+        if (sr_fib_prefix_len(cmd->mask.s_addr) < 0) {
+            cmd->error = "mask is not contiguous";
+            return -1;
+        }
+        if (strlen(cmd->argv[5]) >= sr_IFACE_NAMELEN || sr_get_interface(ctl->sr, cmd->argv[5]) == NULL) {
+            cmd->error = "no such interface";
+            return -1;
+        }
+        strncpy(cmd->iface, cmd->argv[5], sr_IFACE_NAMELEN);
+        if (sr_ctl_call(ctl, strcmp(cmd->argv[1], "replace") == 0 ? sr_ctl_replace_route : sr_ctl_add_route,
+                        cmd) != 0) {
+            if (cmd->error == NULL) {
+                cmd->error = "router stopping";
+            }
+            return -1;
+        }
+        return 0;
+    }
+    if ((cmd->argc == 4 || cmd->argc == 6) && strcmp(cmd->argv[1], "del") == 0) {
+        if (sr_ctl_parse_ip(cmd->argv[2], &(cmd->dest.s_addr)) || sr_ctl_parse_ip(cmd->argv[3], &(cmd->mask.s_addr)) ||
+            (cmd->argc == 6 && sr_ctl_parse_ip(cmd->argv[4], &(cmd->gw.s_addr)))) {
+            cmd->error = "bad address";
+            return -1;
+        }
+        if (cmd->argc == 6) {
+            if (strlen(cmd->argv[5]) >= sr_IFACE_NAMELEN || sr_get_interface(ctl->sr, cmd->argv[5]) == NULL) {
+                cmd->error = "no such interface";
+                return -1;
+            }
+            strncpy(cmd->iface, cmd->argv[5], sr_IFACE_NAMELEN);
+        }
+        if (sr_ctl_call(ctl, sr_ctl_del_route, cmd) != 0) {
+            cmd->error = "no such route";
+            return -1;
+        }
+        return 0;
+    }
+    if ((cmd->argc == 2 || cmd->argc == 3) && strcmp(cmd->argv[1], "reload") == 0) {
+        const char *file = cmd->argc == 3 ? cmd->argv[2] : ctl->sr->rtable;
+
+        /* Parsing and compiling a large file takes a while; only the
+           swap happens on the loop, so forwarding never waits for it */
+        if (file == NULL || sr_build_rt(file, &(cmd->load)) != 0) {
+            cmd->error = "cannot load the routing table file; the old table stays";
+            return -1;
+        }
+        if (sr_ctl_call(ctl, sr_ctl_install, cmd) != 0) {
+            sr_discard_rt(&(cmd->load));
+            cmd->error = "router stopping";
+            return -1;
+        }
+        return 0;
+    }
+    cmd->error = "usage";
+    return -1;
+}
+
+static int sr_ctl_nat(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    if (!ctl->sr->nat_mode) {
+        cmd->error = "NAT is off";
+        return -1;
+    }
+    if (cmd->argc == 1) {
+        return sr_ctl_nat_dump(ctl, cmd, out);
+    }
+    if (cmd->argc == 2 && strcmp(cmd->argv[1], "hosts") == 0) {
+        sr_nat_dump_hosts(&(ctl->sr->nat), out);
+        return 0;
+    }
+    if (cmd->argc == 7 && strcmp(cmd->argv[1], "add") == 0 && strcmp(cmd->argv[2], "tcp") == 0) {
+        cmd->type = nat_mapping_tcp;
+        if (sr_ctl_parse_ip(cmd->argv[3], &(cmd->ip_int)) || sr_ctl_parse_aux(cmd->argv[4], &(cmd->aux_int)) ||
+            sr_ctl_parse_ip(cmd->argv[5], &(cmd->ip_ext)) || sr_ctl_parse_aux(cmd->argv[6], &(cmd->aux_ext))) {
+            cmd->error = "bad address or port";
+            return -1;
+        }
+        if (sr_ctl_call(ctl, sr_ctl_add_static, cmd) != 0) {
+            cmd->error = "external port taken, internal endpoint mapped, or not a NAT address";
+            return -1;
+        }
+        return 0;
+    }
+    if (cmd->argc == 5 && strcmp(cmd->argv[1], "owner") == 0) {
+        char ip[INET_ADDRSTRLEN];
+
+        if (sr_ctl_parse_type(cmd->argv[2], &(cmd->type)) || sr_ctl_parse_ip(cmd->argv[3], &(cmd->ip_ext)) ||
+            sr_ctl_parse_aux(cmd->argv[4], &(cmd->aux_ext))) {
+            cmd->error = "bad type, address or port";
+            return -1;
+        }
+        if (cmd->type == nat_mapping_icmp) {
+            cmd->aux_ext = htons(cmd->aux_ext);
+        }
+        /* Computed from the configuration alone, so no call to the loop */
+        if (sr_nat_deterministic_host(&(ctl->sr->nat), cmd->ip_ext, cmd->aux_ext, cmd->type,
+                                      &(cmd->ip_int)) != 0) {
+            cmd->error = "not a deterministic NAT port";
+            return -1;
+        }
+        fprintf(out, "{\"host\":\"%s\"}\n", sr_ctl_ip(cmd->ip_int, ip));
+        return 0;
+    }
+    if (cmd->argc == 5 && strcmp(cmd->argv[1], "del") == 0) {
+        if (sr_ctl_parse_type(cmd->argv[2], &(cmd->type)) || sr_ctl_parse_ip(cmd->argv[3], &(cmd->ip_ext)) ||
+            sr_ctl_parse_aux(cmd->argv[4], &(cmd->aux_ext))) {
+            cmd->error = "bad type, address or port";
+            return -1;
+        }
+        if (cmd->type == nat_mapping_icmp) {
+            cmd->aux_ext = htons(cmd->aux_ext);
+        }
+        if (sr_ctl_call(ctl, sr_ctl_del_mapping, cmd) != 0) {
+            cmd->error = "no such mapping";
+            return -1;
+        }
+        return 0;
+    }
+    cmd->error = "usage";
+    return -1;
+}
+
+static const struct sr_ctl_command sr_ctl_commands[] = {
+    { "help",   "help",                                        sr_ctl_help },
+    { "stats",  "stats",                                       sr_ctl_stats },
+    { "perf",   "perf | perf on|off|reset",                    sr_ctl_perf },
+    { "arp",    "arp",                                         sr_ctl_arp },
+    { "routes", "routes",                                      sr_ctl_routes },
+    { "route",  "route add|replace DEST GW MASK IFACE | route del DEST MASK [GW IFACE] | route reload [FILE]",
+                sr_ctl_route },
+    { "nat",    "nat | nat hosts | nat add tcp INT_IP INT_PORT EXT_IP EXT_PORT | "
+                "nat del tcp|icmp EXT_IP EXT_PORT | nat owner tcp|icmp EXT_IP EXT_PORT",
+                sr_ctl_nat },
+    { NULL, NULL, NULL }
+};
+
+static int sr_ctl_help(struct sr_ctl *ctl, struct sr_ctl_cmd *cmd, FILE *out) {
+    const struct sr_ctl_command *c;
+
+    for (c = sr_ctl_commands; c->name; c++) {
+        fprintf(out, "{\"usage\":\"%s\"}\n", c->usage);
+    }
+    return 0;
+}
+
+/* Run one command line and write its reply */
+static void sr_ctl_execute(struct sr_ctl *ctl, char *line, FILE *out) {
+    const struct sr_ctl_command *c;
+    struct sr_ctl_cmd cmd;
+    char *word, *save = NULL;
+
+    memset(&cmd, 0, sizeof(cmd));
+    for (word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if (cmd.argc == SR_CTL_ARGS) {
+            fprintf(out, "{\"ok\":false,\"error\":\"too many words\"}\n");
+            return;
+        }
+        cmd.argv[cmd.argc++] = word;
+    }
+    if (cmd.argc == 0) {
+        return;
+    }
+
+    for (c = sr_ctl_commands; c->name; c++) {
+        if (strcmp(c->name, cmd.argv[0]) == 0) {
+            break;
+        }
+    }
+    if (c->name == NULL) {
+        fprintf(out, "{\"ok\":false,\"error\":\"unknown command, try help\"}\n");
+    } else if (c->run(ctl, &cmd, out) == 0) {
+        fprintf(out, "{\"ok\":true}\n");
+    } else if (cmd.error && strcmp(cmd.error, "usage") == 0) {
+        fprintf(out, "{\"ok\":false,\"error\":\"usage: %s\"}\n", c->usage);
+    } else {
+        fprintf(out, "{\"ok\":false,\"error\":\"%s\"}\n", cmd.error ? cmd.error : "failed");
+    }
+}
+
+static void sr_ctl_serve(struct sr_ctl *ctl, int fd) {
+    FILE *in = fdopen(dup(fd), "r");
+    FILE *out = fdopen(dup(fd), "w");
+    char line[SR_CTL_LINE];
+    int c;
+
+    if (in == NULL || out == NULL) {
+        perror("fdopen(..):sr_ctl_serve");
+    }
+    while (in && out && fgets(line, sizeof(line), in) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(in)) {
+            while ((c = fgetc(in)) != EOF && c != '\n')
+                ;
+            fprintf(out, "{\"ok\":false,\"error\":\"line too long\"}\n");
+        } else {
+            sr_ctl_execute(ctl, line, out);
+        }
+        if (fflush(out) != 0) {
+            break;
+        }
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (out) {
+        fclose(out);
+    }
+}
+
+/* Serves one client at a time until sr_ctl_close */
+static void *sr_ctl_thread(void *arg) {
+    struct sr_ctl *ctl = arg;
+    sigset_t mask;
+    int fd;
+
+    /* Leave SIGINT and SIGTERM to the loop thread; SIGPIPE is ignored
+       process-wide, so a client that went away is EPIPE */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (!ctl->stopping) {
+        if ((fd = accept(ctl->listen_fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        pthread_mutex_lock(&(ctl->lock));
+        ctl->client_fd = fd;
+        pthread_mutex_unlock(&(ctl->lock));
+
+        sr_ctl_serve(ctl, fd);
+
+        pthread_mutex_lock(&(ctl->lock));
+        ctl->client_fd = -1;
+        pthread_mutex_unlock(&(ctl->lock));
+        close(fd);
+    }
+    return NULL;
+}
+
+static void sr_ctl_free(struct sr_ctl *ctl) {
+    if (ctl->listen_fd >= 0) {
+        close(ctl->listen_fd);
+    }
+    if (ctl->call_fd >= 0) {
+        close(ctl->call_fd);
+    }
+    pthread_cond_destroy(&(ctl->done));
+    pthread_mutex_destroy(&(ctl->lock));
+    free(ctl);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_open(..)
+ *
+ * Listen on path and start the control thread. The socket is created
+ * with mode 0600, so only the router's user can change its tables. A
+ * stale socket left at path is replaced; any other file there is an
+ * error. Call it after the
+ * event loop's signal sources are added, so the thread starts with
+ * those signals blocked. Returns 0, or -1 on error.
+ *---------------------------------------------------------------------*/
+int sr_ctl_open(struct sr_instance *sr, const char *path) {
+    struct sr_ctl *ctl;
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path %s is too long\n", path);
+        return -1;
+    }
+    ctl = calloc(1, sizeof(struct sr_ctl));
+    if (ctl == NULL) {
+        return -1;
+    }
+    ctl->sr = sr;
+    strcpy(ctl->path, path);
+    ctl->client_fd = -1;
+    ctl->call_fd = -1;
+    pthread_mutex_init(&(ctl->lock), NULL);
+    pthread_cond_init(&(ctl->done), NULL);
+
+    if ((ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket(..):sr_ctl_open");
+        sr_ctl_free(ctl);
+        return -1;
+    }
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* No window in which the socket exists with looser permissions */
+    mask = umask(077);
+    ret = bind(ctl->listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (ret < 0 || listen(ctl->listen_fd, 4) < 0) {
+        perror("bind(..):sr_ctl_open");
+        sr_ctl_free(ctl);
+        return -1;
+    }
+
+    if ((ctl->call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        sr_event_add(&(sr->loop), ctl->call_fd, sr_ctl_dispatch, NULL, ctl) == NULL) {
+        perror("eventfd(..):sr_ctl_open");
+        unlink(path);
+        sr_ctl_free(ctl);
+        return -1;
+    }
+
+    if (pthread_create(&(ctl->thread), NULL, sr_ctl_thread, ctl) != 0) {
+        perror("pthread_create(..):sr_ctl_open");
+        unlink(path);
+        sr_ctl_free(ctl);
+        return -1;
+    }
+    sr->ctl = ctl;
+    return 0;
+}
+
+/* Stop the control thread and remove the socket. Runs after the event
+   loop has stopped, so a call still waiting on it is failed. */
+void sr_ctl_close(struct sr_instance *sr) {
+    struct sr_ctl *ctl = sr->ctl;
+
+    if (ctl == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&(ctl->lock));
+    ctl->stopping = 1;
+    if (ctl->call_fn != NULL) {
+        ctl->call_ret = -1;
+        ctl->call_fn = NULL;
+        pthread_cond_signal(&(ctl->done));
+    }
+    if (ctl->client_fd >= 0) {
+        shutdown(ctl->client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&(ctl->lock));
+
+    /* Wakes accept */
+    shutdown(ctl->listen_fd, SHUT_RDWR);
+    pthread_join(ctl->thread, NULL);
+
+    unlink(ctl->path);
+    sr_ctl_free(ctl);
+    sr->ctl = NULL;
+}
@@ -0,0 +1,57 @@
+/* Control socket.
+
+   A Unix-domain stream socket served by a thread of its own, so a slow
+   or stuck client never holds up forwarding. A client sends one command
+   per line and gets JSON lines back, the last of which is
+   {"ok":true} or {"ok":false,"error":"..."}.
+
+   Reads that are safe from another thread are served on the control
+   thread: counters are summed from the per-thread blocks, ARP entries
+   are copied under the cache lock, and NAT mappings are walked without
+   the NAT lock (sr_nat_dump_begin), so a large dump costs forwarding
+   nothing. Everything that changes state the packet path holds pointers
+   into, and the routing table, which only the loop thread changes (see
+   sr_fib.h), is handed to the event loop thread and runs between
+   packets.
+
+   --
+
+   $ socat - UNIX-CONNECT:/tmp/sr.ctl
+   route add 10.0.2.0 172.64.3.21 255.255.255.0 eth2
+   {"ok":true}
+ */
+
+#ifndef SR_CTL_H
+#define SR_CTL_H
+
+#include <pthread.h>
+#include <sys/un.h>
+#include "sr_event.h"
+
+#define SR_CTL_LINE   256   /* longest command */
+#define SR_CTL_ARGS   8     /* most words in a command */
+#define SR_CTL_ROUTE_CHUNK 256  /* prefixes "routes" copies per loop call */
+
+struct sr_instance;
+
+struct sr_ctl {
+    struct sr_instance* sr;
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    int listen_fd;
+    int client_fd;              /* -1 between clients */
+    int call_fd;                /* eventfd the loop watches for calls */
+    pthread_t thread;
+    volatile int stopping;
+
+    /* At most one call to the loop thread is outstanding */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    sr_event_fn call_fn;        /* NULL when none is pending */
+    void* call_arg;
+    int call_ret;
+};
+
+int sr_ctl_open(struct sr_instance* sr, const char* path);
+void sr_ctl_close(struct sr_instance* sr);
+
+#endif
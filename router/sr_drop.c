@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "sr_tblock.h"
+#include "sr_drop.h"
+
+static const char *sr_drop_names[SR_DROP_NREASONS] = {
+    "eth_short", "ethertype", "arp_short", "arp_not_for_us", "arp_op", "arp_timeout",
+    "ip_short", "ip_checksum", "ttl", "no_route", "ip_proto", "icmp_short",
+    "icmp_checksum", "icmp_type", "nat_no_port", "nat_no_mapping", "nat_unrouted",
+    "nat_filtered", "tx", "rx_len"
+};
+
+__thread struct sr_drop_counters *sr_drop_self;
+static struct sr_tblocks sr_drop_threads = SR_TBLOCKS_INIT(struct sr_drop_counters);
+
+void sr_drop_register(void) {
+    sr_drop_self = sr_tblock_new(&sr_drop_threads);
+}
+
+const char *sr_drop_name(int reason) {
+    return (reason >= 0 && reason < SR_DROP_NREASONS) ? sr_drop_names[reason] : "?";
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_drop_snapshot(..)
+ *
+ * Add up every thread's counters into out. The counting threads are not
+ * stopped; each counter is read with one load.
+ *---------------------------------------------------------------------*/
+static void sr_drop_add(void *block, void *arg) {
+    struct sr_drop_counters *t = block;
+    uint64_t *out = arg;
+    unsigned int i;
+
+    for (i = 0; i < SR_DROP_NREASONS; i++) {
+        out[i] += __atomic_load_n(&t->count[i], __ATOMIC_RELAXED);
+    }
+}
+
+void sr_drop_snapshot(uint64_t out[SR_DROP_NREASONS]) {
+    memset(out, 0, SR_DROP_NREASONS * sizeof(uint64_t));
+    sr_tblocks_foreach(&sr_drop_threads, sr_drop_add, out);
+}
+
+/* One JSON object with a member per reason, zeros included, so
+   successive dumps line up */
+void sr_drop_dump_json(FILE *fp) {
+    uint64_t total[SR_DROP_NREASONS];
+    unsigned int i;
+
+    sr_drop_snapshot(total);
+    fprintf(fp, "{\"drops\":{");
+    for (i = 0; i < SR_DROP_NREASONS; i++) {
+        fprintf(fp, "%s\"%s\":%" PRIu64, i ? "," : "", sr_drop_names[i], total[i]);
+    }
+    fprintf(fp, "}}\n");
+    fflush(fp);
+}
@@ -69,3 +69,60 @@ sr_dump_close(FILE *fp)
   fclose(fp);
 }
 
+/*
+ * Open a dump file for reading and check its header. Only ethernet
+ * captures in the byte order of this host, such as the ones written by
+ * sr_dump_open, are accepted.
+ */
+FILE *
+sr_dump_open_read(const char *fname)
+{
+        struct pcap_file_header hdr;
+        FILE *fp;
+
+        if (fname[0] == '-' && fname[1] == '\0')
+                fp = stdin;
+        else {
+                fp = fopen(fname, "r");
+                if (fp == NULL) {
+                        fprintf(stderr, "sr_dump_open_read: can't open %s\n",
+                            fname);
+                        return (NULL);
+                }
+        }
+
+        if (fread((char *)&hdr, sizeof(hdr), 1, fp) != 1 ||
+            hdr.magic != TCPDUMP_MAGIC || hdr.linktype != LINKTYPE_ETHERNET) {
+                fprintf(stderr, "sr_dump_open_read: %s is not an ethernet "
+                    "capture in host byte order\n", fname);
+                if (fp != stdin)
+                        fclose(fp);
+                return (NULL);
+        }
+
+        return fp;
+}
+
+/*
+ * Read the next packet into sp. Returns 1 on success, 0 at end of file
+ * and -1 if the record is truncated or does not fit in buflen bytes.
+ */
+int
+sr_dump_read(FILE *fp, struct pcap_pkthdr *h, unsigned char *sp,
+    unsigned int buflen)
+{
+        struct pcap_sf_pkthdr sf_hdr;
+
+        if (fread(&sf_hdr, sizeof(sf_hdr), 1, fp) != 1)
+                return (feof(fp) ? 0 : -1);
+        if (sf_hdr.caplen > buflen)
+                return (-1);
+
+        h->ts.tv_sec  = sf_hdr.ts.tv_sec;
+        h->ts.tv_usec = sf_hdr.ts.tv_usec;
+        h->caplen     = sf_hdr.caplen;
+        h->len        = sf_hdr.len;
+        if (h->caplen > 0 && fread((char *)sp, h->caplen, 1, fp) != 1)
+                return (-1);
+        return (1);
+}
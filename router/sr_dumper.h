@@ -77,3 +77,14 @@ void sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp);
  * Close the file
  */
 void sr_dump_close(FILE *fp);
+
+/**
+ * Open a dump file for reading and check its header
+ */
+FILE* sr_dump_open_read(const char *fname);
+
+/**
+ * Read the next packet from a dump file, up to buflen bytes
+ */
+int sr_dump_read(FILE *fp, struct pcap_pkthdr *h, unsigned char *sp,
+                 unsigned int buflen);
@@ -0,0 +1,447 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "sr_event.h"
+#include "sr_utils.h"
+
+#ifdef _LINUX_
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#else
+/* Without timerfd, timers are fd-less sources with a deadline */
+#include <poll.h>
+#endif /* _LINUX_ */
+
+struct sr_event_work {
+    sr_event_work_fn work;
+    sr_event_fn done;
+    void *arg;
+    int fd[2];                  /* the worker writes a byte to fd[1] as it ends */
+    int busy;                   /* loop thread only */
+    pthread_t thread;
+};
+
+int sr_event_init(struct sr_event_loop *loop) {
+    loop->sources = NULL;
+    loop->stop = 0;
+#ifdef _LINUX_
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1(..):sr_event_init");
+        return -1;
+    }
+#else
+    loop->epfd = -1;
+#endif /* _LINUX_ */
+    return 0;
+}
+
+void sr_event_destroy(struct sr_event_loop *loop) {
+    struct sr_event_source *src, *next;
+    for (src = loop->sources; src; src = next) {
+        next = src->next;
+        if ((src->timer || src->signo) && src->fd >= 0) {
+            close(src->fd);
+        }
+        if (src->work) {
+            if (src->work->busy) {
+                pthread_join(src->work->thread, NULL);
+            }
+            close(src->work->fd[0]);
+            close(src->work->fd[1]);
+            free(src->work);
+        }
+        free(src);
+    }
+    loop->sources = NULL;
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
+
+/* A source, not on the loop yet; see sr_event_link */
+static struct sr_event_source *sr_event_new(int fd, sr_event_fn dispatch, sr_event_fn prepare, void *arg) {
+    struct sr_event_source *src = calloc(1, sizeof(struct sr_event_source));
+
+    src->fd = fd;
+    src->dispatch = dispatch;
+    src->prepare = prepare;
+    src->arg = arg;
+    return src;
+}
+
+static struct sr_event_source *sr_event_link(struct sr_event_loop *loop, struct sr_event_source *src) {
+    struct sr_event_source **tail = &(loop->sources);
+
+    /* Keep registration order, so dispatch order is predictable */
+    while (*tail) {
+        tail = &((*tail)->next);
+    }
+    *tail = src;
+    return src;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_event_add(..)
+ *
+ * Watch fd for input. fd may be -1 for a source that only has a
+ * prepare function.
+ *---------------------------------------------------------------------*/
+struct sr_event_source *sr_event_add(struct sr_event_loop *loop, int fd,
+                                     sr_event_fn dispatch, sr_event_fn prepare, void *arg) {
+    struct sr_event_source *src = sr_event_new(fd, dispatch, prepare, arg);
+#ifdef _LINUX_
+    struct epoll_event ev;
+
+    if (fd >= 0) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = src;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl(..):sr_event_add");
+            free(src);
+            return NULL;
+        }
+    }
+#endif /* _LINUX_ */
+    return sr_event_link(loop, src);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_event_add_timer(..)
+ *
+ * Run fn every interval_ms, starting interval_ms from now. With an
+ * interval of 0 the timer is one-shot and starts disarmed; see
+ * sr_event_timer_arm.
+ *---------------------------------------------------------------------*/
+struct sr_event_source *sr_event_add_timer(struct sr_event_loop *loop,
+                                           unsigned int interval_ms, sr_event_fn fn, void *arg) {
+    struct sr_event_source *src;
+#ifdef _LINUX_
+    struct itimerspec its;
+    int fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create(..):sr_event_add_timer");
+        return NULL;
+    }
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (interval_ms && timerfd_settime(fd, 0, &its, NULL) != 0) {
+        perror("timerfd_settime(..):sr_event_add_timer");
+        close(fd);
+        return NULL;
+    }
+    if ((src = sr_event_add(loop, fd, fn, NULL, arg)) != NULL) {
+        src->timer = 1;
+    } else {
+        close(fd);
+    }
+#else
+    src = sr_event_link(loop, sr_event_new(-1, fn, NULL, arg));
+    src->timer = 1;
+    src->interval_ms = interval_ms;
+    src->deadline_ms = interval_ms ? monotonic_ms() + interval_ms : 0;
+#endif /* _LINUX_ */
+    return src;
+}
+
+#ifndef _LINUX_
+/* Without signalfd, a handler notes the signal and interrupts the wait */
+static volatile sig_atomic_t sr_event_signalled[NSIG];
+
+static void sr_event_signal_handler(int signo) {
+    sr_event_signalled[signo] = 1;
+}
+#endif /* _LINUX_ */
+
+/*---------------------------------------------------------------------
+ * Method: sr_event_add_signal(..)
+ *
+ * Run fn on the loop whenever signo arrives.
+ *---------------------------------------------------------------------*/
+struct sr_event_source *sr_event_add_signal(struct sr_event_loop *loop, int signo,
+                                            sr_event_fn fn, void *arg) {
+    struct sr_event_source *src;
+#ifdef _LINUX_
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+        perror("sigprocmask(..):sr_event_add_signal");
+        return NULL;
+    }
+    if ((fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("signalfd(..):sr_event_add_signal");
+        return NULL;
+    }
+    if ((src = sr_event_add(loop, fd, fn, NULL, arg)) != NULL) {
+        src->signo = signo;
+    } else {
+        close(fd);
+    }
+#else
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sr_event_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, NULL) != 0) {
+        perror("sigaction(..):sr_event_add_signal");
+        return NULL;
+    }
+    src = sr_event_link(loop, sr_event_new(-1, fn, NULL, arg));
+    src->signo = signo;
+#endif /* _LINUX_ */
+    return src;
+}
+
+static void *sr_event_worker(void *arg) {
+    struct sr_event_work *w = arg;
+    char c = 0;
+
+    w->work(w->arg);
+    while (write(w->fd[1], &c, 1) < 0 && errno == EINTR) {
+        ;
+    }
+    return NULL;
+}
+
+/* Loop side of a work source: the worker has ended */
+static int sr_event_work_done(struct sr_instance *sr, void *arg) {
+    struct sr_event_work *w = arg;
+    char c;
+
+    if (read(w->fd[0], &c, 1) != 1) {
+        return 1;
+    }
+    pthread_join(w->thread, NULL);
+    w->busy = 0;
+    return w->done(sr, w->arg);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_event_add_work(..)
+ *
+ * A source that runs work(arg) off the loop each time it is started
+ * with sr_event_work_start, then done(sr, arg) on the loop.
+ *---------------------------------------------------------------------*/
+struct sr_event_source *sr_event_add_work(struct sr_event_loop *loop,
+                                          sr_event_work_fn work, sr_event_fn done, void *arg) {
+    struct sr_event_work *w = calloc(1, sizeof(struct sr_event_work));
+    struct sr_event_source *src;
+
+    if (w == NULL || pipe(w->fd) != 0) {
+        perror("pipe(..):sr_event_add_work");
+        free(w);
+        return NULL;
+    }
+    fcntl(w->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(w->fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(w->fd[1], F_SETFD, FD_CLOEXEC);
+    w->work = work;
+    w->done = done;
+    w->arg = arg;
+    if ((src = sr_event_add(loop, w->fd[0], sr_event_work_done, NULL, w)) == NULL) {
+        close(w->fd[0]);
+        close(w->fd[1]);
+        free(w);
+        return NULL;
+    }
+    src->work = w;
+    return src;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_event_work_start(..)
+ *
+ * Start a work source's work on a new thread. Returns 0, 1 if it is
+ * still running from the last start, or -1 if no thread can be made.
+ * Call it from the loop thread.
+ *---------------------------------------------------------------------*/
+int sr_event_work_start(struct sr_event_source *src) {
+    struct sr_event_work *w = src->work;
+    sigset_t all, old;
+    int err;
+
+    if (w->busy) {
+        return 1;
+    }
+    /* The worker takes no signals; they belong to the loop's signalfds */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&(w->thread), NULL, sr_event_worker, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create(..):sr_event_work_start");
+        return -1;
+    }
+    w->busy = 1;
+    return 0;
+}
+
+/* Fire a one-shot timer delay_ms from now (0: as soon as possible),
+   replacing any earlier deadline */
+void sr_event_timer_arm(struct sr_event_source *src, unsigned int delay_ms) {
+#ifdef _LINUX_
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay_ms / 1000;
+    /* an all-zero it_value would disarm the timer instead */
+    its.it_value.tv_nsec = delay_ms ? (delay_ms % 1000) * 1000000L : 1;
+    if (timerfd_settime(src->fd, 0, &its, NULL) != 0) {
+        perror("timerfd_settime(..):sr_event_timer_arm");
+    }
+#else
+    src->deadline_ms = monotonic_ms() + delay_ms;
+    if (src->deadline_ms == 0) {
+        src->deadline_ms = 1;
+    }
+#endif /* _LINUX_ */
+}
+
+void sr_event_timer_disarm(struct sr_event_source *src) {
+#ifdef _LINUX_
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(src->fd, 0, &its, NULL);
+#else
+    src->deadline_ms = 0;
+#endif /* _LINUX_ */
+}
+
+/* Wait for at least one source to become ready and mark it pending */
+static int sr_event_wait(struct sr_event_loop *loop, int timeout_ms) {
+    struct sr_event_source *src;
+#ifdef _LINUX_
+    struct epoll_event evs[SR_EVENT_BATCH];
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+    int i, n;
+
+    if ((n = epoll_wait(loop->epfd, evs, SR_EVENT_BATCH, timeout_ms)) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait(..):sr_event_wait");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        src = evs[i].data.ptr;
+        if (src->timer && read(src->fd, &expirations, sizeof(expirations)) < 0) {
+            /* already consumed; not due after all */
+            continue;
+        }
+        if (src->signo) {
+            /* drain; one dispatch covers every delivery so far */
+            while (read(src->fd, &si, sizeof(si)) == sizeof(si)) {
+            }
+        }
+        src->pending = 1;
+    }
+#else
+    struct pollfd pfd[SR_EVENT_BATCH];
+    struct sr_event_source *pfd_src[SR_EVENT_BATCH];
+    uint64_t now = monotonic_ms();
+    int i, n = 0;
+
+    for (src = loop->sources; src; src = src->next) {
+        if (src->timer && src->deadline_ms) {
+            int left = src->deadline_ms > now ? (int) (src->deadline_ms - now) : 0;
+            if (timeout_ms < 0 || left < timeout_ms) {
+                timeout_ms = left;
+            }
+        } else if (src->fd >= 0 && n < SR_EVENT_BATCH) {
+            pfd[n].fd = src->fd;
+            pfd[n].events = POLLIN;
+            pfd_src[n++] = src;
+        }
+    }
+    if (poll(pfd, n, timeout_ms) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll(..):sr_event_wait");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (pfd[i].revents) {
+            pfd_src[i]->pending = 1;
+        }
+    }
+    now = monotonic_ms();
+    for (src = loop->sources; src; src = src->next) {
+        if (src->signo && sr_event_signalled[src->signo]) {
+            sr_event_signalled[src->signo] = 0;
+            src->pending = 1;
+        }
+        if (src->timer && src->deadline_ms && src->deadline_ms <= now) {
+            if (src->interval_ms == 0) {
+                src->deadline_ms = 0;
+            } else {
+                src->deadline_ms += src->interval_ms;
+                if (src->deadline_ms <= now) {
+                    src->deadline_ms = now + src->interval_ms;
+                }
+            }
+            src->pending = 1;
+        }
+    }
+#endif /* _LINUX_ */
+    return 0;
+}
+
+/* Make sr_event_run return 0 at its next iteration. Safe to call from a
+   signal handler, which also interrupts the wait. */
+void sr_event_stop(struct sr_event_loop *loop) {
+    loop->stop = 1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_event_run(..)
+ *
+ * The router's main loop. Returns the first dispatch result that is
+ * not 1: 0 when the session was closed or the loop was stopped, -1 on
+ * error.
+ *---------------------------------------------------------------------*/
+int sr_event_run(struct sr_instance *sr, struct sr_event_loop *loop) {
+    struct sr_event_source *src;
+    int timeout_ms, ret;
+
+    while (!loop->stop) {
+        timeout_ms = -1;
+        for (src = loop->sources; src; src = src->next) {
+            if (src->prepare && src->prepare(sr, src->arg)) {
+                src->pending = 1;
+                timeout_ms = 0;
+            }
+        }
+
+        if (sr_event_wait(loop, timeout_ms) != 0) {
+            return -1;
+        }
+
+        for (src = loop->sources; src; src = src->next) {
+            if (src->pending) {
+                src->pending = 0;
+                if ((ret = src->dispatch(sr, src->arg)) != 1) {
+                    return ret;
+                }
+            }
+        }
+    }
+    return 0;
+}
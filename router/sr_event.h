@@ -0,0 +1,93 @@
+/* Single-threaded event loop for the router. Packet sources (the VNS
+   socket, the shared-memory rings, AF_PACKET sockets) and periodic work
+   (ARP retransmits, ARP and NAT expiry) are all sources on one epoll set,
+   so everything that touches the ARP cache and the NAT table runs on the
+   same thread.
+
+   A source is an fd plus a dispatch function, called when the fd is
+   readable. It may also have a prepare function, called before the loop
+   blocks; a nonzero return means the source has work without its fd
+   becoming readable (frames already on a ring) and gets dispatched
+   without blocking. Prepare is also the place to flush batched output.
+
+   Timers are timerfds; their dispatch function runs once per expiry batch.
+   A timer added with an interval of 0 is one-shot and is (re)armed with
+   sr_event_timer_arm whenever its owner knows its next deadline.
+
+   Signals can be sources too (signalfd): the signal is blocked and its
+   dispatch function runs on the loop like any other source, so it may do
+   real work - dump statistics, reload tables - without async-signal-safety
+   concerns. Add signal sources before starting any other threads, so that
+   they inherit the blocked mask.
+
+   Work too long for a dispatch (building a table from a large file) can
+   be a source as well: started from the loop, it runs on a thread of its
+   own with every signal blocked, and its done function then runs on the
+   loop like a dispatch, to install what the work built. A work source
+   runs one at a time; starting it again while it runs does nothing.
+
+   --
+
+   sr_event_init(&loop)
+   sr_event_add(&loop, fd, dispatch, prepare, arg)
+   sr_event_add_timer(&loop, interval_ms, fn, arg)
+   sr_event_add_signal(&loop, SIGUSR1, fn, arg)
+   src = sr_event_add_work(&loop, work, done, arg)
+   sr_event_work_start(src)       from the loop thread
+   sr_event_run(sr, &loop)        until a dispatch returns 0 or -1
+ */
+
+#ifndef SR_EVENT_H
+#define SR_EVENT_H
+
+#include <inttypes.h>
+#include <signal.h>
+
+struct sr_instance;
+struct sr_event_work;
+
+#define SR_EVENT_BATCH 16   /* epoll events per wakeup */
+
+/* Returns 1 to keep the loop going, 0 to stop it, -1 on error */
+typedef int (*sr_event_fn)(struct sr_instance* sr, void* arg);
+
+/* Runs off the loop thread; must not touch anything the loop does */
+typedef void (*sr_event_work_fn)(void* arg);
+
+struct sr_event_source {
+    int fd;
+    sr_event_fn dispatch;
+    sr_event_fn prepare;
+    void* arg;
+    int timer;              /* fd is a timerfd owned by the loop */
+    int signo;              /* fd is a signalfd owned by the loop, or 0 */
+    struct sr_event_work* work; /* fd is the pipe of a work source, or NULL */
+    int pending;
+    unsigned int interval_ms;   /* timers without timerfd only */
+    uint64_t deadline_ms;       /* 0: disarmed */
+    struct sr_event_source* next;
+};
+
+struct sr_event_loop {
+    int epfd;
+    struct sr_event_source* sources;
+    volatile sig_atomic_t stop;  /* set by sr_event_stop */
+};
+
+int sr_event_init(struct sr_event_loop* loop);
+void sr_event_destroy(struct sr_event_loop* loop);
+struct sr_event_source* sr_event_add(struct sr_event_loop* loop, int fd,
+        sr_event_fn dispatch, sr_event_fn prepare, void* arg);
+struct sr_event_source* sr_event_add_timer(struct sr_event_loop* loop,
+        unsigned int interval_ms, sr_event_fn fn, void* arg);
+struct sr_event_source* sr_event_add_signal(struct sr_event_loop* loop, int signo,
+                                            sr_event_fn fn, void* arg);
+struct sr_event_source* sr_event_add_work(struct sr_event_loop* loop,
+        sr_event_work_fn work, sr_event_fn done, void* arg);
+int sr_event_work_start(struct sr_event_source* src);
+void sr_event_timer_arm(struct sr_event_source* src, unsigned int delay_ms);
+void sr_event_timer_disarm(struct sr_event_source* src);
+int sr_event_run(struct sr_instance* sr, struct sr_event_loop* loop);
+void sr_event_stop(struct sr_event_loop* loop);
+
+#endif
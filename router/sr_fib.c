@@ -0,0 +1,1487 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_event.h"
+#include "sr_utils.h"
+#include "sr_fib.h"
+
+/* Route of a compiled prefix that forwards nowhere although a shorter
+   one has a route; never dereferenced */
+#define SR_FIB_NO_ROUTE ((struct sr_rt *) 1)
+
+static struct sr_fib_compiled *sr_fib_compile_trie(const struct sr_fib *fib);
+
+struct sr_fib_block {
+    struct sr_fib_block *next;
+};
+
+static void *sr_fib_alloc(struct sr_fib_pool *pool) {
+    struct sr_fib_block *block;
+    void *item;
+
+    if (pool->free) {
+        item = pool->free;
+        pool->free = *(void **) item;
+    } else {
+        if (pool->left == 0) {
+            if ((block = malloc(SR_FIB_BLOCK)) == NULL) {
+                return NULL;
+            }
+            block->next = pool->blocks;
+            pool->blocks = block;
+            pool->left = (SR_FIB_BLOCK - sizeof(struct sr_fib_block)) / pool->size;
+        }
+        item = (char *) (pool->blocks + 1) + --pool->left * pool->size;
+    }
+    memset(item, 0, pool->size);
+    return item;
+}
+
+static void sr_fib_pool_put(struct sr_fib_pool *pool, void *item) {
+    *(void **) item = pool->free;
+    pool->free = item;
+}
+
+static void sr_fib_pool_free(struct sr_fib_pool *pool) {
+    struct sr_fib_block *block;
+
+    while ((block = pool->blocks)) {
+        pool->blocks = block->next;
+        free(block);
+    }
+    pool->left = 0;
+    pool->free = NULL;
+}
+
+/* Free a list of routes, except those that live in fib's snapshot */
+static void sr_fib_free_routes(const struct sr_fib *fib, struct sr_rt *rt) {
+    struct sr_rt *next;
+
+    for (; rt; rt = next) {
+        next = rt->next;
+        if (fib == NULL || (char *) rt < (char *) fib->map ||
+            (char *) rt >= (char *) fib->map + fib->map_len) {
+            free(rt);
+        }
+    }
+}
+
+/* Length of a netmask in network order, or -1 if its ones are not contiguous */
+int sr_fib_prefix_len(uint32_t mask) {
+    uint32_t m = ntohl(mask);
+    int len = 0;
+
+    while (m & 0x80000000U) {
+        m <<= 1;
+        len++;
+    }
+    return m ? -1 : len;
+}
+
+/* MurmurHash3's finalizer: every input bit flips each output bit with
+   probability about one half */
+static uint32_t sr_fib_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static int sr_fib_same_hop(const struct sr_rt *a, const struct sr_rt *b) {
+    return a->gw.s_addr == b->gw.s_addr && strncmp(a->interface, b->interface, sr_IFACE_NAMELEN) == 0;
+}
+
+/* Key of rt's next hop, the same for the same gateway and interface */
+static uint32_t sr_fib_hop_key(const struct sr_rt *rt) {
+    uint32_t h = sr_fib_mix(ntohl(rt->gw.s_addr));
+    int i;
+
+    for (i = 0; i < sr_IFACE_NAMELEN && rt->interface[i]; i++) {
+        h = sr_fib_mix(h ^ (uint8_t) rt->interface[i]);
+    }
+    return h;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_join(..)
+ *
+ * Append rt to the equal-cost routes at node, with one release store,
+ * unless one of them already has its next hop. Returns 0, or 1.
+ *---------------------------------------------------------------------*/
+static int sr_fib_join(struct sr_fib_node *node, struct sr_rt *rt) {
+    struct sr_rt **link = &(node->route);
+
+    for (; *link; link = &((*link)->ecmp_next)) {
+        if (sr_fib_same_hop(*link, rt)) {
+            return 1;
+        }
+    }
+    rt->ecmp_next = NULL;
+    rt->ecmp_key = sr_fib_hop_key(rt);
+    __atomic_store_n(link, rt, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Relink a prefix's equal-cost routes through next, to retire them; returns how many */
+static unsigned int sr_fib_group_list(struct sr_rt *group) {
+    unsigned int n = 0;
+
+    for (; group; group = group->ecmp_next) {
+        group->next = group->ecmp_next;
+        n++;
+    }
+    return n;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_path(..)
+ *
+ * Walk from the root towards prefix/len (prefix in host order), filling
+ * path[d] with the node at depth d. With create set, missing nodes are
+ * added; each is zeroed before the store that makes it reachable.
+ * Returns the depth reached, len unless a node is missing.
+ *---------------------------------------------------------------------*/
+static int sr_fib_path(struct sr_fib *fib, uint32_t prefix, int len, int create,
+                       struct sr_fib_node **path) {
+    struct sr_fib_node *next;
+    int depth, bit;
+
+    path[0] = fib->root;
+    for (depth = 0; depth < len; depth++) {
+        bit = (prefix >> (31 - depth)) & 1;
+        if ((next = path[depth]->child[bit]) == NULL) {
+            if (!create || (next = sr_fib_alloc(&(fib->nodes))) == NULL) {
+                break;
+            }
+            __atomic_store_n(&(path[depth]->child[bit]), next, __ATOMIC_RELEASE);
+        }
+        path[depth + 1] = next;
+    }
+    return depth;
+}
+
+/* An empty, unpublished version, or NULL if memory runs out */
+struct sr_fib *sr_fib_new(void) {
+    struct sr_fib *fib = calloc(1, sizeof(struct sr_fib));
+
+    if (fib == NULL) {
+        return NULL;
+    }
+    fib->nodes.size = sizeof(struct sr_fib_node);
+    if ((fib->root = sr_fib_alloc(&(fib->nodes))) == NULL) {
+        free(fib);
+        return NULL;
+    }
+    return fib;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add(..)
+ *
+ * Add rt to a version that is not published yet. The version points at
+ * rt itself, which must outlive it. A route for a prefix that already
+ * has some is one more equal-cost next hop. Returns 0, 1 if the prefix
+ * already has a route with rt's next hop (rt is not added), or -1 if the
+ * mask is not contiguous or memory runs out.
+ *---------------------------------------------------------------------*/
+int sr_fib_add(struct sr_fib *fib, struct sr_rt *rt) {
+    struct sr_fib_node *path[33];
+    int len = sr_fib_prefix_len(rt->mask.s_addr);
+
+    if (len < 0 || sr_fib_path(fib, ntohl(rt->dest.s_addr), len, 1, path) != len) {
+        return -1;
+    }
+    if (sr_fib_join(path[len], rt)) {
+        return 1;
+    }
+    fib->n_routes++;
+    return 0;
+}
+
+static void sr_fib_compiled_free(struct sr_fib_compiled *c) {
+    struct sr_fib_compiled *next;
+
+    for (; c; c = next) {
+        next = c->dead_next;
+        sr_fib_pool_free(&(c->nodes));
+        free(c);
+    }
+}
+
+/* Frees the version's nodes and retired routes, not its live routes */
+void sr_fib_free(struct sr_fib *fib) {
+    if (fib) {
+        sr_fib_compiled_free(fib->compiled);
+        sr_fib_compiled_free(fib->dead_compiled);
+        sr_fib_pool_free(&(fib->nodes));
+        sr_fib_free_routes(fib, fib->dead_routes);
+        if (fib->map) {
+            munmap(fib->map, fib->map_len);
+        }
+        free(fib);
+    }
+}
+
+static void sr_fib_wake_reclaim(struct sr_fib_table *table) {
+    uint64_t one = 1;
+
+    if (write(table->reclaim_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write(..):sr_fib_wake_reclaim");
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_publish(..)
+ *
+ * Make fib the version lookups see, and retire the one it replaces.
+ * Before sr_fib_init_reclaim nothing can be looking up, so the old
+ * version is freed on the spot.
+ *---------------------------------------------------------------------*/
+void sr_fib_publish(struct sr_fib_table *table, struct sr_fib *fib) {
+    struct sr_fib *old;
+
+    fib->version = ++table->versions;
+    old = __atomic_exchange_n(&(table->current), fib, __ATOMIC_ACQ_REL);
+    if (old == NULL) {
+        return;
+    }
+    if (table->reclaim_fd <= 0) {
+        sr_fib_free(old);
+        return;
+    }
+    old->retired_next = table->retired;
+    table->retired = old;
+    sr_fib_wake_reclaim(table);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_retire_routes(..)
+ *
+ * Free a list of routes, linked through next, once lookups are done
+ * with them. The routes must belong to the published version: retire a
+ * replaced table's routes before publishing the table that replaces it.
+ *---------------------------------------------------------------------*/
+void sr_fib_retire_routes(struct sr_fib_table *table, struct sr_rt *list) {
+    struct sr_fib *fib = table->current;
+    struct sr_rt **link;
+
+    if (list == NULL) {
+        return;
+    }
+    if (table->reclaim_fd <= 0 || fib == NULL) {
+        sr_fib_free_routes(fib, list);
+        return;
+    }
+    /* Behind what is already waiting, usually nothing, rather than
+       walking list, which can be a whole table */
+    for (link = &(fib->dead_routes); *link; link = &((*link)->next))
+        ;
+    *link = list;
+    sr_fib_wake_reclaim(table);
+}
+
+/* Before an in place change: lookups go back to the full trie */
+static void sr_fib_decompile(struct sr_fib_table *table, struct sr_fib *fib) {
+    struct sr_fib_compiled *c = fib->compiled;
+
+    fib->changed_ms = monotonic_ms();
+    fib->changes++;
+    if (c == NULL) {
+        return;
+    }
+    __atomic_store_n(&(fib->compiled), NULL, __ATOMIC_RELEASE);
+    if (table->reclaim_fd <= 0) {
+        sr_fib_compiled_free(c);
+        return;
+    }
+    c->dead_next = fib->dead_compiled;
+    fib->dead_compiled = c;
+    sr_fib_wake_reclaim(table);
+}
+
+/* The published version, created if there is none yet, or NULL */
+static struct sr_fib *sr_fib_current_or_new(struct sr_fib_table *table) {
+    struct sr_fib *fib = table->current;
+
+    if (fib == NULL && (fib = sr_fib_new()) != NULL) {
+        sr_fib_publish(table, fib);
+    }
+    return fib;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_set(..)
+ *
+ * Make rt the only route for its prefix in the published version,
+ * creating the version if there is none. The routes it replaces are
+ * retired; they must already be off the routing table list. Returns 0,
+ * or -1 if the mask is not contiguous or memory runs out.
+ *---------------------------------------------------------------------*/
+int sr_fib_set(struct sr_fib_table *table, struct sr_rt *rt) {
+    struct sr_fib *fib;
+    struct sr_fib_node *path[33];
+    struct sr_rt *old;
+    int len = sr_fib_prefix_len(rt->mask.s_addr);
+
+    if (len < 0 || (fib = sr_fib_current_or_new(table)) == NULL ||
+        sr_fib_path(fib, ntohl(rt->dest.s_addr), len, 1, path) != len) {
+        return -1;
+    }
+    sr_fib_decompile(table, fib);
+    rt->ecmp_next = NULL;
+    rt->ecmp_key = sr_fib_hop_key(rt);
+    old = path[len]->route;
+    __atomic_store_n(&(path[len]->route), rt, __ATOMIC_RELEASE);
+    fib->n_routes = fib->n_routes + 1 - sr_fib_group_list(old);
+    sr_fib_retire_routes(table, old);
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_set_hop(..)
+ *
+ * Add rt to the published version as one more equal-cost next hop for
+ * its prefix, or as its only route if it has none. Returns 0, 1 if the
+ * prefix already has a route with rt's next hop (rt is not added), or
+ * -1 if the mask is not contiguous or memory runs out.
+ *---------------------------------------------------------------------*/
+int sr_fib_set_hop(struct sr_fib_table *table, struct sr_rt *rt) {
+    struct sr_fib *fib;
+    struct sr_fib_node *path[33];
+    int len = sr_fib_prefix_len(rt->mask.s_addr);
+
+    if (len < 0 || (fib = sr_fib_current_or_new(table)) == NULL ||
+        sr_fib_path(fib, ntohl(rt->dest.s_addr), len, 1, path) != len) {
+        return -1;
+    }
+    sr_fib_decompile(table, fib);
+    if (sr_fib_join(path[len], rt)) {
+        return 1;
+    }
+    fib->n_routes++;
+    return 0;
+}
+
+static void sr_fib_retire_node(struct sr_fib_table *table, struct sr_fib *fib,
+                               struct sr_fib_node *node) {
+    if (table->reclaim_fd <= 0) {
+        sr_fib_pool_put(&(fib->nodes), node);
+    } else {
+        node->dead_next = fib->dead_nodes;
+        fib->dead_nodes = node;
+    }
+}
+
+/* Unhook the nodes on path left leading nowhere, deepest first */
+static void sr_fib_prune(struct sr_fib_table *table, struct sr_fib *fib,
+                         struct sr_fib_node **path, uint32_t prefix, int len) {
+    struct sr_fib_node *node;
+    int depth;
+
+    for (depth = len; depth > 0; depth--) {
+        node = path[depth];
+        if (node->route || node->child[0] || node->child[1]) {
+            break;
+        }
+        __atomic_store_n(&(path[depth - 1]->child[(prefix >> (32 - depth)) & 1]), NULL,
+                         __ATOMIC_RELEASE);
+        sr_fib_retire_node(table, fib, node);
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_unset(..)
+ *
+ * Remove the routes for dest/mask from the published version and prune
+ * the nodes left leading nowhere. The routes are retired; they must
+ * already be off the routing table list. Returns 0, or -1 if there are
+ * none.
+ *---------------------------------------------------------------------*/
+int sr_fib_unset(struct sr_fib_table *table, uint32_t dest, uint32_t mask) {
+    struct sr_fib *fib = table->current;
+    struct sr_fib_node *path[33];
+    struct sr_rt *old;
+    uint32_t prefix = ntohl(dest);
+    int len = sr_fib_prefix_len(mask);
+
+    if (fib == NULL || len < 0 || sr_fib_path(fib, prefix, len, 0, path) != len ||
+        (old = path[len]->route) == NULL) {
+        return -1;
+    }
+    sr_fib_decompile(table, fib);
+    __atomic_store_n(&(path[len]->route), NULL, __ATOMIC_RELEASE);
+    fib->n_routes -= sr_fib_group_list(old);
+    sr_fib_prune(table, fib, path, prefix, len);
+    sr_fib_retire_routes(table, old);
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_unset_hop(..)
+ *
+ * Remove rt, one of its prefix's equal-cost routes, from the published
+ * version, and the prefix with it if rt was its last route. A lookup
+ * walking the routes past rt still finds the rest. rt is retired; it
+ * must already be off the routing table list. Returns 0, or -1 if rt is
+ * not in the version.
+ *---------------------------------------------------------------------*/
+int sr_fib_unset_hop(struct sr_fib_table *table, struct sr_rt *rt) {
+    struct sr_fib *fib = table->current;
+    struct sr_fib_node *path[33];
+    struct sr_rt **link;
+    uint32_t prefix = ntohl(rt->dest.s_addr);
+    int len = sr_fib_prefix_len(rt->mask.s_addr);
+
+    if (fib == NULL || len < 0 || sr_fib_path(fib, prefix, len, 0, path) != len) {
+        return -1;
+    }
+    for (link = &(path[len]->route); *link != rt; link = &((*link)->ecmp_next)) {
+        if (*link == NULL) {
+            return -1;
+        }
+    }
+    sr_fib_decompile(table, fib);
+    __atomic_store_n(link, rt->ecmp_next, __ATOMIC_RELEASE);
+    fib->n_routes--;
+    sr_fib_prune(table, fib, path, prefix, len);
+    rt->next = NULL;
+    sr_fib_retire_routes(table, rt);
+    return 0;
+}
+
+/* The first route for exactly dest/mask, or NULL */
+struct sr_rt *sr_fib_find(const struct sr_fib *fib, uint32_t dest, uint32_t mask) {
+    struct sr_fib_node *path[33];
+    int len = sr_fib_prefix_len(mask);
+
+    if (fib == NULL || len < 0 || sr_fib_path((struct sr_fib *) fib, ntohl(dest), len, 0, path) != len) {
+        return NULL;
+    }
+    return path[len]->route;
+}
+
+/* Pre-order walk of node's subtree, node holding prefix/len (host
+   order), skipping everything up to the cursor cur/cur_len */
+static int sr_fib_walk_node(const struct sr_fib_node *node, uint32_t prefix, int len,
+                            uint32_t *cur, int *cur_len, sr_fib_walk_fn fn, void *arg) {
+    uint32_t last = len == 32 ? prefix : prefix | (0xffffffffU >> len);
+    int bit;
+
+    if (*cur_len >= 0 && last < *cur) {
+        return 0;
+    }
+    if (node->route &&
+        (*cur_len < 0 || prefix > *cur || (prefix == *cur && len > *cur_len))) {
+        if (fn(node->route, arg) != 0) {
+            return 1;
+        }
+        *cur = prefix;
+        *cur_len = len;
+    }
+    for (bit = 0; len < 32 && bit < 2; bit++) {
+        if (node->child[bit] &&
+            sr_fib_walk_node(node->child[bit], prefix | ((uint32_t) bit << (31 - len)), len + 1,
+                             cur, cur_len, fn, arg)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_walk(..)
+ *
+ * Call fn on the first route of each prefix after the cursor dest/len
+ * (network order; len -1 starts at the beginning), in address order
+ * with shorter prefixes first, until fn returns nonzero. The cursor is
+ * left on the last prefix fn accepted, so a walk can be resumed in a
+ * later call even if the table changed meanwhile. Returns 1 if fn
+ * stopped the walk, 0 at the end of the table. Call it from the thread
+ * that changes the table.
+ *---------------------------------------------------------------------*/
+int sr_fib_walk(const struct sr_fib *fib, uint32_t *dest, int *len, sr_fib_walk_fn fn, void *arg) {
+    uint32_t cur = ntohl(*dest);
+    int ret;
+
+    if (fib == NULL) {
+        return 0;
+    }
+    ret = sr_fib_walk_node(fib->root, 0, 0, &cur, len, fn, arg);
+    *dest = htonl(cur);
+    return ret;
+}
+
+/* On the free worker: versions nothing can reach any more */
+static void sr_fib_free_versions(void *arg) {
+    struct sr_fib_table *table = arg;
+    struct sr_fib *fib, *next;
+
+    for (fib = table->freeing; fib; fib = next) {
+        next = fib->retired_next;
+        sr_fib_free(fib);
+    }
+}
+
+/* Hand the retired versions to the free worker, unless it has some
+   already or the compile worker may still be reading one of them */
+static void sr_fib_free_retired(struct sr_fib_table *table) {
+    if (table->retired == NULL || table->freeing || table->compiling) {
+        return;
+    }
+    table->freeing = table->retired;
+    table->retired = NULL;
+    if (table->free_work && sr_event_work_start(table->free_work) == 0) {
+        return;
+    }
+    sr_fib_free_versions(table);
+    table->freeing = NULL;
+}
+
+/* Back on the loop: versions retired while the worker ran are next */
+static int sr_fib_freed(struct sr_instance *sr, void *arg) {
+    struct sr_fib_table *table = arg;
+
+    table->freeing = NULL;
+    sr_fib_free_retired(table);
+    return 1;
+}
+
+/* Loop source: the dispatches that retired things have returned by now */
+static int sr_fib_reclaim(struct sr_instance *sr, void *arg) {
+    struct sr_fib_table *table = &(sr->fib);
+    struct sr_fib *fib;
+    struct sr_fib_node *node;
+    struct sr_rt *rt;
+    uint64_t n;
+
+    if (read(table->reclaim_fd, &n, sizeof(n)) < 0) {
+        return 1;
+    }
+    if (table->compiling) {
+        /* The compile worker walks the version's nodes and routes,
+           dead ones included; it wakes this source again when done */
+        return 1;
+    }
+    sr_fib_free_retired(table);
+    if ((fib = table->current)) {
+        sr_fib_compiled_free(fib->dead_compiled);
+        fib->dead_compiled = NULL;
+        while ((node = fib->dead_nodes)) {
+            fib->dead_nodes = node->dead_next;
+            sr_fib_pool_put(&(fib->nodes), node);
+        }
+        rt = fib->dead_routes;
+        fib->dead_routes = NULL;
+        sr_fib_free_routes(fib, rt);
+    }
+    return 1;
+}
+
+/* On the compile worker: the published version as it was when the
+   loop started the compile; the loop may be changing it meanwhile */
+static void sr_fib_compile_version(void *arg) {
+    struct sr_fib_table *table = arg;
+
+    table->compiled = sr_fib_compile_trie(table->compiling);
+}
+
+/* Back on the loop: use the compiled trie unless the version changed
+   or was replaced while it was compiled; the timer tries again then */
+static int sr_fib_compiled(struct sr_instance *sr, void *arg) {
+    struct sr_fib_table *table = arg;
+    struct sr_fib *fib = table->compiling;
+    struct sr_fib_compiled *c = table->compiled;
+
+    table->compiling = NULL;
+    table->compiled = NULL;
+    if (c && fib == table->current && fib->compiled == NULL && fib->changes == table->compiling_changes) {
+        __atomic_store_n(&(fib->compiled), c, __ATOMIC_RELEASE);
+    } else if (c) {
+        sr_fib_compiled_free(c);
+    }
+    sr_fib_wake_reclaim(table);
+    return 1;
+}
+
+/* Timer: compile the published version once changes to it have stopped */
+static int sr_fib_recompile(struct sr_instance *sr, void *arg) {
+    struct sr_fib_table *table = &(sr->fib);
+    struct sr_fib *fib = table->current;
+
+    if (fib == NULL || fib->compiled || table->compiling ||
+        monotonic_ms() - fib->changed_ms < SR_FIB_COMPILE_MS) {
+        return 1;
+    }
+    table->compiling = fib;
+    table->compiling_changes = fib->changes;
+    if (sr_event_work_start(table->compile_work) != 0) {
+        table->compiling = NULL;
+    }
+    return 1;
+}
+
+/* Add the sources that free retired versions and recompile changed ones to sr->loop */
+int sr_fib_init_reclaim(struct sr_instance *sr) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (fd < 0 || sr_event_add(&(sr->loop), fd, sr_fib_reclaim, NULL, NULL) == NULL) {
+        perror("eventfd(..):sr_fib_init_reclaim");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    sr->fib.reclaim_fd = fd;
+    sr->fib.free_work = sr_event_add_work(&(sr->loop), sr_fib_free_versions, sr_fib_freed, &(sr->fib));
+    sr->fib.compile_work = sr_event_add_work(&(sr->loop), sr_fib_compile_version, sr_fib_compiled, &(sr->fib));
+    if (sr->fib.free_work == NULL || sr->fib.compile_work == NULL ||
+        sr_event_add_timer(&(sr->loop), SR_FIB_COMPILE_MS, sr_fib_recompile, NULL) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+const struct sr_fib *sr_fib_current(struct sr_fib_table *table) {
+    return __atomic_load_n(&(table->current), __ATOMIC_ACQUIRE);
+}
+
+static struct sr_rt *sr_fib_lookup_in(const struct sr_fib_node *node, uint32_t ip_dst) {
+    struct sr_rt *best = NULL, *route;
+    uint32_t ip = ntohl(ip_dst);
+    int depth = 0;
+
+    while (node) {
+        if ((route = __atomic_load_n(&(node->route), __ATOMIC_ACQUIRE))) {
+            best = route;
+        }
+        if (depth == 32) {
+            break;
+        }
+        node = __atomic_load_n(&(node->child[(ip >> (31 - depth)) & 1]), __ATOMIC_ACQUIRE);
+        depth++;
+    }
+    return best == SR_FIB_NO_ROUTE ? NULL : best;
+}
+
+/* Longest prefix match for ip_dst (network order), or NULL */
+struct sr_rt *sr_fib_lookup(const struct sr_fib *fib, uint32_t ip_dst) {
+    const struct sr_fib_compiled *c;
+
+    if (fib == NULL) {
+        return NULL;
+    }
+    c = __atomic_load_n(&(fib->compiled), __ATOMIC_ACQUIRE);
+    return sr_fib_lookup_in(c ? c->root : fib->root, ip_dst);
+}
+
+/* The same on the full trie, compiled or not, to check the compiled one */
+struct sr_rt *sr_fib_lookup_full(const struct sr_fib *fib, uint32_t ip_dst) {
+    return fib ? sr_fib_lookup_in(fib->root, ip_dst) : NULL;
+}
+
+/* Whether rt, as returned by sr_fib_lookup, has equal-cost alternatives */
+int sr_fib_multipath(const struct sr_rt *rt) {
+    return rt && __atomic_load_n(&(rt->ecmp_next), __ATOMIC_ACQUIRE) != NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_pick(..)
+ *
+ * The route, among rt and its equal-cost alternatives, that the flow
+ * hashing to flow goes to: the one whose key scores highest mixed with
+ * the flow's hash (rendezvous hashing). A flow only moves when its route
+ * goes or a new one outscores it, so adding or removing one of n next
+ * hops moves about 1/n of the flows, all of them to or from that one.
+ *---------------------------------------------------------------------*/
+struct sr_rt *sr_fib_pick(struct sr_rt *rt, uint32_t flow) {
+    struct sr_rt *best = rt;
+    uint32_t score, best_score;
+
+    if (rt == NULL) {
+        return NULL;
+    }
+    best_score = sr_fib_mix(flow ^ rt->ecmp_key);
+    while ((rt = __atomic_load_n(&(rt->ecmp_next), __ATOMIC_ACQUIRE))) {
+        if ((score = sr_fib_mix(flow ^ rt->ecmp_key)) > best_score) {
+            best = rt;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+/*---------------------------------------------------------------------
+ * Compilation
+ *
+ * ORTC (Draves, King, Venkatachary, Zill, "Constructing Optimal IP
+ * Routing Tables", 1999) over the trie, with each distinct next hop, an
+ * equal-cost group counting as one, and "no route" as next hops:
+ *
+ *   1. every prefix gets the next hop it forwards to, its own route's or
+ *      the one it inherits, and a node with one child gets a stand-in
+ *      leaf for the other half, forwarding to the node's next hop
+ *   2. bottom up, each node gets the next hops its subtree could be
+ *      given at the top: the intersection of its children's, or their
+ *      union if that is empty
+ *   3. top down, a node whose inherited next hop is among its candidates
+ *      needs no route; any other gets one of its candidates
+ *
+ * The result forwards every address exactly as the trie does, with the
+ * fewest prefixes that can. Where it needs "no route" under a route, the
+ * node points at SR_FIB_NO_ROUTE, which lookups turn into NULL.
+ *---------------------------------------------------------------------*/
+
+/* Next hops are numbered from 1; 0 is "no route" */
+struct sr_fib_hops {
+    struct sr_rt **group;       /* by number, a route of each equal-cost group */
+    uint32_t n;
+    uint32_t max;               /* room in group */
+    uint32_t *slots;            /* hash table of numbers */
+    uint32_t mask;
+};
+
+/* A trie node while it is compiled, in depth-first order */
+struct sr_fib_ortc {
+    uint32_t parent;
+    uint32_t child[2];          /* 0 where the trie has no child */
+    uint32_t hop;               /* next hop the prefix forwards to */
+    uint32_t n_set;             /* candidates: the one in set, or n_set in the arena at set */
+    uint32_t set;
+    uint32_t inherit;           /* next hop the compiled prefix inherits */
+    uint32_t route;             /* next hop it gets, or SR_FIB_ORTC_NONE */
+    int keep;                   /* it, or a node under it, gets a route */
+    struct sr_fib_node *out;
+};
+
+#define SR_FIB_ORTC_NONE 0xffffffffU
+
+/* Child bit of node; the compile worker reads nodes the loop changes */
+static const struct sr_fib_node *sr_fib_child(const struct sr_fib_node *node, int bit) {
+    return __atomic_load_n(&(node->child[bit]), __ATOMIC_ACQUIRE);
+}
+
+static uint32_t sr_fib_count_nodes(const struct sr_fib_node *root) {
+    const struct sr_fib_node *stack[2 * 33], *node;
+    uint32_t n = 0;
+    int top = 0;
+
+    stack[top++] = root;
+    while (top) {
+        node = stack[--top];
+        n++;
+        if ((stack[top] = sr_fib_child(node, 1))) {
+            top++;
+        }
+        if ((stack[top] = sr_fib_child(node, 0))) {
+            top++;
+        }
+    }
+    return n;
+}
+
+static int sr_fib_same_group(const struct sr_rt *a, const struct sr_rt *b) {
+    for (; a && b; a = __atomic_load_n(&(a->ecmp_next), __ATOMIC_ACQUIRE),
+             b = __atomic_load_n(&(b->ecmp_next), __ATOMIC_ACQUIRE)) {
+        if (!sr_fib_same_hop(a, b)) {
+            return 0;
+        }
+    }
+    return a == b;
+}
+
+/* Number of the next hop group, the equal-cost routes starting at rt,
+   or 0 if there are more groups than room for them */
+static uint32_t sr_fib_hop_number(struct sr_fib_hops *hops, struct sr_rt *group) {
+    const struct sr_rt *rt;
+    uint32_t h = 0, i;
+
+    for (rt = group; rt; rt = __atomic_load_n(&(rt->ecmp_next), __ATOMIC_ACQUIRE)) {
+        h = sr_fib_mix(h ^ rt->ecmp_key);
+    }
+    for (i = h & hops->mask; hops->slots[i]; i = (i + 1) & hops->mask) {
+        if (sr_fib_same_group(hops->group[hops->slots[i]], group)) {
+            return hops->slots[i];
+        }
+    }
+    if (hops->n == hops->max) {
+        return 0;
+    }
+    hops->group[++hops->n] = group;
+    hops->slots[i] = hops->n;
+    return hops->n;
+}
+
+/* Candidates of o, pointing into arena if there are several */
+static const uint32_t *sr_fib_ortc_set(const struct sr_fib_ortc *o, const uint32_t *arena) {
+    return o->n_set == 1 ? &(o->set) : arena + o->set;
+}
+
+static int sr_fib_ortc_has(const struct sr_fib_ortc *o, const uint32_t *arena, uint32_t hop) {
+    const uint32_t *set = sr_fib_ortc_set(o, arena);
+    uint32_t i;
+
+    for (i = 0; i < o->n_set && set[i] <= hop; i++) {
+        if (set[i] == hop) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Merge two sorted sets into out: their intersection, or their union if it is empty */
+static uint32_t sr_fib_ortc_merge(const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb,
+                                  uint32_t *out) {
+    uint32_t i = 0, j = 0, n = 0;
+
+    while (i < na && j < nb) {
+        if (a[i] == b[j]) {
+            out[n++] = a[i];
+            i++;
+            j++;
+        } else if (a[i] < b[j]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    if (n) {
+        return n;
+    }
+    i = j = 0;
+    while (i < na || j < nb) {
+        if (j == nb || (i < na && a[i] < b[j])) {
+            out[n++] = a[i++];
+        } else if (i == na || b[j] < a[i]) {
+            out[n++] = b[j++];
+        } else {
+            out[n++] = a[i++];
+            j++;
+        }
+    }
+    return n;
+}
+
+/* Route a compiled node points at for next hop number hop */
+static struct sr_rt *sr_fib_ortc_route(const struct sr_fib_hops *hops, uint32_t hop) {
+    return hop ? hops->group[hop] : SR_FIB_NO_ROUTE;
+}
+
+/* Add a compiled node under parent, or return NULL if memory runs out */
+static struct sr_fib_node *sr_fib_ortc_node(struct sr_fib_compiled *c, struct sr_fib_node *parent,
+                                            int bit, struct sr_rt *route) {
+    struct sr_fib_node *node = sr_fib_alloc(&(c->nodes));
+
+    if (node) {
+        node->route = route;
+        c->n_prefixes += route != NULL;
+        c->n_nodes++;
+        parent->child[bit] = node;
+    }
+    return node;
+}
+
+/* Compress fib's trie as above, or return NULL if memory runs out or,
+   on the compile worker, the loop grew or shrank the trie under it */
+static struct sr_fib_compiled *sr_fib_compile_trie(const struct sr_fib *fib) {
+    struct {
+        const struct sr_fib_node *node;
+        uint32_t parent;
+        int bit;
+    } stack[2 * 33];
+    struct sr_fib_hops hops;
+    const struct sr_fib_node *node;
+    struct sr_fib_ortc *o = NULL, *p;
+    struct sr_fib_compiled *c = NULL, *done = NULL;
+    uint32_t *arena = NULL, *grown, n, i, len, used = 0, room = 0, inherit, hop;
+    const uint32_t *a, *b;
+    struct sr_rt *route;
+    int top = 0, bit;
+
+    n = sr_fib_count_nodes(fib->root);
+    memset(&hops, 0, sizeof(hops));
+    hops.max = __atomic_load_n(&(fib->n_routes), __ATOMIC_RELAXED);
+    for (hops.mask = 1; hops.mask < 2 * hops.max; hops.mask <<= 1)
+        ;
+    hops.slots = calloc(hops.mask, sizeof(uint32_t));
+    hops.mask--;
+    hops.group = malloc((hops.max + 1) * sizeof(struct sr_rt *));
+    o = calloc(n, sizeof(*o));
+    c = calloc(1, sizeof(*c));
+    if (hops.slots == NULL || hops.group == NULL || o == NULL || c == NULL) {
+        goto out;
+    }
+
+    /* 1: depth first, parents before children, each with its next hop */
+    stack[top].node = fib->root;
+    stack[top++].parent = SR_FIB_ORTC_NONE;
+    for (i = 0; top; i++) {
+        if (i == n) {
+            goto out;
+        }
+        node = stack[--top].node;
+        o[i].parent = stack[top].parent;
+        inherit = o[i].parent == SR_FIB_ORTC_NONE ? 0 : o[o[i].parent].hop;
+        if (o[i].parent != SR_FIB_ORTC_NONE) {
+            o[o[i].parent].child[stack[top].bit] = i;
+        }
+        route = __atomic_load_n(&(node->route), __ATOMIC_ACQUIRE);
+        if (route == NULL) {
+            o[i].hop = inherit;
+        } else if ((o[i].hop = sr_fib_hop_number(&hops, route)) == 0) {
+            goto out;
+        }
+        for (bit = 1; bit >= 0; bit--) {
+            if ((stack[top].node = sr_fib_child(node, bit))) {
+                stack[top].parent = i;
+                stack[top++].bit = bit;
+            }
+        }
+    }
+    if (i != n) {
+        goto out;
+    }
+
+    /* 2: children before parents; a missing child stands for the node's hop */
+    for (i = n; i-- > 0;) {
+        p = &(o[i]);
+        if (p->child[0] == 0 && p->child[1] == 0) {
+            p->n_set = 1;
+            p->set = p->hop;
+            continue;
+        }
+        len = (p->child[0] ? o[p->child[0]].n_set : 1) + (p->child[1] ? o[p->child[1]].n_set : 1);
+        if (used + len > room) {
+            room = 2 * (used + len);
+            if ((grown = realloc(arena, room * sizeof(uint32_t))) == NULL) {
+                goto out;
+            }
+            arena = grown;
+        }
+        a = p->child[0] ? sr_fib_ortc_set(&(o[p->child[0]]), arena) : &(p->hop);
+        b = p->child[1] ? sr_fib_ortc_set(&(o[p->child[1]]), arena) : &(p->hop);
+        p->n_set = sr_fib_ortc_merge(a, p->child[0] ? o[p->child[0]].n_set : 1,
+                                     b, p->child[1] ? o[p->child[1]].n_set : 1, arena + used);
+        if (p->n_set == 1) {
+            p->set = arena[used];
+        } else {
+            p->set = used;
+            used += p->n_set;
+        }
+    }
+
+    /* 3: parents before children; a route only where the inherited hop
+       will not do, preferring a real next hop to "no route" */
+    for (i = 0; i < n; i++) {
+        p = &(o[i]);
+        p->inherit = p->parent == SR_FIB_ORTC_NONE ? 0 : (o[p->parent].route != SR_FIB_ORTC_NONE ?
+                                                           o[p->parent].route : o[p->parent].inherit);
+        if (sr_fib_ortc_has(p, arena, p->inherit)) {
+            p->route = SR_FIB_ORTC_NONE;
+        } else {
+            p->route = sr_fib_ortc_set(p, arena)[p->n_set - 1];
+        }
+    }
+
+    /* Keep the nodes on the way to a route, stand-in leaves included */
+    for (i = n; i-- > 0;) {
+        p = &(o[i]);
+        hop = p->route != SR_FIB_ORTC_NONE ? p->route : p->inherit;
+        p->keep = p->route != SR_FIB_ORTC_NONE ||
+            (p->child[0] ? o[p->child[0]].keep : p->child[1] && p->hop != hop) ||
+            (p->child[1] ? o[p->child[1]].keep : p->child[0] && p->hop != hop);
+    }
+
+    c->nodes.size = sizeof(struct sr_fib_node);
+    if ((c->root = sr_fib_alloc(&(c->nodes))) == NULL) {
+        goto out;
+    }
+    c->n_nodes = 1;
+    for (i = 0; i < n; i++) {
+        p = &(o[i]);
+        if (!p->keep && i) {
+            continue;
+        }
+        if (i == 0) {
+            p->out = c->root;
+            if (p->route != SR_FIB_ORTC_NONE) {
+                p->out->route = sr_fib_ortc_route(&hops, p->route);
+                c->n_prefixes++;
+            }
+        } else if ((p->out = sr_fib_ortc_node(c, o[p->parent].out, o[p->parent].child[1] == i,
+                                              p->route == SR_FIB_ORTC_NONE ? NULL :
+                                              sr_fib_ortc_route(&hops, p->route))) == NULL) {
+            goto out;
+        }
+        if ((p->child[0] == 0) == (p->child[1] == 0)) {
+            continue;
+        }
+        hop = p->route != SR_FIB_ORTC_NONE ? p->route : p->inherit;
+        if (p->hop != hop &&
+            sr_fib_ortc_node(c, p->out, p->child[0] != 0, sr_fib_ortc_route(&hops, p->hop)) == NULL) {
+            goto out;
+        }
+    }
+    done = c;
+out:
+    if (c && c != done) {
+        sr_fib_compiled_free(c);
+    }
+    free(hops.slots);
+    free(hops.group);
+    free(o);
+    free(arena);
+    return done;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_compile(..)
+ *
+ * Compress fib's trie as above and make lookups walk the result, with a
+ * release store, so the version may be published already. Only the
+ * writer thread may call it. Returns 0, or -1 if memory runs out, in
+ * which case lookups keep walking the full trie.
+ *---------------------------------------------------------------------*/
+int sr_fib_compile(struct sr_fib *fib) {
+    struct sr_fib_compiled *c = sr_fib_compile_trie(fib);
+
+    if (c == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&(fib->compiled), c, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Snapshots
+ *
+ * A version saved as the memory image it is used as:
+ *
+ *   header | nodes | compiled nodes | routes
+ *
+ * Nodes and routes are struct sr_fib_node and struct sr_rt, and their
+ * pointers are the addresses they will have once the file is mapped at
+ * SR_FIB_SNAP_BASE. Loading maps the file there and publishes it without
+ * touching a single node: pages come in as lookups reach them, and the
+ * mapping is private, so in place updates copy the pages they change and
+ * never reach the file. Nodes are in breadth-first order, root first,
+ * and routes in the order their nodes are, equal-cost ones together.
+ * Compiled nodes, if the version had them, follow in the same order and
+ * point at the same routes. A snapshot is a cache for the build that
+ * wrote it, not an interchange format; the header records the layout so
+ * another build refuses it, and the routing table file the version was
+ * built from, so a snapshot of an older file is refused too. The file is
+ * still not trusted: loading checks that every pointer in it is one of
+ * the places save would have put there before anything follows one.
+ *---------------------------------------------------------------------*/
+
+#define SR_FIB_SNAP_MAGIC   "SRFIB04\n"
+
+/* Far from where the heap, libraries and stacks go; 0 where it cannot be */
+#if UINTPTR_MAX > 0xffffffffU
+#define SR_FIB_SNAP_BASE    ((uintptr_t) 0x500000000000UL)
+#else
+#define SR_FIB_SNAP_BASE    ((uintptr_t) 0)
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+struct sr_fib_snap_header {
+    char magic[8];
+    uint64_t base;              /* address the file is mapped at */
+    uint64_t size;              /* of the file */
+    uint32_t node_size;
+    uint32_t route_size;
+    uint32_t n_nodes;
+    uint32_t n_routes;
+    uint32_t n_compiled;        /* compiled nodes, 0 for none */
+    uint32_t n_prefixes;        /* of them with a route */
+    uint64_t list;              /* first route */
+    uint64_t tail;              /* last route */
+    char source[SR_FIB_SOURCE_PATH];    /* routing table file, as struct sr_fib_source */
+    uint64_t source_size;
+    uint64_t source_mtime_ns;
+    uint64_t source_hash;
+};
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_source(..)
+ *
+ * Describe the routing table file at path, with st its stat and data
+ * its st->st_size bytes, for sr_fib_save and sr_fib_load.
+ *---------------------------------------------------------------------*/
+void sr_fib_source(struct sr_fib_source *src, const char *path, const struct stat *st, const void *data) {
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL, w;
+    size_t i, len = st->st_size;
+
+    memset(src, 0, sizeof(*src));
+    if (strlen(path) < sizeof(src->path)) {
+        strcpy(src->path, path);
+    }
+    src->size = len;
+    src->mtime_ns = (uint64_t) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    /* FNV-1a a word at a time: a table file is tens of megabytes */
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    src->hash = h;
+}
+
+/* A saved route by its address in memory */
+struct sr_fib_snap_route {
+    const struct sr_rt *rt;
+    uint32_t at;                /* place in the file's routes */
+};
+
+static int sr_fib_snap_route_cmp(const void *a, const void *b) {
+    const struct sr_rt *x = ((const struct sr_fib_snap_route *) a)->rt;
+    const struct sr_rt *y = ((const struct sr_fib_snap_route *) b)->rt;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Write the compiled trie of n nodes at nodes_at, its routes translated
+   through index, the n_routes saved ones sorted by address */
+static int sr_fib_save_compiled(FILE *fp, const struct sr_fib_compiled *c, uint32_t n, uintptr_t nodes_at,
+                                const struct sr_fib_snap_route *index, uint32_t n_routes,
+                                uintptr_t routes_at) {
+    const struct sr_fib_node **queue;
+    struct sr_fib_snap_route key;
+    const struct sr_fib_snap_route *found;
+    struct sr_fib_node node;
+    uint32_t head, tail;
+    int b, ret = -1;
+
+    if ((queue = malloc(n * sizeof(*queue))) == NULL) {
+        return -1;
+    }
+    queue[0] = c->root;
+    for (head = 0, tail = 1; head < tail; head++) {
+        memset(&node, 0, sizeof(node));
+        for (b = 0; b < 2; b++) {
+            if (queue[head]->child[b]) {
+                if (tail == n) {
+                    goto out;
+                }
+                node.child[b] = (struct sr_fib_node *) (nodes_at + tail * sizeof(node));
+                queue[tail++] = queue[head]->child[b];
+            }
+        }
+        node.route = queue[head]->route;
+        if (node.route && node.route != SR_FIB_NO_ROUTE) {
+            key.rt = node.route;
+            if ((found = bsearch(&key, index, n_routes, sizeof(key), sr_fib_snap_route_cmp)) == NULL) {
+                goto out;
+            }
+            node.route = (struct sr_rt *) (routes_at + found->at * sizeof(struct sr_rt));
+        }
+        if (fwrite(&node, sizeof(node), 1, fp) != 1) {
+            goto out;
+        }
+    }
+    ret = tail == n ? 0 : -1;
+out:
+    free(queue);
+    return ret;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_save(..)
+ *
+ * Write fib, built from the file src describes, to path as a snapshot,
+ * through a temporary file renamed into place, so a mapped older
+ * snapshot is never written under. Call it from the thread that
+ * changes fib, or any thread while fib is unpublished. Returns 0, or -1.
+ *---------------------------------------------------------------------*/
+int sr_fib_save(const struct sr_fib *fib, const struct sr_fib_source *src, const char *path) {
+    struct sr_fib_snap_header hdr;
+    const struct sr_fib_node **queue = NULL;
+    const struct sr_rt **routes = NULL;
+    struct sr_fib_snap_route *index = NULL;
+    const struct sr_fib_compiled *c;
+    const struct sr_rt *hop;
+    struct sr_fib_node node;
+    struct sr_rt rt;
+    uintptr_t nodes_at, compiled_at, routes_at;
+    uint32_t head, tail, r = 0;
+    char tmp[PATH_MAX];
+    FILE *fp = NULL;
+    int b, ret = -1;
+
+    if (fib == NULL || SR_FIB_SNAP_BASE == 0 || src->path[0] == '\0' ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SR_FIB_SNAP_MAGIC, sizeof(hdr.magic));
+    memcpy(hdr.source, src->path, sizeof(hdr.source));
+    hdr.source_size = src->size;
+    hdr.source_mtime_ns = src->mtime_ns;
+    hdr.source_hash = src->hash;
+    hdr.base = SR_FIB_SNAP_BASE;
+    hdr.node_size = sizeof(node);
+    hdr.route_size = sizeof(rt);
+    hdr.n_nodes = sr_fib_count_nodes(fib->root);
+    hdr.n_routes = fib->n_routes;
+    if ((c = fib->compiled)) {
+        hdr.n_compiled = c->n_nodes;
+        hdr.n_prefixes = c->n_prefixes;
+    }
+    nodes_at = SR_FIB_SNAP_BASE + sizeof(hdr);
+    compiled_at = nodes_at + (uintptr_t) hdr.n_nodes * sizeof(node);
+    routes_at = compiled_at + (uintptr_t) hdr.n_compiled * sizeof(node);
+    hdr.size = routes_at - SR_FIB_SNAP_BASE + (uintptr_t) hdr.n_routes * sizeof(rt);
+    if (hdr.n_routes) {
+        hdr.list = routes_at;
+        hdr.tail = routes_at + (uintptr_t) (hdr.n_routes - 1) * sizeof(rt);
+    }
+    queue = malloc(hdr.n_nodes * sizeof(*queue));
+    routes = malloc((hdr.n_routes + 1) * sizeof(*routes));
+    index = malloc((hdr.n_routes + 1) * sizeof(*index));
+    if (queue == NULL || routes == NULL || index == NULL) {
+        goto out;
+    }
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        perror("fopen(..):sr_fib_save");
+        goto out;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        goto fail;
+    }
+
+    /* A node's children get the next free places in the queue, and
+       the queue order is the file order, so their addresses are known */
+    queue[0] = fib->root;
+    for (head = 0, tail = 1; head < tail; head++) {
+        memset(&node, 0, sizeof(node));
+        for (b = 0; b < 2; b++) {
+            if (queue[head]->child[b]) {
+                node.child[b] = (struct sr_fib_node *) (nodes_at + tail * sizeof(node));
+                queue[tail++] = queue[head]->child[b];
+            }
+        }
+        if (queue[head]->route) {
+            node.route = (struct sr_rt *) (routes_at + r * sizeof(rt));
+        }
+        for (hop = queue[head]->route; hop; hop = hop->ecmp_next) {
+            if (r == hdr.n_routes) {
+                goto fail;
+            }
+            routes[r++] = hop;
+        }
+        if (fwrite(&node, sizeof(node), 1, fp) != 1) {
+            goto fail;
+        }
+    }
+    if (r != hdr.n_routes) {
+        goto fail;
+    }
+    if (c) {
+        for (r = 0; r < hdr.n_routes; r++) {
+            index[r].rt = routes[r];
+            index[r].at = r;
+        }
+        qsort(index, hdr.n_routes, sizeof(*index), sr_fib_snap_route_cmp);
+        if (sr_fib_save_compiled(fp, c, hdr.n_compiled, compiled_at, index, hdr.n_routes, routes_at) != 0) {
+            goto fail;
+        }
+    }
+    for (r = 0; r < hdr.n_routes; r++) {
+        rt = *routes[r];
+        rt.ecmp_next = rt.ecmp_next ? (struct sr_rt *) (routes_at + (r + 1) * sizeof(rt)) : NULL;
+        rt.prev = r ? (struct sr_rt *) (routes_at + (r - 1) * sizeof(rt)) : NULL;
+        rt.next = r + 1 < hdr.n_routes ? (struct sr_rt *) (routes_at + (r + 1) * sizeof(rt)) : NULL;
+        if (fwrite(&rt, sizeof(rt), 1, fp) != 1) {
+            goto fail;
+        }
+    }
+    ret = fclose(fp);
+    fp = NULL;
+    if (ret == 0 && (ret = rename(tmp, path)) == 0) {
+        goto out;
+    }
+fail:
+    perror("write(..):sr_fib_save");
+    if (fp) {
+        fclose(fp);
+    }
+    unlink(tmp);
+    ret = -1;
+out:
+    free(queue);
+    free(routes);
+    free(index);
+    return ret;
+}
+
+/* Check that the n nodes at first are the breadth-first tree save
+   writes, no deeper than 32 bits, pointing only at routes among the
+   n_routes at routes. In the full trie (full) each prefix's routes are
+   the next ones, equal-cost ones chained in order, and every route is
+   some prefix's; the compiled trie may point at any route. */
+static int sr_fib_snap_check_trie(const struct sr_fib_node *first, uint32_t n,
+                                  const struct sr_rt *routes, uint32_t n_routes, int full) {
+    const struct sr_rt *hop;
+    uint32_t i, next = 1, level_end = 1, r = 0;
+    int depth = 0, b;
+
+    for (i = 0; i < n; i++) {
+        if (i == level_end) {
+            depth++;
+            level_end = next;
+        }
+        for (b = 0; b < 2; b++) {
+            if (first[i].child[b] == NULL) {
+                continue;
+            }
+            if (depth == 32 || next == n || first[i].child[b] != first + next) {
+                return -1;
+            }
+            next++;
+        }
+        if ((hop = first[i].route) == NULL) {
+            continue;
+        }
+        if (!full) {
+            if (hop != SR_FIB_NO_ROUTE && (hop < routes || hop >= routes + n_routes ||
+                                           (size_t) ((const char *) hop - (const char *) routes) %
+                                           sizeof(struct sr_rt))) {
+                return -1;
+            }
+            continue;
+        }
+        for (;; hop = hop->ecmp_next) {
+            if (r == n_routes || hop != routes + r) {
+                return -1;
+            }
+            r++;
+            if (hop->ecmp_next == NULL) {
+                break;
+            }
+        }
+    }
+    return next == n && (!full || r == n_routes) ? 0 : -1;
+}
+
+/* Check the list links and interface names of the n routes at routes */
+static int sr_fib_snap_check_routes(const struct sr_rt *routes, uint32_t n) {
+    uint32_t r;
+
+    for (r = 0; r < n; r++) {
+        if (routes[r].prev != (r ? routes + r - 1 : NULL) ||
+            routes[r].next != (r + 1 < n ? routes + r + 1 : NULL) ||
+            memchr(routes[r].interface, '\0', sizeof(routes[r].interface)) == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_load(..)
+ *
+ * Map a snapshot at its address and return it as a new, unpublished
+ * version, with its routes as a list in list and tail. The image is
+ * read through once to check it, but nothing is parsed or inserted.
+ * The version owns the mapping and unmaps it when it is freed. Returns
+ * NULL if the file is not a snapshot from this build of the routing
+ * table file src describes, is damaged, or its address is taken, as it
+ * is while another snapshot is published.
+ *---------------------------------------------------------------------*/
+struct sr_fib *sr_fib_load(const char *path, const struct sr_fib_source *src,
+                           struct sr_rt **list, struct sr_rt **tail) {
+    struct sr_fib_snap_header hdr;
+    struct sr_fib_compiled *c;
+    const struct sr_fib_node *nodes;
+    const struct sr_rt *routes;
+    struct sr_fib *fib;
+    struct stat st;
+    void *map;
+    int fd;
+
+    *list = *tail = NULL;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || fstat(fd, &st) != 0 ||
+        memcmp(hdr.magic, SR_FIB_SNAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.base != SR_FIB_SNAP_BASE || hdr.base == 0 || hdr.size != (uint64_t) st.st_size ||
+        hdr.node_size != sizeof(struct sr_fib_node) || hdr.route_size != sizeof(struct sr_rt) ||
+        hdr.n_nodes == 0 || hdr.size != sizeof(hdr) + ((uint64_t) hdr.n_nodes + hdr.n_compiled) *
+        hdr.node_size + (uint64_t) hdr.n_routes * hdr.route_size) {
+        fprintf(stderr, "%s is not a FIB snapshot from this build\n", path);
+        close(fd);
+        return NULL;
+    }
+    if (src->path[0] == '\0' || strncmp(hdr.source, src->path, sizeof(hdr.source)) != 0 ||
+        hdr.source_size != src->size || hdr.source_mtime_ns != src->mtime_ns ||
+        hdr.source_hash != src->hash) {
+        fprintf(stderr, "FIB snapshot %s is not of %s as it is now\n", path, src->path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap((void *) (uintptr_t) hdr.base, hdr.size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || map != (void *) (uintptr_t) hdr.base) {
+        fprintf(stderr, "Cannot map FIB snapshot %s at its address\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, hdr.size);  /* a kernel that took the address as a hint */
+        }
+        return NULL;
+    }
+    nodes = (const struct sr_fib_node *) ((struct sr_fib_snap_header *) map + 1);
+    routes = (const struct sr_rt *) (nodes + hdr.n_nodes + hdr.n_compiled);
+    madvise(map, hdr.size, MADV_SEQUENTIAL);
+    if (sr_fib_snap_check_trie(nodes, hdr.n_nodes, routes, hdr.n_routes, 1) != 0 ||
+        (hdr.n_compiled && sr_fib_snap_check_trie(nodes + hdr.n_nodes, hdr.n_compiled,
+                                                  routes, hdr.n_routes, 0) != 0) ||
+        sr_fib_snap_check_routes(routes, hdr.n_routes) != 0 ||
+        hdr.list != (hdr.n_routes ? (uintptr_t) routes : 0) ||
+        hdr.tail != (hdr.n_routes ? (uintptr_t) (routes + hdr.n_routes - 1) : 0)) {
+        fprintf(stderr, "FIB snapshot %s is damaged\n", path);
+        munmap(map, hdr.size);
+        return NULL;
+    }
+    madvise(map, hdr.size, MADV_NORMAL);
+    fib = calloc(1, sizeof(struct sr_fib));
+    if (fib && hdr.n_compiled && (fib->compiled = calloc(1, sizeof(struct sr_fib_compiled))) == NULL) {
+        free(fib);
+        fib = NULL;
+    }
+    if (fib == NULL) {
+        munmap(map, hdr.size);
+        return NULL;
+    }
+    fib->nodes.size = sizeof(struct sr_fib_node);
+    fib->root = (struct sr_fib_node *) nodes;
+    if ((c = fib->compiled)) {
+        c->root = fib->root + hdr.n_nodes;
+        c->n_nodes = hdr.n_compiled;
+        c->n_prefixes = hdr.n_prefixes;
+        c->nodes.size = sizeof(struct sr_fib_node);
+    }
+    fib->n_routes = hdr.n_routes;
+    fib->map = map;
+    fib->map_len = hdr.size;
+    *list = (struct sr_rt *) (uintptr_t) hdr.list;
+    *tail = (struct sr_rt *) (uintptr_t) hdr.tail;
+    return fib;
+}
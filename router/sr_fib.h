@@ -0,0 +1,171 @@
+/* Forwarding table.
+
+   Lookups do not walk the routing table list (sr->routing_table); they
+   walk a binary trie over the same entries, one node per prefix bit,
+   each node pointing at the route for the prefix that ends there.
+
+   A whole table (a file load or reload) is built as a new version off
+   to the side and published with one atomic pointer store, so a lookup
+   sees either the old table or the new one. Single routes are added,
+   replaced and removed in place on the published version: the new
+   route or node is filled in first and linked with one atomic store,
+   so a concurrent lookup sees the prefix before or after the change.
+   An update only touches the nodes on its prefix's path, at most 33.
+
+   A prefix can have several routes, equal-cost next hops chained
+   through ecmp_next from the one its node points at. A lookup returns
+   the first; sr_fib_pick spreads flows over all of them so that adding
+   or removing one moves as few flows as possible.
+
+   Lookups walk a compiled copy of the trie when the version has one
+   (sr_fib_compile): the smallest set of prefixes that forwards every
+   address the same way (ORTC), pointing at the same route entries, so
+   it is smaller and shallower. A full load compiles before publishing.
+   An in place change drops the compiled trie, so lookups see the change
+   at once on the full one. Once changes have stopped for
+   SR_FIB_COMPILE_MS a worker compiles the published version again, and
+   the loop makes lookups use the result unless the version was changed
+   meanwhile; reclaiming waits for the worker, which may be reading
+   anything the changes retired.
+
+   Replaced versions, removed routes and pruned nodes are retired, not
+   freed: a lookup may still be walking them or hold a route it
+   returned. Lookups happen inside event loop dispatches and keep no
+   route past them, so once the dispatch that retired something returns,
+   nothing can reach it. A loop source woken by every retirement frees
+   it then; pruned nodes go back to their version's pool. Whole versions,
+   a table's worth of nodes and routes, are handed to a worker to free.
+
+   Changes come from one thread at a time: the loop thread (SIGHUP
+   reload, the control socket, which hands its changes to the loop) or
+   the main thread before the loop starts. A new version can be built
+   and compiled on any thread, as reloads do; only publishing it is a
+   change.
+
+   --
+
+   fib = sr_fib_new(); sr_fib_add(fib, rt)...   build off to the side
+   sr_fib_compile(fib)                           compress it for lookups
+   sr_fib_publish(&sr->fib, fib)                 swap it in
+   sr_fib_set(&sr->fib, rt)                      add or replace in place
+   sr_fib_set_hop(&sr->fib, rt)                  add a next hop in place
+   sr_fib_unset(&sr->fib, dest, mask)            remove in place
+   sr_fib_unset_hop(&sr->fib, rt)                remove a next hop in place
+   sr_fib_lookup(sr_fib_current(&sr->fib), ip)
+   sr_fib_walk(fib, &dest, &len, fn, arg)        list prefixes in order, resumably
+   sr_fib_pick(rt, flow_hash)                    the flow's next hop
+
+   A version can be saved to a snapshot file (sr_fib_save), an image of
+   its nodes, compiled nodes and routes laid out for a fixed address,
+   and loaded back (sr_fib_load) by mapping the file there: nothing is
+   parsed or inserted, however large the table; loading only reads the
+   image through once to check every pointer in it. The snapshot
+   records the routing table file it was built from (sr_fib_source),
+   and loading refuses it once that file is different.
+ */
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+struct sr_instance;
+struct sr_rt;
+struct sr_event_source;
+struct stat;
+
+#define SR_FIB_BLOCK 65536  /* bytes per allocation block */
+#define SR_FIB_COMPILE_MS 1000  /* quiet time before a changed version is compiled */
+#define SR_FIB_SOURCE_PATH 256  /* longest routing table file name a snapshot records */
+
+struct sr_fib_node {
+    struct sr_fib_node *child[2];
+    struct sr_rt *route;        /* route for the prefix ending here, or NULL */
+    struct sr_fib_node *dead_next;  /* on fib->dead_nodes once pruned */
+};
+
+/* Fixed-size items carved out of blocks that never move */
+struct sr_fib_pool {
+    struct sr_fib_block *blocks;
+    unsigned int size;          /* bytes per item */
+    unsigned int left;          /* items left in blocks */
+    void *free;                 /* reclaimed items, linked through their first word */
+};
+
+/* A version's trie compressed for lookups */
+struct sr_fib_compiled {
+    struct sr_fib_node *root;
+    unsigned int n_prefixes;    /* nodes with a route */
+    unsigned int n_nodes;
+    struct sr_fib_pool nodes;
+    struct sr_fib_compiled *dead_next;
+};
+
+struct sr_fib {
+    struct sr_fib_node *root;   /* the /0 prefix */
+    unsigned int n_routes;
+    uint64_t version;
+    struct sr_fib_pool nodes;
+    struct sr_fib_compiled *compiled;   /* load with acquire; NULL while stale */
+    uint64_t changed_ms;        /* last in place change */
+    uint64_t changes;           /* in place changes so far */
+    struct sr_fib_node *dead_nodes; /* pruned, waiting for the loop */
+    struct sr_rt *dead_routes;  /* removed or replaced, waiting for the loop */
+    struct sr_fib_compiled *dead_compiled;  /* dropped, waiting for the loop */
+    struct sr_fib *retired_next;
+    void *map;                  /* snapshot the version was loaded from, or NULL */
+    size_t map_len;
+};
+
+/* The routing table file a version was built from; path is empty if
+   it is too long to record */
+struct sr_fib_source {
+    char path[SR_FIB_SOURCE_PATH];
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t hash;              /* FNV-1a of the contents, by 64-bit words */
+};
+
+/* Called by sr_fib_walk with a prefix's first route; nonzero stops */
+typedef int (*sr_fib_walk_fn)(struct sr_rt *rt, void *arg);
+
+/* All-zero is a valid empty table */
+struct sr_fib_table {
+    struct sr_fib *current;     /* published; load with sr_fib_current */
+    struct sr_fib *retired;     /* replaced, waiting for the loop */
+    uint64_t versions;          /* versions published so far */
+    int reclaim_fd;             /* eventfd; 0 until sr_fib_init_reclaim */
+    struct sr_event_source *free_work;  /* frees versions off the loop, or NULL */
+    struct sr_fib *freeing;     /* versions the free worker has */
+    struct sr_event_source *compile_work;   /* compiles changed versions off the loop */
+    struct sr_fib *compiling;   /* version the compile worker has, or NULL */
+    uint64_t compiling_changes; /* its changes when the worker started */
+    struct sr_fib_compiled *compiled;   /* what the worker made of it */
+};
+
+struct sr_fib *sr_fib_new(void);
+int sr_fib_add(struct sr_fib *fib, struct sr_rt *rt);
+int sr_fib_compile(struct sr_fib *fib);
+void sr_fib_free(struct sr_fib *fib);
+void sr_fib_publish(struct sr_fib_table *table, struct sr_fib *fib);
+void sr_fib_retire_routes(struct sr_fib_table *table, struct sr_rt *list);
+int sr_fib_set(struct sr_fib_table *table, struct sr_rt *rt);
+int sr_fib_set_hop(struct sr_fib_table *table, struct sr_rt *rt);
+int sr_fib_unset(struct sr_fib_table *table, uint32_t dest, uint32_t mask);
+int sr_fib_unset_hop(struct sr_fib_table *table, struct sr_rt *rt);
+struct sr_rt *sr_fib_find(const struct sr_fib *fib, uint32_t dest, uint32_t mask);
+int sr_fib_walk(const struct sr_fib *fib, uint32_t *dest, int *len, sr_fib_walk_fn fn, void *arg);
+int sr_fib_init_reclaim(struct sr_instance *sr);
+void sr_fib_source(struct sr_fib_source *src, const char *path, const struct stat *st, const void *data);
+int sr_fib_save(const struct sr_fib *fib, const struct sr_fib_source *src, const char *path);
+struct sr_fib *sr_fib_load(const char *path, const struct sr_fib_source *src,
+                           struct sr_rt **list, struct sr_rt **tail);
+const struct sr_fib *sr_fib_current(struct sr_fib_table *table);
+struct sr_rt *sr_fib_lookup(const struct sr_fib *fib, uint32_t ip_dst);
+struct sr_rt *sr_fib_lookup_full(const struct sr_fib *fib, uint32_t ip_dst);
+int sr_fib_multipath(const struct sr_rt *rt);
+struct sr_rt *sr_fib_pick(struct sr_rt *rt, uint32_t flow);
+int sr_fib_prefix_len(uint32_t mask);
+
+#endif
@@ -76,6 +76,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
+        sr->if_list->index = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
         return;
     }
@@ -87,6 +88,7 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
 
     if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
     assert(if_walker->next);
+    if_walker->next->index = if_walker->index + 1;
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
     if_walker->next = 0;
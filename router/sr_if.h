@@ -41,6 +41,7 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  unsigned int index;   /* position in the interface list, from 0 */
   struct sr_if* next;
 };
 
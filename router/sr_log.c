@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include "sr_log.h"
+#include "sr_utils.h"
+
+static const char *sr_log_module_names[SR_LOG_NMODULES] = { "router", "arp", "nat", "io" };
+static const char *sr_log_level_names[] = { "error", "warn", "info", "debug" };
+
+int sr_log_levels[SR_LOG_NMODULES] = { SR_LOG_INFO, SR_LOG_INFO, SR_LOG_INFO, SR_LOG_INFO };
+int sr_log_ring_at_exit = 0;
+
+/* Rate limit state, one window per module */
+static struct {
+    uint64_t window;            /* second the count is for, monotonic */
+    unsigned int lines;
+    unsigned long held_back;
+} sr_log_limit[SR_LOG_NMODULES];
+static pthread_mutex_t sr_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *sr_log_module_name(int mod) {
+    return (mod >= 0 && mod < SR_LOG_NMODULES) ? sr_log_module_names[mod] : "?";
+}
+
+void sr_log_emit(int mod, int lvl, const char *fmt, ...) {
+    uint64_t second = monotonic_ms() / 1000;
+    va_list ap;
+
+    pthread_mutex_lock(&sr_log_lock);
+    if (sr_log_limit[mod].window != second) {
+        sr_log_limit[mod].window = second;
+        sr_log_limit[mod].lines = 0;
+    }
+    if (sr_log_limit[mod].lines >= SR_LOG_RATE) {
+        sr_log_limit[mod].held_back++;
+        pthread_mutex_unlock(&sr_log_lock);
+        return;
+    }
+    sr_log_limit[mod].lines++;
+    if (sr_log_limit[mod].held_back) {
+        printf("[%s] %lu messages held back\n", sr_log_module_names[mod],
+               sr_log_limit[mod].held_back);
+        sr_log_limit[mod].held_back = 0;
+    }
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    pthread_mutex_unlock(&sr_log_lock);
+}
+
+void sr_log_set(int mod, int lvl) {
+    int i;
+    for (i = 0; i < SR_LOG_NMODULES; i++) {
+        if (mod < 0 || mod == i) {
+            sr_log_levels[i] = lvl;
+        }
+    }
+}
+
+static int sr_log_parse_level(const char *name, size_t len) {
+    int i;
+    for (i = 0; i <= SR_LOG_DEBUG; i++) {
+        if (strlen(sr_log_level_names[i]) == len && strncmp(name, sr_log_level_names[i], len) == 0) {
+            return i;
+        }
+    }
+    if (len == 1 && name[0] >= '0' && name[0] <= '0' + SR_LOG_DEBUG) {
+        return name[0] - '0';
+    }
+    return -1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_log_parse(..)
+ *
+ * Apply a comma separated list of "level" (all modules), "module=level"
+ * and "ring" (dump the flight recorder at exit). Returns 0, or -1 on a
+ * bad item.
+ *---------------------------------------------------------------------*/
+int sr_log_parse(const char *spec) {
+    const char *item = spec, *end, *eq;
+    int mod, lvl;
+
+    while (*item) {
+        end = strchr(item, ',');
+        if (end == NULL) {
+            end = item + strlen(item);
+        }
+        eq = memchr(item, '=', end - item);
+
+        if (end - item == 4 && strncmp(item, "ring", 4) == 0) {
+            sr_log_ring_at_exit = 1;
+        } else if (eq == NULL) {
+            if ((lvl = sr_log_parse_level(item, end - item)) < 0) {
+                return -1;
+            }
+            sr_log_set(-1, lvl);
+        } else {
+            for (mod = 0; mod < SR_LOG_NMODULES; mod++) {
+                if (strlen(sr_log_module_names[mod]) == (size_t) (eq - item) &&
+                    strncmp(item, sr_log_module_names[mod], eq - item) == 0) {
+                    break;
+                }
+            }
+            if (mod == SR_LOG_NMODULES || (lvl = sr_log_parse_level(eq + 1, end - eq - 1)) < 0) {
+                return -1;
+            }
+            sr_log_set(mod, lvl);
+        }
+        item = *end ? end + 1 : end;
+    }
+    if (SR_LOG_MAX_LEVEL < SR_LOG_DEBUG) {
+        for (mod = 0; mod < SR_LOG_NMODULES; mod++) {
+            if (sr_log_levels[mod] > SR_LOG_MAX_LEVEL) {
+                fprintf(stderr, "Messages above %s are compiled out of this build\n",
+                        sr_log_level_names[SR_LOG_MAX_LEVEL]);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Flight recorder. Producers claim a slot with one atomic add; nothing is
+   formatted until sr_log_ring_dump. */
+
+#define SR_LOG_NS ((uint64_t) 1000000000)
+
+struct sr_log_record {
+    uint64_t ns;
+    const char *fmt;
+    long a;
+    long b;
+    int mod;
+};
+
+static struct sr_log_record sr_log_ring[SR_LOG_RING_SIZE];
+static unsigned long sr_log_ring_next;
+
+void sr_log_ring_put(int mod, const char *fmt, long a, long b) {
+    unsigned long seq = __sync_fetch_and_add(&sr_log_ring_next, 1);
+    struct sr_log_record *rec = &sr_log_ring[seq & (SR_LOG_RING_SIZE - 1)];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ns = (uint64_t) ts.tv_sec * SR_LOG_NS + ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->a = a;
+    rec->b = b;
+    rec->mod = mod;
+}
+
+void sr_log_ring_dump(FILE *fp) {
+    unsigned long end = sr_log_ring_next, seq;
+    unsigned long start = end > SR_LOG_RING_SIZE ? end - SR_LOG_RING_SIZE : 0;
+    struct sr_log_record *rec;
+
+    fprintf(fp, "Last %lu of %lu log records:\n", end - start, end);
+    for (seq = start; seq < end; seq++) {
+        rec = &sr_log_ring[seq & (SR_LOG_RING_SIZE - 1)];
+        if (rec->fmt == NULL) {
+            continue;
+        }
+        fprintf(fp, "%" PRIu64 ".%06" PRIu64 " [%s] ", rec->ns / SR_LOG_NS,
+                (rec->ns % SR_LOG_NS) / 1000, sr_log_module_name(rec->mod));
+        fprintf(fp, rec->fmt, rec->a, rec->b);
+        fputc('\n', fp);
+    }
+}
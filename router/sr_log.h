@@ -0,0 +1,84 @@
+/* Leveled logging for the router.
+
+   Every message belongs to a module and has a level. It is formatted only
+   if its level is at or below the module's runtime level (sr_log_set,
+   sr_log_parse), and it is compiled out altogether if its level is above
+   SR_LOG_MAX_LEVEL. Per-packet messages are SR_LOG_DEBUG, so a build
+   without _DEBUG_ carries no code for them at all, and a debug build only
+   pays for a compare unless the module is turned up.
+
+   Emission is rate limited per module to SR_LOG_RATE lines a second. The
+   number of lines held back is reported with the next line that gets out.
+
+   Builds with SR_LOG_RING (on with _DEBUG_) also keep a flight recorder:
+   sr_log_rec stores a timestamp, a format string and two integer arguments
+   in a ring without formatting anything, and sr_log_ring_dump formats the
+   last SR_LOG_RING_SIZE records when somebody asks for them. The format
+   must be a string literal whose conversions take a long (%ld, %lu, %lx).
+
+   --
+
+   sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "ARP reply from %s\n", name);
+   if (sr_log_enabled(SR_LOG_ROUTER, SR_LOG_DEBUG))
+       print_hdrs(packet, len);
+   sr_log_rec(SR_LOG_IO, "rx len %ld type 0x%lx", len, type);
+ */
+
+#ifndef SR_LOG_H
+#define SR_LOG_H
+
+#include <stdio.h>
+
+#define SR_LOG_ERROR 0
+#define SR_LOG_WARN  1
+#define SR_LOG_INFO  2
+#define SR_LOG_DEBUG 3
+
+#ifndef SR_LOG_MAX_LEVEL
+#ifdef _DEBUG_
+#define SR_LOG_MAX_LEVEL SR_LOG_DEBUG
+#else
+#define SR_LOG_MAX_LEVEL SR_LOG_INFO
+#endif
+#endif
+
+#if defined(_DEBUG_) && !defined(SR_LOG_NO_RING)
+#define SR_LOG_RING
+#endif
+
+#define SR_LOG_RATE      100   /* lines per module per second */
+#define SR_LOG_RING_SIZE 4096  /* flight recorder records, a power of two */
+
+enum sr_log_module {
+    SR_LOG_ROUTER,     /* IP and ICMP handling, forwarding */
+    SR_LOG_ARP,        /* ARP handling and the ARP cache */
+    SR_LOG_NAT,        /* NAT translation and mappings */
+    SR_LOG_IO,         /* transports */
+    SR_LOG_NMODULES
+};
+
+extern int sr_log_levels[SR_LOG_NMODULES];
+
+#define sr_log_enabled(mod, lvl) \
+    ((lvl) <= SR_LOG_MAX_LEVEL && (lvl) <= sr_log_levels[mod])
+
+#define sr_log(mod, lvl, fmt, args...) \
+    do { if (sr_log_enabled(mod, lvl)) sr_log_emit(mod, lvl, fmt, ## args); } while (0)
+
+#ifdef SR_LOG_RING
+#define sr_log_rec(mod, fmt, a, b) sr_log_ring_put(mod, fmt, (long) (a), (long) (b))
+#else
+#define sr_log_rec(mod, fmt, a, b) do{}while(0)
+#endif
+
+void sr_log_emit(int mod, int lvl, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+void sr_log_set(int mod, int lvl);
+int sr_log_parse(const char *spec);
+const char *sr_log_module_name(int mod);
+
+void sr_log_ring_put(int mod, const char *fmt, long a, long b);
+void sr_log_ring_dump(FILE *fp);
+extern int sr_log_ring_at_exit;    /* dump the ring when the router exits */
+
+#endif
@@ -24,15 +24,24 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
+#include <signal.h>
 #endif /* _LINUX_ */
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_nat.h"
+#include "sr_log.h"
+#include "sr_perf.h"
+#include "sr_drop.h"
+#include "sr_stats.h"
+#include "sr_ctl.h"
+#include "sr_utils.h"
 
 extern char* optarg;
 
@@ -45,17 +54,30 @@ extern char* optarg;
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
 #define DEFAULT_TOPO 0
-
-/* Inclusions for NAT */
-#define DEFAULT_ICMP_QUERY_TIMEOUT 60
-#define DEFAULT_TCP_ESTB_TIMEOUT 7440
-#define DEFAULT_TCP_TRNS_TIMEOUT 300
+#define SR_RT_PRINT_MAX 64 /* larger tables are summarised at startup */
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static int sr_parse_det_subnet(struct sr_nat* nat, char* subnet);
+static int sr_parse_nat_pool(struct sr_nat* nat, char* pool);
+static int sr_parse_arp_retry(char* spec, unsigned int* interval_ms, unsigned int* backoff);
+static void sr_stop_signal(int sig);
+static int sr_stats_signal(struct sr_instance* sr, void* arg);
+static int sr_reload_signal(struct sr_instance* sr, void* arg);
+static void sr_reload_build(void* arg);
+static int sr_reload_done(struct sr_instance* sr, void* arg);
+
+static struct sr_instance* sr_running; /* for signal handlers */
+static char* fib_snapshot; /* binary copy of the routing table file, -F */
+
+/* kill -HUP builds the new table on a worker; the loop only swaps it in */
+static struct sr_event_source* reload_work;
+static struct sr_rt_load reload_load;
+static int reload_ret;
+static int reload_again; /* another HUP came in while building */
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -71,17 +93,29 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *shm_path = 0;
+    char *afp_ifaces = 0;
+    char *arp_retry = 0; /* ms[,backoff factor] between ARP request tries */
+    unsigned int arp_interval_ms = SR_ARPREQ_INTERVAL_MS;
+    unsigned int arp_backoff = SR_ARPREQ_BACKOFF;
+    char *log_spec = 0;
+    char *stats_export = 0; /* path[,interval ms] for traffic rates */
+    char *ctl_path = 0; /* control socket */
     struct sr_instance sr;
 
     /* NAT */
     int nat_mode = 0; /* NAT mode is not activated by default. */
-    unsigned int icmp_query_timeout = DEFAULT_ICMP_QUERY_TIMEOUT;
-    unsigned int tcp_estb_timeout = DEFAULT_TCP_ESTB_TIMEOUT;
-    unsigned int tcp_trns_timeout = DEFAULT_TCP_TRNS_TIMEOUT;
+    unsigned int icmp_query_timeout = SR_NAT_DEFAULT_ICMP_QUERY_TIMEOUT;
+    unsigned int tcp_estb_timeout = SR_NAT_DEFAULT_TCP_ESTB_TIMEOUT;
+    unsigned int tcp_trns_timeout = SR_NAT_DEFAULT_TCP_TRNS_TIMEOUT;
+    unsigned int nat_host_quota = 0; /* no per-host limit by default */
+    unsigned int nat_port_block_size = 0; /* shared first-fit allocation by default */
+    char *nat_det_subnet = 0; /* deterministic NAT subnet, a.b.c.d/len */
+    char *nat_pool = 0; /* external addresses, comma separated */
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n:I:E:R")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n:I:E:RQ:B:D:P:S:A:W:L:HX:C:F:")) != EOF)
     {
         switch (c)
         {
@@ -125,22 +159,83 @@ int main(int argc, char **argv)
             case 'R':
                 tcp_trns_timeout = atoi((char *) optarg);
                 break;
+            case 'Q':
+                nat_host_quota = atoi((char *) optarg);
+                break;
+            case 'B':
+                nat_port_block_size = atoi((char *) optarg);
+                break;
+            case 'D':
+                nat_det_subnet = optarg;
+                break;
+            case 'P':
+                nat_pool = optarg;
+                break;
+            case 'S':
+                shm_path = optarg;
+                break;
+            case 'A':
+                afp_ifaces = optarg;
+                break;
+            case 'W':
+                arp_retry = optarg;
+                break;
+            case 'L':
+                log_spec = optarg;
+                break;
+            case 'H':
+                sr_perf_enabled = 1;
+                break;
+            case 'X':
+                stats_export = optarg;
+                break;
+            case 'C':
+                ctl_path = optarg;
+                break;
+            case 'F':
+                fib_snapshot = optarg;
+                break;
         } /* switch */
     } /* -- while -- */
 
+    if(log_spec && sr_log_parse(log_spec) != 0)
+    {
+        fprintf(stderr, "Bad log levels %s\n", log_spec);
+        usage(argv[0]);
+        exit(1);
+    }
+    if(arp_retry && sr_parse_arp_retry(arp_retry, &arp_interval_ms, &arp_backoff) != 0)
+    {
+        fprintf(stderr, "Bad ARP retry %s (interval and backoff factor 1 to %d)\n",
+                arp_retry, SR_ARPREQ_MAX_DELAY_MS);
+        usage(argv[0]);
+        exit(1);
+    }
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
 
-    struct sr_nat nat;
-
     if (nat_mode) {
-        nat.icmp_query_timeout = icmp_query_timeout;
-        nat.tcp_estb_timeout = tcp_estb_timeout;
-        nat.tcp_trns_timeout = tcp_trns_timeout;
+        sr.nat.icmp_query_timeout = icmp_query_timeout;
+        sr.nat.tcp_estb_timeout = tcp_estb_timeout;
+        sr.nat.tcp_trns_timeout = tcp_trns_timeout;
+        sr.nat.host_quota = nat_host_quota;
+        sr.nat.port_block_size = nat_port_block_size;
+        sr.nat.det_prefix = 0;
+        sr.nat.addrs = NULL;
+        sr.nat.pool = NULL;
+        sr.nat.pool_size = 0;
+        if (nat_pool && sr_parse_nat_pool(&sr.nat, nat_pool) != 0) {
+            fprintf(stderr, "Invalid NAT address pool %s\n", nat_pool);
+            exit(1);
+        }
+        if (nat_det_subnet && sr_parse_det_subnet(&sr.nat, nat_det_subnet) != 0) {
+            fprintf(stderr, "Invalid deterministic NAT subnet %s\n", nat_det_subnet);
+            exit(1);
+        }
     }
 
     sr.nat_mode = nat_mode;
-    sr.nat = nat;
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -170,32 +265,91 @@ int main(int argc, char **argv)
         }
     }
 
-    Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
-    if(template)
-        Debug("Requesting topology template %s\n", template);
+    if(afp_ifaces)
+    {
+        /* straight on Linux interfaces, no VNS session */
+        if(sr_afpacket_open(&sr, afp_ifaces) == -1)
+        {
+            return 1;
+        }
+    }
+    else if(shm_path)
+    {
+        /* local peer over shared memory, no VNS session */
+        Debug("Client %s attaching to shared memory at %s\n", sr.user, shm_path);
+        if(sr_connect_to_shm(&sr, shm_path) == -1)
+        {
+            return 1;
+        }
+    }
     else
-        Debug("Requesting topology %d\n", topo);
+    {
+        Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
+        if(template)
+            Debug("Requesting topology template %s\n", template);
+        else
+            Debug("Requesting topology %d\n", topo);
+
+        /* connect to server and negotiate session */
+        if(sr_connect_to_server(&sr,port,server) == -1)
+        {
+            return 1;
+        }
+
+        if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
+            Debug("Connected to new instantiation of topology template %s\n", template);
+            sr_load_rt_wrap(&sr, "rtable.vrhost");
+        }
+        else {
+          /* Read from specified routing table */
+          sr_load_rt_wrap(&sr, rtable);
+        }
+    }
 
-    /* connect to server and negotiate session */
-    if(sr_connect_to_server(&sr,port,server) == -1)
+    /* call router init (for arp subsystem etc.) */
+    sr_init(&sr);
+    sr.cache.req_interval_ms = arp_interval_ms;
+    sr.cache.req_backoff = arp_backoff;
+    if(sr_event_add_transport(&sr) != 0)
+    {
+        return 1;
+    }
+    /* A stats reader, control client or server that goes away shows up
+     * as EPIPE on the write rather than killing the router */
+    signal(SIGPIPE, SIG_IGN);
+    if(stats_export && sr_stats_export_open(&sr, stats_export) != 0)
     {
         return 1;
     }
 
-    if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
-        Debug("Connected to new instantiation of topology template %s\n", template);
-        sr_load_rt_wrap(&sr, "rtable.vrhost");
+    /* kill -USR1 prints the stage latency histograms */
+    sr_event_add_signal(&(sr.loop), SIGUSR1, sr_stats_signal, NULL);
+    /* kill -HUP re-reads the routing table file */
+    sr_event_add_signal(&(sr.loop), SIGHUP, sr_reload_signal, NULL);
+    if((reload_work = sr_event_add_work(&(sr.loop), sr_reload_build, sr_reload_done, &sr)) == 0)
+    {
+        return 1;
     }
-    else {
-      /* Read from specified routing table */
-      sr_load_rt_wrap(&sr, rtable);
+
+    /* After the signal sources, so the control thread has them blocked */
+    if(ctl_path && sr_ctl_open(&sr, ctl_path) != 0)
+    {
+        return 1;
     }
 
-    /* call router init (for arp subsystem etc.) */
-    sr_init(&sr);
+    /* Ctrl-C and kill leave the main loop, so the instance is torn down */
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sr_stop_signal;
+        sigemptyset(&sa.sa_mask);
+        sr_running = &sr;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
 
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    sr_event_run(&sr, &(sr.loop));
 
     sr_destroy_instance(&sr);
 
@@ -214,6 +368,17 @@ static void usage(char* argv0)
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
     printf("           [-l log file] \n");
+    printf("           [-Q nat mappings per host] [-B nat port block size] \n");
+    printf("           [-D deterministic nat subnet a.b.c.d/len] \n");
+    printf("           [-P nat address pool a.b.c.d[,a.b.c.d...]] \n");
+    printf("           [-S shared memory socket path] \n");
+    printf("           [-A linux interfaces ifname[,ifname...]] \n");
+    printf("           [-W arp retry interval ms[,backoff factor]] \n");
+    printf("           [-L log levels [module=]error|warn|info|debug[,...][,ring]] \n");
+    printf("           [-H time packet path stages, dump with SIGUSR1] \n");
+    printf("           [-X traffic rates file[,interval ms]] \n");
+    printf("           [-C control socket path] \n");
+    printf("           [-F routing table snapshot path] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -243,6 +408,73 @@ void sr_set_user(struct sr_instance* sr)
 
 } /* -- sr_set_user -- */
 
+static void sr_stop_signal(int sig)
+{
+    sr_event_stop(&(sr_running->loop));
+} /* -- sr_stop_signal -- */
+
+static int sr_stats_signal(struct sr_instance* sr, void* arg)
+{
+    sr_drop_dump_json(stderr);
+    if(!sr_perf_enabled)
+    { fprintf(stderr, "Stage timing is off; start the router with -H\n"); }
+    sr_perf_dump_json(stderr);
+    return 1;
+} /* -- sr_stats_signal -- */
+
+static int sr_reload_signal(struct sr_instance* sr, void* arg)
+{
+    int ret;
+
+    if(sr->rtable == 0 || (ret = sr_event_work_start(reload_work)) < 0)
+    {
+        fprintf(stderr, "Routing table reload failed, keeping the old table\n");
+        return 1;
+    }
+    if(ret == 1)
+    {
+        /* -- the running build may have read the file before it changed -- */
+        reload_again = 1;
+    }
+    return 1;
+} /* -- sr_reload_signal -- */
+
+/* -- on the reload worker: parse, compile and save, off the loop -- */
+static void sr_reload_build(void* arg)
+{
+    struct sr_instance* sr = arg;
+
+    if((reload_ret = sr_build_rt(sr->rtable, &reload_load)) != 0)
+    { return; }
+    if(fib_snapshot && sr_save_rt_snapshot(&reload_load, fib_snapshot) != 0)
+    { fprintf(stderr, "Cannot write routing table snapshot %s\n", fib_snapshot); }
+} /* -- sr_reload_build -- */
+
+/* -- back on the loop: swap the new table in -- */
+static int sr_reload_done(struct sr_instance* sr, void* arg)
+{
+    const struct sr_fib* fib;
+
+    if(reload_ret != 0)
+    {
+        fprintf(stderr, "Routing table reload failed, keeping the old table\n");
+    }
+    else
+    {
+        sr_install_rt(sr, &reload_load);
+        fib = sr_fib_current(&(sr->fib));
+        sr_log(SR_LOG_ROUTER, SR_LOG_INFO,
+               "Reloaded routing table from %s: %u routes, %u compiled prefixes, version %" PRIu64 "\n",
+               sr->rtable, fib->n_routes, fib->compiled ? fib->compiled->n_prefixes : 0, fib->version);
+    }
+    if(reload_again)
+    {
+        reload_again = 0;
+        sr_reload_signal(sr, 0);
+    }
+    return 1;
+} /* -- sr_reload_done -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_destroy_instance(..)
  * Scope: Local
@@ -260,6 +492,20 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    if(sr->ctl)
+    { sr_ctl_close(sr); }
+
+#ifdef SR_LOG_RING
+    if(sr_log_ring_at_exit)
+    { sr_log_ring_dump(stderr); }
+#endif
+
+    if(sr->transport == SR_TRANSPORT_SHM)
+    { sr_shm_close(&(sr->shm)); }
+    if(sr->transport == SR_TRANSPORT_AFPACKET)
+    { sr_afpacket_close(sr->afpacket); }
+    sr_event_destroy(&(sr->loop));
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -278,11 +524,18 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    sr->transport = SR_TRANSPORT_VNS;
+    sr->shm.region = 0;
+    sr->afpacket = 0;
+    sr->ctl = 0;
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->routing_tail = 0;
+    memset(&(sr->fib), 0, sizeof(sr->fib));
+    sr->rtable = 0;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -338,15 +591,133 @@ int sr_verify_routing_table(struct sr_instance* sr)
 } /* -- sr_verify_routing_table -- */
 
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
-    if(sr_load_rt(sr, rtable) != 0) {
-        fprintf(stderr,"Error setting up routing table from file %s\n",
-                rtable);
-        exit(1);
+    uint64_t start = monotonic_ms();
+    const struct sr_fib* fib;
+    struct sr_rt_load load;
+
+    /* -- loaded once before connecting already; a published snapshot
+          would also keep its own copy from mapping again -- */
+    if(sr->rtable && strcmp(sr->rtable, rtable) == 0)
+    { return; }
+
+    /* -- a snapshot stands in for the file while it records the file's
+          path, size, mtime and contents as they are now -- */
+    if(fib_snapshot && sr_load_rt_snapshot(sr, fib_snapshot, rtable) == 0) {
+        printf("Loaded routing table snapshot %s\n", fib_snapshot);
     }
+    else {
+        if(sr_build_rt(rtable, &load) != 0) {
+            fprintf(stderr,"Error setting up routing table from file %s\n",
+                    rtable);
+            exit(1);
+        }
+        if(fib_snapshot && sr_save_rt_snapshot(&load, fib_snapshot) != 0)
+        { fprintf(stderr, "Cannot write routing table snapshot %s\n", fib_snapshot); }
+        sr_install_rt(sr, &load);
+    }
+    sr->rtable = rtable;
 
-
+    fib = sr_fib_current(&(sr->fib));
     printf("Loading routing table\n");
     printf("---------------------------------------------\n");
-    sr_print_routing_table(sr);
+    if(fib && fib->n_routes > SR_RT_PRINT_MAX)
+    {
+        printf("%u routes, %u compiled prefixes, in %" PRIu64 " ms\n", fib->n_routes,
+               fib->compiled ? fib->compiled->n_prefixes : 0, monotonic_ms() - start);
+    }
+    else
+    { sr_print_routing_table(sr); }
     printf("---------------------------------------------\n");
 }
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_det_subnet(..)
+ * Scope: Local
+ *
+ * Parse "a.b.c.d/len" for deterministic NAT. The subnet must be small
+ * enough that every host still gets at least one external port on its
+ * pool address.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_det_subnet(struct sr_nat* nat, char* subnet)
+{
+    char addr[32];
+    char* slash = strchr(subnet, '/');
+    struct in_addr in;
+    int prefix;
+
+    if (slash == 0 || slash - subnet >= sizeof(addr))
+    { return -1; }
+
+    memcpy(addr, subnet, slash - subnet);
+    addr[slash - subnet] = 0;
+    prefix = atoi(slash + 1);
+
+    if (inet_aton(addr, &in) == 0 || prefix < 1 || prefix > 32)
+    { return -1; }
+    if ((1U << (32 - prefix)) / (nat->pool_size ? nat->pool_size : 1) > TOTAL_TCP_PORTS)
+    { return -1; }
+
+    /* keep only the network part */
+    nat->det_subnet = htonl(ntohl(in.s_addr) & (0xffffffffU << (32 - prefix)));
+    nat->det_prefix = prefix;
+    return 0;
+} /* -- sr_parse_det_subnet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_arp_retry(..)
+ * Scope: Local
+ *
+ * Parse "ms[,factor]" for -W. The interval must be at least 1 ms and no
+ * more than the longest retry delay, and the factor at least 1, so the
+ * tries are spread out and a garbage value is not silently clamped.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_arp_retry(char* spec, unsigned int* interval_ms, unsigned int* backoff)
+{
+    char* end;
+    long interval, factor = *backoff;
+
+    interval = strtol(spec, &end, 10);
+    if (end == spec || interval < 1 || interval > SR_ARPREQ_MAX_DELAY_MS)
+    { return -1; }
+    if (*end == ',')
+    {
+        spec = end + 1;
+        factor = strtol(spec, &end, 10);
+        if (end == spec || factor < 1 || factor > SR_ARPREQ_MAX_DELAY_MS)
+        { return -1; }
+    }
+    if (*end != 0)
+    { return -1; }
+
+    *interval_ms = interval;
+    *backoff = factor;
+    return 0;
+} /* -- sr_parse_arp_retry -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_pool(..)
+ * Scope: Local
+ *
+ * Parse a comma separated list of external NAT addresses.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_nat_pool(struct sr_nat* nat, char* pool)
+{
+    char* addr = strtok(pool, ",");
+    struct in_addr in;
+
+    while (addr)
+    {
+        if (inet_aton(addr, &in) == 0)
+        { return -1; }
+        sr_nat_add_pool_addr(nat, in.s_addr);
+        addr = strtok(0, ",");
+    }
+
+    return nat->pool_size ? 0 : -1;
+} /* -- sr_parse_nat_pool -- */
@@ -6,7 +6,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <arpa/inet.h>
 #include "sr_utils.h"
+#include "sr_log.h"
+#include "sr_perf.h"
 
 
 int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
@@ -18,18 +21,34 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
 
-  /* Initialize timeout thread */
-
-  pthread_attr_init(&(nat->thread_attr));
-  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
+  /* Timeouts are handled by sr_nat_tick, run from the router's event loop */
 
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
   nat->mappings = NULL;
   /* Initialize any variables here */
+  nat->hosts = NULL;
+  nat->dumpers = 0;
+  nat->retired = NULL;
+  nat->retired_conns = NULL;
+
+  /* Deterministic mode splits the TCP port space of every pool address
+     evenly over the hosts hashed onto it; the same ranges are used for
+     ICMP identifiers. */
+  if (nat->det_prefix) {
+    unsigned int n_addrs = nat->pool_size ? nat->pool_size : 1;
+    unsigned int n_hosts = ((1U << (32 - nat->det_prefix)) + n_addrs - 1) / n_addrs;
+    nat->det_range = (MAX_16B_NUM + 1 - MIN_TCP_PORT) / n_hosts;
+    nat->port_block_size = 0;
+  }
+
+  /* Blocks must be aligned, so round the block size down to a power of two */
+  if (nat->port_block_size) {
+    unsigned int size = SR_NAT_MIN_BLOCK_SIZE;
+    while (size * 2 <= nat->port_block_size && size * 2 <= TOTAL_TCP_PORTS)
+      size *= 2;
+    nat->port_block_size = size;
+  }
 
   return success;
 }
@@ -41,33 +60,339 @@ int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
   /* free nat memory here */
 
-  pthread_kill(nat->thread, SIGKILL);
   return pthread_mutex_destroy(&(nat->lock)) &&
     pthread_mutexattr_destroy(&(nat->attr));
 
 }
 
-void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
-  struct sr_nat *nat = (struct sr_nat *)nat_ptr;
-  while (1) {
-    sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
+/* Smallest external port or ICMP identifier handed out for this type */
+static unsigned int sr_nat_min_aux(sr_nat_mapping_type type) {
+  return type == nat_mapping_tcp ? MIN_TCP_PORT : MIN_ICMP_IDENTIFIER;
+}
 
-    /*time_t curtime = time(NULL);*/
+/* Allocate a fresh external address with an empty port allocator */
+static struct sr_nat_extaddr *sr_nat_new_addr(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_extaddr *addr = calloc(1, sizeof(struct sr_nat_extaddr));
+  assert(addr != NULL);
+
+  addr->ip = ip;
+  addr->next_aux[nat_mapping_icmp] = MIN_ICMP_IDENTIFIER;
+  addr->next_aux[nat_mapping_tcp] = MIN_TCP_PORT;
+  addr->next = nat->addrs;
+  /* Filled in before it is linked: sr_nat_is_external_addr walks the
+     list without the lock */
+  __atomic_store_n(&(nat->addrs), addr, __ATOMIC_RELEASE);
+  return addr;
+}
 
-    /* handle periodic tasks here */
+/* External address record for ip, or NULL */
+static struct sr_nat_extaddr *sr_nat_find_addr(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_extaddr *addr;
 
-    pthread_mutex_unlock(&(nat->lock));
+  for (addr = nat->addrs; addr != NULL; addr = addr->next) {
+    if (addr->ip == ip) {
+      return addr;
+    }
   }
   return NULL;
 }
 
-/* Get the mapping associated with given external port.
+/* Index of an internal host inside the deterministic subnet, or -1 */
+static int sr_nat_deterministic_index(struct sr_nat *nat, uint32_t ip_int) {
+  uint32_t offset = ntohl(ip_int) - ntohl(nat->det_subnet);
+  return offset < (1U << (32 - nat->det_prefix)) ? (int)offset : -1;
+}
+
+/* Paired pooling: a host is always placed on the same pool address,
+   chosen by a multiplicative hash of its internal address (or by its
+   subnet index in deterministic mode). Without a pool the outgoing
+   interface address is used. */
+static struct sr_nat_extaddr *sr_nat_select_addr(struct sr_nat *nat, uint32_t ip_int, uint32_t ip_ext) {
+  struct sr_nat_extaddr *addr;
+
+  if (nat->pool_size) {
+    int index = nat->det_prefix ? sr_nat_deterministic_index(nat, ip_int) : -1;
+    if (index < 0) {
+      index = (ntohl(ip_int) * 2654435761U) % nat->pool_size;
+    }
+    return nat->pool[index % nat->pool_size];
+  }
+
+  addr = sr_nat_find_addr(nat, ip_ext);
+  return addr != NULL ? addr : sr_nat_new_addr(nat, ip_ext);
+}
+
+/* Find the accounting record of an internal host, creating it if asked */
+static struct sr_nat_host *sr_nat_get_host(struct sr_nat *nat, uint32_t ip_int, uint32_t ip_ext, int create) {
+  struct sr_nat_host *host;
+
+  for (host = nat->hosts; host != NULL; host = host->next) {
+    if (host->ip_int == ip_int) {
+      return host;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  host = calloc(1, sizeof(struct sr_nat_host));
+  assert(host != NULL);
+  host->ip_int = ip_int;
+  host->addr = sr_nat_select_addr(nat, ip_int, ip_ext);
+  host->next = nat->hosts;
+  nat->hosts = host;
+  return host;
+}
+
+/* Free a host record once it holds no mappings and no blocks */
+static void sr_nat_put_host(struct sr_nat *nat, struct sr_nat_host *host) {
+  struct sr_nat_host **walker;
+  int type;
+
+  for (type = 0; type < SR_NAT_MAPPING_TYPES; type++) {
+    if (host->mappings[type] || host->n_blocks[type]) {
+      return;
+    }
+  }
+  for (walker = &nat->hosts; *walker != NULL; walker = &(*walker)->next) {
+    if (*walker == host) {
+      *walker = host->next;
+      free(host);
+      return;
+    }
+  }
+}
+
+/* Take the first free port or identifier inside a block */
+static int sr_nat_alloc_from_block(struct sr_nat *nat, struct sr_nat_extaddr *addr,
+  sr_nat_mapping_type type, unsigned int block) {
+  unsigned int aux = sr_nat_min_aux(type) + block * nat->port_block_size;
+  unsigned int end = aux + nat->port_block_size;
+
+  for (; aux < end; aux++) {
+    if (!addr->aux_used[type][aux]) {
+      addr->aux_used[type][aux] = 1;
+      return aux;
+    }
+  }
+  return -1;
+}
+
+/* Reserve a whole unused block for a host */
+static int sr_nat_reserve_block(struct sr_nat *nat, struct sr_nat_extaddr *addr, sr_nat_mapping_type type) {
+  unsigned int n_blocks = (MAX_16B_NUM + 1 - sr_nat_min_aux(type)) / nat->port_block_size;
+  unsigned int block;
+
+  for (block = 0; block < n_blocks; block++) {
+    if (!addr->block_used[type][block]) {
+      addr->block_used[type][block] = 1;
+      return block;
+    }
+  }
+  return -1;
+}
+
+/* Deterministic mode: the host's range is fixed, and the probe starts at
+   the internal port's slot so a flow usually keeps its port offset. */
+static int sr_nat_alloc_deterministic(struct sr_nat *nat, struct sr_nat_host *host,
+  uint16_t aux_int, sr_nat_mapping_type type) {
+  uint8_t *aux_used = host->addr->aux_used[type];
+  int index = sr_nat_deterministic_index(nat, host->ip_int);
+  unsigned int first, i, aux;
+
+  if (index < 0) {
+    return -1;
+  }
+  if (nat->pool_size) {
+    index /= nat->pool_size;
+  }
+  first = sr_nat_min_aux(type) + index * nat->det_range;
+  for (i = 0; i < nat->det_range; i++) {
+    aux = first + (aux_int + i) % nat->det_range;
+    if (!aux_used[aux]) {
+      aux_used[aux] = 1;
+      return aux;
+    }
+  }
+  return -1;
+}
+
+/* Allocate an external port or identifier for a host. Without blocks this
+   is a first-fit scan over the shared space; with blocks the host only ever
+   draws from its own reserved blocks, reserving a new one when they fill. */
+static int sr_nat_alloc_aux(struct sr_nat *nat, struct sr_nat_host *host, sr_nat_mapping_type type) {
+  struct sr_nat_extaddr *addr = host->addr;
+  unsigned int min = sr_nat_min_aux(type);
+  unsigned int i;
+  int aux, block;
+
+  if (nat->port_block_size == 0) {
+    unsigned int cursor = addr->next_aux[type];
+    for (i = min; i <= MAX_16B_NUM; i++, cursor++) {
+      if (cursor < min || cursor > MAX_16B_NUM) {
+        cursor = min;
+      }
+      if (!addr->aux_used[type][cursor]) {
+        addr->aux_used[type][cursor] = 1;
+        addr->next_aux[type] = cursor + 1;
+        return cursor;
+      }
+    }
+    return -1;
+  }
+
+  for (i = 0; i < host->n_blocks[type]; i++) {
+    aux = sr_nat_alloc_from_block(nat, addr, type, host->blocks[type][i]);
+    if (aux >= 0) {
+      return aux;
+    }
+  }
+
+  if (host->n_blocks[type] == SR_NAT_MAX_HOST_BLOCKS) {
+    return -1;
+  }
+  block = sr_nat_reserve_block(nat, addr, type);
+  if (block < 0) {
+    return -1;
+  }
+  host->blocks[type][host->n_blocks[type]++] = block;
+  return sr_nat_alloc_from_block(nat, addr, type, block);
+}
+
+/* Return a port or identifier, handing its block back once it is empty */
+static void sr_nat_release_aux(struct sr_nat *nat, struct sr_nat_host *host, sr_nat_mapping_type type, uint16_t aux) {
+  struct sr_nat_extaddr *addr = host->addr;
+  unsigned int block, first, i;
+
+  addr->aux_used[type][aux] = 0;
+  if (nat->port_block_size == 0) {
+    return;
+  }
+
+  block = (aux - sr_nat_min_aux(type)) / nat->port_block_size;
+  first = sr_nat_min_aux(type) + block * nat->port_block_size;
+  for (i = first; i < first + nat->port_block_size; i++) {
+    if (addr->aux_used[type][i]) {
+      return;
+    }
+  }
+
+  addr->block_used[type][block] = 0;
+  for (i = 0; i < host->n_blocks[type]; i++) {
+    if (host->blocks[type][i] == block) {
+      host->blocks[type][i] = host->blocks[type][--host->n_blocks[type]];
+      break;
+    }
+  }
+}
+
+static void sr_nat_free_mapping(struct sr_nat_mapping *mapping) {
+  struct sr_nat_connection *conn, *next;
+
+  for (conn = mapping->conns; conn != NULL; conn = next) {
+    next = conn->next;
+    free(conn);
+  }
+  free(mapping);
+}
+
+/* Free what was removed during dumps, once none is running */
+static void sr_nat_free_retired(struct sr_nat *nat) {
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+
+  while ((mapping = nat->retired) != NULL) {
+    nat->retired = mapping->retired_next;
+    sr_nat_free_mapping(mapping);
+  }
+  while ((conn = nat->retired_conns) != NULL) {
+    nat->retired_conns = conn->retired_next;
+    free(conn);
+  }
+}
+
+/* Unlink a mapping, free it with its connections and give back its external port */
+static void sr_nat_remove_mapping(struct sr_nat *nat, struct sr_nat_mapping **link) {
+  struct sr_nat_mapping *mapping = *link;
+
+  *link = mapping->next;
+
+  if (mapping->host != NULL) {
+    sr_nat_release_aux(nat, mapping->host, mapping->type, mapping->aux_ext);
+    mapping->host->addr->mappings--;
+    mapping->host->mappings[mapping->type]--;
+    sr_nat_put_host(nat, mapping->host);
+  } else {
+    struct sr_nat_extaddr *addr = sr_nat_find_addr(nat, mapping->ip_ext);
+    addr->aux_used[mapping->type][mapping->aux_ext] = 0;
+    addr->mappings--;
+  }
+
+  if (nat->dumpers) {
+    mapping->retired_next = nat->retired;
+    nat->retired = mapping;
+  } else {
+    sr_nat_free_mapping(mapping);
+  }
+}
+
+/* Drop idle TCP connections; returns the number still alive */
+static int sr_nat_expire_connections(struct sr_nat *nat, struct sr_nat_mapping *mapping, time_t curtime) {
+  struct sr_nat_connection **link = &mapping->conns;
+  int alive = 0;
+
+  while (*link != NULL) {
+    struct sr_nat_connection *conn = *link;
+    unsigned int timeout = conn->tcp_state == ESTABLISHED ? nat->tcp_estb_timeout : nat->tcp_trns_timeout;
+    if (difftime(curtime, conn->last_updated) > timeout) {
+      *link = conn->next;
+      if (nat->dumpers) {
+        conn->retired_next = nat->retired_conns;
+        nat->retired_conns = conn;
+      } else {
+        free(conn);
+      }
+    } else {
+      link = &conn->next;
+      alive++;
+    }
+  }
+  return alive;
+}
+
+void sr_nat_tick(struct sr_nat *nat) {  /* Periodic Timout handling, every SR_NAT_TICK_MS */
+  pthread_mutex_lock(&(nat->lock));
+
+  time_t curtime = time(NULL);
+
+  /* handle periodic tasks here */
+  struct sr_nat_mapping **link = &nat->mappings;
+  while (*link != NULL) {
+    struct sr_nat_mapping *mapping = *link;
+    int expired;
+    if (mapping->type == nat_mapping_icmp) {
+      expired = difftime(curtime, mapping->last_updated) > nat->icmp_query_timeout;
+    } else {
+      expired = sr_nat_expire_connections(nat, mapping, curtime) == 0 &&
+        difftime(curtime, mapping->last_updated) > nat->tcp_trns_timeout;
+    }
+    if (expired && !mapping->is_static) {
+      sr_nat_remove_mapping(nat, link);
+    } else {
+      link = &mapping->next;
+    }
+  }
+
+  pthread_mutex_unlock(&(nat->lock));
+}
+
+/* Get the mapping associated with given external address and port.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
 
-  printf  ("NAT lookup given external port \n"); 
+  sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "NAT lookup given external port \n");
+  SR_PERF_BEGIN(t0);
   pthread_mutex_lock(&(nat->lock));
 
   /* handle lookup here, malloc and assign to copy */
@@ -75,7 +400,7 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
   curr_mapping = nat->mappings;
 
   while (curr_mapping != NULL) {
-    if (curr_mapping->type == type && curr_mapping->aux_ext == aux_ext) {
+    if (curr_mapping->type == type && curr_mapping->aux_ext == aux_ext && curr_mapping->ip_ext == ip_ext) {
       target_mapping = curr_mapping;
       break;
     }
@@ -83,7 +408,12 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
   }
 
   pthread_mutex_unlock(&(nat->lock));
-  print_nat_mapping (target_mapping);
+  if (target_mapping != NULL && sr_log_enabled(SR_LOG_NAT, SR_LOG_DEBUG))
+    print_nat_mapping (target_mapping);
+  else if (target_mapping == NULL)
+    sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "No mapping for external port %u\n", (unsigned int) aux_ext);
+  sr_log_rec(SR_LOG_NAT, "lookup external port %ld: %ld", aux_ext, target_mapping != NULL);
+  SR_PERF_END(SR_PERF_NAT, t0);
   return target_mapping;
 
 }
@@ -93,7 +423,8 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  printf  ("NAT lookup given internal port \n");
+  sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "NAT lookup given internal port \n");
+  SR_PERF_BEGIN(t0);
   
 
   pthread_mutex_lock(&(nat->lock));
@@ -112,6 +443,7 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   }
 
   pthread_mutex_unlock(&(nat->lock));
+  SR_PERF_END(SR_PERF_NAT, t0);
  /* print_nat_mapping (target_mapping);*/
 /*  assert (target_mapping != NULL);*/
   return target_mapping;
@@ -131,12 +463,29 @@ struct sr_nat_connection *sr_nat_lookup_connection (struct sr_nat_connection *cu
 
 /* Insert a new mapping into the nat's mapping table.
    Actually returns a copy to the new mapping, for thread safety.
+   Returns NULL when the host is over quota or out of ports.
  */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, sr_nat_mapping_type type ) {
 
   pthread_mutex_lock(&(nat->lock));
 
+  struct sr_nat_host *host = sr_nat_get_host(nat, ip_int, ip_ext, 1);
+  if (nat->host_quota &&
+      host->mappings[nat_mapping_icmp] + host->mappings[nat_mapping_tcp] >= nat->host_quota) {
+    host->quota_denied++;
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+
+  int aux_ext = nat->det_prefix ? sr_nat_alloc_deterministic(nat, host, aux_int, type) :
+    sr_nat_alloc_aux(nat, host, type);
+  if (aux_ext < 0) {
+    host->alloc_failed++;
+    pthread_mutex_unlock(&(nat->lock));
+    return NULL;
+  }
+
   /* handle insert here, create a mapping, and then return a copy of it */
   struct sr_nat_mapping *new_mapping = malloc(sizeof(struct sr_nat_mapping)); 
   assert(new_mapping != NULL);
@@ -145,7 +494,15 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   new_mapping->last_updated = time(NULL);
   new_mapping->ip_int = ip_int;
   new_mapping->aux_int = aux_int;
+  new_mapping->ip_ext = host->addr->ip;
+  new_mapping->aux_ext = aux_ext;
   new_mapping->conns = NULL;
+  new_mapping->host = host;
+  new_mapping->is_static = 0;
+
+  host->addr->mappings++;
+  host->mappings[type]++;
+  host->created[type]++;
 
   struct sr_nat_mapping *curr_mapping = nat->mappings;
   nat->mappings = new_mapping;
@@ -155,67 +512,292 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   return new_mapping;
 }
 
-/* Generate a unique icmp identifier with o(n) complexity */
-int sr_nat_generate_icmp_identifier(struct sr_nat *nat) {
+/* Insert a new connection associated with the given IP in the NAT entry. */
+struct sr_nat_connection *sr_nat_insert_tcp_connection (struct sr_nat_mapping *mapping, uint32_t ip_connection) {
+    struct sr_nat_connection *new_connection = malloc(sizeof(struct sr_nat_connection));
+    assert(new_connection != NULL);
+    memset(new_connection, 0, sizeof(struct sr_nat_connection));
 
-    pthread_mutex_lock(&(nat->lock));
+    new_connection->last_updated = time(NULL);
+    new_connection->ip = ip_connection;
+    new_connection->tcp_state = CLOSED;
 
-    uint16_t *free_icmp_identifiers = nat->free_icmp_identifiers;
-    int i;
+    /* Linked before it is published, for dumps walking without the lock */
+    new_connection->next = mapping->conns;
+    __atomic_store_n(&mapping->conns, new_connection, __ATOMIC_RELEASE);
 
-    for (i = MIN_ICMP_IDENTIFIER; i <= TOTAL_ICMP_IDENTIFIERS; i++) {
-        if (free_icmp_identifiers[i] == 0) {
-            free_icmp_identifiers[i] = 1;
-            printf("Allocated ICMP identifier: %d\n", i);
+    return new_connection;
+}
 
-            return i;
-        }
-    }
+int sr_nat_add_static(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, uint16_t aux_ext, int ext_iface) {
+  struct sr_nat_extaddr *addr;
+  struct sr_nat_mapping *mapping;
+  unsigned int min = sr_nat_min_aux(type);
+
+  if (nat->det_prefix || aux_ext < min) {
+    return -1;
+  }
 
+  pthread_mutex_lock(&(nat->lock));
+
+  addr = sr_nat_find_addr(nat, ip_ext);
+  /* Any other address would become one the router answers ARP for */
+  if (addr == NULL && nat->pool_size == 0 && ext_iface) {
+    addr = sr_nat_new_addr(nat, ip_ext);
+  }
+  /* The external port must be free, and not in a block a host holds */
+  if (addr == NULL || addr->aux_used[type][aux_ext] ||
+      (nat->port_block_size && addr->block_used[type][(aux_ext - min) / nat->port_block_size])) {
     pthread_mutex_unlock(&(nat->lock));
     return -1;
+  }
+  for (mapping = nat->mappings; mapping != NULL; mapping = mapping->next) {
+    if (mapping->type == type && mapping->ip_int == ip_int && mapping->aux_int == aux_int) {
+      pthread_mutex_unlock(&(nat->lock));
+      return -1;
+    }
+  }
+
+  mapping = calloc(1, sizeof(struct sr_nat_mapping));
+  assert(mapping != NULL);
+  mapping->type = type;
+  mapping->ip_int = ip_int;
+  mapping->aux_int = aux_int;
+  mapping->ip_ext = ip_ext;
+  mapping->aux_ext = aux_ext;
+  mapping->last_updated = time(NULL);
+  mapping->is_static = 1;
+
+  addr->aux_used[type][aux_ext] = 1;
+  addr->mappings++;
+  mapping->next = nat->mappings;
+  nat->mappings = mapping;
+
+  pthread_mutex_unlock(&(nat->lock));
+  return 0;
 }
 
-/* Generate a unique tcp identifier with o(n) complexity */
-int sr_nat_generate_tcp_port(struct sr_nat *nat) {
+int sr_nat_del_mapping(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_ext, uint16_t aux_ext) {
+  struct sr_nat_mapping **link;
+  int ret = -1;
 
-    pthread_mutex_lock(&(nat->lock));
+  pthread_mutex_lock(&(nat->lock));
+  for (link = &nat->mappings; *link != NULL; link = &(*link)->next) {
+    if ((*link)->type == type && (*link)->ip_ext == ip_ext && (*link)->aux_ext == aux_ext) {
+      sr_nat_remove_mapping(nat, link);
+      ret = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(nat->lock));
+  return ret;
+}
 
-    uint16_t *free_tcp_ports = nat->free_tcp_ports;
-    int i;
+struct sr_nat_mapping *sr_nat_dump_begin(struct sr_nat *nat) {
+  struct sr_nat_mapping *head;
 
-    for (i = MIN_TCP_PORT; i <= TOTAL_TCP_PORTS; i++) {
-        if (free_tcp_ports[i] == 0) {
-            free_tcp_ports[i] = 1;
-            printf("Allocated TCP Port: %d\n", i);
+  pthread_mutex_lock(&(nat->lock));
+  nat->dumpers++;
+  head = nat->mappings;
+  pthread_mutex_unlock(&(nat->lock));
+  return head;
+}
 
-            return i;
-        }
+void sr_nat_dump_end(struct sr_nat *nat) {
+  pthread_mutex_lock(&(nat->lock));
+  if (--nat->dumpers == 0) {
+    sr_nat_free_retired(nat);
+  }
+  pthread_mutex_unlock(&(nat->lock));
+}
+
+/* Add an address to the external pool. Call before sr_nat_init. */
+void sr_nat_add_pool_addr(struct sr_nat *nat, uint32_t ip) {
+  nat->pool = realloc(nat->pool, (nat->pool_size + 1) * sizeof(struct sr_nat_extaddr *));
+  assert(nat->pool != NULL);
+  nat->pool[nat->pool_size++] = sr_nat_new_addr(nat, ip);
+}
+
+/* Check whether ip is an external address owned by the NAT. Addresses are
+   only ever prepended, with a release store, and never freed, so the
+   list can be walked without the lock. */
+int sr_nat_is_external_addr(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_extaddr *addr;
+
+  for (addr = __atomic_load_n(&(nat->addrs), __ATOMIC_ACQUIRE); addr != NULL; addr = addr->next) {
+    if (addr->ip == ip) {
+      return 1;
     }
+  }
+  return 0;
+}
 
-    pthread_mutex_unlock(&(nat->lock));
-    return -1;
+/* Track TCP state for a segment leaving through a mapping towards ip_remote */
+void sr_nat_track_tcp_outbound(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_remote, sr_tcp_hdr_t *tcp_hdr) {
+
+  /* Critical section, make sure you lock, careful modifying code under critical section. */
+  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_connection *tcp_conn = sr_nat_lookup_connection (mapping->conns, ip_remote);
+
+  if (!tcp_conn) {
+    tcp_conn = sr_nat_insert_tcp_connection (mapping, ip_remote);
+  }
+
+  tcp_conn->last_updated = time(NULL);
+
+  switch (tcp_conn->tcp_state) {
+    case CLOSED:
+      if (ntohl(tcp_hdr->ack_num) == 0 && tcp_hdr->syn && !tcp_hdr->ack) {
+        tcp_conn->client_isn = ntohl(tcp_hdr->seq_num);
+        tcp_conn->tcp_state = SYN_SENT;
+      }
+      break;
+
+    case SYN_RCVD:
+      if (ntohl(tcp_hdr->seq_num) == tcp_conn->client_isn + 1 && ntohl(tcp_hdr->ack_num) == tcp_conn->server_isn + 1 && !tcp_hdr->syn) {
+        tcp_conn->client_isn = ntohl(tcp_hdr->seq_num);
+        tcp_conn->tcp_state = ESTABLISHED;
+      }
+      break;
+
+    case ESTABLISHED:
+      if (tcp_hdr->fin && tcp_hdr->ack) {
+        tcp_conn->client_isn = ntohl(tcp_hdr->seq_num);
+        tcp_conn->tcp_state = CLOSED;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  pthread_mutex_unlock(&(nat->lock));
+  /* End of critical section. */
 }
 
-/* Insert a new connection associated with the given IP in the NAT entry. */
-struct sr_nat_connection *sr_nat_insert_tcp_connection (struct sr_nat_mapping *mapping, uint32_t ip_connection) {
-    struct sr_nat_connection *new_connection = malloc(sizeof(struct sr_nat_connection));
-    assert(new_connection != NULL);
-    memset(new_connection, 0, sizeof(struct sr_nat_connection));
+/* Track TCP state for a segment from ip_remote arriving through a mapping */
+void sr_nat_track_tcp_inbound(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_remote, sr_tcp_hdr_t *tcp_hdr) {
 
-    new_connection->last_updated = time(NULL);
-    new_connection->ip = ip_connection;
-    new_connection->tcp_state = CLOSED;
+  /* Critical section, make sure you lock, careful modifying code under critical section. */
+  pthread_mutex_lock(&(nat->lock));
 
-    struct sr_nat_connection *curr_connection = mapping->conns;
+  struct sr_nat_connection *tcp_conn = sr_nat_lookup_connection (mapping->conns, ip_remote);
+  if (tcp_conn == NULL) {
+    tcp_conn = sr_nat_insert_tcp_connection (mapping, ip_remote);
+  }
+  tcp_conn->last_updated = time(NULL);
+
+  switch (tcp_conn->tcp_state) {
+    case SYN_SENT:
+      if (ntohl(tcp_hdr->ack_num) == tcp_conn->client_isn + 1 && tcp_hdr->syn && tcp_hdr->ack) {
+        tcp_conn->server_isn = ntohl(tcp_hdr->seq_num);
+        tcp_conn->tcp_state = SYN_RCVD;
+
+      /* Simultaneous open */
+      } else if (ntohl(tcp_hdr->ack_num) == 0 && tcp_hdr->syn && !tcp_hdr->ack) {
+        tcp_conn->server_isn = ntohl(tcp_hdr->seq_num);
+        tcp_conn->tcp_state = SYN_RCVD;
+      }
+      break;
 
-    mapping->conns = new_connection;
-    new_connection->next = curr_connection;
+    default:
+      break;
+  }
 
-    return new_connection;
+  pthread_mutex_unlock(&(nat->lock));
+  /* End of critical section. */
 }
 
 /* Check to see if given interface is a NAT internal interface "eth1" */
 int sr_nat_is_interface_internal(char *interface) {
   return strcmp(interface, NAT_INTERNAL_INTERFACE) == 0 ? 1 : 0;
 }
+
+/* Print per-internal-host mapping counters and reserved blocks, one JSON
+   line per host. The records are copied under the lock and printed
+   without it, so a slow fp never holds up the NAT. */
+void sr_nat_dump_hosts(struct sr_nat *nat, FILE *fp) {
+  struct sr_nat_host *host, *hosts = NULL;
+  unsigned int n = 0, i;
+  char ip_int[INET_ADDRSTRLEN], ip_ext[INET_ADDRSTRLEN];
+
+  pthread_mutex_lock(&(nat->lock));
+  for (host = nat->hosts; host != NULL; host = host->next) {
+    n++;
+  }
+  if (n && (hosts = malloc(n * sizeof(struct sr_nat_host))) != NULL) {
+    for (i = 0, host = nat->hosts; host != NULL; host = host->next, i++) {
+      hosts[i] = *host;
+      hosts[i].next = NULL;
+    }
+  }
+  pthread_mutex_unlock(&(nat->lock));
+
+  for (i = 0; hosts && i < n; i++) {
+    host = &(hosts[i]);
+    /* External addresses are never freed while the NAT runs */
+    inet_ntop(AF_INET, &(host->ip_int), ip_int, sizeof(ip_int));
+    inet_ntop(AF_INET, &(host->addr->ip), ip_ext, sizeof(ip_ext));
+    fprintf(fp, "{\"host\":\"%s\",\"ext\":\"%s\",\"tcp\":%u,\"icmp\":%u,\"created\":%lu,"
+      "\"quota_denied\":%lu,\"alloc_failed\":%lu,\"tcp_blocks\":%u,\"icmp_blocks\":%u}\n",
+      ip_int, ip_ext, host->mappings[nat_mapping_tcp], host->mappings[nat_mapping_icmp],
+      host->created[nat_mapping_tcp] + host->created[nat_mapping_icmp],
+      host->quota_denied, host->alloc_failed,
+      host->n_blocks[nat_mapping_tcp], host->n_blocks[nat_mapping_icmp]);
+  }
+  free(hosts);
+}
+
+/* Recover the internal host owning an external port in deterministic mode */
+int sr_nat_deterministic_host(struct sr_nat *nat, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type, uint32_t *ip_int) {
+  unsigned int min = sr_nat_min_aux(type);
+  unsigned int index, pos = 0;
+
+  if (!nat->det_prefix || aux_ext < min) {
+    return -1;
+  }
+  index = (aux_ext - min) / nat->det_range;
+  if (nat->pool_size) {
+    while (pos < nat->pool_size && nat->pool[pos]->ip != ip_ext) {
+      pos++;
+    }
+    if (pos == nat->pool_size) {
+      return -1;
+    }
+    index = index * nat->pool_size + pos;
+  }
+  if (index >= (1U << (32 - nat->det_prefix))) {
+    return -1;
+  }
+  *ip_int = htonl(ntohl(nat->det_subnet) + index);
+  return 0;
+}
+
+/* Print the deterministic port range formula for compliance records */
+void sr_nat_dump_deterministic(struct sr_nat *nat, FILE *fp) {
+  struct in_addr addr;
+
+  if (!nat->det_prefix) {
+    return;
+  }
+  unsigned int n_addrs = nat->pool_size ? nat->pool_size : 1;
+  unsigned int pos;
+
+  addr.s_addr = nat->det_subnet;
+  fprintf(fp, "Deterministic NAT: %s/%u, %u ports per host\n",
+    inet_ntoa(addr), nat->det_prefix, nat->det_range);
+  for (pos = 0; pos < nat->pool_size; pos++) {
+    addr.s_addr = nat->pool[pos]->ip;
+    fprintf(fp, "  pool address %u: %s\n", pos, inet_ntoa(addr));
+  }
+  addr.s_addr = nat->det_subnet;
+  fprintf(fp, "  TCP:  host = %s + ((port - %d) / %u) * %u + pool address\n",
+    inet_ntoa(addr), MIN_TCP_PORT, nat->det_range, n_addrs);
+  fprintf(fp, "  ICMP: host = %s + ((id - %d) / %u) * %u + pool address\n",
+    inet_ntoa(addr), MIN_ICMP_IDENTIFIER, nat->det_range, n_addrs);
+}
@@ -12,9 +12,27 @@
 #define MIN_ICMP_IDENTIFIER 1
 #define TOTAL_ICMP_IDENTIFIERS MAX_16B_NUM - MIN_ICMP_IDENTIFIER
 
+/* Per-host port blocks. A block is an aligned run of port_block_size
+   external ports (or ICMP identifiers) reserved for one internal host. */
+#define SR_NAT_MIN_BLOCK_SIZE 16
+#define SR_NAT_MAX_BLOCKS ((MAX_16B_NUM + 1) / SR_NAT_MIN_BLOCK_SIZE)
+#define SR_NAT_MAX_HOST_BLOCKS 16
+
+/* How often sr_nat_tick expires mappings */
+#define SR_NAT_TICK_MS 1000
+
+/* Timeouts in seconds, unless -I, -E or -R say otherwise */
+#define SR_NAT_DEFAULT_ICMP_QUERY_TIMEOUT 60
+#define SR_NAT_DEFAULT_TCP_ESTB_TIMEOUT 7440
+#define SR_NAT_DEFAULT_TCP_TRNS_TIMEOUT 300
+
+#define SR_NAT_MAPPING_TYPES 2
+
 #include <inttypes.h>
+#include <stdio.h>
 #include <time.h>
 #include <pthread.h>
+#include "sr_protocol.h"
 
 typedef enum {
   nat_mapping_icmp,
@@ -38,12 +56,13 @@ typedef enum {
 
 struct sr_nat_connection {
     /* add TCP connection state data members here */
-    uint16_t ip;
+    uint32_t ip;
     time_t last_updated;
     uint32_t client_isn;
     uint32_t server_isn; 
     sr_tcp_state tcp_state;
     struct sr_nat_connection *next;
+    struct sr_nat_connection *retired_next; /* on nat->retired_conns */
 };
 
 struct sr_nat_mapping {
@@ -54,58 +73,154 @@ struct sr_nat_mapping {
   uint16_t aux_ext; /* external port or icmp id */
   time_t last_updated; /* use to timeout mappings */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  struct sr_nat_host *host; /* accounting record of ip_int, NULL if static */
+  int is_static; /* added by hand, never expires */
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *retired_next; /* on nat->retired */
+};
+
+/* One external address of the NAT pool with its own port allocator. */
+struct sr_nat_extaddr {
+  uint32_t ip;                  /* network byte order */
+  uint8_t aux_used[SR_NAT_MAPPING_TYPES][MAX_16B_NUM + 1];
+  uint8_t block_used[SR_NAT_MAPPING_TYPES][SR_NAT_MAX_BLOCKS];
+  unsigned int next_aux[SR_NAT_MAPPING_TYPES]; /* first-fit scan cursor */
+  unsigned long mappings;       /* live mappings on this address */
+  struct sr_nat_extaddr *next;
+};
+
+/* Accounting for one internal host, indexed by sr_nat_mapping_type. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  struct sr_nat_extaddr *addr;  /* paired external address */
+  unsigned int mappings[SR_NAT_MAPPING_TYPES];    /* live mappings */
+  unsigned long created[SR_NAT_MAPPING_TYPES];    /* mappings ever created */
+  unsigned long quota_denied;                     /* inserts refused by quota */
+  unsigned long alloc_failed;                     /* no port/identifier left */
+  unsigned int n_blocks[SR_NAT_MAPPING_TYPES];
+  uint16_t blocks[SR_NAT_MAPPING_TYPES][SR_NAT_MAX_HOST_BLOCKS]; /* block indices */
+  struct sr_nat_host *next;
 };
 
 struct sr_nat {
   /* add any fields here */
   struct sr_nat_mapping *mappings;
+  struct sr_nat_host *hosts;
 
   /* Timeout */
   unsigned int icmp_query_timeout;
   unsigned int tcp_estb_timeout;
   unsigned int tcp_trns_timeout;
 
-  /* Mapping of available ICMP identifiers */
-  uint16_t free_icmp_identifiers[TOTAL_ICMP_IDENTIFIERS];
-  uint16_t free_tcp_ports[TOTAL_TCP_PORTS];
-
+  /* Fairness: 0 disables the quota / block allocation respectively */
+  unsigned int host_quota;      /* max live mappings per internal host */
+  unsigned int port_block_size; /* ports reserved per block, power of two */
+
+  /* Deterministic NAT (RFC 7422): host n of det_subnet/det_prefix always
+     owns external address pool[n % pool_size] and port range
+     [MIN_TCP_PORT + (n / pool_size) * det_range, +det_range).
+     det_prefix of 0 disables it. */
+  uint32_t det_subnet;          /* network byte order */
+  unsigned int det_prefix;
+  unsigned int det_range;       /* derived in sr_nat_init */
+
+  /* External addresses. pool holds the configured addresses (-P) that
+     hosts are hashed onto; addrs lists every address with an allocator,
+     including outgoing interface addresses used when no pool is set.
+     Addresses are only prepended, with a release store, and never
+     freed, so readers may walk addrs without the lock. */
+  struct sr_nat_extaddr *addrs;
+  struct sr_nat_extaddr **pool;
+  unsigned int pool_size;
+
+
+  /* Dumps walk the mapping list without the lock (sr_nat_dump_begin).
+     While any is running, removed mappings and connections are kept on
+     the retired lists, with their next pointers intact, and freed when
+     the last dump ends. */
+  unsigned int dumpers;
+  struct sr_nat_mapping *retired;
+  struct sr_nat_connection *retired_conns;
 
   /* threading */
   pthread_mutex_t lock;
   pthread_mutexattr_t attr;
-  pthread_attr_t thread_attr;
-  pthread_t thread;
 };
 
 
 int   sr_nat_init(struct sr_nat *nat);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
-void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
+void  sr_nat_tick(struct sr_nat *nat);  /* Periodic Timout */
 
-/* Get the mapping associated with given external port.
+/* Get the mapping associated with given external address and port.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
 /* Get the mapping associated with given internal (ip, port) pair.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+/* Insert a new mapping into the nat's mapping table, allocating its
+   external port or identifier. The external address comes from the pool
+   when one is configured, otherwise ip_ext is used. Returns NULL if the
+   internal host is over its quota or no port is left. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, sr_nat_mapping_type type );
+
+/* Add a mapping that never expires, e.g. to forward an external port to
+   an internal server. ip_ext must be a NAT address: a pool address when
+   a pool is configured, otherwise one already in use or, with ext_iface
+   set, the address of an external interface. aux_ext must be free. Not
+   available in deterministic mode. Returns 0, or -1 if the mapping
+   cannot be added. */
+int sr_nat_add_static(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, uint16_t aux_ext, int ext_iface);
+
+/* Remove the mapping of an external endpoint, static or not. Run it where
+   sr_nat_tick runs, as packets in flight may hold the mapping. Returns 0,
+   or -1 if there is no such mapping. */
+int sr_nat_del_mapping(struct sr_nat *nat, sr_nat_mapping_type type,
+  uint32_t ip_ext, uint16_t aux_ext);
+
+/* Walk the mappings from any thread without holding the lock: start at
+   the mapping sr_nat_dump_begin returns and follow next, reading fields
+   but no host records, then call sr_nat_dump_end. Connection lists may
+   be walked the same way. Mappings added meanwhile may not be seen. */
+struct sr_nat_mapping *sr_nat_dump_begin(struct sr_nat *nat);
+void sr_nat_dump_end(struct sr_nat *nat);
 
 int sr_nat_is_interface_internal(char *interface); 
 
-int sr_nat_generate_icmp_identifier(struct sr_nat *nat);
+/* Add an address to the external pool. Call before sr_nat_init. */
+void sr_nat_add_pool_addr(struct sr_nat *nat, uint32_t ip);
+
+/* Check whether ip is an external address owned by the NAT */
+int sr_nat_is_external_addr(struct sr_nat *nat, uint32_t ip);
 
 struct sr_nat_connection *sr_nat_lookup_connection (struct sr_nat_connection *curr_connection, uint32_t ip_connection);
 
 struct sr_nat_connection *sr_nat_insert_tcp_connection (struct sr_nat_mapping *mapping, uint32_t ip_connection);
 
-int sr_nat_generate_tcp_port(struct sr_nat *nat);
+/* Update the connection state machine of a mapping for a TCP segment
+   going out to / coming in from ip_remote. */
+void sr_nat_track_tcp_outbound(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_remote, sr_tcp_hdr_t *tcp_hdr);
+void sr_nat_track_tcp_inbound(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  uint32_t ip_remote, sr_tcp_hdr_t *tcp_hdr);
+
+/* Print per-internal-host mapping counters and reserved blocks as JSON
+   lines. Safe from any thread. */
+void sr_nat_dump_hosts(struct sr_nat *nat, FILE *fp);
+
+/* Deterministic mode: recover the internal host owning an external port
+   without any mapping state. Reads only the configuration, so any thread
+   may call it. Returns 0 and sets ip_int on success. */
+int sr_nat_deterministic_host(struct sr_nat *nat, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type, uint32_t *ip_int);
+
+/* Deterministic mode: print the port range formula for compliance logs. */
+void sr_nat_dump_deterministic(struct sr_nat *nat, FILE *fp);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "sr_tblock.h"
+#include "sr_perf.h"
+
+volatile int sr_perf_enabled = 0;
+
+static const char *sr_perf_stage_names[SR_PERF_NSTAGES] = {
+    "rx", "packet", "ip", "nat", "lpm", "arp", "tx"
+};
+
+/* One per recording thread */
+struct sr_perf_thread {
+    struct sr_perf_hist hist[SR_PERF_NSTAGES];
+};
+
+/* What sr_perf_add sums: one stage over every thread */
+struct sr_perf_sum {
+    unsigned int stage;
+    struct sr_perf_hist total;
+};
+
+static __thread struct sr_perf_thread *sr_perf_self;
+static struct sr_tblocks sr_perf_threads = SR_TBLOCKS_INIT(struct sr_perf_thread);
+
+uint64_t sr_perf_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int sr_perf_bucket(uint64_t ns) {
+    unsigned int e;
+
+    if (ns < (1 << SR_PERF_SUB_BITS)) {
+        return ns;
+    }
+    e = 63 - __builtin_clzll(ns);
+    return ((e - SR_PERF_SUB_BITS + 1) << SR_PERF_SUB_BITS) +
+           ((ns >> (e - SR_PERF_SUB_BITS)) & ((1 << SR_PERF_SUB_BITS) - 1));
+}
+
+/* Largest value that falls into bucket i */
+static uint64_t sr_perf_bucket_top(unsigned int i) {
+    unsigned int e, sub;
+
+    if (i < (1 << SR_PERF_SUB_BITS)) {
+        return i;
+    }
+    e = (i >> SR_PERF_SUB_BITS) + SR_PERF_SUB_BITS - 1;
+    sub = i & ((1 << SR_PERF_SUB_BITS) - 1);
+    return ((((uint64_t) 1 << SR_PERF_SUB_BITS) + sub + 1) << (e - SR_PERF_SUB_BITS)) - 1;
+}
+
+void sr_perf_record(int stage, uint64_t ns) {
+    struct sr_perf_hist *h;
+
+    if (sr_perf_self == NULL) {
+        sr_perf_self = sr_tblock_new(&sr_perf_threads);
+    }
+    h = &(sr_perf_self->hist[stage]);
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+    h->buckets[sr_perf_bucket(ns)]++;
+}
+
+static void sr_perf_clear(void *block, void *arg) {
+    struct sr_perf_thread *t = block;
+    memset(t->hist, 0, sizeof(t->hist));
+}
+
+void sr_perf_reset(void) {
+    sr_tblocks_foreach(&sr_perf_threads, sr_perf_clear, NULL);
+}
+
+static uint64_t sr_perf_percentile(const struct sr_perf_hist *h, double pct) {
+    uint64_t rank = (uint64_t) (h->count * pct / 100.0), seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < SR_PERF_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t top = sr_perf_bucket_top(i);
+            return top < h->max_ns ? top : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_perf_dump_json(..)
+ *
+ * One JSON object per line and stage, in the same shape as sr_bench's
+ * output. Percentiles are bucket upper bounds. Stages nothing was
+ * recorded for are left out.
+ *---------------------------------------------------------------------*/
+static void sr_perf_add(void *block, void *arg) {
+    struct sr_perf_thread *t = block;
+    struct sr_perf_sum *sum = arg;
+    const struct sr_perf_hist *h = &(t->hist[sum->stage]);
+    unsigned int i;
+
+    sum->total.count += h->count;
+    sum->total.sum_ns += h->sum_ns;
+    if (h->max_ns > sum->total.max_ns) {
+        sum->total.max_ns = h->max_ns;
+    }
+    for (i = 0; i < SR_PERF_BUCKETS; i++) {
+        sum->total.buckets[i] += h->buckets[i];
+    }
+}
+
+void sr_perf_dump_json(FILE *fp) {
+    struct sr_perf_sum sum;
+    struct sr_perf_hist *total = &(sum.total);
+    unsigned int stage;
+
+    for (stage = 0; stage < SR_PERF_NSTAGES; stage++) {
+        memset(&sum, 0, sizeof(sum));
+        sum.stage = stage;
+        sr_tblocks_foreach(&sr_perf_threads, sr_perf_add, &sum);
+        if (total->count == 0) {
+            continue;
+        }
+        fprintf(fp, "{\"stage\":\"%s\",\"count\":%" PRIu64 ",\"mean_ns\":%.1f,"
+                "\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ","
+                "\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+                sr_perf_stage_names[stage], total->count, (double) total->sum_ns / total->count,
+                sr_perf_percentile(total, 50.0), sr_perf_percentile(total, 90.0),
+                sr_perf_percentile(total, 99.0), sr_perf_percentile(total, 99.9),
+                total->max_ns);
+    }
+    fflush(fp);
+}
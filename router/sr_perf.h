@@ -0,0 +1,61 @@
+/* Per-stage latency histograms for the packet path.
+
+   Each stage (transport receive, sr_handlepacket, sr_iphandler, NAT,
+   LPM, ARP lookup, transmit) is timed with clock_gettime(CLOCK_MONOTONIC)
+   and the duration goes into a log-linear histogram: 16 linear sub-buckets
+   per power of two, so any value is within 1/16 of its bucket. That is
+   enough to read p99 and p99.9 off directly. Every thread that records
+   gets its own set of histograms (sr_tblock.h), and sr_perf_dump_json
+   adds the threads up.
+
+   Timing is off unless sr_perf_enabled is set (-H, or "perf on" on the
+   control socket). When it is off, a stage costs one load and one branch.
+   sr_perf_reset zeroes the histograms; a sample recorded while it runs
+   may survive it.
+
+   --
+
+   SR_PERF_BEGIN(t0);
+   ... the stage ...
+   SR_PERF_END(SR_PERF_LPM, t0);
+ */
+
+#ifndef SR_PERF_H
+#define SR_PERF_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+enum sr_perf_stage {
+    SR_PERF_RX,         /* one transport dispatch, including handling */
+    SR_PERF_PACKET,     /* sr_handlepacket */
+    SR_PERF_IP,         /* sr_iphandler */
+    SR_PERF_NAT,        /* NAT mapping lookup */
+    SR_PERF_LPM,        /* routing table lookup */
+    SR_PERF_ARP,        /* ARP cache lookup */
+    SR_PERF_TX,         /* handing one frame or batch to the transport */
+    SR_PERF_NSTAGES
+};
+
+#define SR_PERF_SUB_BITS 4
+#define SR_PERF_BUCKETS  ((64 - SR_PERF_SUB_BITS + 1) << SR_PERF_SUB_BITS)
+
+struct sr_perf_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[SR_PERF_BUCKETS];
+};
+
+extern volatile int sr_perf_enabled;
+
+#define SR_PERF_BEGIN(t) uint64_t t = sr_perf_enabled ? sr_perf_now() : 0
+#define SR_PERF_END(stage, t) \
+    do { if (t) sr_perf_record(stage, sr_perf_now() - (t)); } while (0)
+
+uint64_t sr_perf_now(void);
+void sr_perf_record(int stage, uint64_t ns);
+void sr_perf_reset(void);
+void sr_perf_dump_json(FILE* fp);
+
+#endif
@@ -277,5 +277,6 @@ typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 #define IP_PACKET 2
 #define ICMP_PACKET 3
 #define ICMP_TYPE3_PACKET 4
+#define TCP_PACKET 5
 
 #endif /* -- SR_PROTOCOL_H -- */
@@ -0,0 +1,462 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_replay.c
+ *
+ * Description:
+ *
+ * Offline driver for sr. Frames from a pcap capture (the format written by
+ * sr_dumper.c) are fed to sr_handlepacket back to back, without a VNS
+ * server. Everything the router sends is counted and optionally written to
+ * another capture. At the end the replay reports the packet rate, the
+ * distribution of per-packet handling time and the number of heap
+ * allocations made while handling packets.
+ *
+ * The interface list comes from a small config file:
+ *
+ *   # name  hardware address   ip
+ *   eth1    00:00:00:00:01:01  10.0.1.1
+ *   eth2    00:00:00:00:02:01  172.64.3.1
+ *   # neighbours preloaded in the ARP cache
+ *   arp     10.0.1.100         00:00:00:00:01:64
+ *
+ * Frames are given to the interface whose hardware address they are sent
+ * to; broadcasts go to the interface owning the ARP target address, or to
+ * the -i interface. Frames sent by one of our interfaces, as found in
+ * captures taken with sr -l, are skipped.
+ *
+ * The router's timers (ARP retransmits and expiry, NAT expiry) belong to
+ * its event loop and do not run during a replay.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_dumper.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_tool.h"
+
+extern char* optarg;
+
+#define DEFAULT_RTABLE "rtable"
+#define DEFAULT_LOOPS 1
+#define REPLAY_MAX_FRAME 65535
+#define REPLAY_MAX_ARP 256
+
+/* A frame of the capture with the interface it arrives on */
+struct sr_replay_frame {
+    uint8_t* buf;
+    unsigned int len;
+    char iface[sr_IFACE_NAMELEN];
+};
+
+/* What the router handed to sr_send_packet */
+static unsigned long tx_packets = 0;
+static unsigned long tx_bytes = 0;
+static FILE* tx_dump = NULL;
+
+/* Neighbours from the config, inserted once the ARP cache exists */
+static uint32_t arp_ips[REPLAY_MAX_ARP];
+static unsigned char arp_macs[REPLAY_MAX_ARP][ETHER_ADDR_LEN];
+static int n_arp = 0;
+
+/* -- allocation counters, filled in by the --wrap'd allocator -- */
+static volatile int alloc_counting = 0;
+static unsigned long alloc_calls = 0;
+static unsigned long alloc_bytes = 0;
+static unsigned long free_calls = 0;
+
+#ifdef _LINUX_
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size)
+{
+    if (alloc_counting) {
+        __sync_fetch_and_add(&alloc_calls, 1);
+        __sync_fetch_and_add(&alloc_bytes, size);
+    }
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    if (alloc_counting) {
+        __sync_fetch_and_add(&alloc_calls, 1);
+        __sync_fetch_and_add(&alloc_bytes, nmemb * size);
+    }
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    if (alloc_counting) {
+        __sync_fetch_and_add(&alloc_calls, 1);
+        __sync_fetch_and_add(&alloc_bytes, size);
+    }
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr)
+{
+    if (alloc_counting && ptr) {
+        __sync_fetch_and_add(&free_calls, 1);
+    }
+    __real_free(ptr);
+}
+#endif /* _LINUX_ */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ * Scope: Global
+ *
+ * Stand-in for the VNS version: count the frame and log it to the output
+ * capture if there is one.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const char* iface /* borrowed */)
+{
+    struct pcap_pkthdr h;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(buf);
+    assert(iface);
+
+    if ( len < sizeof(struct sr_ethernet_hdr) ){
+        fprintf(stderr , "** Error: packet is wayy to short \n");
+        return -1;
+    }
+
+    __sync_fetch_and_add(&tx_packets, 1);
+    __sync_fetch_and_add(&tx_bytes, len);
+
+    if (tx_dump) {
+        gettimeofday(&h.ts, 0);
+        h.caplen = len;
+        h.len = len;
+        sr_dump(tx_dump, &h, buf);
+    }
+
+    return 0;
+} /* -- sr_send_packet -- */
+
+int sr_send_packets(struct sr_instance* sr, uint8_t** bufs, unsigned int* lens,
+                    unsigned int n, const char* iface)
+{
+    unsigned int i;
+    int sent = 0;
+
+    for (i = 0; i < n; i++)
+        if (sr_send_packet(sr, bufs[i], lens[i], iface) == 0)
+            sent++;
+    return sent;
+} /* -- sr_send_packets -- */
+
+static void usage(char* argv0)
+{
+    printf("Simple Router Replay\n");
+    printf("Format: %s -c ifconfig -f capture [-r rtable] [-i iface] [-o out.pcap]\n", argv0);
+    printf("           [-l loops] [-v] [-n] [-Q host_quota] [-B block_size] [-P ip[,ip...]]\n");
+} /* -- usage -- */
+
+/* Config lines: interfaces go straight into sr, neighbours wait for the
+   ARP cache */
+static int sr_replay_add_iface(void* arg, const char* name, const unsigned char* mac, uint32_t ip)
+{
+    struct sr_instance* sr = arg;
+
+    sr_add_interface(sr, name);
+    sr_set_ether_addr(sr, mac);
+    sr_set_ether_ip(sr, ip);
+    return 0;
+}
+
+static int sr_replay_add_arp(void* arg, uint32_t ip, const unsigned char* mac)
+{
+    if (n_arp == REPLAY_MAX_ARP) {
+        return -1;
+    }
+    arp_ips[n_arp] = ip;
+    memcpy(arp_macs[n_arp], mac, ETHER_ADDR_LEN);
+    n_arp++;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_replay_iface(..)
+ * Scope: Local
+ *
+ * Pick the interface a frame arrives on, or NULL if it should be skipped.
+ *
+ *---------------------------------------------------------------------------*/
+
+static struct sr_if* sr_replay_iface(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+        struct sr_if* default_iface)
+{
+    sr_ethernet_hdr_t* eth_hdr = (sr_ethernet_hdr_t*) buf;
+    struct sr_if* iface;
+
+    if (len < sizeof(sr_ethernet_hdr_t)) {
+        return NULL;
+    }
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        /* Sent by us */
+        if (memcmp(eth_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) == 0) {
+            return NULL;
+        }
+    }
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (memcmp(eth_hdr->ether_dhost, iface->addr, ETHER_ADDR_LEN) == 0) {
+            return iface;
+        }
+    }
+
+    if (ntohs(eth_hdr->ether_type) == ethertype_arp &&
+            len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        sr_arp_hdr_t* arp_hdr = (sr_arp_hdr_t*) (buf + sizeof(sr_ethernet_hdr_t));
+        for (iface = sr->if_list; iface; iface = iface->next) {
+            if (iface->ip == arp_hdr->ar_tip) {
+                return iface;
+            }
+        }
+    }
+
+    return default_iface;
+} /* -- sr_replay_iface -- */
+
+int main(int argc, char **argv)
+{
+    int c, i;
+    char *config = 0;
+    char *capture = 0;
+    char *rtable = DEFAULT_RTABLE;
+    char *default_name = 0;
+    char *out = 0;
+    unsigned int loops = DEFAULT_LOOPS;
+    int verbose = 0;
+    struct sr_instance sr;
+
+    /* NAT */
+    int nat_mode = 0;
+    unsigned int nat_host_quota = 0;
+    unsigned int nat_port_block_size = 0;
+    char *nat_pool = 0;
+
+    while ((c = getopt(argc, argv, "hc:f:r:i:o:l:vnQ:B:P:")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'c':
+                config = optarg;
+                break;
+            case 'f':
+                capture = optarg;
+                break;
+            case 'r':
+                rtable = optarg;
+                break;
+            case 'i':
+                default_name = optarg;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'l':
+                loops = atoi((char *) optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'n':
+                nat_mode = 1;
+                break;
+            case 'Q':
+                nat_host_quota = atoi((char *) optarg);
+                break;
+            case 'B':
+                nat_port_block_size = atoi((char *) optarg);
+                break;
+            case 'P':
+                nat_pool = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        } /* switch */
+    } /* -- while -- */
+
+    if (config == 0 || capture == 0 || loops == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* The router prints for every packet; keep that out of the timings */
+    FILE* report = fdopen(dup(fileno(stdout)), "w");
+    if (report == NULL) {
+        perror("fdopen");
+        exit(1);
+    }
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        perror("freopen");
+        exit(1);
+    }
+
+    memset(&sr, 0, sizeof(sr));
+    sr.sockfd = -1;
+
+    if (sr_tool_load_config(config, sr_replay_add_iface, sr_replay_add_arp, &sr) != 0) {
+        exit(1);
+    }
+    if (sr_load_rt(&sr, rtable) != 0) {
+        fprintf(stderr, "Error setting up routing table from file %s\n", rtable);
+        exit(1);
+    }
+
+    struct sr_if* default_iface = NULL;
+    if (default_name && (default_iface = sr_get_interface(&sr, default_name)) == NULL) {
+        fprintf(stderr, "Unknown interface %s\n", default_name);
+        exit(1);
+    }
+
+    if (nat_mode) {
+        sr_tool_nat_defaults(&(sr.nat));
+        sr.nat.host_quota = nat_host_quota;
+        sr.nat.port_block_size = nat_port_block_size;
+        if (nat_pool) {
+            char *ip = strtok(nat_pool, ",");
+            struct in_addr addr;
+            for (; ip; ip = strtok(NULL, ",")) {
+                if (inet_aton(ip, &addr) == 0) {
+                    fprintf(stderr, "Invalid NAT address pool entry %s\n", ip);
+                    exit(1);
+                }
+                sr_nat_add_pool_addr(&sr.nat, addr.s_addr);
+            }
+        }
+    }
+    sr.nat_mode = nat_mode;
+
+    if (out) {
+        tx_dump = sr_dump_open(out, 0, REPLAY_MAX_FRAME);
+        if (!tx_dump) {
+            exit(1);
+        }
+    }
+
+    /* -- load the whole capture so file I/O stays out of the timings -- */
+    FILE* fp = sr_dump_open_read(capture);
+    if (fp == NULL) {
+        exit(1);
+    }
+    unsigned char* buf = malloc(REPLAY_MAX_FRAME);
+    unsigned int n_frames = 0, cap_frames = 1024, skipped = 0;
+    struct sr_replay_frame* frames = malloc(cap_frames * sizeof(*frames));
+    struct pcap_pkthdr h;
+    int ret;
+    while ((ret = sr_dump_read(fp, &h, buf, REPLAY_MAX_FRAME)) == 1) {
+        struct sr_if* iface = sr_replay_iface(&sr, buf, h.caplen, default_iface);
+        if (iface == NULL) {
+            skipped++;
+            continue;
+        }
+        if (n_frames == cap_frames) {
+            cap_frames *= 2;
+            frames = realloc(frames, cap_frames * sizeof(*frames));
+        }
+        frames[n_frames].buf = malloc(h.caplen);
+        memcpy(frames[n_frames].buf, buf, h.caplen);
+        frames[n_frames].len = h.caplen;
+        strncpy(frames[n_frames].iface, iface->name, sr_IFACE_NAMELEN);
+        n_frames++;
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Truncated or oversized record in %s\n", capture);
+        exit(1);
+    }
+    if (n_frames == 0) {
+        fprintf(stderr, "No frames to replay in %s (%u skipped)\n", capture, skipped);
+        exit(1);
+    }
+
+    sr_init(&sr);
+    for (i = 0; i < n_arp; i++) {
+        struct sr_arpreq* req = sr_arpcache_insert(&(sr.cache), arp_macs[i], arp_ips[i]);
+        if (req) {
+            sr_arpreq_destroy(&(sr.cache), req);
+        }
+    }
+
+    /* -- replay -- */
+    unsigned long total = (unsigned long) n_frames * loops;
+    uint32_t* lat = malloc(total * sizeof(uint32_t));
+    unsigned long k = 0;
+    unsigned int loop;
+
+    alloc_counting = 1;
+    uint64_t start = sr_tool_now_ns();
+    for (loop = 0; loop < loops; loop++) {
+        unsigned int f;
+        for (f = 0; f < n_frames; f++) {
+            uint64_t t0 = sr_tool_now_ns();
+            /* The router rewrites frames in place */
+            memcpy(buf, frames[f].buf, frames[f].len);
+            sr_handlepacket(&sr, buf, frames[f].len, frames[f].iface);
+            uint64_t t1 = sr_tool_now_ns();
+            lat[k++] = (t1 - t0 > 0xffffffffULL) ? 0xffffffffU : (uint32_t) (t1 - t0);
+        }
+    }
+    uint64_t elapsed = sr_tool_now_ns() - start;
+    alloc_counting = 0;
+
+    if (tx_dump) {
+        sr_dump_close(tx_dump);
+    }
+
+    /* -- report -- */
+    qsort(lat, total, sizeof(uint32_t), sr_tool_cmp_u32);
+    double secs = elapsed / 1e9;
+    fprintf(report, "frames      %u replayed x %u loops, %u skipped\n", n_frames, loops, skipped);
+    fprintf(report, "elapsed     %.6f s\n", secs);
+    fprintf(report, "rate        %.0f pps\n", secs > 0 ? total / secs : 0.0);
+    fprintf(report, "latency ns  min %u p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+            lat[0], lat[total * 50 / 100], lat[total * 90 / 100], lat[total * 99 / 100],
+            lat[total * 999 / 1000], lat[total - 1]);
+    fprintf(report, "sent        %lu packets, %lu bytes\n", tx_packets, tx_bytes);
+#ifdef _LINUX_
+    fprintf(report, "allocs      %lu (%.2f per frame), %lu bytes, %lu frees\n",
+            alloc_calls, (double) alloc_calls / total, alloc_bytes, free_calls);
+#else
+    fprintf(report, "allocs      not counted on this platform\n");
+#endif /* _LINUX_ */
+    fclose(report);
+
+    return 0;
+} /* -- main -- */
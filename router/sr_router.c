@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 
 #include "sr_if.h"
@@ -24,6 +25,11 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_event.h"
+#include "sr_log.h"
+#include "sr_perf.h"
+#include "sr_drop.h"
+#include "sr_stats.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -33,27 +39,43 @@
  *
  *---------------------------------------------------------------------*/
 
+static int sr_arpcache_timer(struct sr_instance* sr, void* arg)
+{
+    sr_arpcache_tick(sr);
+    return 1;
+}
+
+static int sr_arpreq_timer(struct sr_instance* sr, void* arg)
+{
+    sr_arpcache_sweepreqs(sr);
+    return 1;
+}
+
+static int sr_nat_timer(struct sr_instance* sr, void* arg)
+{
+    sr_nat_tick(&(sr->nat));
+    return 1;
+}
+
 void sr_init(struct sr_instance* sr)
 {
     /* REQUIRES */
     assert(sr);
 
-    /* Initialize cache and cache cleanup thread */
+    /* Initialize cache; its timeouts run on the event loop */
     sr_arpcache_init(&(sr->cache));
-
+    sr_event_init(&(sr->loop));
+    sr_fib_init_reclaim(sr);
+    sr_event_add_timer(&(sr->loop), SR_ARPCACHE_TICK_MS, sr_arpcache_timer, NULL);
+    sr->cache.req_timer = sr_event_add_timer(&(sr->loop), 0, sr_arpreq_timer, NULL);
 
     /* NAT */
     if (sr->nat_mode) {
-         printf ("Nat is enabled \n");
+         sr_log(SR_LOG_NAT, SR_LOG_INFO, "Nat is enabled \n");
    	 sr_nat_init(&(sr->nat));
+         sr_nat_dump_deterministic(&(sr->nat), stdout);
+         sr_event_add_timer(&(sr->loop), SR_NAT_TICK_MS, sr_nat_timer, NULL);
     }
-    pthread_attr_init(&(sr->attr));
-    pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
-    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-    pthread_t thread;
-
-    pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
     
     /* Add initialization code here! */
 
@@ -87,22 +109,30 @@ void sr_handlepacket(struct sr_instance* sr,
 
     /* Get ethernet header */
     sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t *) packet;
+    SR_PERF_BEGIN(t0);
 
     /* Check for mininum length requirement */
     if (check_min_len (len, ETH_HDR)) {
-        printf("Ethernet header does not satisfy mininum length requirement \n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "Ethernet header does not satisfy mininum length requirement \n");
+        SR_DROP(SR_DROP_ETH_SHORT);
         return;
     }
 
     uint16_t ethtype = ethertype((uint8_t *)eth_hdr);
+    sr_log_rec(SR_LOG_IO, "rx len %ld type 0x%lx", len, ethtype);
 
     if (ethtype == ethertype_ip){  
-        printf("Received the IP Packet!\n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "Received the IP Packet!\n");
+        SR_PERF_BEGIN(t1);
         sr_iphandler(sr, packet, len, interface);
+        SR_PERF_END(SR_PERF_IP, t1);
     } else if (ethtype == ethertype_arp){
-        printf("Received the ARP Packet!\n");
+        sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "Received the ARP Packet!\n");
         sr_arphandler(sr, packet, len, interface);
+    } else {
+        SR_DROP(SR_DROP_ETHERTYPE);
     }
+    SR_PERF_END(SR_PERF_PACKET, t0);
 
 } /* end sr_ForwardPacket */
 
@@ -122,15 +152,39 @@ void sr_arphandler (struct sr_instance* sr,
 
     /* Check mininum length */
     if (check_min_len (len, ARP_PACKET)) {
-        printf("ARP packet does not satisfy mininum length requirement \n");
+        sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "ARP packet does not satisfy mininum length requirement \n");
+        SR_DROP(SR_DROP_ARP_SHORT);
         return;
     }
 
     /* If target interface is not NULL, the packet is for one of the interfaces in our router */
     struct sr_if *target_iface = get_router_interface (arp_hdr->ar_tip, sr);
+
+    /* Answer for NAT pool addresses on the external side with our own MAC */
+    struct sr_if pool_iface;
+    if (!target_iface && sr->nat_mode && !sr_nat_is_interface_internal(interface) &&
+            sr_nat_is_external_addr(&(sr->nat), arp_hdr->ar_tip)) {
+        pool_iface = *sr_get_interface(sr, interface);
+        pool_iface.ip = arp_hdr->ar_tip;
+        target_iface = &pool_iface;
+    }
+
+    /* Gratuitous ARP (sender and target address are the same): only
+       updates what we already know or are waiting for */
+    if (!target_iface && arp_hdr->ar_sip == arp_hdr->ar_tip) {
+        send_arpreq_packets (sr, sr_arpcache_learn(&(sr->cache), arp_hdr->ar_sha, arp_hdr->ar_sip, 0),
+                             arp_hdr->ar_sha);
+        return;
+    }
+
     if (target_iface) {
         if (ntohs(arp_hdr->ar_op) == arp_op_request) {
-            printf("Received ARP Request!\n");
+            sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "Received ARP Request!\n");
+            /* The sender is about to hear from us; learn its MAC now rather
+               than ARP for it on our first packet back */
+            send_arpreq_packets (sr, sr_arpcache_learn(&(sr->cache), arp_hdr->ar_sha, arp_hdr->ar_sip, 1),
+                                 arp_hdr->ar_sha);
+
             /* Create reply packet to send back to sender */
             int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
             uint8_t *arp_reply = malloc(packet_len);
@@ -142,18 +196,20 @@ void sr_arphandler (struct sr_instance* sr,
 
             /* Send out ARP reply */
             sr_send_packet(sr, arp_reply, packet_len, target_iface->name);
-            printf("Sent an ARP reply packet\n");
+            sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "Sent an ARP reply packet\n");
             free(arp_reply);
             return;
     
         } else if (ntohs(arp_hdr -> ar_op) == arp_op_reply) {
             /* Cache ARP packet and go through the request queue to send out outstanding packets */
-            printf("Received ARP reply!\n");
+            sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "Received ARP reply!\n");
             send_arp_req (arp_hdr, &(sr->cache), sr);
             return;
         }
+        SR_DROP(SR_DROP_ARP_OP);
     } else {
-        printf ("Dropping packet! ARP packet is not targeted at our router.");
+        sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "Dropping packet! ARP packet is not targeted at our router.\n");
+        SR_DROP(SR_DROP_ARP_NOT_FOR_US);
         return; 
     }
 }
@@ -183,20 +239,26 @@ void sr_iphandler (struct sr_instance* sr,
     struct sr_if *target_iface = get_router_interface (ip_hdr->ip_dst, sr);
     struct sr_rt *dst_lpm = sr_routing_lpm (sr, ip_hdr->ip_dst);
 
+    /* Destination is one of the NAT pool addresses */
+    int nat_ext = sr->nat_mode && sr_nat_is_external_addr(&(sr->nat), ip_hdr->ip_dst);
+
     /* Check for mininum length  */
     if (check_min_len (len, IP_PACKET)) {
-        printf("IP packet does not satisfy mininum length requirement \n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "IP packet does not satisfy mininum length requirement \n");
+        SR_DROP(SR_DROP_IP_SHORT);
         return;
     }
 
     /* Verify checksum */
     if (verify_ip_checksum (ip_hdr)) {
-        printf("IP Header checksum fails\n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "IP Header checksum fails\n");
+        SR_DROP(SR_DROP_IP_CHECKSUM);
         return;
     } 
 
     /* If there is no match in routing table and the packet is not for one of the interfaces, send ICMP net unreachable */
-    if (target_iface == NULL && dst_lpm == NULL) {
+    if (target_iface == NULL && dst_lpm == NULL && !nat_ext) {
+        SR_DROP(SR_DROP_NO_ROUTE);
         int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
         uint8_t *new_packet = malloc(packet_len);
 
@@ -220,6 +282,26 @@ void sr_iphandler (struct sr_instance* sr,
         if (sr->nat_mode) {
             if (sr_nat_is_interface_internal(interface)) {
 
+                /* Internal host talking to another one through its external endpoint */
+                if (ip_p == ip_protocol_tcp && (target_iface != NULL || nat_ext) &&
+                        nat_hairpin (sr, packet, len)) {
+                    return;
+                }
+
+                /* Pool address that is neither ours nor routable */
+                if (target_iface == NULL && dst_lpm == NULL) {
+                    sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "Packet for unrouted NAT pool address, dropping\n");
+                    SR_DROP(SR_DROP_NAT_UNROUTED);
+                    return;
+                }
+
+                /* The flow picks its next hop before translation changes the
+                   packet, so the side it goes to, the external address it
+                   gets and the interface it leaves by all agree */
+                if (target_iface == NULL && sr_fib_multipath(dst_lpm)) {
+                    dst_lpm = sr_fib_pick(dst_lpm, flow_hash(packet, len));
+                }
+
                 /* Packet is for the router or the internal interface */
                 if (target_iface != NULL || sr_nat_is_interface_internal(dst_lpm->interface)) {
                     /* Get ICMP header */
@@ -229,19 +311,21 @@ void sr_iphandler (struct sr_instance* sr,
                         if (is_icmp_echo_request (icmp_hdr)) {
                             send_echo_reply (sr, packet, len, interface);
                         } else {
-                            printf("Unknown ICMP type \n");
+                            sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "Unknown ICMP type \n");
+                            SR_DROP(SR_DROP_ICMP_TYPE);
                             return;
                         }
                     } else if (ip_p == ip_protocol_tcp) {
+                        SR_DROP(SR_DROP_IP_PROTO);
                         int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
 
-                        uint8_t *new_packet = malloc(len);
+                        uint8_t *new_packet = malloc(packet_len);
 
                         /* Create ethernet header */
                         create_ethernet_header (eth_hdr, new_packet, sr_get_interface(sr, interface)->addr, eth_hdr->ether_shost, htons(ethertype_ip));
 
-                        /* Create ip header */
-                        create_ip_header (ip_hdr, new_packet, target_iface->ip, ip_hdr->ip_src);
+                        /* Create ip header; a segment routed back inside has no target interface */
+                        create_ip_header (ip_hdr, new_packet, target_iface ? target_iface->ip : sr_get_interface(sr, interface)->ip, ip_hdr->ip_src);
 
                         /* Create icmp header */
                         create_icmp_type3_header (ip_hdr, new_packet, port_unreachable_type, port_unreachable_code);
@@ -251,6 +335,8 @@ void sr_iphandler (struct sr_instance* sr,
 
                         free(new_packet);
                         return; 
+                    } else {
+                        SR_DROP(SR_DROP_IP_PROTO);
                     }
 
                 /* Packet is for the external interface */
@@ -259,12 +345,15 @@ void sr_iphandler (struct sr_instance* sr,
                         /* Get ICMP header */
                         sr_icmp_hdr_t *icmp_hdr = get_icmp_hdr (packet);
 
-                        printf("Protocol is ICMP\n");
+                        sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "Protocol is ICMP\n");
                         struct sr_nat_mapping *nat_lookup = sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, icmp_hdr->icmp_aux_identifier, nat_mapping_icmp);
                         if (nat_lookup == NULL) {
-                            nat_lookup = sr_nat_insert_mapping(&(sr->nat), ip_hdr->ip_src, icmp_hdr->icmp_aux_identifier, nat_mapping_icmp);
-                            nat_lookup->ip_ext = sr_get_interface(sr, dst_lpm->interface)->ip;
-                            nat_lookup->aux_ext = sr_nat_generate_icmp_identifier(&(sr->nat));
+                            nat_lookup = sr_nat_insert_mapping(&(sr->nat), ip_hdr->ip_src, icmp_hdr->icmp_aux_identifier, sr_get_interface(sr, dst_lpm->interface)->ip, nat_mapping_icmp);
+                            if (nat_lookup == NULL) {
+                                sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "No ICMP identifier available for host, dropping packet\n");
+                                SR_DROP(SR_DROP_NAT_NO_PORT);
+                                return;
+                            }
                         }
 
                         nat_lookup->last_updated = time(NULL);
@@ -274,186 +363,115 @@ void sr_iphandler (struct sr_instance* sr,
                         icmp_hdr->icmp_sum = 0;
                         ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
                         icmp_hdr->icmp_sum = cksum(icmp_hdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+                        sr_stats_count_nat(SR_STATS_NAT_OUT);
 
                     } else if (ip_p == ip_protocol_tcp) {
                         sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *) (packet + sizeof (sr_ethernet_hdr_t) + sizeof(sr_tcp_hdr_t)); 
                         struct sr_nat_mapping *nat_lookup = sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, ntohs(tcp_hdr->src_port), nat_mapping_tcp);
                         if (nat_lookup == NULL) {
-                            nat_lookup = sr_nat_insert_mapping(&(sr->nat), ip_hdr->ip_src, ntohs(tcp_hdr->src_port), nat_mapping_tcp);
-                            nat_lookup->ip_ext = sr_get_interface(sr, dst_lpm->interface)->ip;
-                            nat_lookup->aux_ext = sr_nat_generate_tcp_port(&(sr->nat));
+                            nat_lookup = sr_nat_insert_mapping(&(sr->nat), ip_hdr->ip_src, ntohs(tcp_hdr->src_port), sr_get_interface(sr, dst_lpm->interface)->ip, nat_mapping_tcp);
+                            if (nat_lookup == NULL) {
+                                sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "No TCP port available for host, dropping packet\n");
+                                SR_DROP(SR_DROP_NAT_NO_PORT);
+                                return;
+                            }
                         }
                         nat_lookup->last_updated = time(NULL);
 
-                        /* Critical section, make sure you lock, careful modifying code under critical section. */
-                        pthread_mutex_lock(&((sr->nat).lock));
-                        struct sr_nat_connection *tcp_conn = sr_nat_lookup_connection (nat_lookup->conns, ip_hdr->ip_dst);
-
-                        if (!tcp_conn) {
-                            tcp_conn = sr_nat_insert_tcp_connection (nat_lookup, ip_hdr->ip_dst);
-                        }
-
-                        tcp_conn->last_updated = time(NULL);
-
-                        switch (tcp_conn->tcp_state) {
-                            case CLOSED:
-                                if (ntohl(tcp_hdr->ack_num) == 0 && tcp_hdr->syn && !tcp_hdr->ack) {
-                                    tcp_conn->client_isn = ntohl(tcp_hdr->seq_num);
-                                    tcp_conn->tcp_state = SYN_SENT;
-                                }
-                                break;
-
-                            case SYN_RCVD:
-                                if (ntohl(tcp_hdr->seq_num) == tcp_conn->client_isn + 1 && ntohl(tcp_hdr->ack_num) == tcp_conn->server_isn + 1 && !tcp_hdr->syn) {
-                                    tcp_conn->client_isn = ntohl(tcp_hdr->seq_num);
-                                    tcp_conn->tcp_state = ESTABLISHED;
-                                }
-                                break;
-
-                            case ESTABLISHED:
-                                if (tcp_hdr->fin && tcp_hdr->ack) {
-                                    tcp_conn->client_isn = ntohl(tcp_hdr->seq_num);
-                                    tcp_conn->tcp_state = CLOSED;
-                                }
-                                break;
-
-                            default:
-                                break;
-                        }
-
-                        pthread_mutex_unlock(&((sr->nat).lock));
-                        /* End of critical section. */
+                        sr_nat_track_tcp_outbound(&(sr->nat), nat_lookup, ip_hdr->ip_dst, tcp_hdr);
 
                         ip_hdr->ip_src = nat_lookup->ip_ext;
                         tcp_hdr->src_port = htons(nat_lookup->aux_ext);
 
+                        ip_hdr->ip_sum = 0;
                         ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
                         tcp_hdr->tcp_sum = tcp_cksum(ip_hdr, tcp_hdr, len);
+                        sr_stats_count_nat(SR_STATS_NAT_OUT);
                     } else {
-                        printf("Packet of unknown type \n");
+                        sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "Packet of unknown type \n");
                     }
 
                     /* check routing table, and perform LPM */ 
                     /* Look up routing table for the rt entry that is mapped to the destination of received packet */
                     if (dst_lpm) {
-                        struct sr_if *out_iface = sr_get_interface(sr, dst_lpm->interface);
-                        /* If there is a match, check ARP cache */
-                        struct sr_arpentry * arp_entry = sr_arpcache_lookup (sr_cache, dst_lpm->gw.s_addr); 
-                        /* If there is a match in our ARP cache, send frame to next hop */
-                        if (arp_entry){
-                            printf("There is a match in the ARP cache\n");
-                            memcpy(eth_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
-                            memcpy(eth_hdr->ether_dhost, arp_entry->mac, sizeof(unsigned char)*ETHER_ADDR_LEN);
-                            sr_send_packet (sr, packet, len, out_iface->name); 
-                            return;
-
-                        } else {
-                            printf("There is no match in our ARP cache\n");
-                            /* If there is no match in our ARP cache, send ARP request. */
-                            struct sr_arpreq * req = sr_arpcache_queuereq(sr_cache, ip_hdr->ip_dst, packet, len, out_iface->name);
-                            handle_arpreq(req, sr);
-                            return;
-                        }
+                        forward_packet_hop (sr, packet, len, dst_lpm);
+                        return;
                     }
                 }
             } else {          
-                if (target_iface) {
+                if (target_iface || nat_ext) {
                     if (ip_p == ip_protocol_icmp) {
-                        printf("(EX->IN) ICMP\n");
+                        sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "(EX->IN) ICMP\n");
                         /* Get ICMP header */
                         sr_icmp_hdr_t *icmp_hdr = get_icmp_hdr (packet);
 
-                        struct sr_nat_mapping *nat_lookup = sr_nat_lookup_external(&(sr->nat), icmp_hdr->icmp_aux_identifier, nat_mapping_icmp); 
-		                if (nat_lookup != NULL) {
+                        struct sr_nat_mapping *nat_lookup = NULL;
+                        if (is_icmp_error(icmp_hdr)) {
+                            /* Error about a datagram one of our internal hosts sent */
+                            if (!nat_translate_icmp_error (sr, packet, len)) {
+                                sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "ICMP error for unknown NAT flow, dropping\n");
+                                SR_DROP(SR_DROP_NAT_NO_MAPPING);
+                                return;
+                            }
+                            sr_stats_count_nat(SR_STATS_NAT_IN);
+                        } else if ((nat_lookup = sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, icmp_hdr->icmp_aux_identifier, nat_mapping_icmp)) != NULL) {
                             if (is_icmp_echo_reply(icmp_hdr)) {
                                 ip_hdr->ip_dst = nat_lookup->ip_int;
                                 icmp_hdr->icmp_aux_identifier= nat_lookup->aux_int;
                                 nat_lookup->last_updated = time(NULL);
 
+                                ip_hdr->ip_sum = 0;
                                 ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
                                 icmp_hdr->icmp_sum = cksum(icmp_hdr, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
-                                print_hdrs (packet, len);            
+                                sr_stats_count_nat(SR_STATS_NAT_IN);
+                                if (sr_log_enabled(SR_LOG_NAT, SR_LOG_DEBUG))
+                                    print_hdrs (packet, len);
                             }
                         } else {
-                            printf ("Got here");
+                            sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "ICMP for unknown NAT mapping, dropping\n");
+                            SR_DROP(SR_DROP_NAT_NO_MAPPING);
                             return; 
                         }
                     } else if (ip_p == ip_protocol_tcp) {
                         /* TO-DO: TCP*/
-                        printf("(EX->IN) TCP\n");
+                        sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "(EX->IN) TCP\n");
                         sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
-                        struct sr_nat_mapping *nat_lookup = sr_nat_lookup_external(&(sr->nat), ntohs(tcp_hdr->dst_port), nat_mapping_tcp);
+                        struct sr_nat_mapping *nat_lookup = sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, ntohs(tcp_hdr->dst_port), nat_mapping_tcp);
                         if (!nat_lookup) {
+                            SR_DROP(SR_DROP_NAT_NO_MAPPING);
                             return; 
                         }
 
                         nat_lookup->last_updated = time(NULL);
 
-                        /* Critical section, make sure you lock, careful modifying code under critical section. */
-                        pthread_mutex_lock(&((sr->nat).lock));
-
-                        struct sr_nat_connection *tcp_conn = sr_nat_lookup_connection (nat_lookup->conns, ip_hdr->ip_src);
-                        if (tcp_conn == NULL) {
-                            tcp_conn = sr_nat_insert_tcp_connection (nat_lookup, ip_hdr->ip_src);
-                        }
-                        tcp_conn->last_updated = time(NULL);
-
-                        switch (tcp_conn->tcp_state) {
-                            case SYN_SENT:
-                                if (ntohl(tcp_hdr->ack_num) == tcp_conn->client_isn + 1 && tcp_hdr->syn && tcp_hdr->ack) {
-                                    tcp_conn->server_isn = ntohl(tcp_hdr->seq_num);
-                                    tcp_conn->tcp_state = SYN_RCVD;
-
-                                /* Simultaneous open */
-                                } else if (ntohl(tcp_hdr->ack_num) == 0 && tcp_hdr->syn && !tcp_hdr->ack) {
-                                    tcp_conn->server_isn = ntohl(tcp_hdr->seq_num);
-                                    tcp_conn->tcp_state = SYN_RCVD;
-                                }
-                                break;
-
-                            default:
-                                break;
-                        }
-
-                        pthread_mutex_unlock(&((sr->nat).lock));
-                        /* End of critical section. */
+                        sr_nat_track_tcp_inbound(&(sr->nat), nat_lookup, ip_hdr->ip_src, tcp_hdr);
 
                         ip_hdr->ip_dst = nat_lookup->ip_int;
                         tcp_hdr->dst_port = htons(nat_lookup->aux_int);
 
+                        ip_hdr->ip_sum = 0;
                         ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
                         tcp_hdr->tcp_sum = tcp_cksum(ip_hdr, tcp_hdr, len);
+                        sr_stats_count_nat(SR_STATS_NAT_IN);
                     
                     }
 
                     struct sr_rt *dst_lpm = sr_routing_lpm (sr, ip_hdr->ip_dst);
                     if (dst_lpm) {
-                        struct sr_if *out_iface = sr_get_interface(sr, dst_lpm->interface);
-                        /* If there is a match, check ARP cache */
-                        struct sr_arpentry * arp_entry = sr_arpcache_lookup (sr_cache, dst_lpm->gw.s_addr); 
-                        /* If there is a match in our ARP cache, send frame to next hop */
-                        if (arp_entry){
-                            printf("There is a match in the ARP cache\n");
-                            memcpy(eth_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
-                            memcpy(eth_hdr->ether_dhost, arp_entry->mac, sizeof(unsigned char)*ETHER_ADDR_LEN);
-                            sr_send_packet (sr, packet, len, out_iface->name); 
-                            return;
-
-                        } else {
-                            printf("There is no match in our ARP cache\n");
-                            /* If there is no match in our ARP cache, send ARP request. */
-                            struct sr_arpreq * req = sr_arpcache_queuereq(sr_cache, ip_hdr->ip_dst, packet, len, out_iface->name);
-                            handle_arpreq(req, sr);
-                            return;
-                        }
+                        forward_packet (sr, packet, len, dst_lpm);
+                        return;
                     } 
+                    SR_DROP(SR_DROP_NO_ROUTE);
                 } else {
                     if (!sr_nat_is_interface_internal(dst_lpm->interface)) {
                         /* Look up routing table for the rt entry that is mapped to the destination of received packet */
-                        printf("It is not for an internal interface or router. Dropping the packet \n"); 
+                        sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "It is not for an internal interface or router. Dropping the packet \n"); 
+                        SR_DROP(SR_DROP_NAT_FILTERED);
                         return; 
                     }
+                    /* Unsolicited, from outside to an internal host */
+                    SR_DROP(SR_DROP_NAT_FILTERED);
                 }
             }
         } else {
@@ -488,6 +506,7 @@ int verify_ip_checksum (sr_ip_hdr_t *ip_hdr) {
     uint16_t original_cksum = ip_hdr->ip_sum;
     memset(&(ip_hdr->ip_sum), 0, sizeof(uint16_t));
     uint16_t received_cksum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+    ip_hdr->ip_sum = original_cksum;
     if (original_cksum != received_cksum){
         return 1;
     }
@@ -613,31 +632,273 @@ void send_echo_reply (struct sr_instance* sr, uint8_t * packet, unsigned int len
     }
 }
 
+/* Hash of the flow an IP packet belongs to: its addresses and protocol,
+   and its ports if it is TCP or UDP and not a fragment. Fragments carry
+   no ports past the first, so all of a datagram's fragments hash alike,
+   but not like the flow's unfragmented packets, which may take another
+   equal-cost next hop */
+uint32_t flow_hash (uint8_t *packet, unsigned int len) {
+    sr_ip_hdr_t *ip_hdr = get_ip_hdr(packet);
+    unsigned int l4 = sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl * 4;
+    uint32_t hash = ntohl(ip_hdr->ip_src);
+    uint32_t ports;
+
+    hash = (hash * 0x9e3779b1U) ^ ntohl(ip_hdr->ip_dst);
+    hash = (hash * 0x9e3779b1U) ^ ip_hdr->ip_p;
+    if ((ip_hdr->ip_p == ip_protocol_tcp || ip_hdr->ip_p == ip_protocol_udp) &&
+        (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) == 0 && len >= l4 + sizeof(ports)) {
+        memcpy(&ports, packet + l4, sizeof(ports));
+        hash = (hash * 0x9e3779b1U) ^ ntohl(ports);
+    }
+    return hash;
+}
+
+/* Send a packet to the next hop of a routing entry. If the entry has
+   equal-cost alternatives, the packet's flow picks one. */
+void forward_packet (struct sr_instance* sr, uint8_t * packet, unsigned int len, struct sr_rt *rt) {
+    if (sr_fib_multipath(rt)) {
+        rt = sr_fib_pick(rt, flow_hash(packet, len));
+    }
+    forward_packet_hop (sr, packet, len, rt);
+}
+
+/* Send a packet to the next hop of exactly this route, resolving its MAC
+   through the ARP cache or queueing the packet behind an ARP request */
+void forward_packet_hop (struct sr_instance* sr, uint8_t * packet, unsigned int len, struct sr_rt *rt) {
+    struct sr_arpcache *sr_cache = &sr->cache;
+    sr_ethernet_hdr_t *eth_hdr = get_eth_hdr(packet);
+    struct sr_if *out_iface = sr_get_interface(sr, rt->interface);
+
+    /* If there is a match, check ARP cache */
+    struct sr_arpentry * arp_entry = sr_arpcache_lookup (sr_cache, rt->gw.s_addr); 
+    sr_log_rec(SR_LOG_ROUTER, "forward to %lx, resolved %ld", ntohl(rt->gw.s_addr), arp_entry != NULL);
+    /* If there is a match in our ARP cache, send frame to next hop */
+    if (arp_entry){
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "There is a match in the ARP cache\n");
+        memcpy(eth_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
+        memcpy(eth_hdr->ether_dhost, arp_entry->mac, sizeof(unsigned char)*ETHER_ADDR_LEN);
+        sr_send_packet (sr, packet, len, out_iface->name); 
+        free(arp_entry);
+    } else {
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "There is no match in our ARP cache\n");
+        /* If there is no match in our ARP cache, send ARP request. */
+        struct sr_arpreq * req = sr_arpcache_queuereq(sr_cache, rt->gw.s_addr, packet, len, out_iface->name);
+        handle_arpreq(req, sr);
+    }
+}
+
+/* Hairpin a TCP segment from an internal host to one of our external
+   endpoints: translate the source as if the segment left the NAT, then
+   the destination as if it came back in, and forward it straight back to
+   the internal side. Returns 1 if the packet was consumed, 0 if the
+   destination endpoint has no mapping. */
+int nat_hairpin (struct sr_instance* sr, uint8_t * packet, unsigned int len) {
+    sr_ip_hdr_t *ip_hdr = get_ip_hdr(packet);
+    sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *) (packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+    if (check_min_len (len, TCP_PACKET)) {
+        return 0;
+    }
+
+    struct sr_nat_mapping *dst_mapping = sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, ntohs(tcp_hdr->dst_port), nat_mapping_tcp);
+    if (dst_mapping == NULL) {
+        return 0;
+    }
+
+    struct sr_rt *dst_lpm = sr_routing_lpm (sr, dst_mapping->ip_int);
+    if (dst_lpm == NULL) {
+        return 0;
+    }
+
+    /* Source translation, as for any outbound segment */
+    struct sr_nat_mapping *src_mapping = sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, ntohs(tcp_hdr->src_port), nat_mapping_tcp);
+    if (src_mapping == NULL) {
+        src_mapping = sr_nat_insert_mapping(&(sr->nat), ip_hdr->ip_src, ntohs(tcp_hdr->src_port), ip_hdr->ip_dst, nat_mapping_tcp);
+        if (src_mapping == NULL) {
+            sr_log(SR_LOG_NAT, SR_LOG_DEBUG, "No TCP port available for host, dropping hairpin packet\n");
+            SR_DROP(SR_DROP_NAT_NO_PORT);
+            return 1;
+        }
+    }
+    src_mapping->last_updated = time(NULL);
+    sr_nat_track_tcp_outbound(&(sr->nat), src_mapping, dst_mapping->ip_ext, tcp_hdr);
+
+    ip_hdr->ip_src = src_mapping->ip_ext;
+    tcp_hdr->src_port = htons(src_mapping->aux_ext);
+
+    /* Destination translation, as for any inbound segment */
+    dst_mapping->last_updated = time(NULL);
+    sr_nat_track_tcp_inbound(&(sr->nat), dst_mapping, src_mapping->ip_ext, tcp_hdr);
+
+    ip_hdr->ip_dst = dst_mapping->ip_int;
+    tcp_hdr->dst_port = htons(dst_mapping->aux_int);
+
+    ip_hdr->ip_sum = 0;
+    ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+    tcp_hdr->tcp_sum = tcp_cksum(ip_hdr, tcp_hdr, len);
+    sr_stats_count_nat(SR_STATS_NAT_OUT);
+    sr_stats_count_nat(SR_STATS_NAT_IN);
+
+    forward_packet (sr, packet, len, dst_lpm);
+    return 1;
+}
+
+/* Translate an ICMP error sent to one of our external endpoints for the
+   internal host whose datagram caused it. The mapping is found from the
+   IP header and first 8 bytes quoted in the error. The outer destination,
+   the quoted source address and the quoted port or identifier are put
+   back to their internal values, and the quoted checksums as well as the
+   ICMP checksum are patched incrementally. Returns 1 if the packet was
+   translated, 0 if no mapping matches and it should be dropped. */
+int nat_translate_icmp_error (struct sr_instance* sr, uint8_t * packet, unsigned int len) {
+    sr_ip_hdr_t *ip_hdr = get_ip_hdr(packet);
+    sr_icmp_t3_hdr_t *icmp_hdr = (sr_icmp_t3_hdr_t *) get_icmp_hdr(packet);
+    sr_ip_hdr_t *inner_ip_hdr = (sr_ip_hdr_t *) icmp_hdr->data;
+    unsigned int inner_off = (uint8_t *) inner_ip_hdr - packet;
+
+    if (check_min_len (len, ICMP_TYPE3_PACKET)) {
+        return 0;
+    }
+
+    /* Quoted header plus the 8 bytes of transport header every router returns */
+    unsigned int inner_hl = inner_ip_hdr->ip_hl * 4;
+    if (inner_hl < sizeof(sr_ip_hdr_t) || inner_off + inner_hl + 8 > len) {
+        return 0;
+    }
+
+    /* The quoted datagram must have left through the address the error came back to */
+    if (inner_ip_hdr->ip_src != ip_hdr->ip_dst) {
+        return 0;
+    }
+
+    uint8_t *inner_l4 = (uint8_t *) inner_ip_hdr + inner_hl;
+    unsigned int l4_avail = len - (inner_l4 - packet);
+    struct sr_nat_mapping *mapping = NULL;
+    unsigned int aux_off, sum_off;
+    uint16_t old_aux, new_aux, old_l4_sum, new_l4_sum;
+    int has_l4_sum = 1;
+    int pseudo_hdr = 0;
+
+    /* Quoted fields are patched through byte offsets, as the inner
+       headers need not be aligned */
+    if (inner_ip_hdr->ip_p == ip_protocol_tcp) {
+        sr_tcp_hdr_t *inner_tcp_hdr = (sr_tcp_hdr_t *) inner_l4;
+        mapping = sr_nat_lookup_external(&(sr->nat), inner_ip_hdr->ip_src, ntohs(inner_tcp_hdr->src_port), nat_mapping_tcp);
+        if (mapping == NULL) {
+            return 0;
+        }
+        aux_off = offsetof(sr_tcp_hdr_t, src_port);
+        sum_off = offsetof(sr_tcp_hdr_t, tcp_sum);
+        new_aux = htons(mapping->aux_int);
+        /* The TCP checksum is only present if more than 8 bytes were quoted */
+        has_l4_sum = l4_avail >= sum_off + sizeof(uint16_t);
+        pseudo_hdr = 1;
+    } else if (inner_ip_hdr->ip_p == ip_protocol_icmp) {
+        sr_icmp_hdr_t *inner_icmp_hdr = (sr_icmp_hdr_t *) inner_l4;
+        if (!is_icmp_echo_request(inner_icmp_hdr)) {
+            return 0;
+        }
+        mapping = sr_nat_lookup_external(&(sr->nat), inner_ip_hdr->ip_src, inner_icmp_hdr->icmp_aux_identifier, nat_mapping_icmp);
+        if (mapping == NULL) {
+            return 0;
+        }
+        aux_off = offsetof(sr_icmp_hdr_t, icmp_aux_identifier);
+        sum_off = offsetof(sr_icmp_hdr_t, icmp_sum);
+        new_aux = mapping->aux_int;
+    } else {
+        return 0;
+    }
+
+    uint32_t old_src = inner_ip_hdr->ip_src;
+    uint16_t old_ip_sum = inner_ip_hdr->ip_sum;
+
+    /* Quoted headers */
+    inner_ip_hdr->ip_src = mapping->ip_int;
+    inner_ip_hdr->ip_sum = cksum_update32(old_ip_sum, old_src, mapping->ip_int);
+    memcpy(&old_aux, inner_l4 + aux_off, sizeof(uint16_t));
+    memcpy(inner_l4 + aux_off, &new_aux, sizeof(uint16_t));
+    if (has_l4_sum) {
+        memcpy(&old_l4_sum, inner_l4 + sum_off, sizeof(uint16_t));
+        new_l4_sum = cksum_update16(old_l4_sum, old_aux, new_aux);
+        if (pseudo_hdr) {
+            new_l4_sum = cksum_update32(new_l4_sum, old_src, mapping->ip_int);
+        }
+        memcpy(inner_l4 + sum_off, &new_l4_sum, sizeof(uint16_t));
+    }
+
+    /* The ICMP checksum covers every quoted word changed above */
+    icmp_hdr->icmp_sum = cksum_update32(icmp_hdr->icmp_sum, old_src, mapping->ip_int);
+    icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_ip_sum, inner_ip_hdr->ip_sum);
+    icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_aux, new_aux);
+    if (has_l4_sum) {
+        icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_l4_sum, new_l4_sum);
+    }
+
+    /* Outer header */
+    ip_hdr->ip_dst = mapping->ip_int;
+    ip_hdr->ip_sum = 0;
+    ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+    return 1;
+}
+
+/* Send the packets waiting on a resolved ARP request to mac, then free
+   the request. req has already been taken off the queue by
+   sr_arpcache_insert, so nothing here needs the cache lock. Packets go out
+   in arrival order, in batches of one sr_send_packets call per interface
+   run. req may be NULL. */
+void send_arpreq_packets (struct sr_instance* sr, struct sr_arpreq *req, unsigned char *mac) {
+    uint8_t *bufs[SR_SEND_BATCH];
+    unsigned int lens[SR_SEND_BATCH];
+    unsigned int n = 0;
+    struct sr_packet *req_packet, *prev = NULL, *next;
+    struct sr_if *out_iface = NULL;
+
+    if (!req)
+        return;
+
+    /* Packets are queued newest first */
+    for (req_packet = req->packets; req_packet; req_packet = next) {
+        next = req_packet->next;
+        req_packet->next = prev;
+        prev = req_packet;
+    }
+    req->packets = prev;
+
+    for (req_packet = req->packets; req_packet; req_packet = req_packet->next) {
+        /* Flush at an interface change or a full batch */
+        if (n && (n == SR_SEND_BATCH || strncmp(out_iface->name, req_packet->iface, sr_IFACE_NAMELEN))) {
+            sr_send_packets(sr, bufs, lens, n, out_iface->name);
+            n = 0;
+        }
+        if (n == 0)
+            out_iface = sr_get_interface(sr, req_packet->iface);
+
+        sr_ethernet_hdr_t *req_eth_hdr = (sr_ethernet_hdr_t *) req_packet->buf;
+        memcpy(req_eth_hdr->ether_dhost, mac, sizeof(unsigned char)*ETHER_ADDR_LEN);
+        memcpy(req_eth_hdr->ether_shost, out_iface->addr, sizeof(unsigned char)*ETHER_ADDR_LEN);
+        bufs[n] = req_packet->buf;
+        lens[n++] = req_packet->len;
+    }
+    if (n)
+        sr_send_packets(sr, bufs, lens, n, out_iface->name);
+
+    sr_log(SR_LOG_ARP, SR_LOG_DEBUG, "Sent packets from request queue\n");
+    sr_arpreq_free(req);
+}
+
 /* Send ARP request */
 void send_arp_req (sr_arp_hdr_t *arp_hdr, struct sr_arpcache *cache, struct sr_instance* sr) {
     struct sr_arpreq *req = sr_arpcache_insert(cache, arp_hdr->ar_sha, arp_hdr->ar_sip);
-    if (req){
-        /* Sending out outstanding packets for a request */
-        struct sr_packet *req_packet = req->packets;
-        while (req_packet) {
-            sr_ethernet_hdr_t *req_eth_hdr = (sr_ethernet_hdr_t *) req_packet->buf;
-            memcpy(req_eth_hdr->ether_dhost, arp_hdr->ar_sha, sizeof(unsigned char)*ETHER_ADDR_LEN);
-            memcpy(req_eth_hdr->ether_shost, sr_get_interface(sr, req_packet->iface)->addr, sizeof(unsigned char)*ETHER_ADDR_LEN);
-            sr_send_packet(sr, req_packet->buf, req_packet->len, req_packet->iface);
-            req_packet = req_packet->next;
-        }
-    }
-    printf("Sent packets from request queue\n");
-    sr_arpreq_destroy(cache, req);
+    send_arpreq_packets (sr, req, arp_hdr->ar_sha);
 }
 
 /* Send ICMP type 3 message after performing longest prefix match */
 void send_icmp_type3_msg(uint8_t * new_packet, struct sr_rt *src_lpm, struct sr_arpcache *sr_cache, struct sr_instance* sr, char* interface, unsigned int len)  {
     if (src_lpm){
-        printf("Found the match in routing table\n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "Found the match in routing table\n");
         struct sr_arpentry *entry = sr_arpcache_lookup(sr_cache, src_lpm->gw.s_addr);
         if (entry){
-            printf("Found the ARP entry in the cache\n");
+            sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "Found the ARP entry in the cache\n");
             struct sr_if *out_iface = sr_get_interface(sr, src_lpm->interface);
 
             /* Modify ethernet header */
@@ -680,10 +941,13 @@ int check_min_len (unsigned int len, int type) {
         case ICMP_TYPE3_PACKET:
             min_len = sizeof (sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof (sr_icmp_t3_hdr_t);
             break; 
+        case TCP_PACKET:
+            min_len = sizeof (sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof (sr_tcp_hdr_t);
+            break; 
     }
     /* Check for mininum length requirement */
     if (len < min_len) {
-        printf( "The ethernet header does not satisfy mininum length \n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "The ethernet header does not satisfy mininum length \n");
         return 1;
     }
     return 0;
@@ -695,7 +959,7 @@ struct sr_if* get_router_interface (uint32_t ip, struct sr_instance* sr) {
     while (curr_iface){
         /* Check if the packet is targeted towards the current router interface */
         if (curr_iface->ip == ip){
-            printf("Packet is for me \n");
+            sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "Packet is for me \n");
             /* The packet is targeted towards the current router */
             return curr_iface;
         }
@@ -712,6 +976,10 @@ int is_icmp_echo_request(sr_icmp_hdr_t *icmp_hdr) {
     return (icmp_hdr->icmp_type == 8 && icmp_hdr->icmp_code == 0) ? 1 : 0;
 }
 
+int is_icmp_error(sr_icmp_hdr_t *icmp_hdr) {
+    return (icmp_hdr->icmp_type == dest_net_unreachable_type || icmp_hdr->icmp_type == time_exceeded_type) ? 1 : 0;
+}
+
 void route_packet (struct sr_instance* sr,
         uint8_t * packet,
         unsigned int len,
@@ -735,19 +1003,22 @@ void route_packet (struct sr_instance* sr,
 
     /* Check for mininum length  */
     if (check_min_len (len, IP_PACKET)) {
-        printf("IP packet does not satisfy mininum length requirement \n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "IP packet does not satisfy mininum length requirement \n");
+        SR_DROP(SR_DROP_IP_SHORT);
         return;
     }
 
     /* Verify checksum */
     if (verify_ip_checksum (ip_hdr)) {
-        printf("IP Header checksum fails\n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "IP Header checksum fails\n");
+        SR_DROP(SR_DROP_IP_CHECKSUM);
         return;
     } 
 
     /* If time exceeded, send out time exceeded message */
     if (decrement_and_recalculate (ip_hdr)){
-        printf("TTL of IP is 0. Time exceeded. \n");
+        sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "TTL of IP is 0. Time exceeded. \n");
+        SR_DROP(SR_DROP_TTL);
         int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t11_hdr_t);
         uint8_t *new_packet = malloc(packet_len);
 
@@ -806,13 +1077,15 @@ void route_packet (struct sr_instance* sr,
         if (ip_p == ip_protocol_icmp) {
             /* Check for mininum length for ICMP Packet */
             if (check_min_len (len, ICMP_PACKET)) {
-                printf("IP packet does not satisfy mininum length requirement \n");
+                sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "IP packet does not satisfy mininum length requirement \n");
+                SR_DROP(SR_DROP_ICMP_SHORT);
                 return;
             }
 
             /* Check ICMP checksum */
             if (verify_icmp_checksum (icmp_hdr, ICMP_PACKET, len)) {
-                printf("ICMP packet fails checksum \n");
+                sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "ICMP packet fails checksum \n");
+                SR_DROP(SR_DROP_ICMP_CHECKSUM);
                 return;
             } 
 
@@ -821,11 +1094,13 @@ void route_packet (struct sr_instance* sr,
                 send_echo_reply (sr, packet, len, interface);
                 return;
             } else {
-                printf ("ICMP packet of unknown type\n");
+                sr_log(SR_LOG_ROUTER, SR_LOG_DEBUG, "ICMP packet of unknown type\n");
+                SR_DROP(SR_DROP_ICMP_TYPE);
                 return;
             }
         /* If it is TCP / UDP, send ICMP port unreachable */
         } else if (ip_p == ip_protocol_udp || ip_p == ip_protocol_tcp) {
+            SR_DROP(SR_DROP_IP_PROTO);
             int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
             uint8_t *new_packet = malloc(len);
 
@@ -844,33 +1119,19 @@ void route_packet (struct sr_instance* sr,
             free(new_packet);
             return; 
         }
+        SR_DROP(SR_DROP_IP_PROTO);
     /* Not for me*/ 
     } else {
         /* check routing table, and perform LPM */ 
         /* Look up routing table for the rt entry that is mapped to the destination of received packet */
         struct sr_rt* dst_lpm = sr_routing_lpm (sr, ip_hdr->ip_dst); 
         if (dst_lpm) {
-            struct sr_if *out_iface = sr_get_interface(sr, dst_lpm->interface);
-            /* If there is a match, check ARP cache */
-            struct sr_arpentry * arp_entry = sr_arpcache_lookup (sr_cache, dst_lpm->gw.s_addr); 
-            /* If there is a match in our ARP cache, send frame to next hop */
-            if (arp_entry){
-                printf("There is a match in the ARP cache\n");
-                memcpy(eth_hdr->ether_shost, out_iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
-                memcpy(eth_hdr->ether_dhost, arp_entry->mac, sizeof(unsigned char)*ETHER_ADDR_LEN);
-                sr_send_packet (sr, packet, len, out_iface->name); 
-                return;
-
-            } else {
-                printf("There is no match in our ARP cache\n");
-                /* If there is no match in our ARP cache, send ARP request. */
-                struct sr_arpreq * req = sr_arpcache_queuereq(sr_cache, ip_hdr->ip_dst, packet, len, out_iface->name);
-                handle_arpreq(req, sr);
-                return;
-            }
+            forward_packet (sr, packet, len, dst_lpm);
+            return;
 
         /* If there is no match in routing table, send ICMP net unreachable */
         } else {
+            SR_DROP(SR_DROP_NO_ROUTE);
             int packet_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
             uint8_t *new_packet = malloc(packet_len);
 
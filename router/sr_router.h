@@ -16,6 +16,10 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
+#include "sr_shm.h"
+#include "sr_afpacket.h"
+#include "sr_event.h"
+#include "sr_fib.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -31,9 +35,15 @@
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
 
+/* how frames reach the router */
+#define SR_TRANSPORT_VNS 0 /* VNSPACKET over the server socket */
+#define SR_TRANSPORT_SHM 1 /* sr_shm rings, sockfd is the control socket */
+#define SR_TRANSPORT_AFPACKET 2 /* Linux interfaces through sr_afpacket */
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_ctl;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -45,6 +55,10 @@ struct sr_rt;
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    int  transport; /* SR_TRANSPORT_* */
+    struct sr_shm shm; /* rings, if transport is SR_TRANSPORT_SHM */
+    struct sr_afpacket* afpacket; /* if transport is SR_TRANSPORT_AFPACKET */
+    struct sr_ctl* ctl; /* control socket, if one was asked for */
     char user[32]; /* user name */
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
@@ -52,8 +66,11 @@ struct sr_instance
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table */
+    struct sr_rt* routing_tail; /* its last entry, for appends */
+    struct sr_fib_table fib; /* what lookups use, compiled from routing_table */
+    const char* rtable; /* file routing_table was loaded from, for reloads */
     struct sr_arpcache cache;   /* ARP cache */
-    pthread_attr_t attr;
+    struct sr_event_loop loop;  /* packet I/O and timers */
     FILE* logfile;
 
     /* for NAT */
@@ -65,9 +82,14 @@ struct sr_instance
 int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
+#define SR_SEND_BATCH 64 /* most packets per sr_send_packets call */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packets(struct sr_instance* , uint8_t** , unsigned int* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_connect_to_shm(struct sr_instance* , const char* );
+int sr_event_add_transport(struct sr_instance* );
+void sr_dispatch_packet(struct sr_instance* , uint8_t* , unsigned int , char* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
@@ -107,11 +129,18 @@ uint8_t *create_echo_reply (struct sr_if* src_iface, sr_ethernet_hdr_t* eth_hdr,
 uint8_t* create_icmp_reply (uint8_t* packet, struct sr_if* if_walker, int packet_len, sr_ip_hdr_t *ip_hdr, uint8_t type, unsigned int code); 
 
 void send_arp_req (sr_arp_hdr_t *arp_hdr, struct sr_arpcache *cache, struct sr_instance* sr);
+void send_arpreq_packets (struct sr_instance* sr, struct sr_arpreq *req, unsigned char *mac);
 void send_echo_reply (struct sr_instance* sr, uint8_t * packet, unsigned int len, char* interface);
 void send_icmp_type3_msg (uint8_t * new_packet, struct sr_rt *src_lpm, struct sr_arpcache *sr_cache, struct sr_instance* sr, char* interface, unsigned int len);
 
 void route_packet (struct sr_instance* sr,  uint8_t * packet, unsigned int len, char* interface);
+uint32_t flow_hash (uint8_t *packet, unsigned int len);
+void forward_packet (struct sr_instance* sr, uint8_t * packet, unsigned int len, struct sr_rt *rt);
+void forward_packet_hop (struct sr_instance* sr, uint8_t * packet, unsigned int len, struct sr_rt *rt);
+int nat_hairpin (struct sr_instance* sr, uint8_t * packet, unsigned int len);
+int nat_translate_icmp_error (struct sr_instance* sr, uint8_t * packet, unsigned int len);
 int is_icmp_echo_reply(sr_icmp_hdr_t *icmp_hdr);
 int is_icmp_echo_request(sr_icmp_hdr_t *icmp_hdr);
+int is_icmp_error(sr_icmp_hdr_t *icmp_hdr);
 
 #endif /* SR_ROUTER_H */
@@ -12,6 +12,9 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 
 #include <sys/socket.h>
@@ -21,115 +24,410 @@
 
 #include "sr_rt.h"
 #include "sr_router.h"
+#include "sr_perf.h"
+#include "sr_fib.h"
+
+static void sr_free_rt_list(struct sr_rt* rt)
+{
+    struct sr_rt* next;
+
+    for( ; rt; rt = next)
+    {
+        next = rt->next;
+        free(rt);
+    }
+} /* -- sr_free_rt_list -- */
+
+static void sr_rt_append(struct sr_instance* sr, struct sr_rt* entry)
+{
+    entry->next = 0;
+    entry->prev = sr->routing_tail;
+    if(sr->routing_tail)
+    { sr->routing_tail->next = entry; }
+    else
+    { sr->routing_table = entry; }
+    sr->routing_tail = entry;
+} /* -- sr_rt_append -- */
+
+/* Put entry in old's place in the list, or take old out if entry is 0 */
+static void sr_rt_unlink(struct sr_instance* sr, struct sr_rt* old, struct sr_rt* entry)
+{
+    struct sr_rt* prev = old->prev;
+    struct sr_rt* next = old->next;
+
+    if(entry)
+    {
+        entry->prev = prev;
+        entry->next = next;
+    }
+    if(prev)
+    { prev->next = entry ? entry : next; }
+    else
+    { sr->routing_table = entry ? entry : next; }
+    if(next)
+    { next->prev = entry ? entry : prev; }
+    else
+    { sr->routing_tail = entry ? entry : prev; }
+} /* -- sr_rt_unlink -- */
+
+static const char* sr_rt_skip_blanks(const char* s, const char* eol)
+{
+    while(s < eol && (*s == ' ' || *s == '\t' || *s == '\r'))
+    { s++; }
+    return s;
+} /* -- sr_rt_skip_blanks -- */
+
+/* Parse a dotted quad at *s, leaving *s just past it. Returns 0, or -1. */
+static int sr_rt_parse_ip(const char** s, const char* eol, struct in_addr* addr)
+{
+    const char* p = *s;
+    uint32_t ip = 0, part;
+    int i, digits;
+
+    for(i = 0; i < 4; i++)
+    {
+        if(i > 0)
+        {
+            if(p == eol || *p != '.')
+            { return -1; }
+            p++;
+        }
+        for(part = 0, digits = 0; p < eol && *p >= '0' && *p <= '9' && digits < 3; p++, digits++)
+        { part = part * 10 + (*p - '0'); }
+        if(digits == 0 || part > 255)
+        { return -1; }
+        ip = ip << 8 | part;
+    }
+    addr->s_addr = htonl(ip);
+    *s = p;
+    return 0;
+} /* -- sr_rt_parse_ip -- */
+
+/* "dest gw mask iface", maybe followed by a # comment. Returns 0, or -1. */
+static int sr_rt_parse_line(const char* s, const char* eol, struct sr_rt* entry)
+{
+    struct in_addr* addrs[3];
+    const char* name;
+    int i;
+
+    addrs[0] = &(entry->dest);
+    addrs[1] = &(entry->gw);
+    addrs[2] = &(entry->mask);
+    for(i = 0; i < 3; i++)
+    {
+        if(sr_rt_parse_ip(&s, eol, addrs[i]) != 0 || s == eol || (*s != ' ' && *s != '\t'))
+        { return -1; }
+        s = sr_rt_skip_blanks(s, eol);
+    }
+    for(name = s; s < eol && *s != ' ' && *s != '\t' && *s != '\r'; s++)
+        ;
+    if(s == name || s - name >= sr_IFACE_NAMELEN)
+    { return -1; }
+    memcpy(entry->interface, name, s - name);
+    s = sr_rt_skip_blanks(s, eol);
+    return (s == eol || *s == '#') ? 0 : -1;
+} /* -- sr_rt_parse_line -- */
+
+/* Map filename for reading, with st its stat; 0 for an empty file, or
+   MAP_FAILED */
+static const char* sr_rt_map(const char* filename, struct stat* st)
+{
+    const char* map = 0;
+    int fd;
+
+    if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, st) != 0)
+    {
+        perror("open");
+        if(fd >= 0)
+        { close(fd); }
+        return MAP_FAILED;
+    }
+    if(st->st_size > 0)
+    {
+        map = mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED)
+        { perror("mmap"); }
+        else
+        { madvise((void*) map, st->st_size, MADV_SEQUENTIAL); }
+    }
+    close(fd);
+    return map;
+} /* -- sr_rt_map -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_build_rt(..)
  *
+ * Build the routing table in filename into load without touching the
+ * one in use, so it can run on any thread. The file is mapped and
+ * parsed in one pass into a new list and FIB, and the FIB compiled.
+ * Blank lines and lines starting with # are skipped. Lines for one
+ * prefix through different next hops make equal-cost routes; a line
+ * repeating a route is ignored. load->source describes exactly the
+ * bytes parsed, for a snapshot of the table.
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+int sr_build_rt(const char* filename, struct sr_rt_load* load)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
-    struct in_addr dest_addr;
-    struct in_addr gw_addr;
-    struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct stat st;
+    const char* map;
+    const char* p;
+    const char* end;
+    const char* eol;
+    struct sr_rt* list = 0;
+    struct sr_rt* tail = 0;
+    struct sr_rt* entry;
+    struct sr_fib* fib;
+    int ret, line_no = 0, dups = 0, first_dup = 0;
 
     /* -- REQUIRES -- */
     assert(filename);
-    if( access(filename,R_OK) != 0)
-    {
-        perror("access");
-        return -1;
-    }
+    if((map = sr_rt_map(filename, &st)) == MAP_FAILED)
+    { return -1; }
 
-    fp = fopen(filename,"r");
+    fib = sr_fib_new();
+    assert(fib);
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+    for(p = map, end = map + st.st_size; p < end; p = eol + 1)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
+        line_no++;
+        if((eol = memchr(p, '\n', end - p)) == 0)
+        { eol = end; }
+        p = sr_rt_skip_blanks(p, eol);
+        if(p == eol || *p == '#')
+        { continue; }
+        entry = (struct sr_rt*)calloc(1, sizeof(struct sr_rt));
+        assert(entry);
+        if(sr_rt_parse_line(p, eol, entry) != 0 || (ret = sr_fib_add(fib, entry)) < 0)
         { 
             fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
+                    "Error loading routing table, bad address, mask or interface on line %d of %s\n",
+                    line_no, filename);
+            munmap((void*) map, st.st_size);
+            free(entry);
+            sr_free_rt_list(list);
+            sr_fib_free(fib);
             return -1; 
         }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        if(ret == 1)
+        {
+            if(dups++ == 0)
+            { first_dup = line_no; }
+            free(entry);
+            continue;
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
-        }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
-        }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+        entry->prev = tail;
+        if(tail)
+        { tail->next = entry; }
+        else
+        { list = entry; }
+        tail = entry;
+    } /* -- for -- */
+    sr_fib_source(&(load->source), filename, &st, map);
+    if(map)
+    { munmap((void*) map, st.st_size); }
+    if(dups)
+    {
+        fprintf(stderr, "%d duplicate routes in %s ignored, the first on line %d\n",
+                dups, filename, first_dup);
+    }
 
+    sr_fib_compile(fib); /* lookups walk the full trie if it fails */
+
+    load->fib = fib;
+    load->list = list;
+    load->tail = tail;
     return 0; /* -- success -- */
+} /* -- sr_build_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_install_rt(..)
+ *
+ * Replace the routing table with one sr_build_rt built; lookups move
+ * from the old table to the new one in a single step. Call it from the
+ * thread that changes the table.
+ *---------------------------------------------------------------------*/
+
+void sr_install_rt(struct sr_instance* sr, struct sr_rt_load* load)
+{
+    struct sr_rt* old = sr->routing_table;
+
+    sr->routing_table = load->list;
+    sr->routing_tail = load->tail;
+    sr_fib_retire_routes(&(sr->fib), old);
+    sr_fib_publish(&(sr->fib), load->fib);
+    memset(load, 0, sizeof(struct sr_rt_load));
+} /* -- sr_install_rt -- */
+
+/* Free a table sr_build_rt built that will not be installed after all */
+void sr_discard_rt(struct sr_rt_load* load)
+{
+    sr_free_rt_list(load->list);
+    sr_fib_free(load->fib);
+    memset(load, 0, sizeof(struct sr_rt_load));
+} /* -- sr_discard_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ *
+ * Replace the routing table with the one in filename. On any error the
+ * old table stays in place.
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+    struct sr_rt_load load;
+
+    if(sr_build_rt(filename, &load) != 0)
+    { return -1; }
+    sr_install_rt(sr, &load);
+    return 0;
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_load_rt_snapshot(..)
+ *
+ * Replace the routing table with a snapshot written by
+ * sr_save_rt_snapshot, the same way sr_load_rt replaces it with a file,
+ * if the snapshot was made from filename as it is now.
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt_snapshot(struct sr_instance* sr, const char* path, const char* filename)
+{
+    struct sr_rt_load load;
+    struct stat st;
+    const char* map;
+
+    if((map = sr_rt_map(filename, &st)) == MAP_FAILED)
+    { return -1; }
+    sr_fib_source(&(load.source), filename, &st, map);
+    if(map)
+    { munmap((void*) map, st.st_size); }
+    if((load.fib = sr_fib_load(path, &(load.source), &(load.list), &(load.tail))) == 0)
+    { return -1; }
+    sr_install_rt(sr, &load);
+    return 0;
+} /* -- sr_load_rt_snapshot -- */
+
+/* Save a table sr_build_rt built as a snapshot at path */
+int sr_save_rt_snapshot(struct sr_rt_load* load, const char* path)
+{
+    return sr_fib_save(load->fib, &(load->source), path);
+} /* -- sr_save_rt_snapshot -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_add_rt_entry(..)
  *
+ * Add a route, in place. A prefix that already has routes gets it as
+ * one more equal-cost next hop. Returns 0, 1 if the prefix already has
+ * a route through gw and if_name (it stays, as when a file lists a route
+ * twice), or -1 if the mask is not contiguous.
  *---------------------------------------------------------------------*/
 
-void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
+int sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
 struct in_addr gw, struct in_addr mask,char* if_name)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt* entry;
+    int ret;
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
-    {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+    entry = (struct sr_rt*)calloc(1, sizeof(struct sr_rt));
+    assert(entry);
+    entry->dest = dest;
+    entry->gw   = gw;
+    entry->mask = mask;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
 
-        return;
+    if((ret = sr_fib_set_hop(&(sr->fib), entry)) != 0)
+    {
+        free(entry);
+        return ret;
     }
+    sr_rt_append(sr, entry);
+    return 0;
+} /* -- sr_add_entry -- */
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
-    }
+/*---------------------------------------------------------------------
+ * Method: sr_replace_rt_entry(..)
+ *
+ * Make gw on if_name the only route for dest/mask, in place, replacing
+ * the ones it has, if any. Returns 0, or -1 if the mask is not
+ * contiguous.
+ *---------------------------------------------------------------------*/
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+int sr_replace_rt_entry(struct sr_instance* sr, struct in_addr dest,
+        struct in_addr gw, struct in_addr mask, char* if_name)
+{
+    struct sr_rt* old = sr_fib_find(sr_fib_current(&(sr->fib)), dest.s_addr, mask.s_addr);
+    struct sr_rt* entry;
+    struct sr_rt* hop;
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    if(old == 0)
+    { return sr_add_rt_entry(sr, dest, gw, mask, if_name); }
 
-} /* -- sr_add_entry -- */
+    entry = (struct sr_rt*)calloc(1, sizeof(struct sr_rt));
+    assert(entry);
+    entry->dest = dest;
+    entry->gw   = gw;
+    entry->mask = mask;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
+
+    /* The prefix's nodes exist, so this cannot fail */
+    sr_rt_unlink(sr, old, entry);
+    for(hop = old->ecmp_next; hop; hop = hop->ecmp_next)
+    { sr_rt_unlink(sr, hop, 0); }
+    sr_fib_set(&(sr->fib), entry);
+    return 0;
+} /* -- sr_replace_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_del_rt_entry(..)
+ *
+ * Remove the routes for dest/mask, in place. Returns 0, or -1 if there
+ * are none.
+ *---------------------------------------------------------------------*/
+
+int sr_del_rt_entry(struct sr_instance* sr, struct in_addr dest,
+        struct in_addr mask)
+{
+    struct sr_rt* old = sr_fib_find(sr_fib_current(&(sr->fib)), dest.s_addr, mask.s_addr);
+    struct sr_rt* hop;
+
+    if(old == 0)
+    { return -1; }
+    for(hop = old; hop; hop = hop->ecmp_next)
+    { sr_rt_unlink(sr, hop, 0); }
+    sr_fib_unset(&(sr->fib), dest.s_addr, mask.s_addr);
+    return 0;
+} /* -- sr_del_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_del_rt_nexthop(..)
+ *
+ * Remove the route for dest/mask through gw on if_name, in place,
+ * leaving the prefix's other equal-cost routes. Returns 0, or -1 if
+ * there is none.
+ *---------------------------------------------------------------------*/
+
+int sr_del_rt_nexthop(struct sr_instance* sr, struct in_addr dest,
+        struct in_addr gw, struct in_addr mask, char* if_name)
+{
+    struct sr_rt* hop = sr_fib_find(sr_fib_current(&(sr->fib)), dest.s_addr, mask.s_addr);
+
+    for( ; hop; hop = hop->ecmp_next)
+    {
+        if(hop->gw.s_addr == gw.s_addr &&
+           strncmp(hop->interface, if_name, sr_IFACE_NAMELEN) == 0)
+        { break; }
+    }
+    if(hop == 0)
+    { return -1; }
+    sr_rt_unlink(sr, hop, 0);
+    sr_fib_unset_hop(&(sr->fib), hop);
+    return 0;
+} /* -- sr_del_rt_nexthop -- */
 
 /*---------------------------------------------------------------------
  * Method:
@@ -180,20 +478,8 @@ void sr_print_routing_entry(struct sr_rt* entry)
 
 /* Return longest prefix match */
 struct sr_rt * sr_routing_lpm (struct sr_instance* sr, uint32_t ip_dst) {
-    struct sr_rt * routing_table = sr->routing_table;
-    int len = 0; 
-    struct sr_rt* rt_walker = 0;
-    struct sr_rt* longest_prefix = 0;
-    rt_walker = routing_table;
-    while (rt_walker) {
-        /* Compare the bitwise AND of target and the subnet mask with the bitwise AND of routing table entry and the subnet mask */
-        if ((ip_dst & rt_walker->mask.s_addr) == (rt_walker->dest.s_addr & rt_walker->mask.s_addr)) {
-            if ((ip_dst & rt_walker->mask.s_addr) > len){
-                len = ip_dst & rt_walker->mask.s_addr;
-                longest_prefix = rt_walker;
-            }
-        }
-        rt_walker = rt_walker->next; 
-    }
+    SR_PERF_BEGIN(t0);
+    struct sr_rt* longest_prefix = sr_fib_lookup(sr_fib_current(&(sr->fib)), ip_dst);
+    SR_PERF_END(SR_PERF_LPM, t0);
     return longest_prefix;
 }
@@ -19,6 +19,7 @@
 #include <netinet/in.h>
 
 #include "sr_if.h"
+#include "sr_fib.h"
 
 /* ----------------------------------------------------------------------------
  * struct sr_rt
@@ -34,11 +35,32 @@ struct sr_rt
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
     struct sr_rt* next;
+    struct sr_rt* prev;
+    struct sr_rt* ecmp_next; /* next equal-cost route for the same prefix */
+    uint32_t ecmp_key;       /* hash of gw and interface, set by the FIB */
 };
 
+/* A routing table built off to the side, not yet in use */
+struct sr_rt_load
+{
+    struct sr_fib* fib;
+    struct sr_rt* list;
+    struct sr_rt* tail;
+    struct sr_fib_source source; /* the file it was built from */
+};
 
+int sr_build_rt(const char*, struct sr_rt_load*);
+void sr_install_rt(struct sr_instance*, struct sr_rt_load*);
+void sr_discard_rt(struct sr_rt_load*);
 int sr_load_rt(struct sr_instance*,const char*);
-void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
+int sr_load_rt_snapshot(struct sr_instance*, const char*, const char*);
+int sr_save_rt_snapshot(struct sr_rt_load*, const char*);
+int sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
+                  struct in_addr, char*);
+int sr_replace_rt_entry(struct sr_instance*, struct in_addr, struct in_addr,
+                  struct in_addr, char*);
+int sr_del_rt_entry(struct sr_instance*, struct in_addr, struct in_addr);
+int sr_del_rt_nexthop(struct sr_instance*, struct in_addr, struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
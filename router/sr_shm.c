@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "sr_shm.h"
+
+#ifdef _LINUX_
+
+#include <sys/eventfd.h>
+
+/* Descriptors passed from the peer to the router, in this order */
+#define SR_SHM_FD_REGION 0
+#define SR_SHM_FD_TO_ROUTER 1
+#define SR_SHM_FD_FROM_ROUTER 2
+#define SR_SHM_NFDS 3
+
+/* Point rx/tx at the right rings for one end */
+static void sr_shm_attach(struct sr_shm *shm, struct sr_shm_region *region,
+                          int *fds, int router) {
+    shm->region = region;
+    shm->rx = &region->rings[router ? SR_SHM_TO_ROUTER : SR_SHM_FROM_ROUTER];
+    shm->tx = &region->rings[router ? SR_SHM_FROM_ROUTER : SR_SHM_TO_ROUTER];
+    shm->rx_efd = fds[router ? SR_SHM_FD_TO_ROUTER : SR_SHM_FD_FROM_ROUTER];
+    shm->tx_efd = fds[router ? SR_SHM_FD_FROM_ROUTER : SR_SHM_FD_TO_ROUTER];
+    pthread_mutex_init(&(shm->tx_lock), NULL);
+}
+
+static int sr_shm_sockaddr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "sr_shm: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Listen for a router on a Unix socket at path (peer side) */
+int sr_shm_listen(const char *path) {
+    struct sockaddr_un addr;
+    int lfd;
+
+    if (sr_shm_sockaddr(path, &addr) != 0) {
+        return -1;
+    }
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket(..):sr_shm_listen");
+        return -1;
+    }
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0) {
+        perror("bind(..):sr_shm_listen");
+        close(lfd);
+        return -1;
+    }
+    return lfd;
+}
+
+/* Accept a router, create the rings and hand them over (peer side).
+   Returns the control socket. */
+int sr_shm_accept(int lfd, struct sr_shm *shm) {
+    int fds[SR_SHM_NFDS];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct sr_shm_region *region;
+    uint32_t magic = SR_SHM_MAGIC;
+    int fd;
+
+    if ((fd = accept(lfd, NULL, NULL)) < 0) {
+        perror("accept(..):sr_shm_accept");
+        return -1;
+    }
+
+    fds[SR_SHM_FD_REGION] = memfd_create("sr_shm", 0);
+    fds[SR_SHM_FD_TO_ROUTER] = eventfd(0, EFD_NONBLOCK);
+    fds[SR_SHM_FD_FROM_ROUTER] = eventfd(0, EFD_NONBLOCK);
+    if (fds[SR_SHM_FD_REGION] < 0 || fds[SR_SHM_FD_TO_ROUTER] < 0 ||
+        fds[SR_SHM_FD_FROM_ROUTER] < 0 ||
+        ftruncate(fds[SR_SHM_FD_REGION], sizeof(struct sr_shm_region)) != 0) {
+        perror("sr_shm_accept: creating the region");
+        close(fd);
+        return -1;
+    }
+    region = mmap(NULL, sizeof(struct sr_shm_region), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fds[SR_SHM_FD_REGION], 0);
+    if (region == MAP_FAILED) {
+        perror("mmap(..):sr_shm_accept");
+        close(fd);
+        return -1;
+    }
+    /* A fresh memfd is zero filled, so both rings start empty */
+    region->magic = SR_SHM_MAGIC;
+    region->slots = SR_SHM_SLOTS;
+    region->frame_max = SR_SHM_FRAME_MAX;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &magic;
+    iov.iov_len = sizeof(magic);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, 0) != sizeof(magic)) {
+        perror("sendmsg(..):sr_shm_accept");
+        close(fd);
+        return -1;
+    }
+
+    /* The region stays mapped; its descriptor is no longer needed */
+    close(fds[SR_SHM_FD_REGION]);
+    sr_shm_attach(shm, region, fds, 0);
+    return fd;
+}
+
+/* Connect to a peer and map the rings it passes (router side).
+   Returns the control socket. */
+int sr_shm_connect(const char *path, struct sr_shm *shm) {
+    struct sockaddr_un addr;
+    int fds[SR_SHM_NFDS];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct sr_shm_region *region;
+    uint32_t magic = 0;
+    int fd;
+
+    if (sr_shm_sockaddr(path, &addr) != 0) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket(..):sr_shm_connect");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("connect(..):sr_shm_connect");
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &magic;
+    iov.iov_len = sizeof(magic);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(fd, &msg, 0) != sizeof(magic) || magic != SR_SHM_MAGIC ||
+        (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "sr_shm_connect: peer did not send the rings\n");
+        close(fd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    region = mmap(NULL, sizeof(struct sr_shm_region), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fds[SR_SHM_FD_REGION], 0);
+    close(fds[SR_SHM_FD_REGION]);
+    if (region == MAP_FAILED || region->magic != SR_SHM_MAGIC ||
+        region->slots != SR_SHM_SLOTS || region->frame_max != SR_SHM_FRAME_MAX) {
+        fprintf(stderr, "sr_shm_connect: ring layout does not match\n");
+        close(fd);
+        return -1;
+    }
+
+    sr_shm_attach(shm, region, fds, 1);
+    return fd;
+}
+
+void sr_shm_close(struct sr_shm *shm) {
+    if (shm->region) {
+        munmap(shm->region, sizeof(struct sr_shm_region));
+        close(shm->rx_efd);
+        close(shm->tx_efd);
+        pthread_mutex_destroy(&(shm->tx_lock));
+        shm->region = NULL;
+    }
+}
+
+/* Queue a frame on the tx ring. Returns -1 if the ring is full, and the
+   caller drops the frame like a NIC would. */
+int sr_shm_send(struct sr_shm *shm, const uint8_t *frame, unsigned int len, const char *iface) {
+    struct sr_shm_ring *ring = shm->tx;
+    struct sr_shm_slot *slot;
+    uint32_t head, tail;
+    uint64_t one = 1;
+
+    if (len > SR_SHM_FRAME_MAX) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&(shm->tx_lock));
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == SR_SHM_SLOTS) {
+        pthread_mutex_unlock(&(shm->tx_lock));
+        return -1;
+    }
+
+    slot = &ring->slots[head & (SR_SHM_SLOTS - 1)];
+    slot->len = len;
+    strncpy(slot->iface, iface, sr_IFACE_NAMELEN);
+    memcpy(slot->data, frame, len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in sr_shm_prepare_wait: either the consumer sees the
+       new head or we see it sleeping */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+        if (write(shm->tx_efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+            perror("write(..):sr_shm_send");
+        }
+    }
+    pthread_mutex_unlock(&(shm->tx_lock));
+    return 0;
+}
+
+/* Queue n frames for the same interface with one lock, one head update and
+   at most one wakeup. Returns the number queued and sets taken[i] to
+   whether frame i was; an oversized frame is skipped and the ones after
+   it still go, frames past a full ring do not. The rest are the
+   caller's to drop. */
+int sr_shm_send_batch(struct sr_shm *shm, uint8_t *const *frames, const unsigned int *lens,
+                      unsigned int n, const char *iface, uint8_t *taken) {
+    struct sr_shm_ring *ring = shm->tx;
+    struct sr_shm_slot *slot;
+    uint32_t head, tail;
+    uint64_t one = 1;
+    unsigned int i;
+    int sent = 0;
+
+    pthread_mutex_lock(&(shm->tx_lock));
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    memset(taken, 0, n);
+    for (i = 0; i < n; i++) {
+        if (lens[i] > SR_SHM_FRAME_MAX) {
+            continue;
+        }
+        if (head - tail == SR_SHM_SLOTS) {
+            break;
+        }
+        slot = &ring->slots[head & (SR_SHM_SLOTS - 1)];
+        slot->len = lens[i];
+        strncpy(slot->iface, iface, sr_IFACE_NAMELEN);
+        memcpy(slot->data, frames[i], lens[i]);
+        head++;
+        sent++;
+        taken[i] = 1;
+    }
+    if (sent) {
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        /* See sr_shm_send */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+            if (write(shm->tx_efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+                perror("write(..):sr_shm_send_batch");
+            }
+        }
+    }
+    pthread_mutex_unlock(&(shm->tx_lock));
+    return sent;
+}
+
+/* Next received frame, or NULL. The slot is ours until sr_shm_release. */
+struct sr_shm_slot *sr_shm_peek(struct sr_shm *shm) {
+    struct sr_shm_ring *ring = shm->rx;
+    uint32_t tail = ring->tail;
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        return NULL;
+    }
+    return &ring->slots[tail & (SR_SHM_SLOTS - 1)];
+}
+
+void sr_shm_release(struct sr_shm *shm) {
+    struct sr_shm_ring *ring = shm->rx;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Announce that we are about to block on rx_efd. Returns 1 (and stays
+   awake) if frames arrived meanwhile, so the caller must not block. */
+int sr_shm_prepare_wait(struct sr_shm *shm) {
+    __atomic_store_n(&shm->rx->sleeping, 1, __ATOMIC_RELAXED);
+    /* Pairs with the fence in sr_shm_send */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (sr_shm_peek(shm) != NULL) {
+        __atomic_store_n(&shm->rx->sleeping, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/* Back from blocking: stop asking for kicks and reset the eventfd; the
+   ring itself says how much is there */
+void sr_shm_woken(struct sr_shm *shm) {
+    uint64_t count;
+
+    __atomic_store_n(&shm->rx->sleeping, 0, __ATOMIC_RELAXED);
+    if (read(shm->rx_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read(..):sr_shm_woken");
+    }
+}
+
+/* Block until frames arrive, fd (if >= 0) becomes readable or timeout_ms
+   passes (-1 waits forever). Returns SR_SHM_RX_READY and/or
+   SR_SHM_FD_READY, 0 on timeout and -1 on error. */
+int sr_shm_wait(struct sr_shm *shm, int fd, int timeout_ms) {
+    struct pollfd pfd[2];
+    int ret, n = 1, ready = 0;
+
+    if (sr_shm_prepare_wait(shm)) {
+        return SR_SHM_RX_READY;
+    }
+
+    pfd[0].fd = shm->rx_efd;
+    pfd[0].events = POLLIN;
+    if (fd >= 0) {
+        pfd[1].fd = fd;
+        pfd[1].events = POLLIN;
+        n = 2;
+    }
+    do {
+        ret = poll(pfd, n, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    sr_shm_woken(shm);
+    if (ret < 0) {
+        perror("poll(..):sr_shm_wait");
+        return -1;
+    }
+
+    if (sr_shm_peek(shm) != NULL) {
+        ready |= SR_SHM_RX_READY;
+    }
+    if (n == 2 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+        ready |= SR_SHM_FD_READY;
+    }
+    return ready;
+}
+
+#else /* _LINUX_ */
+
+/* memfd and eventfd are Linux only */
+
+int sr_shm_listen(const char *path) {
+    fprintf(stderr, "sr_shm: shared-memory transport needs Linux\n");
+    return -1;
+}
+
+int sr_shm_accept(int lfd, struct sr_shm *shm) {
+    return -1;
+}
+
+int sr_shm_connect(const char *path, struct sr_shm *shm) {
+    fprintf(stderr, "sr_shm: shared-memory transport needs Linux\n");
+    return -1;
+}
+
+void sr_shm_close(struct sr_shm *shm) {
+}
+
+int sr_shm_send(struct sr_shm *shm, const uint8_t *frame, unsigned int len, const char *iface) {
+    return -1;
+}
+
+int sr_shm_send_batch(struct sr_shm *shm, uint8_t *const *frames, const unsigned int *lens,
+                      unsigned int n, const char *iface) {
+    return 0;
+}
+
+struct sr_shm_slot *sr_shm_peek(struct sr_shm *shm) {
+    return NULL;
+}
+
+void sr_shm_release(struct sr_shm *shm) {
+}
+
+int sr_shm_prepare_wait(struct sr_shm *shm) {
+    return 0;
+}
+
+void sr_shm_woken(struct sr_shm *shm) {
+}
+
+int sr_shm_wait(struct sr_shm *shm, int fd, int timeout_ms) {
+    return -1;
+}
+
+#endif /* _LINUX_ */
@@ -0,0 +1,100 @@
+/* Shared-memory packet transport, an alternative to the VNS TCP socket for
+   a router and a peer on the same machine (a test harness or a dataplane
+   shim).
+
+   The peer creates a memory region holding two single-producer,
+   single-consumer rings, one per direction, and two eventfds, and passes
+   all three descriptors to the router over a Unix socket. The same socket
+   then stays open as the control channel and carries the usual VNS
+   commands (VNSHWINFO, VNSCLOSE); only frames go through the rings.
+
+   Each slot holds one frame and the name of the interface it is received
+   on or sent out of. A consumer that runs out of frames sets the ring's
+   'sleeping' flag before it blocks on its eventfd, and the producer only
+   writes the eventfd when it sees the flag, so a busy transport costs no
+   system calls per frame.
+
+   --
+
+   # Router side
+   fd = sr_shm_connect(path, &shm)
+   for each frame: sr_shm_send(&shm, frame, len, iface)
+   while ((slot = sr_shm_peek(&shm)) != NULL):
+       handle slot->data, slot->len, slot->iface
+       sr_shm_release(&shm)
+   sr_shm_wait(&shm, fd, timeout_ms)
+
+   # Peer side
+   lfd = sr_shm_listen(path)
+   fd = sr_shm_accept(lfd, &shm)
+   ... same calls ...
+ */
+
+#ifndef SR_SHM_H
+#define SR_SHM_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "sr_protocol.h"
+
+#define SR_SHM_MAGIC      0x73727368 /* "srsh" */
+#define SR_SHM_SLOTS      1024       /* per ring, a power of two */
+#define SR_SHM_FRAME_MAX  1600
+#define SR_SHM_CACHELINE  64
+
+#define SR_SHM_TO_ROUTER   0
+#define SR_SHM_FROM_ROUTER 1
+
+/* sr_shm_wait results, or'ed together */
+#define SR_SHM_RX_READY  1
+#define SR_SHM_FD_READY  2
+
+struct sr_shm_slot {
+    uint32_t len;
+    char iface[sr_IFACE_NAMELEN];
+    uint8_t data[SR_SHM_FRAME_MAX];
+};
+
+struct sr_shm_ring {
+    uint32_t head __attribute__ ((aligned (SR_SHM_CACHELINE)));  /* written by the producer */
+    uint32_t tail __attribute__ ((aligned (SR_SHM_CACHELINE)));  /* written by the consumer */
+    uint32_t sleeping;                                            /* consumer waits on its eventfd */
+    struct sr_shm_slot slots[SR_SHM_SLOTS] __attribute__ ((aligned (SR_SHM_CACHELINE)));
+};
+
+struct sr_shm_region {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t frame_max;
+    struct sr_shm_ring rings[2] __attribute__ ((aligned (SR_SHM_CACHELINE)));
+};
+
+/* One end of the transport */
+struct sr_shm {
+    struct sr_shm_region *region;
+    struct sr_shm_ring *rx;
+    struct sr_shm_ring *tx;
+    int rx_efd;                 /* kicked by the other end when rx fills up */
+    int tx_efd;                 /* kicked by us when tx fills up */
+    pthread_mutex_t tx_lock;    /* the router sends from more than one thread */
+};
+
+int sr_shm_listen(const char *path);
+int sr_shm_accept(int lfd, struct sr_shm *shm);
+int sr_shm_connect(const char *path, struct sr_shm *shm);
+void sr_shm_close(struct sr_shm *shm);
+
+int sr_shm_send(struct sr_shm *shm, const uint8_t *frame, unsigned int len, const char *iface);
+int sr_shm_send_batch(struct sr_shm *shm, uint8_t *const *frames, const unsigned int *lens,
+                      unsigned int n, const char *iface, uint8_t *taken);
+struct sr_shm_slot *sr_shm_peek(struct sr_shm *shm);
+void sr_shm_release(struct sr_shm *shm);
+int sr_shm_wait(struct sr_shm *shm, int fd, int timeout_ms);
+
+/* sr_shm_wait in two halves, for callers with their own poll loop: block
+   on rx_efd only if sr_shm_prepare_wait returned 0, and call
+   sr_shm_woken after waking up */
+int sr_shm_prepare_wait(struct sr_shm *shm);
+void sr_shm_woken(struct sr_shm *shm);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_event.h"
+#include "sr_tblock.h"
+#include "sr_stats.h"
+
+static const char *sr_stats_proto_names[SR_STATS_NPROTOS] = {
+    "arp", "icmp", "tcp", "udp", "other"
+};
+
+static __thread struct sr_stats *sr_stats_self;
+static struct sr_tblocks sr_stats_threads = SR_TBLOCKS_INIT(struct sr_stats);
+
+/* Exporter state; only the loop thread runs it, ctl reads dropped */
+static struct {
+    char path[256];
+    int fd;                     /* -1 while a FIFO has no reader */
+    unsigned long dropped;      /* lines a full or missing reader missed */
+    uint64_t stamp;             /* monotonic ms of prev */
+    struct sr_stats prev;
+    struct sr_stats now;
+} sr_stats_export_state = { "", -1 };
+
+static struct sr_stats *sr_stats_mine(void) {
+    if (sr_stats_self == NULL) {
+        sr_stats_self = sr_tblock_new(&sr_stats_threads);
+    }
+    return sr_stats_self;
+}
+
+const char *sr_stats_proto_name(int proto) {
+    return (proto >= 0 && proto < SR_STATS_NPROTOS) ? sr_stats_proto_names[proto] : "?";
+}
+
+static int sr_stats_classify(const uint8_t *frame, unsigned int len) {
+    uint16_t type;
+
+    if (len < sizeof(sr_ethernet_hdr_t)) {
+        return SR_STATS_OTHER;
+    }
+    type = ethertype((uint8_t *) frame);
+    if (type == ethertype_arp) {
+        return SR_STATS_ARP;
+    }
+    if (type != ethertype_ip || len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+        return SR_STATS_OTHER;
+    }
+    switch (((const sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t)))->ip_p) {
+        case ip_protocol_icmp:
+            return SR_STATS_ICMP;
+        case ip_protocol_tcp:
+            return SR_STATS_TCP;
+        case ip_protocol_udp:
+            return SR_STATS_UDP;
+    }
+    return SR_STATS_OTHER;
+}
+
+/* Count one frame received on or sent out of iface. iface may be NULL. */
+void sr_stats_count(int dir, const struct sr_if *iface, const uint8_t *frame, unsigned int len) {
+    struct sr_stats *s;
+    int proto;
+
+    if (iface == NULL || iface->index >= SR_STATS_MAX_IFACES) {
+        return;
+    }
+    s = sr_stats_mine();
+    proto = sr_stats_classify(frame, len);
+    s->packets[iface->index][dir][proto]++;
+    s->bytes[iface->index][dir][proto] += len;
+}
+
+void sr_stats_count_nat(int dir) {
+    sr_stats_mine()->nat[dir]++;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_snapshot(..)
+ *
+ * Add up every thread's counters into out, without stopping the
+ * threads. Each counter is read with one load.
+ *---------------------------------------------------------------------*/
+static void sr_stats_add(void *block, void *arg) {
+    const uint64_t *c = block;
+    uint64_t *sum = arg;
+    size_t i;
+
+    for (i = 0; i < sizeof(struct sr_stats) / sizeof(uint64_t); i++) {
+        sum[i] += __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+    }
+}
+
+void sr_stats_snapshot(struct sr_stats *out) {
+    memset(out, 0, sizeof(*out));
+    sr_tblocks_foreach(&sr_stats_threads, sr_stats_add, out);
+}
+
+static void sr_stats_dump_protos(FILE *fp, const uint64_t *packets) {
+    unsigned int p;
+
+    for (p = 0; p < SR_STATS_NPROTOS; p++) {
+        fprintf(fp, "%s\"%s\":%" PRIu64, p ? "," : "", sr_stats_proto_names[p], packets[p]);
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_dump_json(..)
+ *
+ * Totals since start: one JSON line per interface, then one line of NAT
+ * translations, and with -X the number of rate lines the exporter
+ * dropped.
+ *---------------------------------------------------------------------*/
+void sr_stats_dump_json(struct sr_instance *sr, FILE *fp) {
+    struct sr_stats s;
+    struct sr_if *iface;
+    uint64_t pkts[SR_STATS_NDIRS], bytes[SR_STATS_NDIRS];
+    unsigned int dir, p;
+
+    sr_stats_snapshot(&s);
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (iface->index >= SR_STATS_MAX_IFACES) {
+            continue;
+        }
+        for (dir = 0; dir < SR_STATS_NDIRS; dir++) {
+            pkts[dir] = bytes[dir] = 0;
+            for (p = 0; p < SR_STATS_NPROTOS; p++) {
+                pkts[dir] += s.packets[iface->index][dir][p];
+                bytes[dir] += s.bytes[iface->index][dir][p];
+            }
+        }
+        fprintf(fp, "{\"iface\":\"%s\",\"rx_packets\":%" PRIu64 ",\"rx_bytes\":%" PRIu64 ","
+                "\"tx_packets\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 ",\"rx_by_proto\":{",
+                iface->name, pkts[SR_STATS_RX], bytes[SR_STATS_RX], pkts[SR_STATS_TX], bytes[SR_STATS_TX]);
+        sr_stats_dump_protos(fp, s.packets[iface->index][SR_STATS_RX]);
+        fprintf(fp, "},\"tx_by_proto\":{");
+        sr_stats_dump_protos(fp, s.packets[iface->index][SR_STATS_TX]);
+        fprintf(fp, "}}\n");
+    }
+    fprintf(fp, "{\"nat_out\":%" PRIu64 ",\"nat_in\":%" PRIu64 "}\n",
+            s.nat[SR_STATS_NAT_OUT], s.nat[SR_STATS_NAT_IN]);
+    if (sr_stats_export_state.path[0]) {
+        fprintf(fp, "{\"export_dropped\":%lu}\n",
+                __atomic_load_n(&sr_stats_export_state.dropped, __ATOMIC_RELAXED));
+    }
+}
+
+/* Opens the export file without blocking. A FIFO with no reader yet is
+   not an error: the exporter stays closed and tries again next time. */
+static int sr_stats_export_reopen(void) {
+    int fd = open(sr_stats_export_state.path, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK, 0644);
+
+    if (fd < 0 && errno != ENXIO) {
+        perror("open(..):sr_stats_export_open");
+    }
+    return sr_stats_export_state.fd = fd;
+}
+
+/* Write the lines in buf, each whole or not at all, and never wait for
+   the reader: a line is shorter than PIPE_BUF, so a FIFO with no room
+   refuses it with EAGAIN, and it and the rest of the batch are dropped.
+   A reader that went away (EPIPE; SIGPIPE is ignored) is reopened on a
+   later tick. */
+static void sr_stats_export_write(const char *buf, size_t len) {
+    const char *line = buf, *end = buf + len, *nl;
+    ssize_t n;
+
+    if (sr_stats_export_state.fd < 0) {
+        sr_stats_export_reopen();
+    }
+    while (sr_stats_export_state.fd >= 0 && line < end) {
+        nl = (const char *) memchr(line, '\n', end - line) + 1;
+        if ((n = write(sr_stats_export_state.fd, line, nl - line)) == nl - line) {
+            line = nl;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno == EPIPE) {
+                close(sr_stats_export_state.fd);
+                sr_stats_export_state.fd = -1;
+            }
+            break;
+        }
+    }
+    for (; line < end; line++) {
+        if (*line == '\n') {
+            __atomic_add_fetch(&sr_stats_export_state.dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void sr_stats_export_rates(FILE *fp, const uint64_t *now, const uint64_t *prev,
+                                  unsigned int n, double secs) {
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        fprintf(fp, "%s\"%s\":%.1f", i ? "," : "", sr_stats_proto_names[i],
+                (now[i] - prev[i]) / secs);
+    }
+}
+
+static int sr_stats_export(struct sr_instance *sr, void *arg) {
+    struct sr_stats *now = &(sr_stats_export_state.now), *prev = &(sr_stats_export_state.prev);
+    FILE *fp;
+    char *buf = NULL;
+    size_t len = 0;
+    uint64_t stamp = monotonic_ms();
+    double secs = (stamp - sr_stats_export_state.stamp) / 1000.0;
+    struct sr_if *iface;
+    uint64_t pkts[SR_STATS_NDIRS], bytes[SR_STATS_NDIRS];
+    unsigned int dir, p;
+
+    if (secs <= 0 || (fp = open_memstream(&buf, &len)) == NULL) {
+        return 1;
+    }
+    sr_stats_snapshot(now);
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (iface->index >= SR_STATS_MAX_IFACES) {
+            continue;
+        }
+        for (dir = 0; dir < SR_STATS_NDIRS; dir++) {
+            pkts[dir] = bytes[dir] = 0;
+            for (p = 0; p < SR_STATS_NPROTOS; p++) {
+                pkts[dir] += now->packets[iface->index][dir][p] - prev->packets[iface->index][dir][p];
+                bytes[dir] += now->bytes[iface->index][dir][p] - prev->bytes[iface->index][dir][p];
+            }
+        }
+        fprintf(fp, "{\"ms\":%" PRIu64 ",\"iface\":\"%s\",\"rx_pps\":%.1f,\"rx_bytes_ps\":%.1f,"
+                "\"tx_pps\":%.1f,\"tx_bytes_ps\":%.1f,\"rx_pps_by_proto\":{",
+                stamp, iface->name, pkts[SR_STATS_RX] / secs, bytes[SR_STATS_RX] / secs,
+                pkts[SR_STATS_TX] / secs, bytes[SR_STATS_TX] / secs);
+        sr_stats_export_rates(fp, now->packets[iface->index][SR_STATS_RX],
+                              prev->packets[iface->index][SR_STATS_RX], SR_STATS_NPROTOS, secs);
+        fprintf(fp, "},\"tx_pps_by_proto\":{");
+        sr_stats_export_rates(fp, now->packets[iface->index][SR_STATS_TX],
+                              prev->packets[iface->index][SR_STATS_TX], SR_STATS_NPROTOS, secs);
+        fprintf(fp, "}}\n");
+    }
+    if (sr->nat_mode) {
+        fprintf(fp, "{\"ms\":%" PRIu64 ",\"nat_out_ps\":%.1f,\"nat_in_ps\":%.1f}\n", stamp,
+                (now->nat[SR_STATS_NAT_OUT] - prev->nat[SR_STATS_NAT_OUT]) / secs,
+                (now->nat[SR_STATS_NAT_IN] - prev->nat[SR_STATS_NAT_IN]) / secs);
+    }
+    fclose(fp);
+    sr_stats_export_write(buf, len);
+    free(buf);
+
+    *prev = *now;
+    sr_stats_export_state.stamp = stamp;
+    return 1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_export_open(..)
+ *
+ * spec is "path[,interval_ms]". Opens path for appending (a FIFO works
+ * for a reader that wants a stream) and adds a timer to sr->loop that
+ * writes, every interval, one JSON line per interface with its packet
+ * and byte rates, plus one line of NAT translation rates in NAT mode.
+ * Nothing waits on the reader: a FIFO is picked up once a reader opens
+ * it, and lines it has no room for are dropped and counted.
+ * Returns 0, or -1 if the file cannot be opened.
+ *---------------------------------------------------------------------*/
+int sr_stats_export_open(struct sr_instance *sr, const char *spec) {
+    const char *comma = strchr(spec, ',');
+    size_t len = comma ? (size_t) (comma - spec) : strlen(spec);
+    int interval = comma ? atoi(comma + 1) : SR_STATS_EXPORT_MS;
+
+    if (len >= sizeof(sr_stats_export_state.path) || interval <= 0) {
+        fprintf(stderr, "Bad stats export %s\n", spec);
+        return -1;
+    }
+    memcpy(sr_stats_export_state.path, spec, len);
+    sr_stats_export_state.path[len] = '\0';
+    if (sr_stats_export_reopen() < 0 && errno != ENXIO) {
+        return -1;
+    }
+    sr_stats_snapshot(&(sr_stats_export_state.prev));
+    sr_stats_export_state.stamp = monotonic_ms();
+    if (sr_event_add_timer(&(sr->loop), interval, sr_stats_export, NULL) == NULL) {
+        if (sr_stats_export_state.fd >= 0) {
+            close(sr_stats_export_state.fd);
+            sr_stats_export_state.fd = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* Traffic counters.
+
+   Packets and bytes received and sent, per interface and per protocol
+   (ARP, ICMP, TCP, UDP, anything else), and NAT translations in each
+   direction. Receive is counted as the transport hands a frame to the
+   router, transmit once the transport has taken it.
+
+   As with the drop counters, every counting thread has a block of its
+   own (sr_tblock.h) and sr_stats_snapshot adds the blocks up.
+
+   Interfaces are counted by sr_if index; interfaces past
+   SR_STATS_MAX_IFACES are not counted.
+
+   The exporter (sr_stats_export_open, -X) samples the counters on a
+   timer and appends per-second rates to a file as JSON lines.
+ */
+
+#ifndef SR_STATS_H
+#define SR_STATS_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+struct sr_instance;
+struct sr_if;
+
+#define SR_STATS_MAX_IFACES  16
+#define SR_STATS_EXPORT_MS   1000   /* default export interval */
+
+enum sr_stats_dir {
+    SR_STATS_RX,
+    SR_STATS_TX,
+    SR_STATS_NDIRS
+};
+
+enum sr_stats_proto {
+    SR_STATS_ARP,
+    SR_STATS_ICMP,
+    SR_STATS_TCP,
+    SR_STATS_UDP,
+    SR_STATS_OTHER,
+    SR_STATS_NPROTOS
+};
+
+enum sr_stats_nat_dir {
+    SR_STATS_NAT_OUT,   /* internal to external */
+    SR_STATS_NAT_IN,    /* external to internal, ICMP errors included */
+    SR_STATS_NAT_NDIRS
+};
+
+/* Only uint64_t members: snapshots add blocks up word by word */
+struct sr_stats {
+    uint64_t packets[SR_STATS_MAX_IFACES][SR_STATS_NDIRS][SR_STATS_NPROTOS];
+    uint64_t bytes[SR_STATS_MAX_IFACES][SR_STATS_NDIRS][SR_STATS_NPROTOS];
+    uint64_t nat[SR_STATS_NAT_NDIRS];
+};
+
+void sr_stats_count(int dir, const struct sr_if *iface, const uint8_t *frame, unsigned int len);
+void sr_stats_count_nat(int dir);
+void sr_stats_snapshot(struct sr_stats *out);
+const char *sr_stats_proto_name(int proto);
+void sr_stats_dump_json(struct sr_instance *sr, FILE *fp);
+int sr_stats_export_open(struct sr_instance *sr, const char *spec);
+
+#endif
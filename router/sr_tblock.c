@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sr_tblock.h"
+
+/* Sits in a cache line of its own in front of the block, so walking the
+   set never touches a line a counting thread writes */
+struct sr_tblock {
+    struct sr_tblock *next;
+};
+
+/* A zeroed block for the calling thread, linked into set. Aborts if
+   there is no memory: counting has no way to report a failure. */
+void *sr_tblock_new(struct sr_tblocks *set) {
+    struct sr_tblock *b;
+    void *mem;
+
+    if (posix_memalign(&mem, SR_TBLOCK_ALIGN, SR_TBLOCK_ALIGN + set->size) != 0) {
+        abort();
+    }
+    memset(mem, 0, SR_TBLOCK_ALIGN + set->size);
+    b = mem;
+    pthread_mutex_lock(&(set->lock));
+    b->next = set->head;
+    set->head = b;
+    pthread_mutex_unlock(&(set->lock));
+    return (char *) mem + SR_TBLOCK_ALIGN;
+}
+
+/* Call fn on every block of set, holding the set's lock. The threads
+   that own the blocks keep counting meanwhile. */
+void sr_tblocks_foreach(struct sr_tblocks *set, void (*fn)(void *block, void *arg), void *arg) {
+    struct sr_tblock *b;
+
+    pthread_mutex_lock(&(set->lock));
+    for (b = set->head; b; b = b->next) {
+        fn((char *) b + SR_TBLOCK_ALIGN, arg);
+    }
+    pthread_mutex_unlock(&(set->lock));
+}
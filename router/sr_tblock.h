@@ -0,0 +1,43 @@
+/* Per-thread blocks for counters that many threads bump and one reader
+   adds up (drop counters, traffic counters, stage histograms).
+
+   Each thread gets its own zeroed block, aligned to a cache line, the
+   first time it counts; after that counting is a plain increment with no
+   lock and no shared line. Blocks are linked into their set under the
+   set's lock and never freed, so a thread's numbers outlive it and a
+   reader can walk the set while the threads keep counting.
+
+   --
+
+   static struct sr_tblocks set = SR_TBLOCKS_INIT(struct my_counters);
+   static __thread struct my_counters *self;
+
+   if (self == NULL)
+       self = sr_tblock_new(&set);
+   self->count++;
+
+   sr_tblocks_foreach(&set, add_up, &total);
+ */
+
+#ifndef SR_TBLOCK_H
+#define SR_TBLOCK_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SR_TBLOCK_ALIGN 64
+
+struct sr_tblock;
+
+struct sr_tblocks {
+    size_t size;                /* bytes per block */
+    struct sr_tblock *head;
+    pthread_mutex_t lock;
+};
+
+#define SR_TBLOCKS_INIT(type) { sizeof(type), NULL, PTHREAD_MUTEX_INITIALIZER }
+
+void *sr_tblock_new(struct sr_tblocks *set);
+void sr_tblocks_foreach(struct sr_tblocks *set, void (*fn)(void *block, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,111 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_tool.c
+ *
+ * Description:
+ *
+ * Code shared by the offline tools; see sr_tool.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_nat.h"
+#include "sr_tool.h"
+
+uint64_t sr_tool_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* qsort order for latency samples */
+int sr_tool_cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+int sr_tool_parse_mac(const char* s, unsigned char* mac)
+{
+    unsigned int b[ETHER_ADDR_LEN];
+    int i;
+
+    if (sscanf(s, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETHER_ADDR_LEN) {
+        return -1;
+    }
+    for (i = 0; i < ETHER_ADDR_LEN; i++) {
+        if (b[i] > 0xff) {
+            return -1;
+        }
+        mac[i] = b[i];
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tool_load_config(..)
+ *
+ * Read an interface config, handing each interface to iface_fn and each
+ * "arp" line to arp_fn. Returns 0, or -1 if the file cannot be read, a
+ * line is malformed or rejected, or it lists no interface.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_tool_load_config(const char* fname, sr_tool_iface_fn iface_fn, sr_tool_arp_fn arp_fn, void* arg)
+{
+    FILE* fp = fopen(fname, "r");
+    char line[256];
+    char name[sr_IFACE_NAMELEN], mac[32], ip[32];
+    struct in_addr addr;
+    unsigned char hw[ETHER_ADDR_LEN];
+    int lineno = 0, n_ifaces = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening interface config %s\n", fname);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (line[0] == '#' || sscanf(line, "%31s", name) != 1) {
+            continue;
+        }
+        if (strcmp(name, "arp") == 0) {
+            if (sscanf(line, "%*s %31s %31s", ip, mac) != 2 || inet_aton(ip, &addr) == 0 ||
+                    sr_tool_parse_mac(mac, hw) != 0 || arp_fn(arg, addr.s_addr, hw) != 0) {
+                fprintf(stderr, "%s:%d: bad arp entry\n", fname, lineno);
+                fclose(fp);
+                return -1;
+            }
+        } else {
+            if (sscanf(line, "%*s %31s %31s", mac, ip) != 2 || inet_aton(ip, &addr) == 0 ||
+                    sr_tool_parse_mac(mac, hw) != 0 || iface_fn(arg, name, hw, addr.s_addr) != 0) {
+                fprintf(stderr, "%s:%d: bad interface entry\n", fname, lineno);
+                fclose(fp);
+                return -1;
+            }
+            n_ifaces++;
+        }
+    }
+    fclose(fp);
+
+    if (n_ifaces == 0) {
+        fprintf(stderr, "No interfaces in %s\n", fname);
+        return -1;
+    }
+    return 0;
+} /* -- sr_tool_load_config -- */
+
+/* The NAT timeouts sr starts with unless told otherwise */
+void sr_tool_nat_defaults(struct sr_nat* nat)
+{
+    nat->icmp_query_timeout = SR_NAT_DEFAULT_ICMP_QUERY_TIMEOUT;
+    nat->tcp_estb_timeout = SR_NAT_DEFAULT_TCP_ESTB_TIMEOUT;
+    nat->tcp_trns_timeout = SR_NAT_DEFAULT_TCP_TRNS_TIMEOUT;
+}
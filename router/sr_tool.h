@@ -0,0 +1,33 @@
+/* Helpers shared by the offline tools (sr_replay, sr_bench,
+   sr_vns_server): timing, sorting samples, and the interface config
+   file they all read:
+
+     # name  hardware address   ip
+     eth1    00:00:00:00:01:01  10.0.1.1
+     # neighbours, preloaded in the ARP cache or answered for
+     arp     10.0.1.100         00:00:00:00:01:64
+
+   --
+
+   sr_tool_load_config(fname, iface_fn, arp_fn, arg)   one call per line
+   sr_tool_nat_defaults(&sr.nat)                       timeouts as sr uses
+ */
+
+#ifndef SR_TOOL_H
+#define SR_TOOL_H
+
+#include <inttypes.h>
+
+struct sr_nat;
+
+/* Called for each line of the config; return -1 to reject it */
+typedef int (*sr_tool_iface_fn)(void* arg, const char* name, const unsigned char* mac, uint32_t ip);
+typedef int (*sr_tool_arp_fn)(void* arg, uint32_t ip, const unsigned char* mac);
+
+uint64_t sr_tool_now_ns(void);
+int sr_tool_cmp_u32(const void* a, const void* b);
+int sr_tool_parse_mac(const char* s, unsigned char* mac);
+int sr_tool_load_config(const char* fname, sr_tool_iface_fn iface_fn, sr_tool_arp_fn arp_fn, void* arg);
+void sr_tool_nat_defaults(struct sr_nat* nat);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "sr_protocol.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
@@ -19,6 +20,33 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* Milliseconds on the monotonic clock, for timers that must not jump with
+   the wall clock */
+uint64_t monotonic_ms (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Incrementally update a checksum after a 16-bit word of the covered data
+   changes from old to new (RFC 1624, eqn. 3). Values are taken as they sit
+   in the packet, so no byte swapping is needed. */
+uint16_t cksum_update16 (uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t s = (uint16_t) ~sum;
+
+  s += (uint16_t) ~old;
+  s += new;
+  while (s > 0xffff)
+    s = (s >> 16) + (s & 0xffff);
+  return (uint16_t) ~s;
+}
+
+/* Same as cksum_update16 for a 32-bit field such as an IP address */
+uint16_t cksum_update32 (uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_update16 (sum, old >> 16, new >> 16);
+  return cksum_update16 (sum, old & 0xffff, new & 0xffff);
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -74,6 +102,43 @@ uint32_t tcp_cksum(sr_ip_hdr_t *ip_hdr, sr_tcp_hdr_t *tcp_hdr, int total_len) {
 }
 
 
+/* Write a TCP segment of 'size' bytes, ethernet header included, with
+   valid IP and TCP checksums. Used by the traffic generators. */
+unsigned int build_tcp_frame(uint8_t *buf, unsigned int size,
+                             const uint8_t *smac, const uint8_t *dmac,
+                             uint32_t src, uint32_t dst,
+                             uint16_t sport, uint16_t dport, int syn) {
+  sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t *)buf;
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+  sr_tcp_hdr_t *tcp_hdr = (sr_tcp_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+  memset(buf, 0, size);
+  memcpy(eth_hdr->ether_shost, smac, ETHER_ADDR_LEN);
+  memcpy(eth_hdr->ether_dhost, dmac, ETHER_ADDR_LEN);
+  eth_hdr->ether_type = htons(ethertype_ip);
+
+  ip_hdr->ip_v = 4;
+  ip_hdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+  ip_hdr->ip_len = htons(size - sizeof(sr_ethernet_hdr_t));
+  ip_hdr->ip_off = htons(IP_DF);
+  ip_hdr->ip_ttl = 64;
+  ip_hdr->ip_p = ip_protocol_tcp;
+  ip_hdr->ip_src = src;
+  ip_hdr->ip_dst = dst;
+  ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+
+  tcp_hdr->src_port = htons(sport);
+  tcp_hdr->dst_port = htons(dport);
+  tcp_hdr->seq_num = htonl(1);
+  tcp_hdr->data_offset = sizeof(sr_tcp_hdr_t) / 4;
+  tcp_hdr->syn = syn;
+  tcp_hdr->ack = !syn;
+  tcp_hdr->window = htons(65535);
+  tcp_hdr->tcp_sum = tcp_cksum(ip_hdr, tcp_hdr, size);
+
+  return size;
+}
+
 /* Prints out formatted Ethernet address, e.g. 00:11:22:33:44:55 */
 void print_addr_eth(uint8_t *addr) {
   int pos = 0;
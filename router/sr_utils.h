@@ -31,7 +31,14 @@
 #define SR_UTILS_H
 
 uint16_t cksum(const void *_data, int len);
+uint64_t monotonic_ms(void);
 uint32_t tcp_cksum(sr_ip_hdr_t *ipHdr, sr_tcp_hdr_t *tcpHdr, int total_len);
+uint16_t cksum_update16(uint16_t sum, uint16_t old, uint16_t new);
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new);
+unsigned int build_tcp_frame(uint8_t *buf, unsigned int size,
+                             const uint8_t *smac, const uint8_t *dmac,
+                             uint32_t src, uint32_t dst,
+                             uint16_t sport, uint16_t dport, int syn);
 
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
@@ -35,11 +35,15 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_perf.h"
+#include "sr_drop.h"
+#include "sr_stats.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
@@ -335,7 +339,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 {
     int command, len;
     unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -424,27 +427,11 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         /* -------------        VNSPACKET     -------------------- */
 
         case VNSPACKET:
-            sr_pkt = (c_packet_ethernet_header *)buf;
-
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
-
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
-
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
+            sr_dispatch_packet(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
                     (char*)(buf + sizeof(c_base)));
-
             break;
 
             /* -------------        VNSCLOSE      -------------------- */
@@ -506,6 +493,149 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
     return ret;
 }/* -- sr_read_from_server -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_dispatch_packet(..)
+ * Scope: global
+ *
+ * Hand a frame received on 'iface' to the router, whichever transport it
+ * came in on.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_dispatch_packet(struct sr_instance* sr /* borrowed */,
+                        uint8_t* packet /* lent */,
+                        unsigned int len,
+                        char* iface /* lent */)
+{
+    sr_stats_count(SR_STATS_RX, sr_get_interface(sr, iface), packet, len);
+
+    /* -- check if it is an ARP to another router if so drop   -- */
+    if ( sr_arp_req_not_for_us(sr, packet, len, iface) )
+    {
+        SR_DROP(SR_DROP_ARP_NOT_FOR_US);
+        return;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr, packet, len);
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_handlepacket(sr, packet, len, iface);
+} /* -- sr_dispatch_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_connect_to_shm(..)
+ * Scope: global
+ *
+ * Attach to a local peer's shared-memory rings instead of a VNS server.
+ * There is no authentication or topology request; the peer describes the
+ * interfaces with a VNSHWINFO right after handing over the rings.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_connect_to_shm(struct sr_instance* sr, const char* path)
+{
+    /* REQUIRES */
+    assert(sr);
+    assert(path);
+
+    if ((sr->sockfd = sr_shm_connect(path, &(sr->shm))) < 0)
+    { return -1; }
+    sr->transport = SR_TRANSPORT_SHM;
+
+    if (sr_read_from_server_expect(sr, VNSHWINFO) != 1)
+    { return -1; }
+
+    return 0;
+} /* -- sr_connect_to_shm -- */
+
+/*-----------------------------------------------------------------------------
+ * Event loop sources for the transports
+ *
+ * The server (or control) socket delivers one command per readiness. The
+ * shared-memory receive ring is drained in bounded bursts so the other
+ * sources get their turn; its prepare step arms the eventfd kick before
+ * the loop sleeps.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_server_dispatch(struct sr_instance* sr, void* arg)
+{
+    SR_PERF_BEGIN(t0);
+    int ret = sr_read_from_server(sr);
+    SR_PERF_END(SR_PERF_RX, t0);
+    return ret;
+}
+
+static int sr_shm_dispatch(struct sr_instance* sr, void* arg)
+{
+    struct sr_shm_slot* slot;
+    char iface[sr_IFACE_NAMELEN + 1];
+    uint32_t len;
+    int n = 0;
+    SR_PERF_BEGIN(t0);
+
+    sr_shm_woken(&(sr->shm));
+    while (n < SR_SHM_SLOTS && (slot = sr_shm_peek(&(sr->shm))) != NULL)
+    {
+        /* The slot is shared with the peer: read its length once and
+         * bound it, and terminate our own copy of the name */
+        len = *(volatile uint32_t*)&(slot->len);
+        if (len > SR_SHM_FRAME_MAX)
+        {
+            SR_DROP(SR_DROP_RX_LEN);
+        }
+        else
+        {
+            memcpy(iface, slot->iface, sr_IFACE_NAMELEN);
+            iface[sizeof(iface) - 1] = '\0';
+            sr_dispatch_packet(sr, slot->data, len, iface);
+        }
+        sr_shm_release(&(sr->shm));
+        n++;
+    }
+    SR_PERF_END(SR_PERF_RX, t0);
+    return 1;
+}
+
+static int sr_shm_prepare(struct sr_instance* sr, void* arg)
+{
+    return sr_shm_prepare_wait(&(sr->shm));
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_add_transport(..)
+ * Scope: global
+ *
+ * Put the connected transport on the event loop. Returns 0 on success.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_event_add_transport(struct sr_instance* sr)
+{
+    /* REQUIRES */
+    assert(sr);
+
+    switch (sr->transport)
+    {
+        case SR_TRANSPORT_AFPACKET:
+            return sr_afpacket_add_sources(sr, &(sr->loop));
+
+        case SR_TRANSPORT_SHM:
+            if (sr_event_add(&(sr->loop), sr->shm.rx_efd, sr_shm_dispatch,
+                        sr_shm_prepare, NULL) == NULL)
+            { return -1; }
+            /* fall through: VNSCLOSE still comes over the control socket */
+
+        default:
+            if (sr_event_add(&(sr->loop), sr->sockfd, sr_server_dispatch,
+                        NULL, NULL) == NULL)
+            { return -1; }
+    }
+
+    return 0;
+} /* -- sr_event_add_transport -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
  * Scope: Local
@@ -559,13 +689,36 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
  *
  *---------------------------------------------------------------------------*/
 
+static int sr_transmit(struct sr_instance* , uint8_t* , unsigned int , const char* );
+static int sr_transmit_batch(struct sr_instance* , uint8_t** , unsigned int* ,
+                             unsigned int , const char* );
+static int sr_write_batch(struct sr_instance* , uint8_t** , unsigned int* ,
+                          unsigned int , const char* );
+static int sr_writev_all(int , struct iovec* , int );
+
 int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          uint8_t* buf /* borrowed */ ,
                          unsigned int len,
                          const char* iface /* borrowed */)
+{
+    SR_PERF_BEGIN(t0);
+    int ret = sr_transmit(sr, buf, len, iface);
+    SR_PERF_END(SR_PERF_TX, t0);
+    if (ret < 0)
+    { SR_DROP(SR_DROP_TX); }
+    else
+    { sr_stats_count(SR_STATS_TX, sr_get_interface(sr, iface), buf, len); }
+    return ret;
+} /* -- sr_send_packet -- */
+
+static int sr_transmit(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const char* iface /* borrowed */)
 {
     c_packet_header *sr_pkt;
     unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct iovec iov;
 
     /* REQUIRES */
     assert(sr);
@@ -578,6 +731,23 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
+    if ( sr->transport == SR_TRANSPORT_SHM ){
+        sr_log_packet(sr,buf,len);
+        if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+            fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+            return -1;
+        }
+        return sr_shm_send(&(sr->shm), buf, len, iface);
+    }
+    if ( sr->transport == SR_TRANSPORT_AFPACKET ){
+        sr_log_packet(sr,buf,len);
+        if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+            fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+            return -1;
+        }
+        return sr_afpacket_send(sr, buf, len, iface);
+    }
+
     /* Create packet */
     sr_pkt = (c_packet_header *)malloc(len +
             sizeof(c_packet_header));
@@ -597,7 +767,9 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
+    iov.iov_base = sr_pkt;
+    iov.iov_len = total_len;
+    if( sr_writev_all(sr->sockfd, &iov, 1) != 0 ){
         fprintf(stderr, "Error writing packet\n");
         free(sr_pkt);
         return -1;
@@ -606,7 +778,152 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     free(sr_pkt);
 
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_transmit -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packets(..)
+ * Scope: Global
+ *
+ * Send n packets out of the same interface in one go: one ring update and
+ * kick on the shared-memory and raw-socket transports, one writev to the
+ * VNS server. Returns the number of packets sent.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packets(struct sr_instance* sr /* borrowed */,
+                    uint8_t** bufs /* borrowed */,
+                    unsigned int* lens,
+                    unsigned int n,
+                    const char* iface /* borrowed */)
+{
+    SR_PERF_BEGIN(t0);
+    int ret = sr_transmit_batch(sr, bufs, lens, n, iface);
+    SR_PERF_END(SR_PERF_TX, t0);
+    if (ret < (int) n)
+    { SR_DROP_N(SR_DROP_TX, n - (ret < 0 ? 0 : ret)); }
+    return ret;
+} /* -- sr_send_packets -- */
+
+static int sr_transmit_batch(struct sr_instance* sr /* borrowed */,
+                             uint8_t** bufs /* borrowed */,
+                             unsigned int* lens,
+                             unsigned int n,
+                             const char* iface /* borrowed */)
+{
+    uint8_t* ok_bufs[SR_SEND_BATCH];
+    unsigned int ok_lens[SR_SEND_BATCH];
+    uint8_t taken[SR_SEND_BATCH];
+    unsigned int i, m = 0;
+    int sent;
+    struct sr_if* out_iface;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(iface);
+    assert(n <= SR_SEND_BATCH);
+
+    for (i = 0; i < n; i++)
+    {
+        if ( lens[i] < sizeof(struct sr_ethernet_hdr) ){
+            fprintf(stderr , "** Error: packet is wayy to short \n");
+            continue;
+        }
+        sr_log_packet(sr,bufs[i],lens[i]);
+        if ( ! sr_ether_addrs_match_interface( sr, bufs[i], iface) ){
+            fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+            continue;
+        }
+        ok_bufs[m] = bufs[i];
+        ok_lens[m++] = lens[i];
+    }
+    if (m == 0)
+    { return 0; }
+
+    if ( sr->transport == SR_TRANSPORT_SHM ){
+        sent = sr_shm_send_batch(&(sr->shm), ok_bufs, ok_lens, m, iface, taken);
+    }
+    else if ( sr->transport == SR_TRANSPORT_AFPACKET ){
+        sent = sr_afpacket_send_batch(sr, ok_bufs, ok_lens, m, iface, taken);
+    }
+    else
+    {
+        /* The VNS socket takes the whole batch or fails */
+        sent = sr_write_batch(sr, ok_bufs, ok_lens, m, iface);
+        memset(taken, sent == (int) m, m);
+    }
+
+    /* A transport may skip a frame and take the ones after it */
+    out_iface = sr_get_interface(sr, iface);
+    for (i = 0; i < m; i++)
+    {
+        if (taken[i])
+        { sr_stats_count(SR_STATS_TX, out_iface, ok_bufs[i], ok_lens[i]); }
+    }
+
+    return sent;
+} /* -- sr_transmit_batch -- */
+
+/* One writev to the VNS server for m checked packets */
+static int sr_write_batch(struct sr_instance* sr /* borrowed */,
+                          uint8_t** ok_bufs /* borrowed */,
+                          unsigned int* ok_lens,
+                          unsigned int m,
+                          const char* iface /* borrowed */)
+{
+    c_packet_header hdrs[SR_SEND_BATCH];
+    struct iovec iov[2 * SR_SEND_BATCH];
+    unsigned int i;
+
+    for (i = 0; i < m; i++)
+    {
+        hdrs[i].mLen  = htonl(ok_lens[i] + sizeof(c_packet_header));
+        hdrs[i].mType = htonl(VNSPACKET);
+        strncpy(hdrs[i].mInterfaceName,iface,16);
+        iov[2 * i].iov_base = &hdrs[i];
+        iov[2 * i].iov_len = sizeof(c_packet_header);
+        iov[2 * i + 1].iov_base = ok_bufs[i];
+        iov[2 * i + 1].iov_len = ok_lens[i];
+    }
+
+    if( sr_writev_all(sr->sockfd, iov, 2 * m) != 0 ){
+        fprintf(stderr, "Error writing packet\n");
+        return -1;
+    }
+
+    return m;
+} /* -- sr_write_batch -- */
+
+/* Write all of iov, which is used up on the way. A short write (a signal,
+ * or a send buffer with room for only part of a batch) carries on from
+ * where it stopped, so the server never sees half a packet. Returns 0, or
+ * -1 on error. */
+static int sr_writev_all(int fd, struct iovec* iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0)
+    {
+        if ((ret = writev(fd, iov, iovcnt)) < 0)
+        {
+            if (errno == EINTR)
+            { continue; }
+            perror("writev(..):sr_writev_all");
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t*) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+} /* -- sr_writev_all -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -660,7 +977,9 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
 
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
+            (a_hdr->ar_tip     != iface->ip ) &&
+            (a_hdr->ar_sip     != a_hdr->ar_tip ) && /* gratuitous ARP is for everyone */
+            !(sr->nat_mode && sr_nat_is_external_addr(&(sr->nat), a_hdr->ar_tip)) )
     { return 1; }
 
     return 0;
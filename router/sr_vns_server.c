@@ -0,0 +1,811 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_vns_server.c
+ *
+ * Description:
+ *
+ * Minimal stand-in for the VNS server (pox_module/cs144/srhandler.py) for
+ * end-to-end throughput tests. It listens on a local TCP port, accepts one
+ * router, walks it through the authentication and VNSOPEN exchange of
+ * vnscommand.h, hands it the interfaces from a config file (the same format
+ * sr_replay uses) in a VNSHWINFO message and then pushes frames at a fixed
+ * rate through the router's real sr_read_from_server loop.
+ *
+ * Frames are either replayed from a pcap capture (-f) or generated TCP
+ * segments (-g) carrying a sequence number and send time in their payload.
+ * Every frame the router sends back is counted; for generated traffic the
+ * tag gives the round-trip latency through the router. ARP requests from
+ * the router are answered from the "arp" lines of the config, the way the
+ * neighbours on a real link would.
+ *
+ * With -S the router attaches over the shared-memory transport (sr_shm.h)
+ * instead: there is no authentication or VNSOPEN, the VNSHWINFO and the
+ * final VNSCLOSE go over the Unix control socket and frames go through the
+ * rings.
+ *
+ * Authentication is not checked; any reply is accepted.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_protocol.h"
+#include "sr_dumper.h"
+#include "sr_utils.h"
+#include "sr_shm.h"
+#include "sr_tool.h"
+#include "vnscommand.h"
+
+extern char* optarg;
+
+#define DEFAULT_PORT 8888
+#define DEFAULT_COUNT 100000
+#define DEFAULT_SIZE 128
+#define DEFAULT_FLOWS 64
+#define DEFAULT_DRAIN_MS 1000
+#define SERVER_MAX_IFACES 16
+#define SERVER_MAX_ARP 256
+#define SERVER_MAX_FRAME 1514
+#define SERVER_SALT_LEN 16
+#define SERVER_TAG_MAGIC 0x76736e74 /* "vsnt" */
+#define SERVER_RING_WAIT_NS 1000000000ULL /* give up on a ring that stays full */
+
+struct server_iface {
+    char name[sr_IFACE_NAMELEN];
+    unsigned char mac[ETHER_ADDR_LEN];
+    uint32_t ip;
+};
+
+struct server_neighbour {
+    uint32_t ip;
+    unsigned char mac[ETHER_ADDR_LEN];
+};
+
+/* Written into the payload of generated frames */
+struct server_tag {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t sent_ns;
+} __attribute__ ((packed));
+
+struct server_frame {
+    uint8_t* buf;
+    unsigned int len;
+    char iface[sr_IFACE_NAMELEN];
+};
+
+static struct server_iface ifaces[SERVER_MAX_IFACES];
+static int n_ifaces = 0;
+static struct server_neighbour neighbours[SERVER_MAX_ARP];
+static int n_neighbours = 0;
+
+static int sockfd = -1;
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static int use_shm = 0;
+static struct sr_shm shm;
+
+/* -- run state shared by the sender and the receiver -- */
+static volatile int sending_done = 0;
+static unsigned long frames_sent = 0;
+static unsigned long frames_received = 0;
+static unsigned long arp_answered = 0;
+static unsigned long tagged_received = 0;
+static uint64_t first_tx_ns = 0;
+static uint64_t last_rx_ns = 0;
+static uint32_t* latencies = NULL;
+static unsigned long max_tagged = 0;
+static FILE* rx_dump = NULL;
+
+static void usage(char* argv0)
+{
+    printf("Simple Router VNS Server\n");
+    printf("Format: %s -c ifconfig (-f capture | -g src_ip,dst_ip) [-p port | -S path] [-i iface]\n", argv0);
+    printf("           [-n frames] [-R pps] [-s size] [-F flows] [-o out.pcap]\n");
+} /* -- usage -- */
+
+static int add_iface(void* arg, const char* name, const unsigned char* mac, uint32_t ip)
+{
+    if (n_ifaces == SERVER_MAX_IFACES) {
+        return -1;
+    }
+    strncpy(ifaces[n_ifaces].name, name, sr_IFACE_NAMELEN);
+    memcpy(ifaces[n_ifaces].mac, mac, ETHER_ADDR_LEN);
+    ifaces[n_ifaces].ip = ip;
+    n_ifaces++;
+    return 0;
+}
+
+static int add_neighbour(void* arg, uint32_t ip, const unsigned char* mac)
+{
+    if (n_neighbours == SERVER_MAX_ARP) {
+        return -1;
+    }
+    neighbours[n_neighbours].ip = ip;
+    memcpy(neighbours[n_neighbours].mac, mac, ETHER_ADDR_LEN);
+    n_neighbours++;
+    return 0;
+}
+
+static struct server_iface* find_iface(const char* name)
+{
+    int i;
+    for (i = 0; i < n_ifaces; i++) {
+        if (strncmp(ifaces[i].name, name, sr_IFACE_NAMELEN) == 0) {
+            return &ifaces[i];
+        }
+    }
+    return NULL;
+}
+
+static struct server_neighbour* find_neighbour(uint32_t ip)
+{
+    int i;
+    for (i = 0; i < n_neighbours; i++) {
+        if (neighbours[i].ip == ip) {
+            return &neighbours[i];
+        }
+    }
+    return NULL;
+}
+
+/* -- socket helpers -- */
+
+/* A receive timeout ends the read only if may_time_out is set and nothing
+   has been read yet, so commands are never cut in half */
+static int read_full(int fd, void* buf, size_t len, int may_time_out)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = read(fd, (uint8_t*) buf + done, len - done);
+        if (ret < 0 && (errno == EINTR || ((done > 0 || !may_time_out) &&
+                        (errno == EAGAIN || errno == EWOULDBLOCK)))) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = write(fd, (const uint8_t*) buf + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Read one length-prefixed command; the caller frees *buf */
+static int read_command(uint8_t** buf, uint32_t* len, uint32_t* type)
+{
+    uint32_t nlen;
+
+    if (read_full(sockfd, &nlen, sizeof(nlen), 1) != 0) {
+        return -1;
+    }
+    *len = ntohl(nlen);
+    if (*len < sizeof(c_base) || *len > 10000) {
+        fprintf(stderr, "Bad command length %u\n", *len);
+        return -1;
+    }
+    *buf = malloc(*len);
+    memcpy(*buf, &nlen, sizeof(nlen));
+    if (read_full(sockfd, *buf + sizeof(nlen), *len - sizeof(nlen), 0) != 0) {
+        free(*buf);
+        return -1;
+    }
+    *type = ntohl(((c_base*) *buf)->mType);
+    return 0;
+}
+
+/* Send a frame to the router as arriving on 'iface' */
+static int send_frame(const uint8_t* frame, unsigned int len, const char* iface)
+{
+    uint8_t buf[sizeof(c_packet_header) + SERVER_MAX_FRAME];
+    c_packet_header* hdr = (c_packet_header*) buf;
+    int ret;
+
+    if (len > SERVER_MAX_FRAME) {
+        return -1;
+    }
+    if (use_shm) {
+        /* The router drains its ring in bursts; wait for room rather than drop */
+        uint64_t start = sr_tool_now_ns();
+        while (sr_shm_send(&shm, frame, len, iface) != 0) {
+            if (sr_tool_now_ns() - start > SERVER_RING_WAIT_NS) {
+                return -1;
+            }
+            sched_yield();
+        }
+        return 0;
+    }
+    hdr->mLen = htonl(sizeof(c_packet_header) + len);
+    hdr->mType = htonl(VNSPACKET);
+    memset(hdr->mInterfaceName, 0, sizeof(hdr->mInterfaceName));
+    strncpy(hdr->mInterfaceName, iface, sizeof(hdr->mInterfaceName));
+    memcpy(buf + sizeof(c_packet_header), frame, len);
+
+    pthread_mutex_lock(&send_lock);
+    ret = write_full(sockfd, buf, sizeof(c_packet_header) + len);
+    pthread_mutex_unlock(&send_lock);
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: server_handshake(..)
+ * Scope: Local
+ *
+ * AUTH_REQUEST -> AUTH_REPLY -> AUTH_STATUS -> VNSOPEN -> HWINFO, the order
+ * sr_connect_to_server and sr_read_from_server expect.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int send_hwinfo(void);
+
+static int server_handshake(void)
+{
+    uint8_t req_buf[sizeof(c_auth_request) + SERVER_SALT_LEN];
+    c_auth_request* req = (c_auth_request*) req_buf;
+    uint8_t status_buf[sizeof(c_auth_status) + 1];
+    c_auth_status* status = (c_auth_status*) status_buf;
+    uint8_t* buf;
+    uint32_t len, type;
+    int i;
+
+    req->mLen = htonl(sizeof(req_buf));
+    req->mType = htonl(VNS_AUTH_REQUEST);
+    for (i = 0; i < SERVER_SALT_LEN; i++) {
+        req->salt[i] = rand();
+    }
+    if (write_full(sockfd, req_buf, sizeof(req_buf)) != 0) {
+        return -1;
+    }
+
+    if (read_command(&buf, &len, &type) != 0) {
+        return -1;
+    }
+    free(buf);
+    if (type != VNS_AUTH_REPLY) {
+        fprintf(stderr, "Expected auth reply, got command %u\n", type);
+        return -1;
+    }
+
+    status->mLen = htonl(sizeof(status_buf));
+    status->mType = htonl(VNS_AUTH_STATUS);
+    status->auth_ok = 1;
+    status->msg[0] = '\0';
+    if (write_full(sockfd, status_buf, sizeof(status_buf)) != 0) {
+        return -1;
+    }
+
+    if (read_command(&buf, &len, &type) != 0) {
+        return -1;
+    }
+    if (type != VNSOPEN) {
+        fprintf(stderr, "Expected VNSOPEN, got command %u (templates are not supported)\n", type);
+        free(buf);
+        return -1;
+    }
+    printf("Router %.32s of %.32s opened topology %u\n", ((c_open*) buf)->mVirtualHostID,
+            ((c_open*) buf)->mUID, ntohs(((c_open*) buf)->topoID));
+    free(buf);
+
+    return send_hwinfo();
+}
+
+/* Describe the interfaces of the config file */
+static int send_hwinfo(void)
+{
+    c_hwinfo hwinfo;
+    uint32_t len;
+    int i, n = 0;
+
+    memset(&hwinfo, 0, sizeof(hwinfo));
+    for (i = 0; i < n_ifaces; i++) {
+        hwinfo.mHWInfo[n].mKey = htonl(HWINTERFACE);
+        strncpy(hwinfo.mHWInfo[n++].value, ifaces[i].name, 32);
+        hwinfo.mHWInfo[n].mKey = htonl(HWETHER);
+        memcpy(hwinfo.mHWInfo[n++].value, ifaces[i].mac, ETHER_ADDR_LEN);
+        hwinfo.mHWInfo[n].mKey = htonl(HWETHIP);
+        memcpy(hwinfo.mHWInfo[n++].value, &ifaces[i].ip, sizeof(uint32_t));
+    }
+    len = 2 * sizeof(uint32_t) + n * sizeof(c_hw_entry);
+    hwinfo.mLen = htonl(len);
+    hwinfo.mType = htonl(VNSHWINFO);
+    return write_full(sockfd, &hwinfo, len);
+}
+
+/* Answer an ARP request from the router for one of the neighbours */
+static void answer_arp(const uint8_t* frame, unsigned int len, const char* iface)
+{
+    sr_arp_hdr_t* req = (sr_arp_hdr_t*) (frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t reply[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_ethernet_hdr_t* eth_hdr = (sr_ethernet_hdr_t*) reply;
+    sr_arp_hdr_t* arp_hdr = (sr_arp_hdr_t*) (reply + sizeof(sr_ethernet_hdr_t));
+    struct server_neighbour* nb;
+
+    if (len < sizeof(reply) || ntohs(req->ar_op) != arp_op_request ||
+            (nb = find_neighbour(req->ar_tip)) == NULL) {
+        return;
+    }
+
+    memcpy(eth_hdr->ether_dhost, req->ar_sha, ETHER_ADDR_LEN);
+    memcpy(eth_hdr->ether_shost, nb->mac, ETHER_ADDR_LEN);
+    eth_hdr->ether_type = htons(ethertype_arp);
+    memcpy(arp_hdr, req, sizeof(sr_arp_hdr_t));
+    arp_hdr->ar_op = htons(arp_op_reply);
+    memcpy(arp_hdr->ar_sha, nb->mac, ETHER_ADDR_LEN);
+    arp_hdr->ar_sip = nb->ip;
+    memcpy(arp_hdr->ar_tha, req->ar_sha, ETHER_ADDR_LEN);
+    arp_hdr->ar_tip = req->ar_sip;
+
+    if (send_frame(reply, sizeof(reply), iface) == 0) {
+        arp_answered++;
+    }
+}
+
+/* Account for one frame from the router */
+static void handle_frame(uint8_t* frame, unsigned int flen, const char* iface, uint64_t rx_ns)
+{
+    if (rx_dump) {
+        struct pcap_pkthdr h;
+        gettimeofday(&h.ts, 0);
+        h.caplen = flen;
+        h.len = flen;
+        sr_dump(rx_dump, &h, frame);
+    }
+
+    if (ethertype(frame) == ethertype_arp) {
+        answer_arp(frame, flen, iface);
+    } else {
+        unsigned int off = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t);
+        struct server_tag tag;
+
+        frames_received++;
+        last_rx_ns = rx_ns;
+        if (flen >= off + sizeof(tag)) {
+            memcpy(&tag, frame + off, sizeof(tag));
+            if (tag.magic == htonl(SERVER_TAG_MAGIC) && tagged_received < max_tagged) {
+                latencies[tagged_received++] = (uint32_t) ((sr_tool_now_ns() - tag.sent_ns) / 1000);
+            }
+        }
+    }
+}
+
+/* server_receive for the shared-memory transport */
+static void server_receive_shm(unsigned int drain_ms)
+{
+    struct sr_shm_slot* slot;
+    uint8_t* buf;
+    uint32_t len, type;
+    int ready;
+
+    uint64_t last_rx = sr_tool_now_ns();
+    for (;;) {
+        while ((slot = sr_shm_peek(&shm)) != NULL) {
+            last_rx = sr_tool_now_ns();
+            if (slot->len >= sizeof(sr_ethernet_hdr_t) && slot->len <= SR_SHM_FRAME_MAX) {
+                char iface[sr_IFACE_NAMELEN + 1];
+                memcpy(iface, slot->iface, sr_IFACE_NAMELEN);
+                iface[sr_IFACE_NAMELEN] = '\0';
+                handle_frame(slot->data, slot->len, iface, last_rx);
+            }
+            sr_shm_release(&shm);
+        }
+
+        if ((ready = sr_shm_wait(&shm, sockfd, 100)) < 0) {
+            break;
+        }
+        if (ready & SR_SHM_FD_READY) {
+            /* Only a closing router talks on the control socket */
+            if (read_command(&buf, &len, &type) != 0) {
+                break;
+            }
+            free(buf);
+            if (type == VNSCLOSE) {
+                break;
+            }
+        }
+        if (ready == 0 && sending_done && sr_tool_now_ns() - last_rx > (uint64_t) drain_ms * 1000000ULL) {
+            break;
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: server_receive(..)
+ * Scope: Local
+ *
+ * Collect everything the router sends until the sender is done and no
+ * frame has arrived for drain_ms.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void server_receive(unsigned int drain_ms)
+{
+    struct timeval tv;
+    uint8_t* buf;
+    uint32_t len, type;
+
+    if (use_shm) {
+        server_receive_shm(drain_ms);
+        return;
+    }
+
+    /* Wake up regularly to notice the end of the run */
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint64_t last_rx = sr_tool_now_ns();
+    for (;;) {
+        errno = 0;
+        if (read_command(&buf, &len, &type) != 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && !(sending_done &&
+                        sr_tool_now_ns() - last_rx > (uint64_t) drain_ms * 1000000ULL)) {
+                continue;
+            }
+            break;
+        }
+        last_rx = sr_tool_now_ns();
+        if (type == VNSPACKET && len >= sizeof(c_packet_header) + sizeof(sr_ethernet_hdr_t)) {
+            c_packet_header* hdr = (c_packet_header*) buf;
+            char iface[sizeof(hdr->mInterfaceName) + 1];
+
+            memcpy(iface, hdr->mInterfaceName, sizeof(hdr->mInterfaceName));
+            iface[sizeof(hdr->mInterfaceName)] = '\0';
+            handle_frame(buf + sizeof(c_packet_header), len - sizeof(c_packet_header), iface, last_rx);
+        }
+        free(buf);
+    }
+}
+
+/* -- sender thread -- */
+
+struct sender_args {
+    struct server_frame* frames;
+    unsigned int n_frames;
+    unsigned long count;
+    unsigned long rate;
+    int tagged;
+    uint64_t elapsed_ns;
+};
+
+static void* server_send(void* arg)
+{
+    struct sender_args* a = arg;
+    uint64_t start = sr_tool_now_ns();
+    unsigned long i;
+
+    first_tx_ns = start;
+    for (i = 0; i < a->count; i++) {
+        struct server_frame* f = &a->frames[i % a->n_frames];
+
+        if (a->rate) {
+            uint64_t due = start + (uint64_t) i * 1000000000ULL / a->rate;
+            uint64_t now;
+            while ((now = sr_tool_now_ns()) < due) {
+                if (due - now > 200000) {
+                    usleep((due - now) / 1000 - 100);
+                }
+            }
+        }
+
+        if (a->tagged) {
+            struct server_tag tag;
+            unsigned int off = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t);
+            sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t*) (f->buf + sizeof(sr_ethernet_hdr_t));
+            sr_tcp_hdr_t* tcp_hdr = (sr_tcp_hdr_t*) (f->buf + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+            tag.magic = htonl(SERVER_TAG_MAGIC);
+            tag.seq = htonl(i);
+            tag.sent_ns = sr_tool_now_ns();
+            memcpy(f->buf + off, &tag, sizeof(tag));
+            tcp_hdr->tcp_sum = tcp_cksum(ip_hdr, tcp_hdr, f->len);
+        }
+
+        if (send_frame(f->buf, f->len, f->iface) != 0) {
+            fprintf(stderr, "Router went away after %lu frames\n", i);
+            break;
+        }
+        frames_sent++;
+    }
+
+    a->elapsed_ns = sr_tool_now_ns() - start;
+    sending_done = 1;
+    return NULL;
+}
+
+/* Frames of a capture, injected on the interface they were sent to */
+static struct server_frame* load_capture(const char* fname, const char* default_iface, unsigned int* n)
+{
+    FILE* fp = sr_dump_open_read(fname);
+    unsigned char* buf = malloc(SERVER_MAX_FRAME + 1);
+    struct server_frame* frames = NULL;
+    unsigned int cap = 0;
+    struct pcap_pkthdr h;
+    int ret, i;
+
+    *n = 0;
+    if (fp == NULL) {
+        free(buf);
+        return NULL;
+    }
+    while ((ret = sr_dump_read(fp, &h, buf, SERVER_MAX_FRAME + 1)) == 1) {
+        const char* iface = default_iface;
+        if (h.caplen < sizeof(sr_ethernet_hdr_t) || h.caplen > SERVER_MAX_FRAME) {
+            continue;
+        }
+        for (i = 0; i < n_ifaces; i++) {
+            if (memcmp(((sr_ethernet_hdr_t*) buf)->ether_dhost, ifaces[i].mac, ETHER_ADDR_LEN) == 0) {
+                iface = ifaces[i].name;
+            }
+        }
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            frames = realloc(frames, cap * sizeof(*frames));
+        }
+        frames[*n].buf = malloc(h.caplen);
+        memcpy(frames[*n].buf, buf, h.caplen);
+        frames[*n].len = h.caplen;
+        strncpy(frames[*n].iface, iface, sr_IFACE_NAMELEN);
+        (*n)++;
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    free(buf);
+    if (ret < 0) {
+        fprintf(stderr, "Truncated or oversized record in %s\n", fname);
+    }
+    return frames;
+}
+
+/* TCP segments from 'flows' source ports of src to dst, entering on iface */
+static struct server_frame* make_frames(struct server_iface* iface, uint32_t src, uint32_t dst,
+        unsigned int size, unsigned int flows)
+{
+    struct server_frame* frames = malloc(flows * sizeof(*frames));
+    struct server_neighbour* nb = find_neighbour(src);
+    static const unsigned char default_mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 1 };
+    unsigned int i;
+
+    for (i = 0; i < flows; i++) {
+        frames[i].buf = malloc(size);
+        frames[i].len = build_tcp_frame(frames[i].buf, size, nb ? nb->mac : default_mac, iface->mac,
+                src, dst, 10000 + i, 80, 0);
+        strncpy(frames[i].iface, iface->name, sr_IFACE_NAMELEN);
+    }
+    return frames;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    unsigned int port = DEFAULT_PORT;
+    char *config = 0;
+    char *capture = 0;
+    char *gen = 0;
+    char *iface_name = 0;
+    char *out = 0;
+    char *shm_path = 0;
+    unsigned int size = DEFAULT_SIZE;
+    unsigned int flows = DEFAULT_FLOWS;
+    struct sender_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.count = DEFAULT_COUNT;
+
+    while ((c = getopt(argc, argv, "hc:f:g:p:i:n:R:s:F:o:S:")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'c':
+                config = optarg;
+                break;
+            case 'f':
+                capture = optarg;
+                break;
+            case 'g':
+                gen = optarg;
+                break;
+            case 'p':
+                port = atoi((char *) optarg);
+                break;
+            case 'i':
+                iface_name = optarg;
+                break;
+            case 'n':
+                args.count = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                args.rate = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                size = atoi((char *) optarg);
+                break;
+            case 'F':
+                flows = atoi((char *) optarg);
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'S':
+                shm_path = optarg;
+                use_shm = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        } /* switch */
+    } /* -- while -- */
+
+    if (config == 0 || (capture == 0) == (gen == 0) || args.count == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (sr_tool_load_config(config, add_iface, add_neighbour, NULL) != 0) {
+        exit(1);
+    }
+
+    struct server_iface* iface = iface_name ? find_iface(iface_name) : &ifaces[0];
+    if (iface == NULL) {
+        fprintf(stderr, "Unknown interface %s\n", iface_name);
+        exit(1);
+    }
+
+    if (capture) {
+        args.frames = load_capture(capture, iface->name, &args.n_frames);
+    } else {
+        char src[32], dst[32];
+        struct in_addr src_addr, dst_addr;
+        unsigned int min = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t) +
+            sizeof(struct server_tag);
+        if (sscanf(gen, "%31[^,],%31s", src, dst) != 2 || inet_aton(src, &src_addr) == 0 ||
+                inet_aton(dst, &dst_addr) == 0) {
+            fprintf(stderr, "Bad -g %s, expected src_ip,dst_ip\n", gen);
+            exit(1);
+        }
+        if (size < min || size > SERVER_MAX_FRAME || flows == 0) {
+            fprintf(stderr, "Frame size must be %u to %u bytes, with at least one flow\n",
+                    min, SERVER_MAX_FRAME);
+            exit(1);
+        }
+        args.frames = make_frames(iface, src_addr.s_addr, dst_addr.s_addr, size, flows);
+        args.n_frames = flows;
+        args.tagged = 1;
+    }
+    if (args.n_frames == 0) {
+        fprintf(stderr, "No frames to send\n");
+        exit(1);
+    }
+    latencies = malloc(args.count * sizeof(uint32_t));
+    max_tagged = args.count;
+
+    if (out) {
+        rx_dump = sr_dump_open(out, 0, SERVER_MAX_FRAME);
+        if (!rx_dump) {
+            exit(1);
+        }
+    }
+
+    /* -- wait for the router -- */
+    int on = 1;
+    if (use_shm) {
+        int lfd = sr_shm_listen(shm_path);
+        if (lfd < 0) {
+            exit(1);
+        }
+        printf("Waiting for a router on %s\n", shm_path);
+        fflush(stdout);
+        if ((sockfd = sr_shm_accept(lfd, &shm)) < 0) {
+            exit(1);
+        }
+        close(lfd);
+        unlink(shm_path);
+        if (send_hwinfo() != 0) {
+            fprintf(stderr, "Sending hardware info to the router failed\n");
+            exit(1);
+        }
+    } else {
+        int lfd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (lfd < 0 || bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0) {
+            perror("listen");
+            exit(1);
+        }
+        printf("Waiting for a router on port %u\n", port);
+        fflush(stdout);
+        if ((sockfd = accept(lfd, NULL, NULL)) < 0) {
+            perror("accept");
+            exit(1);
+        }
+        close(lfd);
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        if (server_handshake() != 0) {
+            fprintf(stderr, "Handshake with the router failed\n");
+            exit(1);
+        }
+    }
+
+    /* Give the router a moment to take in the hardware info */
+    usleep(100000);
+
+    pthread_t sender;
+    pthread_create(&sender, NULL, server_send, &args);
+    server_receive(DEFAULT_DRAIN_MS);
+    pthread_join(sender, NULL);
+
+    /* -- close the session -- */
+    c_close bye;
+    memset(&bye, 0, sizeof(bye));
+    bye.mLen = htonl(sizeof(bye));
+    bye.mType = htonl(VNSCLOSE);
+    strncpy(bye.mErrorMessage, "test run complete", sizeof(bye.mErrorMessage));
+    pthread_mutex_lock(&send_lock);
+    write_full(sockfd, &bye, sizeof(bye));
+    pthread_mutex_unlock(&send_lock);
+    close(sockfd);
+    if (use_shm) {
+        sr_shm_close(&shm);
+    }
+
+    if (rx_dump) {
+        sr_dump_close(rx_dump);
+    }
+
+    /* -- report, one JSON line like sr_bench -- */
+    double secs = args.elapsed_ns / 1e9;
+    double rx_secs = last_rx_ns > first_tx_ns ? (last_rx_ns - first_tx_ns) / 1e9 : 0.0;
+    printf("{\"bench\":\"%s\",\"sent\":%lu,\"received\":%lu,\"arp_answered\":%lu,"
+            "\"send_s\":%.6f,\"offered_pps\":%.0f,\"forwarded_pps\":%.0f",
+            use_shm ? "shm_e2e" : "vns_e2e", frames_sent, frames_received, arp_answered, secs, secs > 0 ? frames_sent / secs : 0.0,
+            rx_secs > 0 ? frames_received / rx_secs : 0.0);
+    if (tagged_received) {
+        unsigned long n = tagged_received;
+        qsort(latencies, n, sizeof(uint32_t), sr_tool_cmp_u32);
+        printf(",\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u",
+                latencies[n * 50 / 100], latencies[n * 90 / 100], latencies[n * 99 / 100],
+                latencies[n * 999 / 1000], latencies[n - 1]);
+    }
+    printf("}\n");
+
+    return 0;
+} /* -- main -- */